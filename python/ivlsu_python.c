@@ -0,0 +1,546 @@
+/**
+ * @file ivlsu_python.c
+ * @brief Python binding of the IMPERIAL/IVLSU library.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * Exposes model instances (see ivlsu_registry.c) to Python as ivlsu.Model objects
+ * whose query, profile, slice and grid methods run the library's threaded batch and
+ * grid kernels on whole arrays. Inputs are read in place through the buffer protocol
+ * when they are C-contiguous float64 buffers, such as NumPy float64 arrays, and are
+ * converted once otherwise. The results are written straight into newly made NumPy
+ * float64 arrays, or into array.array('d') objects when NumPy is not installed. The
+ * GIL is released while the library runs, so several Python threads may query at once.
+ *
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "ivlsu.h"
+
+/** A model instance seen from Python. */
+typedef struct ivlsu_python_model_t {
+	PyObject_HEAD
+	/** The instance */
+	ivlsu_instance_t instance;
+} ivlsu_python_model_t;
+
+/** An array of doubles read or written in place. */
+typedef struct ivlsu_python_array_t {
+	/** The object holding the values, a new reference */
+	PyObject *object;
+	/** The buffer of the object, held while the values are used */
+	Py_buffer view;
+	/** Non-zero while the buffer is held */
+	int held;
+} ivlsu_python_array_t;
+
+/**
+ * Returns the NumPy module, or NULL without an error set if it is not installed.
+ *
+ * @return A new reference, or NULL.
+ */
+static PyObject *ivlsu_python_numpy() {
+	PyObject *numpy = PyImport_ImportModule("numpy");
+
+	if (numpy == NULL)
+		PyErr_Clear();
+	return numpy;
+}
+
+/**
+ * Checks whether a buffer holds native float64 values.
+ *
+ * @param view The buffer.
+ * @return 1 if it does, 0 otherwise.
+ */
+static int ivlsu_python_is_double(const Py_buffer *view) {
+	return view->itemsize == sizeof(double) && view->format != NULL &&
+	       (strcmp(view->format, "d") == 0 || strcmp(view->format, "@d") == 0 || strcmp(view->format, "=d") == 0 ||
+		(strcmp(view->format, "<d") == 0 && PY_LITTLE_ENDIAN) || (strcmp(view->format, ">d") == 0 && PY_BIG_ENDIAN));
+}
+
+/**
+ * Reads an input array in place if it is a C-contiguous float64 buffer, or converts
+ * it once otherwise, with numpy.ascontiguousarray or array.array('d').
+ *
+ * @param object The input: a buffer, a sequence or a number.
+ * @param name Name of the input, for errors.
+ * @param array The returned array.
+ * @return 0, or -1 with an exception set.
+ */
+static int ivlsu_python_input(PyObject *object, const char *name, ivlsu_python_array_t *array) {
+	PyObject *numpy = NULL, *module = NULL;
+
+	memset(array, 0, sizeof(ivlsu_python_array_t));
+	Py_INCREF(object);
+	array->object = object;
+
+	if (PyObject_GetBuffer(object, &(array->view), PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0) {
+		if (ivlsu_python_is_double(&(array->view))) {
+			array->held = 1;
+			return 0;
+		}
+		PyBuffer_Release(&(array->view));
+	}
+	PyErr_Clear();
+
+	Py_CLEAR(array->object);
+	if ((numpy = ivlsu_python_numpy()) != NULL) {
+		array->object = PyObject_CallMethod(numpy, "ascontiguousarray", "Os", object, "float64");
+		Py_DECREF(numpy);
+	} else if ((module = PyImport_ImportModule("array")) != NULL) {
+		if (PyNumber_Check(object))
+			array->object = PyObject_CallMethod(module, "array", "s(O)", "d", object);
+		else
+			array->object = PyObject_CallMethod(module, "array", "sO", "d", object);
+		Py_DECREF(module);
+	}
+
+	if (array->object == NULL || PyObject_GetBuffer(array->object, &(array->view), PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+		Py_CLEAR(array->object);
+		PyErr_Format(PyExc_TypeError, "%s must be a float64 buffer, a sequence of numbers or a number", name);
+		return -1;
+	}
+	array->held = 1;
+	return 0;
+}
+
+/**
+ * Makes an output array of doubles, a NumPy array of the given shape if NumPy is
+ * installed, a flat array.array('d') otherwise.
+ *
+ * @param count Number of values.
+ * @param shape Shape of the NumPy array, a tuple.
+ * @param array The returned array, with its buffer held.
+ * @return 0, or -1 with an exception set.
+ */
+static int ivlsu_python_output(Py_ssize_t count, PyObject *shape, ivlsu_python_array_t *array) {
+	PyObject *numpy = ivlsu_python_numpy(), *module = NULL;
+
+	memset(array, 0, sizeof(ivlsu_python_array_t));
+	if (numpy != NULL) {
+		array->object = PyObject_CallMethod(numpy, "empty", "Os", shape, "float64");
+		Py_DECREF(numpy);
+	} else if ((module = PyImport_ImportModule("array")) != NULL) {
+		array->object = PyObject_CallMethod(module, "array", "sN", "d", PyBytes_FromStringAndSize(NULL, 0));
+		if (array->object != NULL && count > 0) {
+			// Grow the array to its size without going through a list.
+			PyObject *zeros = PyBytes_FromStringAndSize(NULL, count * sizeof(double));
+			PyObject *result = zeros != NULL ? PyObject_CallMethod(array->object, "frombytes", "O", zeros) : NULL;
+
+			Py_XDECREF(zeros);
+			if (result == NULL)
+				Py_CLEAR(array->object);
+			Py_XDECREF(result);
+		}
+		Py_DECREF(module);
+	}
+
+	if (array->object == NULL || PyObject_GetBuffer(array->object, &(array->view), PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) != 0) {
+		Py_CLEAR(array->object);
+		return -1;
+	}
+	array->held = 1;
+	return 0;
+}
+
+/**
+ * Lets go of an array's buffer and, unless it is returned, of the array.
+ *
+ * @param array The array.
+ * @param keep Non-zero to keep the reference to the array for the caller.
+ * @return The array if kept, NULL otherwise.
+ */
+static PyObject *ivlsu_python_release(ivlsu_python_array_t *array, int keep) {
+	PyObject *object = array->object;
+
+	if (array->held)
+		PyBuffer_Release(&(array->view));
+	array->held = 0;
+	array->object = NULL;
+	if (!keep) {
+		Py_XDECREF(object);
+		return NULL;
+	}
+	return object;
+}
+
+/**
+ * Returns the number of doubles an array holds.
+ *
+ * @param array The array.
+ * @return Number of values.
+ */
+static Py_ssize_t ivlsu_python_count(const ivlsu_python_array_t *array) {
+	return array->view.len / (Py_ssize_t)sizeof(double);
+}
+
+/**
+ * Returns the shape of an input as a tuple, its length if it is not N-dimensional.
+ *
+ * @param array The array.
+ * @return A new reference, or NULL.
+ */
+static PyObject *ivlsu_python_shape(const ivlsu_python_array_t *array) {
+	PyObject *shape = NULL;
+	int i = 0;
+
+	if (array->view.ndim <= 0 || array->view.shape == NULL)
+		return Py_BuildValue("(n)", ivlsu_python_count(array));
+	if ((shape = PyTuple_New(array->view.ndim)) == NULL)
+		return NULL;
+	for (i = 0; i < array->view.ndim; i++)
+		PyTuple_SET_ITEM(shape, i, PyLong_FromSsize_t(array->view.shape[i]));
+	return shape;
+}
+
+/**
+ * Runs a batch query on an instance without the GIL and returns its Vp, Vs and
+ * density arrays as a tuple. Takes over the output arrays.
+ *
+ * @param self The model.
+ * @param batch The batch, with its inputs and numpoints set.
+ * @param grid The grid to query instead of the batch inputs, or NULL.
+ * @param outputs The Vp, Vs and density arrays.
+ * @return The tuple, or NULL with an exception set.
+ */
+static PyObject *ivlsu_python_run(ivlsu_python_model_t *self, ivlsu_batch_t *batch, const ivlsu_grid_t *grid,
+				  ivlsu_python_array_t outputs[3]) {
+	PyObject *result = NULL;
+	int status = SUCCESS, i = 0;
+
+	batch->properties = IVLSU_VP | IVLSU_VS | IVLSU_RHO;
+	batch->type = IVLSU_FLOAT64;
+	batch->vp = outputs[0].view.buf;
+	batch->vs = outputs[1].view.buf;
+	batch->rho = outputs[2].view.buf;
+
+	Py_BEGIN_ALLOW_THREADS
+	if (grid != NULL)
+		status = ivlsu_instance_query_grid(&(self->instance), grid, batch);
+	else
+		status = ivlsu_instance_query_batch(&(self->instance), batch);
+	Py_END_ALLOW_THREADS
+
+	if (status != SUCCESS) {
+		for (i = 0; i < 3; i++)
+			ivlsu_python_release(&(outputs[i]), 0);
+		PyErr_SetString(PyExc_RuntimeError, "The query failed; see the error printed by the library.");
+		return NULL;
+	}
+
+	result = PyTuple_New(3);
+	for (i = 0; i < 3; i++) {
+		if (result != NULL)
+			PyTuple_SET_ITEM(result, i, ivlsu_python_release(&(outputs[i]), 1));
+		else
+			ivlsu_python_release(&(outputs[i]), 0);
+	}
+	return result;
+}
+
+/**
+ * Makes the Vp, Vs and density output arrays of a query.
+ *
+ * @param count Number of values of each.
+ * @param shape Shape of each, a tuple; the reference is taken over.
+ * @param outputs The returned arrays.
+ * @return 0, or -1 with an exception set.
+ */
+static int ivlsu_python_outputs(Py_ssize_t count, PyObject *shape, ivlsu_python_array_t outputs[3]) {
+	int i = 0, status = 0;
+
+	memset(outputs, 0, 3 * sizeof(ivlsu_python_array_t));
+	for (i = 0; i < 3 && shape != NULL && status == 0; i++)
+		status = ivlsu_python_output(count, shape, &(outputs[i]));
+	if (shape == NULL || status != 0) {
+		for (i = 0; i < 3; i++)
+			ivlsu_python_release(&(outputs[i]), 0);
+		if (!PyErr_Occurred())
+			PyErr_NoMemory();
+		status = -1;
+	}
+	Py_XDECREF(shape);
+	return status;
+}
+
+/**
+ * Opens the model: Model(directory=None, label="ivlsu"). The directory defaults to
+ * UCVM_INSTALL_PATH, or ".." if it is not set.
+ */
+static int ivlsu_python_model_init(ivlsu_python_model_t *self, PyObject *args, PyObject *kwargs) {
+	static char *keywords[] = { "directory", "label", NULL };
+	const char *directory = getenv("UCVM_INSTALL_PATH"), *label = "ivlsu";
+	int status = SUCCESS;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zs", keywords, &directory, &label))
+		return -1;
+	if (directory == NULL)
+		directory = getenv("UCVM_INSTALL_PATH") != NULL ? getenv("UCVM_INSTALL_PATH") : "..";
+
+	if (self->instance.shared != NULL)
+		ivlsu_instance_close(&(self->instance));
+	Py_BEGIN_ALLOW_THREADS
+	status = ivlsu_instance_open(&(self->instance), directory, label);
+	Py_END_ALLOW_THREADS
+	if (status != SUCCESS) {
+		PyErr_Format(PyExc_OSError, "Could not open the model %s in %s.", label, directory);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Closes the model.
+ */
+static void ivlsu_python_model_dealloc(ivlsu_python_model_t *self) {
+	if (self->instance.shared != NULL)
+		ivlsu_instance_close(&(self->instance));
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/**
+ * Checks that the model is open.
+ *
+ * @param self The model.
+ * @return 0, or -1 with an exception set.
+ */
+static int ivlsu_python_check(ivlsu_python_model_t *self) {
+	if (self->instance.shared == NULL) {
+		PyErr_SetString(PyExc_ValueError, "The model is not open.");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * set_option(key, value): changes a query option of this model only.
+ */
+static PyObject *ivlsu_python_set_option(ivlsu_python_model_t *self, PyObject *args) {
+	const char *key = NULL, *value = NULL;
+
+	if (!PyArg_ParseTuple(args, "ss", &key, &value) || ivlsu_python_check(self) != 0)
+		return NULL;
+	if (ivlsu_instance_set_option(&(self->instance), key, value) != SUCCESS) {
+		PyErr_Format(PyExc_ValueError, "Unknown option or invalid option value: %s = %s.", key, value);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+/**
+ * query(longitude, latitude, depth, spacing=0): Vp, Vs and density at each point.
+ */
+static PyObject *ivlsu_python_query(ivlsu_python_model_t *self, PyObject *args, PyObject *kwargs) {
+	static char *keywords[] = { "longitude", "latitude", "depth", "spacing", NULL };
+	PyObject *objects[3], *result = NULL;
+	ivlsu_python_array_t inputs[3], outputs[3];
+	ivlsu_batch_t batch = { 0 };
+	const char *names[3] = { "longitude", "latitude", "depth" };
+	int i = 0, status = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|d", keywords, &objects[0], &objects[1], &objects[2], &(batch.spacing)) ||
+	    ivlsu_python_check(self) != 0)
+		return NULL;
+
+	memset(inputs, 0, sizeof(inputs));
+	for (i = 0; i < 3 && status == 0; i++)
+		status = ivlsu_python_input(objects[i], names[i], &(inputs[i]));
+	if (status == 0 && (ivlsu_python_count(&inputs[1]) != ivlsu_python_count(&inputs[0]) ||
+			    ivlsu_python_count(&inputs[2]) != ivlsu_python_count(&inputs[0]) || ivlsu_python_count(&inputs[0]) > INT_MAX)) {
+		PyErr_SetString(PyExc_ValueError, "longitude, latitude and depth must hold as many values.");
+		status = -1;
+	}
+
+	if (status == 0 && ivlsu_python_outputs(ivlsu_python_count(&inputs[0]), ivlsu_python_shape(&inputs[0]), outputs) == 0) {
+		batch.numpoints = (int)ivlsu_python_count(&inputs[0]);
+		batch.longitude = inputs[0].view.buf;
+		batch.latitude = inputs[1].view.buf;
+		batch.depth = inputs[2].view.buf;
+		result = ivlsu_python_run(self, &batch, NULL, outputs);
+	}
+
+	for (i = 0; i < 3; i++)
+		ivlsu_python_release(&(inputs[i]), 0);
+	return result;
+}
+
+/**
+ * profile(longitude, latitude, depth, spacing=0): Vp, Vs and density down one site
+ * at each depth.
+ */
+static PyObject *ivlsu_python_profile(ivlsu_python_model_t *self, PyObject *args, PyObject *kwargs) {
+	static char *keywords[] = { "longitude", "latitude", "depth", "spacing", NULL };
+	PyObject *object = NULL, *result = NULL;
+	ivlsu_python_array_t depth, outputs[3];
+	ivlsu_batch_t batch = { 0 };
+	double longitude = 0, latitude = 0, *site = NULL;
+	Py_ssize_t count = 0, i = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ddO|d", keywords, &longitude, &latitude, &object, &(batch.spacing)) ||
+	    ivlsu_python_check(self) != 0 || ivlsu_python_input(object, "depth", &depth) != 0)
+		return NULL;
+
+	count = ivlsu_python_count(&depth);
+	if (count > INT_MAX || (site = malloc((2 * count + 1) * sizeof(double))) == NULL) {
+		PyErr_NoMemory();
+	} else if (ivlsu_python_outputs(count, ivlsu_python_shape(&depth), outputs) == 0) {
+		for (i = 0; i < count; i++) {
+			site[i] = longitude;
+			site[count + i] = latitude;
+		}
+		batch.numpoints = (int)count;
+		batch.longitude = site;
+		batch.latitude = site + count;
+		batch.depth = depth.view.buf;
+		result = ivlsu_python_run(self, &batch, NULL, outputs);
+	}
+
+	free(site);
+	ivlsu_python_release(&depth, 0);
+	return result;
+}
+
+/**
+ * slice(longitude, latitude, depth, spacing=0): Vp, Vs and density on the
+ * len(latitude) by len(longitude) mesh of sites at one depth.
+ */
+static PyObject *ivlsu_python_slice(ivlsu_python_model_t *self, PyObject *args, PyObject *kwargs) {
+	static char *keywords[] = { "longitude", "latitude", "depth", "spacing", NULL };
+	PyObject *objects[2], *result = NULL;
+	ivlsu_python_array_t inputs[2], outputs[3];
+	ivlsu_batch_t batch = { 0 };
+	double depth = 0, *points = NULL;
+	const double *longitude = NULL, *latitude = NULL;
+	Py_ssize_t nx = 0, ny = 0, x = 0, y = 0, count = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOd|d", keywords, &objects[0], &objects[1], &depth, &(batch.spacing)) ||
+	    ivlsu_python_check(self) != 0)
+		return NULL;
+	if (ivlsu_python_input(objects[0], "longitude", &inputs[0]) != 0)
+		return NULL;
+	if (ivlsu_python_input(objects[1], "latitude", &inputs[1]) != 0) {
+		ivlsu_python_release(&inputs[0], 0);
+		return NULL;
+	}
+
+	nx = ivlsu_python_count(&inputs[0]);
+	ny = ivlsu_python_count(&inputs[1]);
+	count = nx * ny;
+	longitude = inputs[0].view.buf;
+	latitude = inputs[1].view.buf;
+	if ((ny > 0 && count / ny != nx) || count > INT_MAX || (points = malloc((3 * count + 1) * sizeof(double))) == NULL) {
+		PyErr_NoMemory();
+	} else if (ivlsu_python_outputs(count, Py_BuildValue("(nn)", ny, nx), outputs) == 0) {
+		// Sites in latitude then longitude order, so consecutive points share a row.
+		for (y = 0; y < ny; y++) {
+			for (x = 0; x < nx; x++) {
+				points[y * nx + x] = longitude[x];
+				points[count + y * nx + x] = latitude[y];
+				points[2 * count + y * nx + x] = depth;
+			}
+		}
+		batch.numpoints = (int)count;
+		batch.longitude = points;
+		batch.latitude = points + count;
+		batch.depth = points + 2 * count;
+		result = ivlsu_python_run(self, &batch, NULL, outputs);
+	}
+
+	free(points);
+	ivlsu_python_release(&inputs[0], 0);
+	ivlsu_python_release(&inputs[1], 0);
+	return result;
+}
+
+/**
+ * grid(origin, step, shape, rotation=0, spacing=0): Vp, Vs and density on a regular
+ * UTM grid without projecting any point, as arrays of shape (nz, ny, nx). origin is
+ * (easting, northing, depth) of the first node, step the node spacing along each and
+ * shape (nx, ny, nz).
+ */
+static PyObject *ivlsu_python_grid(ivlsu_python_model_t *self, PyObject *args, PyObject *kwargs) {
+	static char *keywords[] = { "origin", "step", "shape", "rotation", "spacing", NULL };
+	ivlsu_python_array_t outputs[3];
+	ivlsu_batch_t batch = { 0 };
+	ivlsu_grid_t grid = { 0 };
+	long count = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "(ddd)(ddd)(iii)|dd", keywords, &(grid.origin_e), &(grid.origin_n),
+					 &(grid.origin_depth), &(grid.spacing_e), &(grid.spacing_n), &(grid.spacing_depth), &(grid.nx),
+					 &(grid.ny), &(grid.nz), &(grid.rotation), &(grid.spacing)) ||
+	    ivlsu_python_check(self) != 0)
+		return NULL;
+	if (grid.nx <= 0 || grid.ny <= 0 || grid.nz <= 0) {
+		PyErr_SetString(PyExc_ValueError, "The grid needs at least one node along each axis.");
+		return NULL;
+	}
+
+	count = (long)grid.nx * grid.ny * grid.nz;
+	if (ivlsu_python_outputs(count, Py_BuildValue("(iii)", grid.nz, grid.ny, grid.nx), outputs) != 0)
+		return NULL;
+	return ivlsu_python_run(self, &batch, &grid, outputs);
+}
+
+/** Methods of ivlsu.Model. */
+static PyMethodDef ivlsu_python_model_methods[] = {
+	{ "set_option", (PyCFunction)ivlsu_python_set_option, METH_VARARGS,
+	  "set_option(key, value)\n\nChanges a query option (interpolation, sort_threshold, prefetch_distance) of this model only." },
+	{ "query", (PyCFunction)ivlsu_python_query, METH_VARARGS | METH_KEYWORDS,
+	  "query(longitude, latitude, depth, spacing=0) -> (vp, vs, rho)\n\n"
+	  "Queries the points given by three arrays of equal size. Values outside of the model are -1." },
+	{ "profile", (PyCFunction)ivlsu_python_profile, METH_VARARGS | METH_KEYWORDS,
+	  "profile(longitude, latitude, depth, spacing=0) -> (vp, vs, rho)\n\nQueries one site at each depth of an array." },
+	{ "slice", (PyCFunction)ivlsu_python_slice, METH_VARARGS | METH_KEYWORDS,
+	  "slice(longitude, latitude, depth, spacing=0) -> (vp, vs, rho)\n\n"
+	  "Queries every site of a longitude by latitude mesh at one depth; the arrays have shape (len(latitude), len(longitude))." },
+	{ "grid", (PyCFunction)ivlsu_python_grid, METH_VARARGS | METH_KEYWORDS,
+	  "grid(origin, step, shape, rotation=0, spacing=0) -> (vp, vs, rho)\n\n"
+	  "Queries a regular UTM grid: origin is (easting, northing, depth), step the node spacing along each and\n"
+	  "shape (nx, ny, nz). The arrays have shape (nz, ny, nx)." },
+	{ NULL, NULL, 0, NULL }
+};
+
+/** The ivlsu.Model type. */
+static PyTypeObject ivlsu_python_model_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "ivlsu.Model",
+	.tp_basicsize = sizeof(ivlsu_python_model_t),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Model(directory=None, label=\"ivlsu\")\n\n"
+		  "An instance of the model with query options of its own. Models opened on the same data share it.",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)ivlsu_python_model_init,
+	.tp_dealloc = (destructor)ivlsu_python_model_dealloc,
+	.tp_methods = ivlsu_python_model_methods,
+};
+
+/** The ivlsu module. */
+static struct PyModuleDef ivlsu_python_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "ivlsu",
+	.m_doc = "Vectorized queries of the IMPERIAL/IVLSU velocity model.",
+	.m_size = -1,
+};
+
+/**
+ * Initializes the module.
+ *
+ * @return The module, or NULL.
+ */
+PyMODINIT_FUNC PyInit_ivlsu() {
+	PyObject *module = NULL;
+
+	if (PyType_Ready(&ivlsu_python_model_type) < 0 || (module = PyModule_Create(&ivlsu_python_module)) == NULL)
+		return NULL;
+
+	Py_INCREF(&ivlsu_python_model_type);
+	if (PyModule_AddObject(module, "Model", (PyObject *)&ivlsu_python_model_type) < 0 ||
+	    PyModule_AddObject(module, "NA", PyFloat_FromDouble(NA)) < 0) {
+		Py_DECREF(&ivlsu_python_model_type);
+		Py_DECREF(module);
+		return NULL;
+	}
+	return module;
+}
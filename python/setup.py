@@ -0,0 +1,21 @@
+# Builds the ivlsu Python module against the library in ../src.
+#
+#   make python            (from the top directory, after make)
+#   python3 setup.py build_ext --inplace
+
+from setuptools import Extension, setup
+
+setup(
+    name="ivlsu",
+    version="1.0",
+    description="Vectorized queries of the IMPERIAL/IVLSU velocity model",
+    ext_modules=[
+        Extension(
+            "ivlsu",
+            sources=["ivlsu_python.c"],
+            include_dirs=["../src"],
+            library_dirs=["../src"],
+            libraries=["ivlsu", "proj", "m", "pthread"],
+        )
+    ],
+)
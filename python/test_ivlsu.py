@@ -0,0 +1,138 @@
+# Checks the ivlsu module against the library it wraps, using only the standard
+# library: Model.query, Model.profile and Model.grid must return what ivlsu_query
+# and ivlsu_query_grid return for the same points, with interpolation off and on.
+#
+#   make python_test       (from the top directory, after make)
+#
+# The model is read from UCVM_INSTALL_PATH, or ".." if it is not set, as Model and
+# tests/test_ivlsu do.
+
+import array
+import ctypes
+import os
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+
+import ivlsu  # noqa: E402
+
+IVLSU_VP, IVLSU_VS, IVLSU_RHO = 0x01, 0x02, 0x04
+IVLSU_FLOAT64 = 1
+
+
+class Point(ctypes.Structure):
+    _fields_ = [("longitude", ctypes.c_double), ("latitude", ctypes.c_double), ("depth", ctypes.c_double)]
+
+
+class Properties(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_double) for name in ("vp", "vs", "rho", "qp", "qs")]
+
+
+class Batch(ctypes.Structure):
+    _fields_ = [
+        ("numpoints", ctypes.c_int),
+        ("longitude", ctypes.c_void_p),
+        ("latitude", ctypes.c_void_p),
+        ("depth", ctypes.c_void_p),
+        ("properties", ctypes.c_int),
+        ("type", ctypes.c_int),
+        ("vp", ctypes.c_void_p),
+        ("vs", ctypes.c_void_p),
+        ("rho", ctypes.c_void_p),
+        ("qp", ctypes.c_void_p),
+        ("qs", ctypes.c_void_p),
+        ("spacing", ctypes.c_double),
+        ("vp_gradient", ctypes.c_void_p),
+        ("vs_gradient", ctypes.c_void_p),
+        ("frame", ctypes.c_int),
+    ]
+
+
+class Grid(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_double) for name in ("origin_e", "origin_n", "origin_depth", "spacing_e", "spacing_n", "spacing_depth")]
+    _fields_ += [(name, ctypes.c_int) for name in ("nx", "ny", "nz")]
+    _fields_ += [("spacing", ctypes.c_double), ("rotation", ctypes.c_double)]
+
+
+def address(values):
+    return values.buffer_info()[0]
+
+
+def library_query(lib, longitude, latitude, depth):
+    """Vp, Vs and density of each point from ivlsu_query."""
+    count = len(longitude)
+    points = (Point * count)(*[Point(longitude[i], latitude[i], depth[i]) for i in range(count)])
+    data = (Properties * count)()
+    assert lib.ivlsu_query(points, data, count) == 0
+    return [array.array("d", [getattr(data[i], name) for i in range(count)]) for name in ("vp", "vs", "rho")]
+
+
+def library_grid(lib, origin, step, shape, rotation=0):
+    """Vp, Vs and density on a grid from ivlsu_query_grid."""
+    grid = Grid(*origin, *step, *shape, 0, rotation)
+    count = shape[0] * shape[1] * shape[2]
+    outputs = [array.array("d", bytes(8 * count)) for i in range(3)]
+    batch = Batch(properties=IVLSU_VP | IVLSU_VS | IVLSU_RHO, type=IVLSU_FLOAT64)
+    batch.vp, batch.vs, batch.rho = [address(values) for values in outputs]
+    assert lib.ivlsu_query_grid(ctypes.byref(grid), ctypes.byref(batch)) == 0
+    return outputs
+
+
+def check_same(module, library):
+    """The module's values are the library's wherever ivlsu_query has Vp."""
+    vp, vs, rho = module
+    assert len(vp) == len(library[0]) and max(library[0]) > 0
+    for i in range(len(vp)):
+        if library[0][i] < 0:
+            # ivlsu_query interpolates NA nodes to about -1 and keeps Vs and density
+            # where a node has no Vp; the batch kernels return NA for all three.
+            assert vp[i] == ivlsu.NA and vs[i] == ivlsu.NA and rho[i] == ivlsu.NA, (i, vp[i], vs[i], rho[i])
+        else:
+            assert (vp[i], vs[i], rho[i]) == (library[0][i], library[1][i], library[2][i]), (i, vp[i], library[0][i])
+
+
+def main():
+    directory = os.environ.get("UCVM_INSTALL_PATH", "..")
+    lib = ctypes.CDLL(os.path.join(HERE, "..", "src", "libivlsu.so"))
+    lib.ivlsu_init.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+    lib.ivlsu_set_option.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+    assert lib.ivlsu_init(directory.encode(), b"ivlsu") == 0
+    model = ivlsu.Model(directory)
+
+    # Points inside, between the nodes, in the bricks without data and outside of the model.
+    longitude = array.array("d", [-116.2 + 0.037 * (i % 20) for i in range(200)])
+    latitude = array.array("d", [32.5 + 0.041 * (i // 20) for i in range(200)])
+    depth = array.array("d", [350.0 * (i % 23) for i in range(200)])
+    depths = array.array("d", [250.0 * i for i in range(33)])
+
+    for interpolation in ("off", "on"):
+        model.set_option("interpolation", interpolation)
+        assert lib.ivlsu_set_option(b"interpolation", interpolation.encode()) == 0
+
+        check_same(model.query(longitude, latitude, depth), library_query(lib, longitude, latitude, depth))
+        check_same(model.query(list(longitude), tuple(latitude), depth), library_query(lib, longitude, latitude, depth))
+        check_same(model.profile(-115.8, 32.9, depths), library_query(lib, [-115.8] * 33, [32.9] * 33, depths))
+
+        for rotation in (0, 30):
+            vp, vs, rho = model.grid((600250, 3620400, 300), (1000, 2000, 1000), (5, 4, 3), rotation)
+            library = library_grid(lib, (600250, 3620400, 300), (1000, 2000, 1000), (5, 4, 3), rotation)
+            assert (vp, vs, rho) == tuple(library)
+        # A grid reaching past the south edge and into the bricks without data.
+        vp, vs, rho = model.grid((625000, 3600000, 0), (2000, 2000, 1000), (12, 12, 9))
+        assert (vp, vs, rho) == tuple(library_grid(lib, (625000, 3600000, 0), (2000, 2000, 1000), (12, 12, 9)))
+        assert ivlsu.NA in vp and any(v > 0 for v in vp)
+
+    try:
+        model.set_option("threads", "2")
+        raise AssertionError("threads is not an option of a model")
+    except ValueError:
+        pass
+
+    del model
+    assert lib.ivlsu_finalize() == 0
+    print("Python module queries were successful.")
+
+
+if __name__ == "__main__":
+    main()
@@ -12,189 +12,3261 @@
 
 #include "ivlsu.h"
 
+// Constants
+/** The version of the model. */
+const char *ivlsu_version_string = "IMPERIAL";
+
+// Variables
+/** Set to 1 when the model is ready for query. */
+int ivlsu_is_initialized = 0;
+
+/** Location of the binary data files. */
+char ivlsu_data_directory[512];
+
+/** Configuration parameters. */
+ivlsu_configuration_t *ivlsu_configuration;
+/** Holds pointers to the velocity model data OR indicates it can be read from file. */
+ivlsu_model_t *ivlsu_velocity_model;
+
+/** Proj.4 latitude longitude, WGS84 projection holder. */
+projPJ ivlsu_latlon;
+/** Proj.4 UTM projection holder. */
+projPJ ivlsu_utm;
+
+/** The cosine of the rotation angle used to rotate the box and point around the bottom-left corner. */
+double ivlsu_cos_rotation_angle = 0;
+/** The sine of the rotation angle used to rotate the box and point around the bottom-left corner. */
+double ivlsu_sin_rotation_angle = 0;
+
+/** The height of this model's region, in meters. */
+double ivlsu_total_height_m = 0;
+/** The width of this model's region, in meters. */
+double ivlsu_total_width_m = 0;
+
 /** The config of the model */
 char *ivlsu_config_string=NULL;
 int ivlsu_config_sz=0;
 
+/** Counters of the query kernels. */
+ivlsu_stats_t ivlsu_stats;
+
+/** Number of queries holding the model, counted under the parity of the reload epoch they started in. */
+static long ivlsu_readers[2] = { 0, 0 };
+/** Reload epoch, advanced twice by every reload while it waits for the queries holding the old model. */
+static long ivlsu_epoch = 0;
+/** Serializes reloads. */
+static pthread_mutex_t ivlsu_reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Worker threads kept between parallel loops, with the projection handles they made. */
+typedef struct ivlsu_pool_t {
+	/** Held by the parallel loop using the pool */
+	pthread_mutex_t busy;
+	/** Guards the fields below */
+	pthread_mutex_t lock;
+	/** Signaled when a task is handed out or the pool stops */
+	pthread_cond_t start;
+	/** Signaled when the last worker of a task is done */
+	pthread_cond_t done;
+	/** Number of threads started, workers 1 to started */
+	int started;
+	/** Workers 1 to participants - 1 run the current task */
+	int participants;
+	/** Number of workers still running the current task */
+	int running;
+	/** Set to make the threads exit */
+	int stopping;
+	/** Advanced every time a task is handed out */
+	unsigned long generation;
+	/** Generation each worker has last seen */
+	unsigned long seen[IVLSU_MAX_THREADS];
+	/** The current task */
+	ivlsu_task_t *task;
+	/** The threads */
+	pthread_t threads[IVLSU_MAX_THREADS];
+	/** The workers, indexed as the threads */
+	ivlsu_worker_t workers[IVLSU_MAX_THREADS];
+} ivlsu_pool_t;
+
+/** The worker pool of ivlsu_parallel_for. */
+static ivlsu_pool_t ivlsu_pool = { .busy = PTHREAD_MUTEX_INITIALIZER, .lock = PTHREAD_MUTEX_INITIALIZER,
+				   .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+/** Registers the pool's fork handler once. */
+static pthread_once_t ivlsu_pool_once = PTHREAD_ONCE_INIT;
+
+/** Projection handles of each calling thread, made on its first query. */
+static pthread_key_t ivlsu_projection_key;
+/** Creates ivlsu_projection_key once. */
+static pthread_once_t ivlsu_projection_once = PTHREAD_ONCE_INIT;
+
+/** Proj.4 definition of the latitude longitude projection. */
+#define IVLSU_LATLON_PROJECTION "+proj=latlong +datum=WGS84"
+/** Proj.4 definition of the UTM projection. */
+#define IVLSU_UTM_PROJECTION "+proj=utm +zone=11 +datum=WGS84 +units=m +no_defs"
+/** Central meridian of the UTM zone, in degrees. */
+#define IVLSU_UTM_CENTRAL_MERIDIAN -117.0
+
+/**
+ * Builds the products derived from the whole volume at init.
+ *
+ * @param model The model whose volume is set up.
+ * @return SUCCESS, or FAIL if the basin depth rasters could not be allocated.
+ */
+static int ivlsu_build_derived(ivlsu_model_t *model) {
+	// Precompute the Z1.0 and Z2.5 basin depth rasters.
+	if (ivlsu_build_zdepth_rasters(model) != SUCCESS) {
+		print_error("Could not allocate the basin depth rasters.");
+		return FAIL;
+	}
+
+	// Integrate the vertical P and S travel times used for travel time and
+	// time-averaged Vs queries. Without them only those queries are unavailable.
+	model->vp_time = ivlsu_build_travel_time(&(model->volume), IVLSU_VP);
+	model->vs_time = ivlsu_build_travel_time(&(model->volume), IVLSU_VS);
+
+	// Sum the volume for box averages. Without the table only those are unavailable.
+	model->summed = ivlsu_build_summed_table(&(model->volume));
+
+	// Downsample the volume for coarse queries. Missing levels fall back to finer ones.
+	ivlsu_build_pyramid(model);
+
+	// Summarize the volume brick by brick for region statistics and for skipping
+	// cells without data. Without the hierarchy only region statistics are unavailable.
+	if (ivlsu_build_bricks(model) != SUCCESS)
+		fprintf(stderr, "WARNING: Could not allocate the brick hierarchy.\n");
+
+	return SUCCESS;
+}
+
+/**
+ * Frees a model and everything it holds.
+ *
+ * @param model The model.
+ */
+void ivlsu_free_model(ivlsu_model_t *model) {
+	int i = 0;
+
+	if (model->vp_status == 1)
+		fclose((FILE *)model->vp);
+	else
+		free(model->vp);
+	if (model->vp_file != NULL)
+		fclose(model->vp_file);
+	free(model->z1000);
+	free(model->z2500);
+	free(model->vp_time);
+	free(model->vs_time);
+	free(model->summed);
+	for (i = 0; i < model->lod_count; i++)
+		free((void *)model->lod[i].vp);
+	for (i = 0; i < model->brick_levels; i++)
+		free(model->bricks[i].bricks);
+	free((void *)model->volume.empty);
+	free(model);
+}
+
+/**
+ * Loads a model from a data directory without touching the loaded model: reads the
+ * Vp data, or the window of it, and builds the derived products of a whole model.
+ *
+ * @param config The configuration describing the data.
+ * @param directory The directory holding vp.dat.
+ * @param window_first First z level held in memory.
+ * @param window_levels Number of z levels held in memory, 0 for the whole model.
+ * @return The model, or NULL.
+ */
+ivlsu_model_t *ivlsu_load_model(const ivlsu_configuration_t *config, const char *directory, int window_first, int window_levels) {
+	ivlsu_model_t *model = calloc(1, sizeof(ivlsu_model_t));
+
+	if (model == NULL) {
+		print_error("Could not allocate the model.");
+		return NULL;
+	}
+
+	model->window_first = window_first;
+	model->window_levels = window_levels;
+	if (ivlsu_read_model(config, directory, model) == FAIL) {
+		print_error("No model file was found to read from.");
+		ivlsu_free_model(model);
+		return NULL;
+	}
+
+	ivlsu_setup_volume(config, model);
+	if (model->window_levels == 0 && ivlsu_build_derived(model) != SUCCESS) {
+		ivlsu_free_model(model);
+		return NULL;
+	}
+
+	return model;
+}
+
+/**
+ * Checks whether two configurations describe the same grid of nodes.
+ *
+ * @param a A configuration.
+ * @param b Another configuration.
+ * @return 1 if the grids are the same, 0 otherwise.
+ */
+int ivlsu_same_grid(const ivlsu_configuration_t *a, const ivlsu_configuration_t *b) {
+	return a->nx == b->nx && a->ny == b->ny && a->nz == b->nz && a->depth == b->depth && a->depth_interval == b->depth_interval &&
+	       a->bottom_left_corner_e == b->bottom_left_corner_e && a->bottom_left_corner_n == b->bottom_left_corner_n &&
+	       a->top_right_corner_e == b->top_right_corner_e && a->top_right_corner_n == b->top_right_corner_n;
+}
+
+/**
+ * Picks the sorting threshold and prefetch distance the configuration leaves at -1
+ * from the size of the volume.
+ *
+ * @param config The configuration.
+ * @param volume The volume queried.
+ */
+void ivlsu_default_options(ivlsu_configuration_t *config, const ivlsu_volume_t *volume) {
+	// Sorting scattered batches only pays off once the volume no longer fits in cache.
+	if (config->sort_threshold < 0) {
+		if (volume->count * sizeof(float) >= IVLSU_SORT_MIN_VOLUME)
+			config->sort_threshold = IVLSU_SORT_THRESHOLD;
+		else
+			config->sort_threshold = 0;
+	}
+
+	// Likewise prefetching the corners only hides latency the cache is not already hiding.
+	if (config->prefetch_distance < 0) {
+		if (volume->count * sizeof(float) >= IVLSU_PREFETCH_MIN_VOLUME)
+			config->prefetch_distance = IVLSU_PREFETCH_DISTANCE;
+		else
+			config->prefetch_distance = 0;
+	}
+}
+
+/**
+ * Initializes the IMPERIAL plugin model within the UCVM framework. In order to initialize
+ * the model, we must provide the UCVM install path and optionally a place in memory
+ * where the model already exists.
+ *
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @return Success or failure, if initialization was successful.
+ */
+int ivlsu_init(const char *dir, const char *label) {
+	return ivlsu_init_window(dir, label, 0, -1);
+}
+
+/**
+ * Initializes the model holding only the z levels that queries between two depths
+ * read in memory, for processes that each work on their own depth range of a large
+ * model. Samples outside of the window are still read, from file. The derived
+ * products that scan the whole volume, the basin depth rasters, vertical travel
+ * times, summed-volume table, pyramid and brick hierarchy, are not built: Z1.0 and
+ * Z2.5 then search the columns, and the queries needing the others fail.
+ *
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @param min_depth Shallowest depth queried, in meters.
+ * @param max_depth Deepest depth queried, in meters; below min_depth loads the whole model.
+ * @return Success or failure, if initialization was successful.
+ */
+int ivlsu_init_window(const char *dir, const char *label, double min_depth, double max_depth) {
+	int tempVal = 0, last = 0;
+	char configbuf[512];
+
+	// Initialize variables.
+	ivlsu_configuration = calloc(1, sizeof(ivlsu_configuration_t));
+	ivlsu_velocity_model = calloc(1, sizeof(ivlsu_model_t));
+
+        ivlsu_config_string = calloc(IVLSU_CONFIG_MAX, sizeof(char));
+        ivlsu_config_string[0]='\0';
+        ivlsu_config_sz=0;
+
+	ivlsu_reset_stats();
+
+	// Defaults for the options the configuration file may leave out.
+	ivlsu_configuration->sort_threshold = -1;
+	ivlsu_configuration->prefetch_distance = -1;
+
+	// Configuration file location.
+	sprintf(configbuf, "%s/model/%s/data/config", dir, label);
+
+	// Read the configuration file.
+	if (ivlsu_read_configuration(configbuf, ivlsu_configuration) != SUCCESS) {
+		tempVal = FAIL;
+                print_error("No configuration file was found to read from.");
+		return FAIL;
+        }
+
+	// Set up the data directory.
+	sprintf(ivlsu_data_directory, "%s/model/%s/data/%s", dir, label, ivlsu_configuration->model_dir);
+
+	// A point loads its own z level and the one above it, and gradients the ones around those.
+	if (max_depth >= min_depth && ivlsu_configuration->depth_interval > 0) {
+		ivlsu_velocity_model->window_first = (int)floor(min_depth / ivlsu_configuration->depth_interval) - 2;
+		last = (int)floor(max_depth / ivlsu_configuration->depth_interval) + 2;
+		ivlsu_velocity_model->window_first = ivlsu_velocity_model->window_first < 0 ? 0 : ivlsu_velocity_model->window_first;
+		last = last >= ivlsu_configuration->nz ? ivlsu_configuration->nz - 1 : last;
+		ivlsu_velocity_model->window_levels = last >= ivlsu_velocity_model->window_first ? last - ivlsu_velocity_model->window_first + 1 : 1;
+	}
+
+	// Can we allocate the model, or parts of it, to memory. If so, we do.
+	tempVal = ivlsu_try_reading_model(ivlsu_velocity_model);
+
+	if (tempVal == SUCCESS) {
+		fprintf(stderr, "WARNING: Could not load model into memory. Reading the model from the\n");
+		fprintf(stderr, "hard disk may result in slow performance.");
+	} else if (tempVal == FAIL) {
+		print_error("No model file was found to read from.");
+		return FAIL;
+	}
+
+	// Describe the data for the batch kernel.
+	ivlsu_setup_volume(ivlsu_configuration, ivlsu_velocity_model);
+
+	// The derived products read the whole volume; a window of the model goes without them.
+	if (ivlsu_velocity_model->window_levels == 0 && ivlsu_build_derived(ivlsu_velocity_model) != SUCCESS)
+		return FAIL;
+
+	ivlsu_default_options(ivlsu_configuration, &(ivlsu_velocity_model->volume));
+
+	// In order to simplify our calculations in the query, we want to rotate the box so that the bottom-left
+	// corner is at (0m,0m). Our box's height is total_height_m and total_width_m. We then rotate the
+	// point so that is is somewhere between (0,0) and (total_width_m, total_height_m). How far along
+	// the X and Y axis determines which grid points we use for the interpolation routine.
+
+	ivlsu_total_height_m = sqrt(pow(ivlsu_configuration->top_left_corner_n - ivlsu_configuration->bottom_left_corner_n, 2.0f) +
+						  pow(ivlsu_configuration->top_left_corner_e - ivlsu_configuration->bottom_left_corner_e, 2.0f));
+	ivlsu_total_width_m  = sqrt(pow(ivlsu_configuration->top_right_corner_n - ivlsu_configuration->top_left_corner_n, 2.0f) +
+						  pow(ivlsu_configuration->top_right_corner_e - ivlsu_configuration->top_left_corner_e, 2.0f));
+
+
+        // We need to convert the point from lat, lon to UTM, let's set it up.
+        if (!(ivlsu_latlon = pj_init_plus(IVLSU_LATLON_PROJECTION))) {
+                print_error("Could not set up latitude and longitude projection.");
+                return FAIL;
+        }
+        if (!(ivlsu_utm = pj_init_plus(IVLSU_UTM_PROJECTION))) {
+                print_error("Could not set up UTM projection.");
+                return FAIL;
+        }
+
+        /* setup config_string */
+        sprintf(ivlsu_config_string,"config = %s\n",configbuf);
+        ivlsu_config_sz=1;
+
+	// Let everyone know that we are initialized and ready for business.
+	ivlsu_is_initialized = 1;
+
+	return SUCCESS;
+}
+
+/**
+ * Holds the current model for a query: the model stays allocated until the matching
+ * ivlsu_model_release, even if a reload replaces it meanwhile. A query takes the model
+ * once and reads everything from it, so it never mixes two versions of the data.
+ *
+ * @param ticket Returned ticket to pass to ivlsu_model_release.
+ * @return The model.
+ */
+ivlsu_model_t *ivlsu_model_acquire(int *ticket) {
+	*ticket = (int)(*(volatile long *)&ivlsu_epoch & 1);
+	__sync_fetch_and_add(&(ivlsu_readers[*ticket]), 1);
+	return *(ivlsu_model_t * volatile *)&ivlsu_velocity_model;
+}
+
+/**
+ * Lets go of the model held by ivlsu_model_acquire.
+ *
+ * @param ticket The ticket ivlsu_model_acquire returned.
+ */
+void ivlsu_model_release(int ticket) {
+	__sync_fetch_and_sub(&(ivlsu_readers[ticket]), 1);
+}
+
+/**
+ * Waits until no query holds a model that was current before the call. Each of the
+ * two phases moves new queries onto the other counter and waits for the old one to
+ * drain, so a steady stream of queries cannot hold the wait off.
+ */
+static void ivlsu_wait_for_readers() {
+	int phase = 0, parity = 0;
+
+	for (phase = 0; phase < 2; phase++) {
+		parity = (int)(__sync_fetch_and_add(&ivlsu_epoch, 1) & 1);
+		while (*(volatile long *)&(ivlsu_readers[parity]) > 0)
+			usleep(IVLSU_RELOAD_POLL);
+	}
+}
+
+/**
+ * Reloads the model's data while other threads keep querying it. The new data is read
+ * and its derived products built on the calling thread, then published with a single
+ * pointer swap; queries that started on the old model finish on it, and it is freed
+ * once they have. Queries never wait and never see a partly loaded model. The new
+ * configuration may point to another data directory but must describe the same grid;
+ * runtime options and the depth window keep their current values. Must not be called
+ * while the calling thread holds the model.
+ *
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @return SUCCESS, or FAIL with the old model still in place.
+ */
+int ivlsu_reload(const char *dir, const char *label) {
+	ivlsu_configuration_t config;
+	ivlsu_model_t *model = NULL, *old = NULL;
+	char configbuf[sizeof(ivlsu_data_directory)], directory[sizeof(ivlsu_data_directory)];
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is reloaded.");
+		return FAIL;
+	}
+
+	pthread_mutex_lock(&ivlsu_reload_lock);
+	memset(&config, 0, sizeof(config));
+	if (snprintf(configbuf, sizeof(configbuf), "%s/model/%s/data/config", dir, label) >= (int)sizeof(configbuf)) {
+		print_error("The path of the model to reload is too long.");
+	} else if (ivlsu_read_configuration(configbuf, &config) != SUCCESS) {
+		print_error("No configuration file was found to reload from.");
+	} else if (!ivlsu_same_grid(&config, ivlsu_configuration)) {
+		print_error("The reloaded model must have the same grid as the loaded one.");
+	} else if (snprintf(directory, sizeof(directory), "%s/model/%s/data/%s", dir, label, config.model_dir) >= (int)sizeof(directory)) {
+		print_error("The path of the model to reload is too long.");
+	} else {
+		// Read the new data into a model of the same window.
+		model = ivlsu_load_model(ivlsu_configuration, directory, ivlsu_velocity_model->window_first,
+					 ivlsu_velocity_model->window_levels);
+	}
+
+	if (model == NULL) {
+		pthread_mutex_unlock(&ivlsu_reload_lock);
+		return FAIL;
+	}
+
+	// Publish the new model, then free the old one once no query holds it.
+	strcpy(ivlsu_data_directory, directory);
+	old = ivlsu_velocity_model;
+	__sync_synchronize();
+	ivlsu_velocity_model = model;
+	__sync_synchronize();
+	ivlsu_wait_for_readers();
+	ivlsu_free_model(old);
+	pthread_mutex_unlock(&ivlsu_reload_lock);
+
+	return SUCCESS;
+}
+
+/** Destination of the values computed by the batch kernel. */
+typedef struct ivlsu_sink_t {
+	/** Array-of-structures output of ivlsu_query, or NULL */
+	ivlsu_properties_t *data;
+	/** Structure-of-arrays output of ivlsu_query_batch, or NULL */
+	ivlsu_batch_t *batch;
+} ivlsu_sink_t;
+
+/**
+ * Stores one value into a batch output array of the given element type.
+ *
+ * @param array The output array.
+ * @param type IVLSU_FLOAT32 or IVLSU_FLOAT64.
+ * @param i Index of the point.
+ * @param value The value to store.
+ */
+static inline void ivlsu_store_value(void *array, int type, long i, double value) {
+	if (type == IVLSU_FLOAT32)
+		((float *)array)[i] = (float)value;
+	else
+		((double *)array)[i] = value;
+}
+
+/**
+ * Writes the properties derived from an interpolated Vp to the sink. Properties that
+ * were not requested are neither computed nor written. Batch outputs of points on
+ * nodes without data are NA for every property, as outside of the model; the
+ * ivlsu_properties_t outputs keep deriving Vs and density from the -1, as
+ * ivlsu_query always has.
+ *
+ * @param sink The output of the query.
+ * @param i Index of the point.
+ * @param inside Zero if the point is outside of the model.
+ * @param vp The interpolated Vp.
+ */
+static inline void ivlsu_sink_store(const ivlsu_sink_t *sink, long i, int inside, double vp) {
+	ivlsu_batch_t *batch = sink->batch;
+
+	if (sink->data != NULL) {
+		if (!inside) {
+			sink->data[i].vp = -1;
+			sink->data[i].vs = -1;
+			sink->data[i].rho = -1;
+			return;
+		}
+		sink->data[i].vp = vp;
+		sink->data[i].rho = ivlsu_calculate_density(vp);
+		sink->data[i].vs = ivlsu_calculate_vs(vp);
+		return;
+	}
+
+	inside = inside && vp >= 0;
+	if (batch->properties & IVLSU_VP)
+		ivlsu_store_value(batch->vp, batch->type, i, inside ? vp : NA);
+	if (batch->properties & IVLSU_VS)
+		ivlsu_store_value(batch->vs, batch->type, i, inside ? ivlsu_calculate_vs(vp) : NA);
+	if (batch->properties & IVLSU_RHO)
+		ivlsu_store_value(batch->rho, batch->type, i, inside ? ivlsu_calculate_density(vp) : NA);
+}
+
+/**
+ * Writes the Vp and Vs gradients of a located point to the batch outputs when they
+ * were requested. Points outside of the model or in cells touching NA nodes keep the
+ * NA written by ivlsu_prepare_batch.
+ *
+ * @param sink The output of the query.
+ * @param i Index of the point.
+ * @param volume The volume being queried.
+ * @param interpolation Non-zero if interpolation is on.
+ * @param cell The located cell.
+ * @param vp The interpolated Vp.
+ */
+static inline void ivlsu_sink_gradient(const ivlsu_sink_t *sink, long i, const ivlsu_volume_t *volume, int interpolation,
+				       const ivlsu_cell_t *cell, double vp) {
+	ivlsu_batch_t *batch = sink->batch;
+	double gradient[3], east = 0, convergence = 0, slope = 0;
+	int axis = 0;
+
+	if (batch == NULL || (batch->properties & IVLSU_GRADIENTS) == 0 ||
+	    ivlsu_cell_gradient(volume, interpolation, cell, gradient) != SUCCESS)
+		return;
+
+	// Rotate the easting and northing axes onto geographic east and north.
+	if (batch->frame == IVLSU_FRAME_ENU) {
+		convergence = ivlsu_meridian_convergence(batch->longitude[i], batch->latitude[i]);
+		east = gradient[0] * cos(convergence) + gradient[1] * sin(convergence);
+		gradient[1] = gradient[1] * cos(convergence) - gradient[0] * sin(convergence);
+		gradient[0] = east;
+	}
+
+	if (batch->properties & IVLSU_VP_GRADIENT)
+		for (axis = 0; axis < 3; axis++)
+			ivlsu_store_value(batch->vp_gradient, batch->type, 3 * i + axis, gradient[axis]);
+
+	if (batch->properties & IVLSU_VS_GRADIENT) {
+		slope = ivlsu_calculate_vs_slope(vp);
+		for (axis = 0; axis < 3; axis++)
+			ivlsu_store_value(batch->vs_gradient, batch->type, 3 * i + axis, slope * gradient[axis]);
+	}
+}
+
+/** A set of points going through the batch kernel. */
+typedef struct ivlsu_evaluation_t {
+	/** First longitude */
+	const double *longitude;
+	/** First latitude */
+	const double *latitude;
+	/** First depth */
+	const double *depth;
+	/** Distance in doubles between consecutive points of each input */
+	int stride;
+	/** Where the results are written */
+	const ivlsu_sink_t *sink;
+	/** The volume being queried */
+	const ivlsu_volume_t *volume;
+	/** Non-zero if interpolation is on */
+	int interpolation;
+	/** Points between prefetching a cell's corners and interpolating it */
+	int prefetch_distance;
+	/** Located points with their Morton keys, sorted evaluation only */
+	ivlsu_sort_record_t *records;
+} ivlsu_evaluation_t;
+
+/**
+ * Projects and locates the points [begin, end) of an evaluation. Runs of points with
+ * the same longitude and latitude, such as profiles and mesh columns, are projected
+ * once and share their horizontal weights; only their depth is located per point.
+ *
+ * @param evaluation The points being evaluated.
+ * @param worker The worker doing the projection.
+ * @param begin First point.
+ * @param end One past the last point, after begin and at most IVLSU_BATCH_CHUNK after it.
+ * @param cells The returned cells, indexed from begin.
+ */
+static void ivlsu_locate_range(const ivlsu_evaluation_t *evaluation, ivlsu_worker_t *worker, long begin, long end,
+			       ivlsu_cell_t *cells) {
+	double utm_e[IVLSU_BATCH_CHUNK], utm_n[IVLSU_BATCH_CHUNK];
+	const double *lon = evaluation->longitude + begin * evaluation->stride;
+	const double *lat = evaluation->latitude + begin * evaluation->stride;
+	const double *depth = evaluation->depth + begin * evaluation->stride;
+	int stride = evaluation->stride;
+	int count = (int)(end - begin), columns = 1, nodes = 0, empty = 0, k = 0;
+	ivlsu_column_t column;
+
+	// Gather the first point of every run of points in the same column and project
+	// them in place.
+	utm_e[0] = lon[0];
+	utm_n[0] = lat[0];
+	for (k = 1; k < count; k++) {
+		if (lon[k * stride] != lon[(k - 1) * stride] || lat[k * stride] != lat[(k - 1) * stride]) {
+			utm_e[columns] = lon[k * stride];
+			utm_n[columns] = lat[k * stride];
+			columns++;
+		}
+	}
+
+	ivlsu_project_points(worker, utm_e, utm_n, 1, columns, utm_e, utm_n);
+
+	for (k = 0, columns = 0; k < count; k++) {
+		if (k == 0 || lon[k * stride] != lon[(k - 1) * stride] || lat[k * stride] != lat[(k - 1) * stride]) {
+			ivlsu_locate_column(evaluation->volume, utm_e[columns], utm_n[columns], &column);
+			columns++;
+		}
+		ivlsu_locate_depth(evaluation->volume, evaluation->interpolation, &column, depth[k * stride], &(cells[k]));
+		nodes += cells[k].mode == IVLSU_CELL_NEAREST;
+		empty += cells[k].mode == IVLSU_CELL_EMPTY;
+	}
+
+	__sync_fetch_and_add(&(ivlsu_stats.points), count);
+	__sync_fetch_and_add(&(ivlsu_stats.column_points), count - columns);
+	__sync_fetch_and_add(&(ivlsu_stats.empty_points), empty);
+	if (evaluation->interpolation)
+		__sync_fetch_and_add(&(ivlsu_stats.node_points), nodes);
+}
+
+/**
+ * Task evaluating points in their given order as a two stage pipeline. Stage one
+ * projects and locates a chunk of points; stage two interpolates them while the
+ * corner lines of the point prefetch_distance ahead are being loaded, so the gathers
+ * of a volume that does not fit in cache overlap instead of waiting one by one.
+ */
+static void ivlsu_evaluate_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_evaluation_t *evaluation = arg;
+	const ivlsu_volume_t *volume = evaluation->volume;
+	int distance = evaluation->prefetch_distance;
+	ivlsu_cell_t cells[IVLSU_BATCH_CHUNK];
+	long chunk = 0, last = 0, i = 0;
+	double vp = 0;
+	int count = 0, k = 0;
+
+	for (chunk = begin; chunk < end; chunk += IVLSU_BATCH_CHUNK) {
+		last = end - chunk < IVLSU_BATCH_CHUNK ? end : chunk + IVLSU_BATCH_CHUNK;
+		count = (int)(last - chunk);
+		ivlsu_locate_range(evaluation, worker, chunk, last, cells);
+
+		for (k = 0; k < distance && k < count; k++)
+			ivlsu_prefetch_cell(volume, &(cells[k]));
+
+		for (k = 0, i = chunk; k < count; k++, i++) {
+			if (distance > 0 && k + distance < count)
+				ivlsu_prefetch_cell(volume, &(cells[k + distance]));
+			vp = ivlsu_evaluate_cell(volume, &(cells[k]));
+			ivlsu_sink_store(evaluation->sink, i, cells[k].mode != IVLSU_CELL_OUTSIDE, vp);
+			ivlsu_sink_gradient(evaluation->sink, i, volume, evaluation->interpolation, &(cells[k]), vp);
+		}
+	}
+}
+
+/**
+ * Task locating points and computing their Morton keys for the sorted evaluation.
+ */
+static void ivlsu_locate_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_evaluation_t *evaluation = arg;
+	ivlsu_cell_t cells[IVLSU_BATCH_CHUNK];
+	ivlsu_sort_record_t *record = NULL;
+	long chunk = 0, last = 0, i = 0;
+
+	for (chunk = begin; chunk < end; chunk += IVLSU_BATCH_CHUNK) {
+		last = end - chunk < IVLSU_BATCH_CHUNK ? end : chunk + IVLSU_BATCH_CHUNK;
+		ivlsu_locate_range(evaluation, worker, chunk, last, cells);
+
+		for (i = chunk; i < last; i++) {
+			record = &(evaluation->records[i]);
+			record->cell = cells[i - chunk];
+			record->key = ivlsu_cell_key(evaluation->volume, &(record->cell));
+			record->index = i;
+		}
+	}
+}
+
+/**
+ * Task evaluating already located points in Morton order and scattering the results
+ * back to the caller's order.
+ */
+static void ivlsu_evaluate_sorted_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_evaluation_t *evaluation = arg;
+	const ivlsu_sort_record_t *record = NULL;
+	int distance = evaluation->prefetch_distance;
+	double vp = 0;
+	long k = 0;
+
+	for (k = begin; k < begin + distance && k < end; k++)
+		ivlsu_prefetch_cell(evaluation->volume, &(evaluation->records[k].cell));
+
+	for (k = begin; k < end; k++) {
+		if (distance > 0 && k + distance < end)
+			ivlsu_prefetch_cell(evaluation->volume, &(evaluation->records[k + distance].cell));
+		record = &(evaluation->records[k]);
+		vp = ivlsu_evaluate_cell(evaluation->volume, &(record->cell));
+		ivlsu_sink_store(evaluation->sink, record->index, record->cell.mode != IVLSU_CELL_OUTSIDE, vp);
+		ivlsu_sink_gradient(evaluation->sink, record->index, evaluation->volume, evaluation->interpolation, &(record->cell), vp);
+	}
+}
+
+/**
+ * Evaluates a batch in Morton order of the grid cells, so that the corner gathers of
+ * scattered points walk through the volume instead of jumping across it. The located
+ * cells travel with their keys through the sort, so the evaluation reads them in order.
+ *
+ * @param evaluation The points being evaluated.
+ * @param numpoints The total number of points to query.
+ * @return SUCCESS, or FAIL if the sort buffers could not be allocated.
+ */
+static int ivlsu_evaluate_sorted(ivlsu_evaluation_t *evaluation, long numpoints) {
+	const ivlsu_volume_t *volume = evaluation->volume;
+	int bits = 0, retVal = FAIL;
+
+	evaluation->records = malloc(numpoints * sizeof(ivlsu_sort_record_t));
+
+	if (evaluation->records != NULL) {
+		ivlsu_parallel_for(numpoints, IVLSU_BATCH_CHUNK, ivlsu_locate_task, evaluation);
+
+		// The keys interleave three indices, each as wide as the largest dimension.
+		while ((1L << bits) < volume->nx || (1L << bits) < volume->ny || (1L << bits) < volume->nz + 1)
+			bits++;
+
+		if (ivlsu_radix_sort(evaluation->records, numpoints, 3 * bits) == SUCCESS) {
+			ivlsu_parallel_for(numpoints, IVLSU_BATCH_CHUNK, ivlsu_evaluate_sorted_task, evaluation);
+			retVal = SUCCESS;
+		}
+	}
+
+	free(evaluation->records);
+	return retVal;
+}
+
+/**
+ * Runs the batch kernel over a set of points. Points are projected in chunks of
+ * IVLSU_BATCH_CHUNK with a single pj_transform call, located and interpolated. Large
+ * batches are spread over the worker threads, and batches of at least sort_threshold
+ * points are evaluated in Morton order.
+ *
+ * @param longitude First longitude.
+ * @param latitude First latitude.
+ * @param depth First depth.
+ * @param stride Distance in doubles between consecutive points of each input.
+ * @param numpoints The total number of points to query.
+ * @param volume The volume, or pyramid level, being queried.
+ * @param config The configuration holding the query options.
+ * @param sink Where the results are written.
+ */
+static void ivlsu_evaluate_points(const double *longitude, const double *latitude, const double *depth, int stride,
+				  long numpoints, const ivlsu_volume_t *volume, const ivlsu_configuration_t *config,
+				  const ivlsu_sink_t *sink) {
+	ivlsu_evaluation_t evaluation = { longitude, latitude, depth, stride, sink, volume,
+					  config->interpolation, config->prefetch_distance, NULL };
+
+	if (config->sort_threshold > 0 && numpoints >= config->sort_threshold &&
+	    ivlsu_evaluate_sorted(&evaluation, numpoints) == SUCCESS)
+		return;
+
+	ivlsu_parallel_for(numpoints, IVLSU_BATCH_CHUNK, ivlsu_evaluate_task, &evaluation);
+}
+
+/**
+ * Queries a model at the given points with the options of a configuration, as
+ * ivlsu_query.
+ *
+ * @param model The model.
+ * @param config The configuration holding the query options.
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned.
+ * @param numpoints The total number of points to query.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_model_query(const ivlsu_model_t *model, const ivlsu_configuration_t *config, const ivlsu_point_t *points,
+		      ivlsu_properties_t *data, int numpoints) {
+	ivlsu_sink_t sink = { data, NULL };
+	int stride = sizeof(ivlsu_point_t) / sizeof(double);
+
+	if (numpoints <= 0)
+		return SUCCESS;
+
+	ivlsu_evaluate_points(&(points[0].longitude), &(points[0].latitude), &(points[0].depth), stride, numpoints,
+			      &(model->volume), config, &sink);
+
+	return SUCCESS;
+}
+
+/**
+ * Queries IMPERIAL at the given points and returns the data that it finds.
+ *
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
+ * @param numpoints The total number of points to query.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_query(ivlsu_point_t *points, ivlsu_properties_t *data, int numpoints) {
+	ivlsu_model_t *model = NULL;
+	int ticket = 0, status;
+
+	if (numpoints <= 0)
+		return SUCCESS;
+
+	model = ivlsu_model_acquire(&ticket);
+	status = ivlsu_model_query(model, ivlsu_configuration, points, data, numpoints);
+	ivlsu_model_release(ticket);
+
+	return status;
+}
+
+/**
+ * Checks the output side of a batch and fills the Qp and Qs outputs, which this model
+ * does not provide, and the gradient outputs with NA.
+ *
+ * @param batch The batch being queried.
+ * @param numpoints Number of points the outputs hold.
+ * @return SUCCESS or FAIL.
+ */
+static int ivlsu_prepare_batch(ivlsu_batch_t *batch, long numpoints) {
+	long i = 0;
+
+	if ((batch->type != IVLSU_FLOAT32 && batch->type != IVLSU_FLOAT64) ||
+		((batch->properties & IVLSU_VP) && batch->vp == NULL) || ((batch->properties & IVLSU_VS) && batch->vs == NULL) ||
+		((batch->properties & IVLSU_RHO) && batch->rho == NULL) || ((batch->properties & IVLSU_QP) && batch->qp == NULL) ||
+		((batch->properties & IVLSU_QS) && batch->qs == NULL) ||
+		((batch->properties & IVLSU_VP_GRADIENT) && batch->vp_gradient == NULL) ||
+		((batch->properties & IVLSU_VS_GRADIENT) && batch->vs_gradient == NULL) ||
+		(batch->frame != IVLSU_FRAME_UTM && batch->frame != IVLSU_FRAME_ENU)) {
+		print_error("The batch query is missing an output array or has an unknown output type.");
+		return FAIL;
+	}
+
+	// Gradients of points outside of the model stay NA.
+	for (i = 0; (batch->properties & IVLSU_GRADIENTS) && i < 3 * numpoints; i++) {
+		if (batch->properties & IVLSU_VP_GRADIENT)
+			ivlsu_store_value(batch->vp_gradient, batch->type, i, NA);
+		if (batch->properties & IVLSU_VS_GRADIENT)
+			ivlsu_store_value(batch->vs_gradient, batch->type, i, NA);
+	}
+
+	// Qp and Qs are not provided by this model.
+	for (i = 0; (batch->properties & (IVLSU_QP | IVLSU_QS)) && i < numpoints; i++) {
+		if (batch->properties & IVLSU_QP)
+			ivlsu_store_value(batch->qp, batch->type, i, NA);
+		if (batch->properties & IVLSU_QS)
+			ivlsu_store_value(batch->qs, batch->type, i, NA);
+	}
+
+	return SUCCESS;
+}
+
+/**
+ * Queries a model with structure-of-arrays inputs and outputs and the options of a
+ * configuration, as ivlsu_query_batch.
+ *
+ * @param model The model.
+ * @param config The configuration holding the query options.
+ * @param batch The input arrays, property mask and output arrays.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_model_query_batch(const ivlsu_model_t *model, const ivlsu_configuration_t *config, ivlsu_batch_t *batch) {
+	ivlsu_sink_t sink = { NULL, batch };
+
+	if (ivlsu_prepare_batch(batch, batch->numpoints) != SUCCESS)
+		return FAIL;
+
+	if (batch->numpoints <= 0 || (batch->properties & (IVLSU_VP | IVLSU_VS | IVLSU_RHO | IVLSU_GRADIENTS)) == 0)
+		return SUCCESS;
+
+	if (batch->longitude == NULL || batch->latitude == NULL || batch->depth == NULL) {
+		print_error("The batch query is missing an input array.");
+		return FAIL;
+	}
+
+	ivlsu_evaluate_points(batch->longitude, batch->latitude, batch->depth, 1, batch->numpoints,
+			      ivlsu_model_volume(model, batch->spacing), config, &sink);
+
+	return SUCCESS;
+}
+
+/**
+ * Queries IMPERIAL with structure-of-arrays inputs and outputs. Only the properties
+ * selected in batch->properties are computed. Points outside of the model or on
+ * nodes without data are NA for every property. Qp and Qs are not part of the model
+ * and are returned as NA. A non-zero batch->spacing samples the coarsest pyramid
+ * level fine enough for it.
+ *
+ * @param batch The input arrays, property mask and output arrays.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_query_batch(ivlsu_batch_t *batch) {
+	ivlsu_model_t *model = NULL;
+	int ticket = 0, status;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	model = ivlsu_model_acquire(&ticket);
+	status = ivlsu_model_query_batch(model, ivlsu_configuration, batch);
+	ivlsu_model_release(ticket);
+
+	return status;
+}
+
+/** A structured grid going through the grid kernel. */
+typedef struct ivlsu_grid_evaluation_t {
+	/** The grid being queried */
+	const ivlsu_grid_t *grid;
+	/** Where the results are written */
+	const ivlsu_sink_t *sink;
+	/** The volume being queried */
+	const ivlsu_volume_t *volume;
+	/** Non-zero if interpolation is on */
+	int interpolation;
+	/** Non-zero if every point of the grid falls exactly on a model node */
+	int aligned;
+	/** Non-zero if gradients are requested */
+	int gradients;
+	/** Node index along each axis, -1 outside of the model */
+	long *x_index, *y_index, *z_index;
+	/** Interpolation weight along each axis */
+	double *x_percent, *y_percent, *z_percent;
+	/** Cosine of the grid's rotation */
+	double cos_rotation;
+	/** Sine of the grid's rotation */
+	double sin_rotation;
+} ivlsu_grid_evaluation_t;
+
+/**
+ * Task evaluating the grid rows [begin, end); a row runs along x at one y and z.
+ */
+static void ivlsu_grid_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_grid_evaluation_t *evaluation = arg;
+	const ivlsu_volume_t *volume = evaluation->volume;
+	const ivlsu_grid_t *grid = evaluation->grid;
+	long plane = (long)volume->nx * volume->ny;
+	long row = 0, i = 0, index = 0, base = 0, nodes = 0, empty = 0, bricks = 0;
+	double vp = 0;
+	ivlsu_cell_t cell;
+	int x = 0, y = 0, z = 0;
+
+	for (row = begin; row < end; row++) {
+		y = (int)(row % grid->ny);
+		z = (int)(row / grid->ny);
+		index = row * grid->nx;
+
+		if (evaluation->y_index[y] < 0 || evaluation->z_index[z] < 0) {
+			for (i = 0; i < grid->nx; i++)
+				ivlsu_sink_store(evaluation->sink, index + i, 0, NA);
+			continue;
+		}
+
+		base = evaluation->z_index[z] * plane + evaluation->y_index[y] * volume->nx;
+		bricks = (evaluation->z_index[z] / IVLSU_BRICK_SIZE * volume->brick_ny + evaluation->y_index[y] / IVLSU_BRICK_SIZE) *
+			 volume->brick_nx;
+		for (x = 0; x < grid->nx; x++, index++) {
+			if (evaluation->x_index[x] < 0) {
+				ivlsu_sink_store(evaluation->sink, index, 0, NA);
+			} else if (volume->empty != NULL && evaluation->x_percent[x] >= 0 && evaluation->y_percent[y] >= 0 &&
+				   evaluation->z_percent[z] >= 0 && volume->empty[bricks + evaluation->x_index[x] / IVLSU_BRICK_SIZE]) {
+				// The cell reaches no data, as in ivlsu_locate_depth.
+				ivlsu_sink_store(evaluation->sink, index, 1, NA);
+				empty++;
+			} else if (evaluation->aligned && !evaluation->gradients) {
+				// Every weight is zero: one direct load per point.
+				ivlsu_sink_store(evaluation->sink, index, 1, ivlsu_volume_vp(volume, base + evaluation->x_index[x]));
+				nodes += evaluation->interpolation;
+			} else {
+				cell.location = base + evaluation->x_index[x];
+				cell.x_percent = evaluation->x_percent[x];
+				cell.y_percent = evaluation->y_percent[y];
+				cell.z_percent = evaluation->z_percent[z];
+				cell.mode = ivlsu_cell_mode(evaluation->interpolation, cell.x_percent, cell.y_percent, cell.z_percent);
+				nodes += evaluation->interpolation && cell.mode == IVLSU_CELL_NEAREST;
+				vp = ivlsu_evaluate_cell(volume, &cell);
+				ivlsu_sink_store(evaluation->sink, index, 1, vp);
+				ivlsu_sink_gradient(evaluation->sink, index, volume, evaluation->interpolation, &cell, vp);
+			}
+		}
+	}
+
+	__sync_fetch_and_add(&(ivlsu_stats.points), (end - begin) * grid->nx);
+	__sync_fetch_and_add(&(ivlsu_stats.node_points), nodes);
+	__sync_fetch_and_add(&(ivlsu_stats.empty_points), empty);
+}
+
+/**
+ * Task evaluating the rows [begin, end) of a rotated grid. Its axes do not follow the
+ * model's, so each point is located on its own, as in the batch kernel.
+ */
+static void ivlsu_rotated_grid_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_grid_evaluation_t *evaluation = arg;
+	const ivlsu_volume_t *volume = evaluation->volume;
+	const ivlsu_grid_t *grid = evaluation->grid;
+	long row = 0, index = 0, nodes = 0, empty = 0;
+	double vp = 0, along = 0, across = 0, depth = 0;
+	ivlsu_column_t column;
+	ivlsu_cell_t cell;
+	int x = 0, y = 0;
+
+	for (row = begin; row < end; row++) {
+		y = (int)(row % grid->ny);
+		depth = grid->origin_depth + (row / grid->ny) * grid->spacing_depth;
+		index = row * grid->nx;
+		across = y * grid->spacing_n;
+
+		for (x = 0; x < grid->nx; x++, index++) {
+			along = x * grid->spacing_e;
+			ivlsu_locate_column(volume, grid->origin_e + along * evaluation->cos_rotation - across * evaluation->sin_rotation,
+					    grid->origin_n + along * evaluation->sin_rotation + across * evaluation->cos_rotation, &column);
+			ivlsu_locate_depth(volume, evaluation->interpolation, &column, depth, &cell);
+			nodes += evaluation->interpolation && cell.mode == IVLSU_CELL_NEAREST;
+			empty += cell.mode == IVLSU_CELL_EMPTY;
+			vp = ivlsu_evaluate_cell(volume, &cell);
+			ivlsu_sink_store(evaluation->sink, index, cell.mode != IVLSU_CELL_OUTSIDE, vp);
+			ivlsu_sink_gradient(evaluation->sink, index, volume, evaluation->interpolation, &cell, vp);
+		}
+	}
+
+	// No point reuses the column of the point before it, which is a spacing away.
+	__sync_fetch_and_add(&(ivlsu_stats.points), (end - begin) * grid->nx);
+	__sync_fetch_and_add(&(ivlsu_stats.node_points), nodes);
+	__sync_fetch_and_add(&(ivlsu_stats.empty_points), empty);
+}
+
+/**
+ * Queries a model on a regular UTM grid with the options of a configuration, as
+ * ivlsu_query_grid.
+ *
+ * @param model The model.
+ * @param config The configuration holding the query options.
+ * @param grid The grid to query.
+ * @param batch The property mask and output arrays, holding nx * ny * nz values.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_model_query_grid(const ivlsu_model_t *model, const ivlsu_configuration_t *config, const ivlsu_grid_t *grid,
+			   ivlsu_batch_t *batch) {
+	ivlsu_sink_t sink = { NULL, batch };
+	ivlsu_grid_evaluation_t evaluation;
+	const ivlsu_volume_t *volume = NULL;
+	long numpoints = (long)grid->nx * grid->ny * grid->nz;
+	int i = 0, retVal = SUCCESS;
+
+	if (grid->nx <= 0 || grid->ny <= 0 || grid->nz <= 0) {
+		print_error("The grid query needs at least one node along each axis.");
+		return FAIL;
+	}
+
+	if ((batch->properties & IVLSU_GRADIENTS) && batch->frame != IVLSU_FRAME_UTM) {
+		print_error("The grid query returns gradients along the UTM axes only.");
+		return FAIL;
+	}
+
+	if (ivlsu_prepare_batch(batch, numpoints) != SUCCESS)
+		return FAIL;
+
+	if ((batch->properties & (IVLSU_VP | IVLSU_VS | IVLSU_RHO | IVLSU_GRADIENTS)) == 0)
+		return SUCCESS;
+
+	volume = ivlsu_model_volume(model, grid->spacing);
+	evaluation.grid = grid;
+	evaluation.sink = &sink;
+	evaluation.volume = volume;
+	evaluation.interpolation = config->interpolation;
+	evaluation.aligned = 1;
+	evaluation.gradients = (batch->properties & IVLSU_GRADIENTS) != 0;
+	evaluation.cos_rotation = cos(grid->rotation * DEG_TO_RAD);
+	evaluation.sin_rotation = sin(grid->rotation * DEG_TO_RAD);
+
+	if (grid->rotation != 0) {
+		ivlsu_parallel_for((long)grid->ny * grid->nz, grid->nx < IVLSU_BATCH_CHUNK ? IVLSU_BATCH_CHUNK / grid->nx : 1,
+				   ivlsu_rotated_grid_task, &evaluation);
+		return SUCCESS;
+	}
+
+	evaluation.x_index = malloc(((long)grid->nx + grid->ny + grid->nz) * sizeof(long));
+	evaluation.x_percent = malloc(((long)grid->nx + grid->ny + grid->nz) * sizeof(double));
+
+	if (evaluation.x_index == NULL || evaluation.x_percent == NULL) {
+		print_error("Could not allocate the grid query.");
+		retVal = FAIL;
+	} else {
+		evaluation.y_index = evaluation.x_index + grid->nx;
+		evaluation.z_index = evaluation.y_index + grid->ny;
+		evaluation.y_percent = evaluation.x_percent + grid->nx;
+		evaluation.z_percent = evaluation.y_percent + grid->ny;
+
+		for (i = 0; i < grid->nx; i++) {
+			if (!ivlsu_locate_axis(grid->origin_e + i * grid->spacing_e, volume->origin_e, volume->dx, volume->nx,
+					       &(evaluation.x_index[i]), &(evaluation.x_percent[i])))
+				evaluation.x_index[i] = -1;
+			else if (evaluation.x_percent[i] != 0)
+				evaluation.aligned = 0;
+		}
+		for (i = 0; i < grid->ny; i++) {
+			if (!ivlsu_locate_axis(grid->origin_n + i * grid->spacing_n, volume->origin_n, volume->dy, volume->ny,
+					       &(evaluation.y_index[i]), &(evaluation.y_percent[i])))
+				evaluation.y_index[i] = -1;
+			else if (evaluation.y_percent[i] != 0)
+				evaluation.aligned = 0;
+		}
+		for (i = 0; i < grid->nz; i++) {
+			if (!ivlsu_locate_level(volume, grid->origin_depth + i * grid->spacing_depth, &(evaluation.z_index[i]),
+						&(evaluation.z_percent[i])))
+				evaluation.z_index[i] = -1;
+			else if (evaluation.z_percent[i] != 0)
+				evaluation.aligned = 0;
+		}
+
+		// Without interpolation every point is a single load of its nearest node anyway.
+		if (!evaluation.interpolation)
+			evaluation.aligned = 1;
+
+		ivlsu_parallel_for((long)grid->ny * grid->nz, grid->nx < IVLSU_BATCH_CHUNK ? IVLSU_BATCH_CHUNK / grid->nx : 1,
+				   ivlsu_grid_task, &evaluation);
+	}
+
+	free(evaluation.x_index);
+	free(evaluation.x_percent);
+	return retVal;
+}
+
+/**
+ * Queries IMPERIAL on a regular grid given directly in UTM coordinates, so no point
+ * is projected. Results are written to the output arrays of the batch in x, then y,
+ * then z order; the input arrays of the batch are not used. Each axis is located once,
+ * and a grid whose nodes all fall on model nodes is read with one direct load per
+ * point. Results are identical to locating every point on its own. A non-zero
+ * grid->spacing samples the coarsest pyramid level fine enough for it. A grid with a
+ * non-zero grid->rotation turns its x and y axes counter-clockwise about its first
+ * node, and each of its points is located on its own.
+ *
+ * @param grid The grid to query.
+ * @param batch The property mask and output arrays, holding nx * ny * nz values.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_query_grid(const ivlsu_grid_t *grid, ivlsu_batch_t *batch) {
+	ivlsu_model_t *model = NULL;
+	int ticket = 0, status;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	model = ivlsu_model_acquire(&ticket);
+	status = ivlsu_model_query_grid(model, ivlsu_configuration, grid, batch);
+	ivlsu_model_release(ticket);
+
+	return status;
+}
+
+/** Arguments of the tasks computing and looking up threshold depths. */
+typedef struct ivlsu_zdepth_evaluation_t {
+	/** Longitude of each site, in degrees */
+	const double *longitude;
+	/** Latitude of each site, in degrees */
+	const double *latitude;
+	/** Vs threshold in meters per second */
+	double threshold;
+	/** Precomputed depths of the threshold at each node, or NULL to search the columns */
+	const float *raster;
+	/** Returned depth of each site */
+	double *zdepth;
+	/** The volume being queried */
+	const ivlsu_volume_t *volume;
+	/** Non-zero if interpolation is on */
+	int interpolation;
+	/** SUCCESS, or FAIL if a task could not allocate its column profile */
+	int status;
+} ivlsu_zdepth_evaluation_t;
+
+/**
+ * Task computing the Z1.0 and Z2.5 depths of the nodes [begin, end) of the top plane.
+ */
+static void ivlsu_zdepth_raster_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	ivlsu_model_t *model = arg;
+	const ivlsu_volume_t *volume = &(model->volume);
+	ivlsu_column_t column = { 0, 0, 0, 0 };
+	long nodes[4], location = 0;
+	double weights[4];
+	double *vp = malloc(volume->nz * sizeof(double));
+
+	for (location = begin; location < end; location++) {
+		if (vp == NULL) {
+			model->z1000[location] = model->z2500[location] = NA;
+			continue;
+		}
+		column.location = location;
+		ivlsu_column_nodes(volume, 0, &column, nodes, weights);
+		ivlsu_column_profile(volume, nodes, weights, vp);
+		model->z1000[location] = ivlsu_column_zdepth(vp, volume->nz, volume->dz, IVLSU_Z1000_THRESHOLD);
+		model->z2500[location] = ivlsu_column_zdepth(vp, volume->nz, volume->dz, IVLSU_Z2500_THRESHOLD);
+	}
+
+	free(vp);
+}
+
+/**
+ * Task looking up the threshold depths of the sites [begin, end).
+ */
+static void ivlsu_zdepth_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	ivlsu_zdepth_evaluation_t *evaluation = arg;
+	const ivlsu_volume_t *volume = evaluation->volume;
+	double utm_e[IVLSU_BATCH_CHUNK], utm_n[IVLSU_BATCH_CHUNK];
+	double weights[4], values[4];
+	double *vp = NULL;
+	long nodes[4], start = 0, i = 0;
+	ivlsu_column_t column;
+	int count = 0, k = 0;
+
+	if (evaluation->raster == NULL && (vp = malloc(volume->nz * sizeof(double))) == NULL) {
+		evaluation->status = FAIL;
+		return;
+	}
+
+	for (start = begin; start < end; start += IVLSU_BATCH_CHUNK) {
+		count = end - start < IVLSU_BATCH_CHUNK ? (int)(end - start) : IVLSU_BATCH_CHUNK;
+		ivlsu_project_points(worker, evaluation->longitude + start, evaluation->latitude + start, 1, count, utm_e, utm_n);
+
+		for (i = 0; i < count; i++) {
+			ivlsu_locate_column(volume, utm_e[i], utm_n[i], &column);
+			if (column.location < 0) {
+				evaluation->zdepth[start + i] = NA;
+				continue;
+			}
+
+			ivlsu_column_nodes(volume, evaluation->interpolation, &column, nodes, weights);
+			if (evaluation->raster != NULL) {
+				for (k = 0; k < 4; k++)
+					values[k] = nodes[k] >= 0 ? evaluation->raster[nodes[k]] : NA;
+				evaluation->zdepth[start + i] = ivlsu_blend_nodes(values, nodes, weights);
+			} else {
+				ivlsu_column_profile(volume, nodes, weights, vp);
+				evaluation->zdepth[start + i] = ivlsu_column_zdepth(vp, volume->nz, volume->dz, evaluation->threshold);
+			}
+		}
+	}
+
+	free(vp);
+}
+
+/**
+ * Computes the Z1.0 and Z2.5 rasters: the depth at which Vs first reaches 1.0 and
+ * 2.5 km/s down the column of every node.
+ *
+ * @param model The model whose volume is set up.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_build_zdepth_rasters(ivlsu_model_t *model) {
+	long plane = (long)model->volume.nx * model->volume.ny;
+
+	model->z1000 = malloc(plane * sizeof(float));
+	model->z2500 = malloc(plane * sizeof(float));
+	if (model->z1000 == NULL || model->z2500 == NULL)
+		return FAIL;
+
+	return ivlsu_parallel_for(plane, IVLSU_BATCH_CHUNK / 16, ivlsu_zdepth_raster_task, model);
+}
+
+/**
+ * Returns the depth at which Vs first reaches a threshold below each site, such as
+ * Z1.0 (1000 m/s) or Z2.5 (2500 m/s), by bisecting the site's column under the
+ * horizontal interpolation of ivlsu_query. With interpolation off, those two are
+ * looked up on the rasters built at init instead, which give the same depths.
+ *
+ * @param longitude Longitude of each site, in degrees.
+ * @param latitude Latitude of each site, in degrees.
+ * @param numpoints Number of sites.
+ * @param threshold Vs threshold in meters per second.
+ * @param zdepth Returned depth in meters, NA outside of the model or if Vs never
+ * reaches the threshold.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_query_zdepth(const double *longitude, const double *latitude, int numpoints, double threshold, double *zdepth) {
+	ivlsu_zdepth_evaluation_t evaluation;
+	ivlsu_model_t *model = NULL;
+	int ticket = 0, status;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	model = ivlsu_model_acquire(&ticket);
+	evaluation.longitude = longitude;
+	evaluation.latitude = latitude;
+	evaluation.threshold = threshold;
+	evaluation.raster = NULL;
+	evaluation.zdepth = zdepth;
+	evaluation.volume = &(model->volume);
+	evaluation.interpolation = ivlsu_configuration->interpolation;
+	evaluation.status = SUCCESS;
+
+	// The rasters hold each node's own crossing, so they only stand for the column
+	// profile of a site when that profile is its nearest node's.
+	if (threshold == IVLSU_Z1000_THRESHOLD && !evaluation.interpolation)
+		evaluation.raster = model->z1000;
+	else if (threshold == IVLSU_Z2500_THRESHOLD && !evaluation.interpolation)
+		evaluation.raster = model->z2500;
+
+	status = ivlsu_parallel_for(numpoints, IVLSU_BATCH_CHUNK, ivlsu_zdepth_task, &evaluation);
+	if (status == SUCCESS && evaluation.status != SUCCESS) {
+		print_error("Could not allocate the column profiles of the threshold depths.");
+		status = FAIL;
+	}
+	ivlsu_model_release(ticket);
+	return status;
+}
+
+/**
+ * Lists the nodes of the top plane around a located column with their weights under
+ * the horizontal interpolation of ivlsu_query: the origin, +1x, +1y and +x +y nodes
+ * weighted bilinearly, or the origin node alone when interpolation is off. Nodes past
+ * the model's edges get index -1.
+ *
+ * @param volume The volume being queried.
+ * @param interpolation Non-zero if interpolation is on.
+ * @param column The located column.
+ * @param nodes The returned node indices.
+ * @param weights The returned weights.
+ */
+void ivlsu_column_nodes(const ivlsu_volume_t *volume, int interpolation, const ivlsu_column_t *column, long nodes[4],
+			double weights[4]) {
+	double x_percent = interpolation ? column->x_percent : 0;
+	double y_percent = interpolation ? column->y_percent : 0;
+
+	nodes[0] = column->location;
+	nodes[1] = column->location % volume->nx + 1 < volume->nx ? column->location + 1 : -1;
+	nodes[2] = column->location / volume->nx + 1 < volume->ny ? column->location + volume->nx : -1;
+	nodes[3] = nodes[1] >= 0 && nodes[2] >= 0 ? column->location + volume->nx + 1 : -1;
+
+	weights[0] = (1 - x_percent) * (1 - y_percent);
+	weights[1] = x_percent * (1 - y_percent);
+	weights[2] = (1 - x_percent) * y_percent;
+	weights[3] = x_percent * y_percent;
+}
+
+/**
+ * Blends values at the nodes of a column, leaving out NA (negative) values and nodes
+ * past the edges and renormalizing the remaining weights.
+ *
+ * @param values Value at each node.
+ * @param nodes Node indices from ivlsu_column_nodes.
+ * @param weights Weights from ivlsu_column_nodes.
+ * @return The blended value, or NA if no node has a value.
+ */
+double ivlsu_blend_nodes(const double values[4], const long nodes[4], const double weights[4]) {
+	double sum = 0, total = 0;
+	int k = 0;
+
+	for (k = 0; k < 4; k++) {
+		if (nodes[k] >= 0 && weights[k] > 0 && values[k] >= 0) {
+			sum += weights[k] * values[k];
+			total += weights[k];
+		}
+	}
+
+	return total > 0 ? sum / total : NA;
+}
+
+/**
+ * Reads the Vp profile of a column at every z level, blending its nodes with
+ * ivlsu_blend_nodes.
+ *
+ * @param volume The volume being queried.
+ * @param nodes Node indices from ivlsu_column_nodes.
+ * @param weights Weights from ivlsu_column_nodes.
+ * @param vp The returned Vp at each z level, NA where no node has data.
+ */
+void ivlsu_column_profile(const ivlsu_volume_t *volume, const long nodes[4], const double weights[4], double *vp) {
+	long plane = (long)volume->nx * volume->ny;
+	double values[4];
+	int z = 0, k = 0;
+
+	for (z = 0; z < volume->nz; z++) {
+		for (k = 0; k < 4; k++)
+			values[k] = nodes[k] >= 0 && weights[k] > 0 ? ivlsu_volume_vp(volume, z * plane + nodes[k]) : NA;
+		vp[z] = ivlsu_blend_nodes(values, nodes, weights);
+	}
+}
+
+/**
+ * Finds the depth at which Vs first reaches a threshold down a Vp profile, Vp varying
+ * linearly between z levels. NA levels are skipped; the crossing is bisected between
+ * the last level below the threshold and the first level at or above it.
+ *
+ * @param vp Vp at each z level, NA where there is no data.
+ * @param nz Number of z levels.
+ * @param dz Spacing of the z levels in meters.
+ * @param threshold Vs threshold in meters per second.
+ * @return Depth of the crossing in meters, or NA if Vs never reaches the threshold.
+ */
+double ivlsu_column_zdepth(const double *vp, int nz, double dz, double threshold) {
+	double low = 0, high = 1, middle = 0;
+	int z = 0, previous = -1, i = 0;
+
+	for (z = 0; z < nz; z++) {
+		if (vp[z] < 0)
+			continue;
+		if (ivlsu_calculate_vs(vp[z]) >= threshold)
+			break;
+		previous = z;
+	}
+
+	if (z == nz)
+		return NA;
+	if (previous < 0)
+		return z * dz;
+
+	for (i = 0; i < IVLSU_ZDEPTH_BISECTIONS; i++) {
+		middle = 0.5 * (low + high);
+		if (ivlsu_calculate_vs(vp[previous] + middle * (vp[z] - vp[previous])) >= threshold)
+			high = middle;
+		else
+			low = middle;
+	}
+
+	return (previous + high * (z - previous)) * dz;
+}
+
+/** Arguments of the task building a travel time volume. */
+typedef struct ivlsu_travel_time_build_t {
+	/** The volume the times are integrated through */
+	const ivlsu_volume_t *volume;
+	/** IVLSU_VP or IVLSU_VS */
+	int wave;
+	/** Returned travel time at each node */
+	float *time;
+} ivlsu_travel_time_build_t;
+
+/** Arguments of the tasks computing time-averaged velocities. */
+typedef struct ivlsu_vsz_evaluation_t {
+	/** Longitude of each site, in degrees, unless the sites form a grid */
+	const double *longitude;
+	/** Latitude of each site, in degrees, unless the sites form a grid */
+	const double *latitude;
+	/** Grid of sites in UTM coordinates, or NULL */
+	const ivlsu_grid_t *grid;
+	/** Depth averaged over, in meters */
+	double depth;
+	/** Returned average of each site */
+	double *vsz;
+	/** The volume being queried */
+	const ivlsu_volume_t *volume;
+	/** Vertical S travel time at each node */
+	const float *time;
+	/** Non-zero if interpolation is on */
+	int interpolation;
+} ivlsu_vsz_evaluation_t;
+
+/**
+ * Returns the velocity of a wave from Vp.
+ *
+ * @param wave IVLSU_VP or IVLSU_VS.
+ * @param vp Vp in meters per second.
+ * @return The velocity, or NA if Vp is NA or the velocity is not positive.
+ */
+double ivlsu_wave_velocity(int wave, double vp) {
+	double velocity = vp;
+
+	if (vp < 0)
+		return NA;
+	if (wave == IVLSU_VS)
+		velocity = ivlsu_calculate_vs(vp);
+	return velocity > 0 ? velocity : NA;
+}
+
+/**
+ * Task integrating the vertical travel time down the columns [begin, end) of the top plane.
+ */
+static void ivlsu_travel_time_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_travel_time_build_t *build = arg;
+	const ivlsu_volume_t *volume = build->volume;
+	long plane = (long)volume->nx * volume->ny;
+	ivlsu_column_t column = { 0, 0, 0, 0 };
+	long nodes[4], location = 0;
+	double weights[4], time = 0, previous = 0, velocity = 0;
+	double *vp = malloc(volume->nz * sizeof(double));
+	int z = 0, valid = 0;
+
+	for (location = begin; location < end; location++) {
+		if (vp != NULL) {
+			column.location = location;
+			ivlsu_column_nodes(volume, 0, &column, nodes, weights);
+			ivlsu_column_profile(volume, nodes, weights, vp);
+		}
+
+		// The time is only defined down to the first level without data.
+		valid = vp != NULL;
+		time = 0;
+		for (z = 0; z < volume->nz; z++) {
+			velocity = valid ? ivlsu_wave_velocity(build->wave, vp[z]) : NA;
+			if (velocity < 0) {
+				valid = 0;
+				build->time[z * plane + location] = NA;
+				continue;
+			}
+			if (z > 0)
+				time += ivlsu_segment_time(previous, velocity, volume->dz);
+			build->time[z * plane + location] = time;
+			previous = velocity;
+		}
+	}
+
+	free(vp);
+}
+
+/**
+ * Integrates the one-way vertical travel time of a wave from the surface down to
+ * every node, taking the velocity as linear between z levels. This is the profile
+ * trilinear interpolation gives down a node's column; the nearest-node profile
+ * ivlsu_query returns with interpolation off, constant up to half way between the
+ * levels, is not integrated.
+ *
+ * @param volume The volume the times are integrated through.
+ * @param wave IVLSU_VP or IVLSU_VS.
+ * @return The travel time volume in seconds, NA below the first level without data,
+ * or NULL if it could not be allocated.
+ */
+float *ivlsu_build_travel_time(const ivlsu_volume_t *volume, int wave) {
+	ivlsu_travel_time_build_t build = { volume, wave, NULL };
+
+	if ((build.time = malloc(volume->count * sizeof(float))) == NULL)
+		return NULL;
+
+	ivlsu_parallel_for((long)volume->nx * volume->ny, IVLSU_BATCH_CHUNK / 16, ivlsu_travel_time_task, &build);
+	return build.time;
+}
+
+/**
+ * Returns the travel time across a segment over which the velocity varies linearly,
+ * the integral of the slowness.
+ *
+ * @param start Velocity at the start of the segment.
+ * @param end Velocity at the end of the segment.
+ * @param length Length of the segment.
+ * @return The travel time.
+ */
+double ivlsu_segment_time(double start, double end, double length) {
+	if (fabs(end - start) <= 1e-9 * start)
+		return length / start;
+	return length * log(end / start) / (end - start);
+}
+
+/**
+ * Returns the vertical travel time from the surface to a depth below a located column.
+ * The time at the z level above the depth is read from the travel time volume and the
+ * rest of the way is integrated analytically with the velocity linear between the
+ * levels, as in ivlsu_build_travel_time, whatever the interpolation; the corners are
+ * then blended as in ivlsu_blend_nodes.
+ *
+ * @param volume The volume being queried.
+ * @param time The travel time volume of the wave.
+ * @param wave IVLSU_VP or IVLSU_VS.
+ * @param nodes Node indices from ivlsu_column_nodes.
+ * @param weights Weights from ivlsu_column_nodes.
+ * @param depth Depth in meters.
+ * @return The travel time in seconds, or NA.
+ */
+double ivlsu_column_time(const ivlsu_volume_t *volume, const float *time, int wave, const long nodes[4], const double weights[4],
+			 double depth) {
+	long plane = (long)volume->nx * volume->ny;
+	long level = 0, location = 0;
+	double percent = 0, values[4], start = 0, end = 0;
+	int k = 0;
+
+	if (depth < 0 || !ivlsu_locate_level(volume, depth, &level, &percent) || (percent > 0 && level + 1 >= volume->nz))
+		return NA;
+
+	for (k = 0; k < 4; k++) {
+		values[k] = NA;
+		if (nodes[k] < 0 || weights[k] <= 0)
+			continue;
+
+		location = level * plane + nodes[k];
+		if ((values[k] = time[location]) < 0 || percent == 0)
+			continue;
+
+		start = ivlsu_wave_velocity(wave, ivlsu_volume_vp(volume, location));
+		end = ivlsu_wave_velocity(wave, ivlsu_volume_vp(volume, location + plane));
+		if (start < 0 || end < 0)
+			values[k] = NA;
+		else
+			values[k] += ivlsu_segment_time(start, start + percent * (end - start), percent * volume->dz);
+	}
+
+	return ivlsu_blend_nodes(values, nodes, weights);
+}
+
+/**
+ * Task computing the time-averaged Vs of the sites [begin, end).
+ */
+static void ivlsu_vsz_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_vsz_evaluation_t *evaluation = arg;
+	const ivlsu_grid_t *grid = evaluation->grid;
+	double utm_e[IVLSU_BATCH_CHUNK], utm_n[IVLSU_BATCH_CHUNK];
+	double weights[4], time = 0;
+	long nodes[4], start = 0, i = 0;
+	ivlsu_column_t column;
+	int count = 0;
+
+	for (start = begin; start < end; start += IVLSU_BATCH_CHUNK) {
+		count = end - start < IVLSU_BATCH_CHUNK ? (int)(end - start) : IVLSU_BATCH_CHUNK;
+		if (grid == NULL) {
+			ivlsu_project_points(worker, evaluation->longitude + start, evaluation->latitude + start, 1, count, utm_e, utm_n);
+		} else {
+			for (i = 0; i < count; i++) {
+				utm_e[i] = grid->origin_e + ((start + i) % grid->nx) * grid->spacing_e;
+				utm_n[i] = grid->origin_n + ((start + i) / grid->nx) * grid->spacing_n;
+			}
+		}
+
+		for (i = 0; i < count; i++) {
+			evaluation->vsz[start + i] = NA;
+			ivlsu_locate_column(evaluation->volume, utm_e[i], utm_n[i], &column);
+			if (column.location < 0)
+				continue;
+
+			ivlsu_column_nodes(evaluation->volume, evaluation->interpolation, &column, nodes, weights);
+			time = ivlsu_column_time(evaluation->volume, evaluation->time, IVLSU_VS, nodes, weights, evaluation->depth);
+			if (time > 0)
+				evaluation->vsz[start + i] = evaluation->depth / time;
+		}
+	}
+}
+
+/**
+ * Runs the time-averaged Vs task over the sites of an evaluation.
+ *
+ * @param evaluation The evaluation with its sites and outputs set.
+ * @param numpoints Number of sites.
+ * @return SUCCESS or FAIL.
+ */
+static int ivlsu_evaluate_vsz(ivlsu_vsz_evaluation_t *evaluation, long numpoints) {
+	ivlsu_model_t *model = NULL;
+	int ticket = 0, status = FAIL;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	model = ivlsu_model_acquire(&ticket);
+	evaluation->volume = &(model->volume);
+	evaluation->time = model->vs_time;
+	evaluation->interpolation = ivlsu_configuration->interpolation;
+
+	if (evaluation->time == NULL)
+		print_error("The vertical S travel times could not be allocated at init.");
+	else if (!(evaluation->depth > 0))
+		print_error("The averaging depth must be positive.");
+	else
+		status = ivlsu_parallel_for(numpoints, IVLSU_BATCH_CHUNK, ivlsu_vsz_task, evaluation);
+
+	ivlsu_model_release(ticket);
+	return status;
+}
+
+/**
+ * Returns the time-averaged Vs from the surface to a depth below each site, such as
+ * Vs30: the depth divided by the vertical S travel time. The slowness is integrated
+ * analytically with Vs linear between z levels, starting from the travel times
+ * precomputed at init, so each site costs the same whatever the depth. Interpolation
+ * only picks the columns blended: with it off, the site's nearest column is still
+ * integrated linearly between its levels rather than as the piecewise constant
+ * profile ivlsu_query samples.
+ *
+ * @param longitude Longitude of each site, in degrees.
+ * @param latitude Latitude of each site, in degrees.
+ * @param numpoints Number of sites.
+ * @param depth Depth averaged over, in meters.
+ * @param vsz Returned average in meters per second, NA outside of the model or
+ * where the column has no data above the depth.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_query_vsz(const double *longitude, const double *latitude, int numpoints, double depth, double *vsz) {
+	ivlsu_vsz_evaluation_t evaluation = { longitude, latitude, NULL, depth, vsz, NULL, NULL, 0 };
+
+	return ivlsu_evaluate_vsz(&evaluation, numpoints);
+}
+
+/**
+ * Maps the time-averaged Vs over the nx * ny sites of a regular UTM grid, in x then
+ * y order, without projecting any point. The depth axis of the grid is not used.
+ *
+ * @param grid The grid of sites.
+ * @param depth Depth averaged over, in meters.
+ * @param vsz Returned average of each site, as in ivlsu_query_vsz.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_query_vsz_grid(const ivlsu_grid_t *grid, double depth, double *vsz) {
+	ivlsu_vsz_evaluation_t evaluation = { NULL, NULL, grid, depth, vsz, NULL, NULL, 0 };
+
+	if (grid->nx <= 0 || grid->ny <= 0) {
+		print_error("The grid query needs at least one node along each axis.");
+		return FAIL;
+	}
+
+	return ivlsu_evaluate_vsz(&evaluation, (long)grid->nx * grid->ny);
+}
+
+/** Arguments of the task computing vertical travel times. */
+typedef struct ivlsu_travel_time_evaluation_t {
+	/** Longitude of each point, in degrees */
+	const double *longitude;
+	/** Latitude of each point, in degrees */
+	const double *latitude;
+	/** Depth of each point, in meters */
+	const double *depth;
+	/** Returned P travel time of each point, or NULL */
+	double *tp;
+	/** Returned S travel time of each point, or NULL */
+	double *ts;
+	/** Vertical P travel time at each node */
+	const float *vp_time;
+	/** Vertical S travel time at each node */
+	const float *vs_time;
+	/** The volume being queried */
+	const ivlsu_volume_t *volume;
+	/** Non-zero if interpolation is on */
+	int interpolation;
+} ivlsu_travel_time_evaluation_t;
+
+/**
+ * Task computing the vertical travel times of the points [begin, end).
+ */
+static void ivlsu_travel_time_query_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_travel_time_evaluation_t *evaluation = arg;
+	double utm_e[IVLSU_BATCH_CHUNK], utm_n[IVLSU_BATCH_CHUNK];
+	double weights[4];
+	long nodes[4], start = 0, i = 0;
+	ivlsu_column_t column;
+	int count = 0;
+
+	for (start = begin; start < end; start += IVLSU_BATCH_CHUNK) {
+		count = end - start < IVLSU_BATCH_CHUNK ? (int)(end - start) : IVLSU_BATCH_CHUNK;
+		ivlsu_project_points(worker, evaluation->longitude + start, evaluation->latitude + start, 1, count, utm_e, utm_n);
+
+		for (i = 0; i < count; i++) {
+			ivlsu_locate_column(evaluation->volume, utm_e[i], utm_n[i], &column);
+			if (column.location >= 0)
+				ivlsu_column_nodes(evaluation->volume, evaluation->interpolation, &column, nodes, weights);
+
+			if (evaluation->tp != NULL)
+				evaluation->tp[start + i] = column.location < 0 ? NA :
+					ivlsu_column_time(evaluation->volume, evaluation->vp_time, IVLSU_VP, nodes, weights,
+							  evaluation->depth[start + i]);
+			if (evaluation->ts != NULL)
+				evaluation->ts[start + i] = column.location < 0 ? NA :
+					ivlsu_column_time(evaluation->volume, evaluation->vs_time, IVLSU_VS, nodes, weights,
+							  evaluation->depth[start + i]);
+		}
+	}
+}
+
+/**
+ * Returns the one-way vertical P and S travel times from the surface down to each
+ * point. They are read from the travel times precomputed at init and finished
+ * analytically below the last z level, with the horizontal interpolation of
+ * ivlsu_query, so each point costs the same whatever its depth. The velocity is
+ * taken as linear between z levels even with interpolation off, as in
+ * ivlsu_query_vsz.
+ *
+ * @param longitude Longitude of each point, in degrees.
+ * @param latitude Latitude of each point, in degrees.
+ * @param depth Depth of each point, in meters.
+ * @param numpoints Number of points.
+ * @param tp Returned P travel time in seconds, or NULL if not wanted. NA outside of
+ * the model or where the column has no data above the point.
+ * @param ts Returned S travel time in seconds, or NULL if not wanted.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_query_travel_time(const double *longitude, const double *latitude, const double *depth, int numpoints, double *tp,
+			    double *ts) {
+	ivlsu_travel_time_evaluation_t evaluation = { longitude, latitude, depth, tp, ts, NULL, NULL, NULL, 0 };
+	ivlsu_model_t *model = NULL;
+	int ticket = 0, status = FAIL;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	model = ivlsu_model_acquire(&ticket);
+	evaluation.vp_time = model->vp_time;
+	evaluation.vs_time = model->vs_time;
+	evaluation.volume = &(model->volume);
+	evaluation.interpolation = ivlsu_configuration->interpolation;
+
+	if ((tp != NULL && evaluation.vp_time == NULL) || (ts != NULL && evaluation.vs_time == NULL))
+		print_error("The vertical travel times could not be allocated at init.");
+	else
+		status = ivlsu_parallel_for(numpoints, IVLSU_BATCH_CHUNK, ivlsu_travel_time_query_task, &evaluation);
+
+	ivlsu_model_release(ticket);
+	return status;
+}
+
+/** Arguments of the tasks building the summed-volume table. */
+typedef struct ivlsu_summed_build_t {
+	/** The volume summed */
+	const ivlsu_volume_t *volume;
+	/** The table being built, (nx + 1) * (ny + 1) * (nz + 1) entries */
+	ivlsu_summed_t *table;
+} ivlsu_summed_build_t;
+
+/** Arguments of the task averaging boxes. */
+typedef struct ivlsu_box_evaluation_t {
+	/** The boxes */
+	const ivlsu_box_t *boxes;
+	/** Returned average of each box */
+	ivlsu_box_average_t *averages;
+	/** The volume being queried */
+	const ivlsu_volume_t *volume;
+	/** The summed-volume table of the volume */
+	const ivlsu_summed_t *table;
+} ivlsu_box_evaluation_t;
+
+/**
+ * Adds a weighted entry of the summed-volume table to a sum.
+ *
+ * @param sum The sum.
+ * @param entry The entry.
+ * @param weight Its weight.
+ */
+static inline void ivlsu_summed_add(ivlsu_summed_t *sum, const ivlsu_summed_t *entry, double weight) {
+	sum->vp += weight * entry->vp;
+	sum->vs += weight * entry->vs;
+	sum->rho += weight * entry->rho;
+	sum->inverse_mu += weight * entry->inverse_mu;
+	sum->count += weight * entry->count;
+}
+
+/**
+ * Task filling the z planes [begin, end) of the summed-volume table with the node
+ * values and summing each plane along x and y.
+ */
+static void ivlsu_summed_plane_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_summed_build_t *build = arg;
+	const ivlsu_volume_t *volume = build->volume;
+	long row = volume->nx + 1, plane = row * (volume->ny + 1);
+	long z = 0, y = 0, x = 0;
+	double vp = 0, vs = 0, rho = 0;
+	ivlsu_summed_t *entry = NULL;
+
+	for (z = begin; z < end; z++) {
+		memset(build->table + (z + 1) * plane, 0, row * sizeof(ivlsu_summed_t));
+		for (y = 0; y < volume->ny; y++) {
+			entry = build->table + (z + 1) * plane + (y + 1) * row;
+			memset(entry, 0, sizeof(ivlsu_summed_t));
+
+			for (x = 0; x < volume->nx; x++) {
+				entry++;
+				*entry = entry[-1];
+				vp = ivlsu_volume_vp(volume, (z * volume->ny + y) * volume->nx + x);
+				if (vp < 0)
+					continue;
+
+				vs = ivlsu_calculate_vs(vp);
+				rho = ivlsu_calculate_density(vp);
+				entry->vp += vp;
+				entry->vs += vs;
+				entry->rho += rho;
+				entry->inverse_mu += vs > 0 ? 1 / (rho * vs * vs) : 0;
+				entry->count += 1;
+			}
+
+			// Add the row below.
+			for (x = 1; x <= volume->nx; x++)
+				ivlsu_summed_add(entry - volume->nx + x, entry - volume->nx + x - row, 1);
+		}
+	}
+}
+
+/**
+ * Task summing the columns [begin, end) of the summed-volume table along z.
+ */
+static void ivlsu_summed_column_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_summed_build_t *build = arg;
+	long plane = (build->volume->nx + 1L) * (build->volume->ny + 1);
+	long column = 0, z = 0;
+
+	for (column = begin; column < end; column++)
+		for (z = 2; z <= build->volume->nz; z++)
+			ivlsu_summed_add(build->table + z * plane + column, build->table + (z - 1) * plane + column, 1);
+}
+
+/**
+ * Builds the summed-volume table of a volume: entry (x, y, z) holds the sums of Vp,
+ * Vs, density and 1 / mu, and the number of nodes with data, over the nodes before
+ * x, y and z. Each node stands for the voxel centered on it.
+ *
+ * @param volume The volume summed.
+ * @return The table, or NULL if it could not be allocated.
+ */
+ivlsu_summed_t *ivlsu_build_summed_table(const ivlsu_volume_t *volume) {
+	ivlsu_summed_build_t build = { volume, NULL };
+	long plane = (volume->nx + 1L) * (volume->ny + 1);
+
+	if ((build.table = malloc(plane * (volume->nz + 1) * sizeof(ivlsu_summed_t))) == NULL)
+		return NULL;
+
+	memset(build.table, 0, plane * sizeof(ivlsu_summed_t));
+	ivlsu_parallel_for(volume->nz, 1, ivlsu_summed_plane_task, &build);
+	ivlsu_parallel_for(plane, IVLSU_BATCH_CHUNK, ivlsu_summed_column_task, &build);
+	return build.table;
+}
+
+/**
+ * Evaluates the summed-volume table at a point given in voxel units, where voxel x
+ * spans [x, x + 1). The table is interpolated multilinearly, which integrates the
+ * voxels exactly over the partial voxels at the point.
+ *
+ * @param volume The volume summed.
+ * @param table Its summed-volume table.
+ * @param x Position along x, within [0, nx].
+ * @param y Position along y, within [0, ny].
+ * @param z Position along z, within [0, nz].
+ * @param sum The returned sums from the origin to the point.
+ */
+void ivlsu_summed_at(const ivlsu_volume_t *volume, const ivlsu_summed_t *table, double x, double y, double z, ivlsu_summed_t *sum) {
+	long row = volume->nx + 1, plane = row * (volume->ny + 1);
+	long x0 = (long)x < volume->nx ? (long)x : volume->nx - 1;
+	long y0 = (long)y < volume->ny ? (long)y : volume->ny - 1;
+	long z0 = (long)z < volume->nz ? (long)z : volume->nz - 1;
+	double xp = x - x0, yp = y - y0, zp = z - z0;
+	const ivlsu_summed_t *entry = table + z0 * plane + y0 * row + x0;
+
+	memset(sum, 0, sizeof(ivlsu_summed_t));
+	ivlsu_summed_add(sum, entry, (1 - xp) * (1 - yp) * (1 - zp));
+	ivlsu_summed_add(sum, entry + 1, xp * (1 - yp) * (1 - zp));
+	ivlsu_summed_add(sum, entry + row, (1 - xp) * yp * (1 - zp));
+	ivlsu_summed_add(sum, entry + row + 1, xp * yp * (1 - zp));
+	ivlsu_summed_add(sum, entry + plane, (1 - xp) * (1 - yp) * zp);
+	ivlsu_summed_add(sum, entry + plane + 1, xp * (1 - yp) * zp);
+	ivlsu_summed_add(sum, entry + plane + row, (1 - xp) * yp * zp);
+	ivlsu_summed_add(sum, entry + plane + row + 1, xp * yp * zp);
+}
+
+/**
+ * Converts a coordinate to voxel units along an axis, clamped to the model.
+ *
+ * @param coordinate The coordinate.
+ * @param origin Coordinate of the first node.
+ * @param spacing Node spacing.
+ * @param n Number of nodes.
+ * @return Position in voxel units within [0, n].
+ */
+static inline double ivlsu_voxel_position(double coordinate, double origin, double spacing, int n) {
+	double position = (coordinate - origin) / spacing + 0.5;
+
+	return position < 0 ? 0 : position > n ? n : position;
+}
+
+/**
+ * Averages the model over one box with the summed-volume table.
+ *
+ * @param volume The volume being queried.
+ * @param table Its summed-volume table.
+ * @param box The box.
+ * @param average The returned average.
+ */
+static void ivlsu_average_box(const ivlsu_volume_t *volume, const ivlsu_summed_t *table, const ivlsu_box_t *box,
+			      ivlsu_box_average_t *average) {
+	double x[2], y[2], z[2], size = 0;
+	ivlsu_summed_t sum, corner;
+	int k = 0;
+
+	average->vp = average->vs = average->rho = average->mu = NA;
+	average->valid_fraction = 0;
+
+	if (!(box->max_e > box->min_e && box->max_n > box->min_n && box->max_depth > box->min_depth))
+		return;
+
+	// Size of the whole box in voxels, including any part outside of the model.
+	size = (box->max_e - box->min_e) / volume->dx * (box->max_n - box->min_n) / volume->dy *
+	       (box->max_depth - box->min_depth) / volume->dz;
+
+	x[0] = ivlsu_voxel_position(box->min_e, volume->origin_e, volume->dx, volume->nx);
+	x[1] = ivlsu_voxel_position(box->max_e, volume->origin_e, volume->dx, volume->nx);
+	y[0] = ivlsu_voxel_position(box->min_n, volume->origin_n, volume->dy, volume->ny);
+	y[1] = ivlsu_voxel_position(box->max_n, volume->origin_n, volume->dy, volume->ny);
+	z[0] = ivlsu_voxel_position(box->min_depth, 0, volume->dz, volume->nz);
+	z[1] = ivlsu_voxel_position(box->max_depth, 0, volume->dz, volume->nz);
+
+	// Inclusion-exclusion over the eight corners of the box.
+	memset(&sum, 0, sizeof(ivlsu_summed_t));
+	for (k = 0; k < 8; k++) {
+		ivlsu_summed_at(volume, table, x[k & 1], y[(k >> 1) & 1], z[k >> 2], &corner);
+		ivlsu_summed_add(&sum, &corner, ((k & 1) + ((k >> 1) & 1) + (k >> 2)) % 2 == 1 ? 1 : -1);
+	}
+
+	// Every corner entering the sum is rounded, so a box without data may keep a
+	// residual far below one voxel.
+	if (sum.count <= 1e-9 * size)
+		return;
+
+	average->vp = sum.vp / sum.count;
+	average->vs = sum.vs / sum.count;
+	average->rho = sum.rho / sum.count;
+	average->mu = sum.inverse_mu > 0 ? sum.count / sum.inverse_mu : NA;
+	average->valid_fraction = sum.count / size;
+}
+
+/**
+ * Task averaging the boxes [begin, end).
+ */
+static void ivlsu_box_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_box_evaluation_t *evaluation = arg;
+	long i = 0;
+
+	for (i = begin; i < end; i++)
+		ivlsu_average_box(evaluation->volume, evaluation->table, &(evaluation->boxes[i]), &(evaluation->averages[i]));
+}
+
+/**
+ * Averages the model over axis-aligned boxes given in UTM coordinates and depth, in
+ * constant time per box whatever its size. Each node stands for the voxel centered on
+ * it and partial voxels count in proportion to their overlap. Vp, Vs and density are
+ * averaged arithmetically and the shear modulus harmonically, over the nodes with
+ * data only; the valid fraction is the share of the box covered by nodes with data.
+ *
+ * @param boxes The boxes.
+ * @param numboxes Number of boxes.
+ * @param averages Returned average of each box, NA where the box holds no data.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_query_box_average(const ivlsu_box_t *boxes, int numboxes, ivlsu_box_average_t *averages) {
+	ivlsu_box_evaluation_t evaluation = { boxes, averages, NULL, NULL };
+	ivlsu_model_t *model = NULL;
+	int ticket = 0, status = FAIL;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	model = ivlsu_model_acquire(&ticket);
+	evaluation.volume = &(model->volume);
+	evaluation.table = model->summed;
+
+	if (evaluation.table == NULL)
+		print_error("The summed-volume table could not be allocated at init.");
+	else
+		status = ivlsu_parallel_for(numboxes, IVLSU_BATCH_CHUNK, ivlsu_box_task, &evaluation);
+
+	ivlsu_model_release(ticket);
+	return status;
+}
+
+/** Arguments of the task downsampling one pyramid level. */
+typedef struct ivlsu_downsample_t {
+	/** The finer level */
+	const ivlsu_volume_t *fine;
+	/** The coarser level being built */
+	const ivlsu_volume_t *coarse;
+	/** Returned samples of the coarser level */
+	float *vp;
+} ivlsu_downsample_t;
+
+/**
+ * Task downsampling the coarse rows [begin, end); a row runs along x at one y and z.
+ */
+static void ivlsu_downsample_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	static const double tent[3] = { 0.25, 0.5, 0.25 };
+	const ivlsu_downsample_t *downsample = arg;
+	const ivlsu_volume_t *fine = downsample->fine;
+	const ivlsu_volume_t *coarse = downsample->coarse;
+	long row = 0, x = 0, y = 0, z = 0, fx = 0, fy = 0, fz = 0;
+	double sum = 0, total = 0, value = 0, weight = 0;
+	int i = 0, j = 0, k = 0;
+
+	for (row = begin; row < end; row++) {
+		y = row % coarse->ny;
+		z = row / coarse->ny;
+
+		for (x = 0; x < coarse->nx; x++) {
+			// A node without data stays without data.
+			if (2 * x < fine->nx && 2 * y < fine->ny && 2 * z < fine->nz &&
+			    ivlsu_volume_vp(fine, (2 * z * fine->ny + 2 * y) * fine->nx + 2 * x) < 0) {
+				downsample->vp[row * coarse->nx + x] = NA;
+				continue;
+			}
+
+			sum = total = 0;
+			for (k = 0; k < 3; k++) {
+				fz = 2 * z + k - 1;
+				for (j = 0; j < 3; j++) {
+					fy = 2 * y + j - 1;
+					for (i = 0; i < 3; i++) {
+						fx = 2 * x + i - 1;
+						if (fx < 0 || fx >= fine->nx || fy < 0 || fy >= fine->ny || fz < 0 || fz >= fine->nz)
+							continue;
+
+						value = ivlsu_volume_vp(fine, (fz * fine->ny + fy) * fine->nx + fx);
+						if (value >= 0) {
+							weight = tent[i] * tent[j] * tent[k];
+							sum += weight * value;
+							total += weight;
+						}
+					}
+				}
+			}
+			downsample->vp[row * coarse->nx + x] = total > 0 ? sum / total : NA;
+		}
+	}
+}
+
+/**
+ * Builds the levels of the multiresolution pyramid, each half the resolution of the
+ * one before along every axis. A coarse node takes the [1/4 1/2 1/4] tent filtered
+ * average of the 27 fine nodes around it, so the levels do not alias; nodes without
+ * data are left out of the average, and a coarse node on a fine node without data
+ * has no data either. Every coarse node lies on a fine node, so a level never
+ * reaches past the model; along an axis with an even number of nodes it ends one
+ * fine spacing short of the model's edge. Levels are only built for models held in
+ * memory.
+ *
+ * @param model The model whose volume is set up.
+ * @return Number of levels built.
+ */
+int ivlsu_build_pyramid(ivlsu_model_t *model) {
+	const ivlsu_volume_t *fine = &(model->volume);
+	ivlsu_downsample_t downsample;
+	ivlsu_volume_t *coarse = NULL;
+	float *vp = NULL;
+
+	model->lod_count = 0;
+	while (model->lod_count < IVLSU_LOD_LEVELS && fine->vp != NULL && fine->nx > 2 && fine->ny > 2 && fine->nz > 2) {
+		coarse = &(model->lod[model->lod_count]);
+		*coarse = *fine;
+		coarse->nx = (fine->nx + 1) / 2;
+		coarse->ny = (fine->ny + 1) / 2;
+		coarse->nz = (fine->nz + 1) / 2;
+		coarse->count = (long)coarse->nx * coarse->ny * coarse->nz;
+		coarse->dx = 2 * fine->dx;
+		coarse->dy = 2 * fine->dy;
+		coarse->dz = 2 * fine->dz;
+		coarse->empty = NULL;
+
+		if ((vp = malloc(coarse->count * sizeof(float))) == NULL)
+			break;
+
+		downsample.fine = fine;
+		downsample.coarse = coarse;
+		downsample.vp = vp;
+		ivlsu_parallel_for((long)coarse->ny * coarse->nz, 16, ivlsu_downsample_task, &downsample);
+
+		coarse->vp = vp;
+		model->lod_count++;
+		fine = coarse;
+	}
+
+	return model->lod_count;
+}
+
+/**
+ * Chooses the volume of a model sampled for a target spacing: the coarsest pyramid
+ * level whose horizontal node spacing is no larger than the target.
+ *
+ * @param model The model.
+ * @param spacing Target spacing in meters, 0 for the full resolution.
+ * @return The volume to sample.
+ */
+const ivlsu_volume_t *ivlsu_model_volume(const ivlsu_model_t *model, double spacing) {
+	const ivlsu_volume_t *volume = &(model->volume);
+	int level = 0;
+
+	for (level = 0; level < model->lod_count; level++) {
+		if (model->lod[level].dx > spacing * (1 + 1e-9) || model->lod[level].dy > spacing * (1 + 1e-9))
+			break;
+		volume = &(model->lod[level]);
+	}
+
+	return volume;
+}
+
+/**
+ * Chooses the volume of the current model sampled for a target spacing. The volume
+ * belongs to the model, so it is only safe to use while no reload can free it.
+ *
+ * @param spacing Target spacing in meters, 0 for the full resolution.
+ * @return The volume to sample.
+ */
+const ivlsu_volume_t *ivlsu_select_volume(double spacing) {
+	return ivlsu_model_volume(ivlsu_velocity_model, spacing);
+}
+
+/** Arguments of the tasks building the brick hierarchy. */
+typedef struct ivlsu_brick_build_t {
+	/** The volume described */
+	const ivlsu_volume_t *volume;
+	/** The level being built */
+	ivlsu_brick_level_t *level;
+	/** The level below it, NULL when building the first level */
+	const ivlsu_brick_level_t *finer;
+	/** Returned per brick flag of the first level, set when no cell of the brick reaches data */
+	unsigned char *empty;
+} ivlsu_brick_build_t;
+
+/**
+ * Resets a brick to hold no nodes.
+ *
+ * @param brick The brick.
+ */
+static inline void ivlsu_brick_clear(ivlsu_brick_t *brick) {
+	brick->min_vp = brick->min_vs = FLT_MAX;
+	brick->max_vp = brick->max_vs = -FLT_MAX;
+	brick->valid = 0;
+}
+
+/**
+ * Merges a brick into another.
+ *
+ * @param brick The brick merged into.
+ * @param other The brick merged.
+ */
+static inline void ivlsu_brick_merge(ivlsu_brick_t *brick, const ivlsu_brick_t *other) {
+	brick->min_vp = other->min_vp < brick->min_vp ? other->min_vp : brick->min_vp;
+	brick->max_vp = other->max_vp > brick->max_vp ? other->max_vp : brick->max_vp;
+	brick->min_vs = other->min_vs < brick->min_vs ? other->min_vs : brick->min_vs;
+	brick->max_vs = other->max_vs > brick->max_vs ? other->max_vs : brick->max_vs;
+	brick->valid += other->valid;
+}
+
+/**
+ * Adds the node at a volume index to a brick if it has data.
+ *
+ * @param brick The brick.
+ * @param volume The volume.
+ * @param location Index of the node.
+ */
+static inline void ivlsu_brick_add(ivlsu_brick_t *brick, const ivlsu_volume_t *volume, long location) {
+	ivlsu_brick_t node;
+	double vp = ivlsu_volume_vp(volume, location);
+
+	if (vp < 0)
+		return;
+
+	node.min_vp = node.max_vp = vp;
+	node.min_vs = node.max_vs = ivlsu_calculate_vs(vp);
+	node.valid = 1;
+	ivlsu_brick_merge(brick, &node);
+}
+
+/**
+ * Task building the bricks [begin, end) of the first level from the nodes. A brick is
+ * also flagged empty when every node that a cell with its origin in the brick reads,
+ * the +1x, +1y and previous z level neighbors included, is exactly NA; such cells
+ * blend to exactly NA with weights within [0, 1), whether they are read or not.
+ */
+static void ivlsu_brick_nodes_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_brick_build_t *build = arg;
+	const ivlsu_volume_t *volume = build->volume;
+	const ivlsu_brick_level_t *level = build->level;
+	long plane = (long)volume->nx * volume->ny;
+	long offsets[8] = { 0, 1, volume->nx, volume->nx + 1, -plane, -plane + 1, -plane + volume->nx, -plane + volume->nx + 1 };
+	long brick = 0, x = 0, y = 0, z = 0, x0 = 0, y0 = 0, z0 = 0, location = 0;
+	ivlsu_brick_t *entry = NULL;
+	int empty = 0, k = 0;
+
+	for (brick = begin; brick < end; brick++) {
+		x0 = brick % level->nx * IVLSU_BRICK_SIZE;
+		y0 = brick / level->nx % level->ny * IVLSU_BRICK_SIZE;
+		z0 = brick / level->nx / level->ny * IVLSU_BRICK_SIZE;
+		entry = &(level->bricks[brick]);
+		ivlsu_brick_clear(entry);
+		empty = 1;
+
+		for (z = z0; z < z0 + IVLSU_BRICK_SIZE && z < volume->nz; z++) {
+			for (y = y0; y < y0 + IVLSU_BRICK_SIZE && y < volume->ny; y++) {
+				for (x = x0; x < x0 + IVLSU_BRICK_SIZE && x < volume->nx; x++) {
+					location = z * plane + y * volume->nx + x;
+					ivlsu_brick_add(entry, volume, location);
+					for (k = 0; k < 8 && empty; k++)
+						empty = ivlsu_volume_vp(volume, location + offsets[k]) == NA;
+				}
+			}
+		}
+
+		build->empty[brick] = (unsigned char)empty;
+	}
+}
+
+/**
+ * Task building the bricks [begin, end) of a level from the 2 x 2 x 2 bricks below them.
+ */
+static void ivlsu_brick_merge_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	const ivlsu_brick_build_t *build = arg;
+	const ivlsu_brick_level_t *level = build->level;
+	const ivlsu_brick_level_t *finer = build->finer;
+	long brick = 0, x = 0, y = 0, z = 0;
+	int i = 0;
+
+	for (brick = begin; brick < end; brick++) {
+		x = brick % level->nx * 2;
+		y = brick / level->nx % level->ny * 2;
+		z = brick / level->nx / level->ny * 2;
+		ivlsu_brick_clear(&(level->bricks[brick]));
+
+		for (i = 0; i < 8; i++) {
+			if (x + (i & 1) < finer->nx && y + ((i >> 1) & 1) < finer->ny && z + (i >> 2) < finer->nz)
+				ivlsu_brick_merge(&(level->bricks[brick]),
+						  &(finer->bricks[((z + (i >> 2)) * finer->ny + y + ((i >> 1) & 1)) * finer->nx + x + (i & 1)]));
+		}
+	}
+}
+
+/**
+ * Builds the brick hierarchy of the model's volume: the first level holds the Vp and
+ * Vs range and the number of nodes with data of every IVLSU_BRICK_SIZE cubed brick,
+ * and each further level merges 2 x 2 x 2 bricks of the one below until a single brick
+ * covers the volume. Also flags the first level bricks whose cells reach no data, so
+ * the batch kernel can skip them.
+ *
+ * @param model The model whose volume is set up.
+ * @return SUCCESS, or FAIL if the hierarchy could not be allocated.
+ */
+int ivlsu_build_bricks(ivlsu_model_t *model) {
+	ivlsu_brick_build_t build = { &(model->volume), NULL, NULL, NULL };
+	ivlsu_brick_level_t *level = NULL;
+	long count = 0;
+
+	model->brick_levels = 0;
+	do {
+		level = &(model->bricks[model->brick_levels]);
+		if (model->brick_levels == 0) {
+			level->size = IVLSU_BRICK_SIZE;
+			level->nx = (model->volume.nx + IVLSU_BRICK_SIZE - 1) / IVLSU_BRICK_SIZE;
+			level->ny = (model->volume.ny + IVLSU_BRICK_SIZE - 1) / IVLSU_BRICK_SIZE;
+			level->nz = (model->volume.nz + IVLSU_BRICK_SIZE - 1) / IVLSU_BRICK_SIZE;
+		} else {
+			level->size = 2 * level[-1].size;
+			level->nx = (level[-1].nx + 1) / 2;
+			level->ny = (level[-1].ny + 1) / 2;
+			level->nz = (level[-1].nz + 1) / 2;
+		}
+
+		count = (long)level->nx * level->ny * level->nz;
+		if ((level->bricks = malloc(count * sizeof(ivlsu_brick_t))) == NULL)
+			return FAIL;
+		model->brick_levels++;
+
+		build.level = level;
+		if (model->brick_levels == 1) {
+			if ((build.empty = malloc(count)) == NULL)
+				return FAIL;
+			ivlsu_parallel_for(count, 16, ivlsu_brick_nodes_task, &build);
+			model->volume.empty = build.empty;
+			model->volume.brick_nx = level->nx;
+			model->volume.brick_ny = level->ny;
+		} else {
+			build.finer = level - 1;
+			ivlsu_parallel_for(count, 64, ivlsu_brick_merge_task, &build);
+		}
+	} while (count > 1 && model->brick_levels < IVLSU_BRICK_LEVELS);
+
+	return SUCCESS;
+}
+
+/**
+ * Adds the part of a brick, and of the bricks below it, that lies in a node range to
+ * the region statistics. Bricks inside the range are taken whole, so only the bricks
+ * on its boundary are descended into and only first level bricks on it are scanned.
+ *
+ * @param model The model.
+ * @param level Level of the brick.
+ * @param x Brick index along x.
+ * @param y Brick index along y.
+ * @param z Brick index along z.
+ * @param range First and last node along x, y and z.
+ * @param brick The returned statistics.
+ */
+static void ivlsu_region_walk(const ivlsu_model_t *model, int level, long x, long y, long z, const long range[6],
+			      ivlsu_brick_t *brick) {
+	const ivlsu_brick_level_t *bricks = &(model->bricks[level]);
+	const ivlsu_volume_t *volume = &(model->volume);
+	long first[3], last[3], location = 0, i = 0, j = 0, k = 0;
+	int axis = 0, inside = 1;
+
+	if (x >= bricks->nx || y >= bricks->ny || z >= bricks->nz)
+		return;
+
+	first[0] = x * bricks->size;
+	first[1] = y * bricks->size;
+	first[2] = z * bricks->size;
+	for (axis = 0; axis < 3; axis++) {
+		last[axis] = first[axis] + bricks->size - 1;
+		if (last[axis] < range[2 * axis] || first[axis] > range[2 * axis + 1])
+			return;
+		if (first[axis] < range[2 * axis] || last[axis] > range[2 * axis + 1])
+			inside = 0;
+	}
+
+	if (inside) {
+		ivlsu_brick_merge(brick, &(bricks->bricks[(z * bricks->ny + y) * bricks->nx + x]));
+	} else if (level == 0) {
+		for (k = first[2] > range[4] ? first[2] : range[4]; k <= last[2] && k <= range[5]; k++) {
+			for (j = first[1] > range[2] ? first[1] : range[2]; j <= last[1] && j <= range[3]; j++) {
+				location = (k * volume->ny + j) * volume->nx;
+				for (i = first[0] > range[0] ? first[0] : range[0]; i <= last[0] && i <= range[1]; i++)
+					ivlsu_brick_add(brick, volume, location + i);
+			}
+		}
+	} else {
+		for (i = 0; i < 8; i++)
+			ivlsu_region_walk(model, level - 1, 2 * x + (i & 1), 2 * y + ((i >> 1) & 1), 2 * z + (i >> 2), range, brick);
+	}
+}
+
+/**
+ * Returns the Vp and Vs range and the number of nodes with data among the nodes of a
+ * model inside a box, walking the brick hierarchy so that the cost grows with the
+ * surface of the box rather than its volume.
+ *
+ * @param model The model.
+ * @param box The box, in UTM coordinates and depth.
+ * @param stats The returned statistics; the ranges are NA if no node has data.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_model_region_stats(const ivlsu_model_t *model, const ivlsu_box_t *box, ivlsu_region_stats_t *stats) {
+	const ivlsu_volume_t *volume = &(model->volume);
+	const ivlsu_brick_level_t *top = NULL;
+	long range[6], x = 0, y = 0, z = 0;
+	ivlsu_brick_t brick;
+	int axis = 0;
+
+	if (model->brick_levels == 0) {
+		print_error("The brick hierarchy could not be allocated at init.");
+		return FAIL;
+	}
+
+	range[0] = (long)ceil((box->min_e - volume->origin_e) / volume->dx);
+	range[1] = (long)floor((box->max_e - volume->origin_e) / volume->dx);
+	range[2] = (long)ceil((box->min_n - volume->origin_n) / volume->dy);
+	range[3] = (long)floor((box->max_n - volume->origin_n) / volume->dy);
+	range[4] = (long)ceil(box->min_depth / volume->dz);
+	range[5] = (long)floor(box->max_depth / volume->dz);
+	range[0] = range[0] < 0 ? 0 : range[0];
+	range[1] = range[1] >= volume->nx ? volume->nx - 1 : range[1];
+	range[2] = range[2] < 0 ? 0 : range[2];
+	range[3] = range[3] >= volume->ny ? volume->ny - 1 : range[3];
+	range[4] = range[4] < 0 ? 0 : range[4];
+	range[5] = range[5] >= volume->nz ? volume->nz - 1 : range[5];
+
+	ivlsu_brick_clear(&brick);
+	stats->nodes = 1;
+	for (axis = 0; axis < 3; axis++)
+		stats->nodes *= range[2 * axis + 1] >= range[2 * axis] ? range[2 * axis + 1] - range[2 * axis] + 1 : 0;
+
+	top = &(model->bricks[model->brick_levels - 1]);
+	for (z = 0; stats->nodes > 0 && z < top->nz; z++)
+		for (y = 0; y < top->ny; y++)
+			for (x = 0; x < top->nx; x++)
+				ivlsu_region_walk(model, model->brick_levels - 1, x, y, z, range, &brick);
+
+	stats->valid = brick.valid;
+	stats->min_vp = brick.valid > 0 ? brick.min_vp : NA;
+	stats->max_vp = brick.valid > 0 ? brick.max_vp : NA;
+	stats->min_vs = brick.valid > 0 ? brick.min_vs : NA;
+	stats->max_vs = brick.valid > 0 ? brick.max_vs : NA;
+	return SUCCESS;
+}
+
+/**
+ * Returns the Vp and Vs range and the number of nodes with data among the model nodes
+ * inside a box.
+ *
+ * @param box The box, in UTM coordinates and depth.
+ * @param stats The returned statistics; the ranges are NA if no node has data.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_region_stats(const ivlsu_box_t *box, ivlsu_region_stats_t *stats) {
+	ivlsu_model_t *model = NULL;
+	int ticket = 0, status;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	model = ivlsu_model_acquire(&ticket);
+	status = ivlsu_model_region_stats(model, box, stats);
+	ivlsu_model_release(ticket);
+	return status;
+}
+
+/**
+ * Returns the counters of the query kernels since initialization or the last reset.
+ *
+ * @param stats The returned counters.
+ * @return SUCCESS
+ */
+int ivlsu_get_stats(ivlsu_stats_t *stats) {
+	*stats = ivlsu_stats;
+	return SUCCESS;
+}
+
+/**
+ * Resets the counters of the query kernels.
+ */
+void ivlsu_reset_stats() {
+	memset(&ivlsu_stats, 0, sizeof(ivlsu_stats_t));
+}
+
+/**
+ * Projects longitude and latitude arrays to UTM with a single pj_transform call.
+ *
+ * @param worker The worker whose projection handles are used.
+ * @param longitude Longitudes in degrees.
+ * @param latitude Latitudes in degrees.
+ * @param stride Distance in doubles between consecutive longitudes and latitudes.
+ * @param count Number of points, at most IVLSU_BATCH_CHUNK.
+ * @param utm_e Returned UTM eastings.
+ * @param utm_n Returned UTM northings. The outputs may be the inputs when stride is 1.
+ */
+void ivlsu_project_points(ivlsu_worker_t *worker, const double *longitude, const double *latitude, int stride, int count,
+			  double *utm_e, double *utm_n) {
+	int k = 0;
+
+	for (k = 0; k < count; k++) {
+		utm_e[k] = longitude[k * stride] * DEG_TO_RAD;
+		utm_n[k] = latitude[k * stride] * DEG_TO_RAD;
+	}
+
+	// src to destination
+	if (ivlsu_worker_projection(worker) == SUCCESS) {
+		pj_transform(worker->latlon, worker->utm, count, 1, utm_e, utm_n, NULL);
+	} else {
+		for (k = 0; k < count; k++)
+			utm_e[k] = utm_n[k] = HUGE_VAL;
+	}
+}
+
+/**
+ * Returns the meridian convergence of the UTM projection at a point: the clockwise
+ * angle from geographic north to grid north, positive east of the central meridian
+ * in the northern hemisphere.
+ *
+ * @param longitude Longitude in degrees.
+ * @param latitude Latitude in degrees.
+ * @return The convergence in radians.
+ */
+double ivlsu_meridian_convergence(double longitude, double latitude) {
+	return atan(tan((longitude - IVLSU_UTM_CENTRAL_MERIDIAN) * DEG_TO_RAD) * sin(latitude * DEG_TO_RAD));
+}
+
+/**
+ * Resolves a point, already in UTM, to the grid node it loads and the X, Y and Z
+ * percentages for the bilinear or trilinear interpolation.
+ *
+ * @param volume The volume being queried.
+ * @param interpolation Non-zero if interpolation is on.
+ * @param utm_e UTM easting of the point.
+ * @param utm_n UTM northing of the point.
+ * @param depth Depth of the point in meters.
+ * @param cell The returned cell.
+ */
+void ivlsu_locate_point(const ivlsu_volume_t *volume, int interpolation, double utm_e, double utm_n, double depth, ivlsu_cell_t *cell) {
+	ivlsu_column_t column;
+
+	ivlsu_locate_column(volume, utm_e, utm_n, &column);
+	ivlsu_locate_depth(volume, interpolation, &column, depth, cell);
+}
+
+/**
+ * Resolves a coordinate along one horizontal axis to the node it loads and its
+ * percentage towards the next node.
+ *
+ * @param coordinate UTM coordinate along the axis.
+ * @param origin UTM coordinate of the first node.
+ * @param spacing Node spacing.
+ * @param n Number of nodes.
+ * @param index The returned node index.
+ * @param percent The returned percentage.
+ * @return 1 if the coordinate is inside the model, 0 otherwise.
+ */
+int ivlsu_locate_axis(double coordinate, double origin, double spacing, int n, long *index, double *percent) {
+	// Which point base point does that correspond to? Written so that NaN and
+	// unprojectable (HUGE_VAL) points fall outside.
+	double load_coord = round((coordinate - origin) / spacing);
+
+	if (!(load_coord >= 0 && load_coord <= n - 1))
+		return 0;
+
+	*index = (long)load_coord;
+	*percent = fmod(coordinate - origin, spacing) / spacing;
+	return 1;
+}
+
+/**
+ * Resolves a depth to the z level it loads and its Z percentage.
+ *
+ * @param volume The volume being queried.
+ * @param depth Depth in meters.
+ * @param index The returned z index.
+ * @param percent The returned percentage.
+ * @return 1 if the depth is inside the model, 0 otherwise.
+ */
+int ivlsu_locate_level(const ivlsu_volume_t *volume, double depth, long *index, double *percent) {
+	double load_z_coord = trunc(depth / volume->dz);
+
+	if (!(depth <= volume->depth && load_z_coord >= 0))
+		return 0;
+
+	*index = (long)load_z_coord;
+	*percent = fmod(depth, volume->dz) / volume->dz;
+	return 1;
+}
+
+/**
+ * Chooses how a located cell is evaluated. A weight of zero makes the blend return
+ * its first operand unchanged, so a point on a z level only needs its top plane and
+ * a point on a grid node only needs the node itself; both give results identical to
+ * the full trilinear blend.
+ *
+ * @param interpolation Non-zero if interpolation is on.
+ * @param x_percent X percentage.
+ * @param y_percent Y percentage.
+ * @param z_percent Z percentage.
+ * @return One of IVLSU_CELL_NEAREST, IVLSU_CELL_BILINEAR or IVLSU_CELL_TRILINEAR.
+ */
+int ivlsu_cell_mode(int interpolation, double x_percent, double y_percent, double z_percent) {
+	if (!interpolation)
+		return IVLSU_CELL_NEAREST;
+	if (z_percent != 0)
+		return IVLSU_CELL_TRILINEAR;
+	if (x_percent == 0 && y_percent == 0)
+		return IVLSU_CELL_NEAREST;
+	return IVLSU_CELL_BILINEAR;
+}
+
 /**
- * Initializes the IMPERIAL plugin model within the UCVM framework. In order to initialize
- * the model, we must provide the UCVM install path and optionally a place in memory
- * where the model already exists.
+ * Resolves the horizontal part of a point: the column of nodes it loads and its X and
+ * Y percentages. Points sharing a longitude and latitude share their column.
  *
- * @param dir The directory in which UCVM has been installed.
- * @param label A unique identifier for the velocity model.
- * @return Success or failure, if initialization was successful.
+ * @param volume The volume being queried.
+ * @param utm_e UTM easting of the point.
+ * @param utm_n UTM northing of the point.
+ * @param column The returned column.
  */
-int ivlsu_init(const char *dir, const char *label) {
-	int tempVal = 0;
-	char configbuf[512];
+void ivlsu_locate_column(const ivlsu_volume_t *volume, double utm_e, double utm_n, ivlsu_column_t *column) {
+	long load_x_coord = 0, load_y_coord = 0;
+
+	// Are we outside the model's X and Y boundaries?
+	if (!ivlsu_locate_axis(utm_e, volume->origin_e, volume->dx, volume->nx, &load_x_coord, &(column->x_percent)) ||
+	    !ivlsu_locate_axis(utm_n, volume->origin_n, volume->dy, volume->ny, &load_y_coord, &(column->y_percent))) {
+		column->location = -1;
+		return;
+	}
 
-	// Initialize variables.
-	ivlsu_configuration = calloc(1, sizeof(ivlsu_configuration_t));
-	ivlsu_velocity_model = calloc(1, sizeof(ivlsu_model_t));
+	column->location = load_y_coord * volume->nx + load_x_coord;
+	column->brick = load_y_coord / IVLSU_BRICK_SIZE * volume->brick_nx + load_x_coord / IVLSU_BRICK_SIZE;
+}
 
-        ivlsu_config_string = calloc(IVLSU_CONFIG_MAX, sizeof(char));
-        ivlsu_config_string[0]='\0';
-        ivlsu_config_sz=0;
+/**
+ * Resolves the vertical part of a point within its column.
+ *
+ * @param volume The volume being queried.
+ * @param interpolation Non-zero if interpolation is on.
+ * @param column The located column of the point.
+ * @param depth Depth of the point in meters.
+ * @param cell The returned cell.
+ */
+void ivlsu_locate_depth(const ivlsu_volume_t *volume, int interpolation, const ivlsu_column_t *column, double depth,
+			ivlsu_cell_t *cell) {
+	long load_z_coord = 0;
+
+	// Are we outside the model's Z boundaries?
+	if (column->location < 0 || !ivlsu_locate_level(volume, depth, &load_z_coord, &(cell->z_percent))) {
+		cell->location = -1;
+		cell->mode = IVLSU_CELL_OUTSIDE;
+		return;
+	}
 
-	// Configuration file location.
-	sprintf(configbuf, "%s/model/%s/data/config", dir, label);
+	cell->location = load_z_coord * volume->nx * volume->ny + column->location;
+	cell->x_percent = column->x_percent;
+	cell->y_percent = column->y_percent;
+	cell->mode = ivlsu_cell_mode(interpolation, cell->x_percent, cell->y_percent, cell->z_percent);
 
-	// Read the configuration file.
-	if (ivlsu_read_configuration(configbuf, ivlsu_configuration) != SUCCESS) {
-		tempVal = FAIL;
-                print_error("No configuration file was found to read from.");
+	// Cells reaching no data are NA without reading the volume. Points just before the
+	// first node have negative weights, which do not blend NA back to exactly NA.
+	if (volume->empty != NULL && cell->x_percent >= 0 && cell->y_percent >= 0 && cell->z_percent >= 0 &&
+	    volume->empty[load_z_coord / IVLSU_BRICK_SIZE * volume->brick_nx * volume->brick_ny + column->brick])
+		cell->mode = IVLSU_CELL_EMPTY;
+}
+
+/**
+ * Bilinearly interpolates Vp on the plane of four nodes starting at location, in
+ * origin, +1x, +1y, +x +y order.
+ *
+ * @param volume The volume being queried.
+ * @param location Index of the origin node.
+ * @param x_percent X percentage.
+ * @param y_percent Y percentage.
+ * @return The interpolated Vp.
+ */
+static inline double ivlsu_bilinear_vp(const ivlsu_volume_t *volume, long location, double x_percent, double y_percent) {
+	double v0 = (1 - x_percent) * ivlsu_volume_vp(volume, location) + x_percent * ivlsu_volume_vp(volume, location + 1);
+	double v1 = (1 - x_percent) * ivlsu_volume_vp(volume, location + volume->nx) +
+		    x_percent * ivlsu_volume_vp(volume, location + volume->nx + 1);
+
+	return (1 - y_percent) * v0 + y_percent * v1;
+}
+
+/**
+ * Starts loading the cache lines holding the corners of a located cell: the x and
+ * x + 1 nodes of rows y and y + 1 in the top plane, and in the bottom plane for a
+ * trilinear cell. Does nothing for cells read from file or outside of the data.
+ *
+ * @param volume The volume being queried.
+ * @param cell The located cell.
+ */
+void ivlsu_prefetch_cell(const ivlsu_volume_t *volume, const ivlsu_cell_t *cell) {
+	long plane = (long)volume->nx * volume->ny;
+	long location = cell->location;
+
+	if (volume->vp == NULL || volume->window_end != 0 || cell->mode == IVLSU_CELL_OUTSIDE || cell->mode == IVLSU_CELL_EMPTY ||
+	    location + volume->nx + 1 >= volume->count)
+		return;
+
+	IVLSU_PREFETCH(volume->vp + location);
+	if (cell->mode == IVLSU_CELL_NEAREST)
+		return;
+
+	IVLSU_PREFETCH(volume->vp + location + 1);
+	IVLSU_PREFETCH(volume->vp + location + volume->nx);
+	IVLSU_PREFETCH(volume->vp + location + volume->nx + 1);
+
+	if (cell->mode == IVLSU_CELL_TRILINEAR && location >= plane) {
+		IVLSU_PREFETCH(volume->vp + location - plane);
+		IVLSU_PREFETCH(volume->vp + location - plane + 1);
+		IVLSU_PREFETCH(volume->vp + location - plane + volume->nx);
+		IVLSU_PREFETCH(volume->vp + location - plane + volume->nx + 1);
+	}
+}
+
+/**
+ * Interpolates Vp within a located cell. The top plane is the cell's own z level and
+ * the bottom plane is the level before it, as in ivlsu_trilinear_interpolation.
+ *
+ * @param volume The volume being queried.
+ * @param cell The located cell.
+ * @return Vp, or NA if the cell is outside of the model.
+ */
+double ivlsu_evaluate_cell(const ivlsu_volume_t *volume, const ivlsu_cell_t *cell) {
+	long plane = (long)volume->nx * volume->ny;
+	double top = 0, bottom = 0;
+
+	switch (cell->mode) {
+	case IVLSU_CELL_NEAREST:
+		return ivlsu_volume_vp(volume, cell->location);
+	case IVLSU_CELL_BILINEAR:
+		return ivlsu_bilinear_vp(volume, cell->location, cell->x_percent, cell->y_percent);
+	case IVLSU_CELL_TRILINEAR:
+		top = ivlsu_bilinear_vp(volume, cell->location, cell->x_percent, cell->y_percent);
+		bottom = ivlsu_bilinear_vp(volume, cell->location - plane, cell->x_percent, cell->y_percent);
+		return (1 - cell->z_percent) * top + cell->z_percent * bottom;
+	case IVLSU_CELL_EMPTY:
+		return NA;
+	default:
+		return NA;
+	}
+}
+
+/**
+ * Differentiates the Vp returned by ivlsu_evaluate_cell within a located cell. The
+ * derivatives are those of the cell's own blend: along x and y from the bilinear
+ * weights of the top and bottom planes, and along depth from moving the weight from
+ * the top plane to the plane before it. They are zero when interpolation is off, as
+ * the returned Vp is then constant within each cell. A cell any of whose eight nodes
+ * is NA has no gradient.
+ *
+ * @param volume The volume being queried.
+ * @param interpolation Non-zero if interpolation is on.
+ * @param cell The located cell.
+ * @param gradient The returned derivatives along easting, northing and depth, per meter.
+ * @return SUCCESS, or FAIL if the cell has no gradient.
+ */
+int ivlsu_cell_gradient(const ivlsu_volume_t *volume, int interpolation, const ivlsu_cell_t *cell, double gradient[3]) {
+	long plane = (long)volume->nx * volume->ny;
+	double corners[8], top = 0, bottom = 0;
+	double x = cell->x_percent, y = cell->y_percent, z = cell->z_percent;
+	int k = 0;
+
+	gradient[0] = gradient[1] = gradient[2] = 0;
+	if (cell->mode == IVLSU_CELL_OUTSIDE || cell->mode == IVLSU_CELL_EMPTY)
 		return FAIL;
-        }
+	if (!interpolation)
+		return SUCCESS;
 
-	// Set up the data directory.
-	sprintf(ivlsu_data_directory, "%s/model/%s/data/%s", dir, label, ivlsu_configuration->model_dir);
+	// Origin, +1x, +1y and +x +y of the top plane, then of the bottom plane.
+	for (k = 0; k < 8; k++) {
+		corners[k] = ivlsu_volume_vp(volume, cell->location - (k >> 2) * plane + ((k >> 1) & 1) * volume->nx + (k & 1));
+		if (corners[k] < 0)
+			return FAIL;
+	}
 
-	// Can we allocate the model, or parts of it, to memory. If so, we do.
-	tempVal = ivlsu_try_reading_model(ivlsu_velocity_model);
+	for (k = 0; k < 8; k += 4) {
+		gradient[0] += (k ? z : 1 - z) * ((1 - y) * (corners[k + 1] - corners[k]) + y * (corners[k + 3] - corners[k + 2]));
+		gradient[1] += (k ? z : 1 - z) * ((1 - x) * (corners[k + 2] - corners[k]) + x * (corners[k + 3] - corners[k + 1]));
+	}
+	top = (1 - y) * ((1 - x) * corners[0] + x * corners[1]) + y * ((1 - x) * corners[2] + x * corners[3]);
+	bottom = (1 - y) * ((1 - x) * corners[4] + x * corners[5]) + y * ((1 - x) * corners[6] + x * corners[7]);
 
-	if (tempVal == SUCCESS) {
-		fprintf(stderr, "WARNING: Could not load model into memory. Reading the model from the\n");
-		fprintf(stderr, "hard disk may result in slow performance.");
-	} else if (tempVal == FAIL) {
-		print_error("No model file was found to read from.");
+	gradient[0] /= volume->dx;
+	gradient[1] /= volume->dy;
+	gradient[2] = (bottom - top) / volume->dz;
+	return SUCCESS;
+}
+
+/**
+ * Returns the Vp sample at the given index of the volume. Corners of cells on the
+ * model's edges can fall outside of the data; those read as NA.
+ *
+ * @param volume The volume being queried.
+ * @param location Index of the node.
+ * @return Vp at the node, or NA.
+ */
+double ivlsu_volume_vp(const ivlsu_volume_t *volume, long location) {
+	float value = NA;
+
+	if (location < 0 || location >= volume->count)
+		return NA;
+
+	if (volume->vp != NULL && volume->window_end == 0)
+		return volume->vp[location];
+	if (volume->vp != NULL && location >= volume->window_begin && location < volume->window_end)
+		return volume->vp[location - volume->window_begin];
+
+	// Read from file.
+	if (volume->file == NULL || pread(fileno(volume->file), &value, sizeof(float), location * sizeof(float)) != sizeof(float))
+		return NA;
+	return value;
+}
+
+/**
+ * Spreads the low 21 bits of a value so that two zero bits separate each of them.
+ *
+ * @param value The value to spread.
+ * @return The spread value.
+ */
+static inline uint64_t ivlsu_spread_bits(uint64_t value) {
+	value &= 0x1fffff;
+	value = (value | value << 32) & 0x1f00000000ffffULL;
+	value = (value | value << 16) & 0x1f0000ff0000ffULL;
+	value = (value | value << 8) & 0x100f00f00f00f00fULL;
+	value = (value | value << 4) & 0x10c30c30c30c30c3ULL;
+	value = (value | value << 2) & 0x1249249249249249ULL;
+	return value;
+}
+
+/**
+ * Returns the Morton key of a cell's x, y and z grid indices. Points outside of the
+ * model get the key of the z index one past the bottom so they sort last.
+ *
+ * @param volume The volume being queried.
+ * @param cell The located cell.
+ * @return The Morton key.
+ */
+uint64_t ivlsu_cell_key(const ivlsu_volume_t *volume, const ivlsu_cell_t *cell) {
+	long plane = (long)volume->nx * volume->ny;
+	long x = 0, y = 0, z = volume->nz;
+
+	if (cell->mode != IVLSU_CELL_OUTSIDE) {
+		z = cell->location / plane;
+		y = (cell->location % plane) / volume->nx;
+		x = cell->location % volume->nx;
+	}
+
+	return ivlsu_spread_bits(x) | ivlsu_spread_bits(y) << 1 | ivlsu_spread_bits(z) << 2;
+}
+
+/** One pass of the parallel radix sort. */
+typedef struct ivlsu_radix_pass_t {
+	/** Records being read */
+	const ivlsu_sort_record_t *records;
+	/** Records being written */
+	ivlsu_sort_record_t *out;
+	/** Number of records */
+	long count;
+	/** Number of records per segment */
+	long segment;
+	/** Position of the digit in the key */
+	int shift;
+	/** 256 counters per segment */
+	long *histogram;
+} ivlsu_radix_pass_t;
+
+/**
+ * Task counting the digits of the segments [begin, end).
+ */
+static void ivlsu_radix_histogram_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	ivlsu_radix_pass_t *pass = arg;
+	long s = 0, i = 0, last = 0;
+
+	for (s = begin; s < end; s++) {
+		last = (s + 1) * pass->segment < pass->count ? (s + 1) * pass->segment : pass->count;
+		for (i = s * pass->segment; i < last; i++)
+			pass->histogram[s * 256 + ((pass->records[i].key >> pass->shift) & 0xff)]++;
+	}
+}
+
+/**
+ * Task moving the records of the segments [begin, end) to their sorted positions.
+ */
+static void ivlsu_radix_scatter_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	ivlsu_radix_pass_t *pass = arg;
+	long s = 0, i = 0, last = 0, position = 0;
+
+	for (s = begin; s < end; s++) {
+		last = (s + 1) * pass->segment < pass->count ? (s + 1) * pass->segment : pass->count;
+		for (i = s * pass->segment; i < last; i++) {
+			position = pass->histogram[s * 256 + ((pass->records[i].key >> pass->shift) & 0xff)]++;
+			pass->out[position] = pass->records[i];
+		}
+	}
+}
+
+/**
+ * Sorts records by key with a stable LSD radix sort of 8 bit digits. Each pass counts
+ * digits per segment on the worker threads, turns the counts into per segment offsets
+ * and scatters the segments in parallel.
+ *
+ * @param records The records to sort.
+ * @param count Number of records.
+ * @param bits Number of significant bits in the keys.
+ * @return SUCCESS, or FAIL if the buffers could not be allocated.
+ */
+int ivlsu_radix_sort(ivlsu_sort_record_t *records, long count, int bits) {
+	ivlsu_radix_pass_t pass;
+	long segments = ivlsu_thread_count();
+	long d = 0, s = 0, offset = 0, total = 0;
+	ivlsu_sort_record_t *swap = NULL;
+
+	pass.segment = (count + segments - 1) / segments;
+	pass.count = count;
+	pass.out = malloc(count * sizeof(ivlsu_sort_record_t));
+	pass.histogram = malloc(segments * 256 * sizeof(long));
+
+	if (pass.out == NULL || pass.histogram == NULL) {
+		free(pass.out);
+		free(pass.histogram);
 		return FAIL;
 	}
 
-	// In order to simplify our calculations in the query, we want to rotate the box so that the bottom-left
-	// corner is at (0m,0m). Our box's height is total_height_m and total_width_m. We then rotate the
-	// point so that is is somewhere between (0,0) and (total_width_m, total_height_m). How far along
-	// the X and Y axis determines which grid points we use for the interpolation routine.
+	pass.records = records;
 
-	ivlsu_total_height_m = sqrt(pow(ivlsu_configuration->top_left_corner_n - ivlsu_configuration->bottom_left_corner_n, 2.0f) +
-						  pow(ivlsu_configuration->top_left_corner_e - ivlsu_configuration->bottom_left_corner_e, 2.0f));
-	ivlsu_total_width_m  = sqrt(pow(ivlsu_configuration->top_right_corner_n - ivlsu_configuration->top_left_corner_n, 2.0f) +
-						  pow(ivlsu_configuration->top_right_corner_e - ivlsu_configuration->top_left_corner_e, 2.0f));
+	for (pass.shift = 0; pass.shift < bits; pass.shift += 8) {
+		memset(pass.histogram, 0, segments * 256 * sizeof(long));
+		ivlsu_parallel_for(segments, 1, ivlsu_radix_histogram_task, &pass);
 
+		// Digit major, segment minor offsets keep the sort stable.
+		for (d = 0, offset = 0; d < 256; d++) {
+			for (s = 0; s < segments; s++) {
+				total = pass.histogram[s * 256 + d];
+				pass.histogram[s * 256 + d] = offset;
+				offset += total;
+			}
+		}
 
-        // We need to convert the point from lat, lon to UTM, let's set it up.
-        if (!(ivlsu_latlon = pj_init_plus("+proj=latlong +datum=WGS84"))) {
-                print_error("Could not set up latitude and longitude projection.");
-                return FAIL;
-        }
-        if (!(ivlsu_utm = pj_init_plus("+proj=utm +zone=11 +datum=WGS84 +units=m +no_defs"))) {
-                print_error("Could not set up UTM projection.");
-                return FAIL;
-        }
+		ivlsu_parallel_for(segments, 1, ivlsu_radix_scatter_task, &pass);
 
-        /* setup config_string */
-        sprintf(ivlsu_config_string,"config = %s\n",configbuf);
-        ivlsu_config_sz=1;
+		swap = (ivlsu_sort_record_t *)pass.records;
+		pass.records = pass.out;
+		pass.out = swap;
+	}
 
-	// Let everyone know that we are initialized and ready for business.
-	ivlsu_is_initialized = 1;
+	// An odd number of passes leaves the result in the scratch buffer.
+	if (pass.records != records) {
+		memcpy(records, pass.records, count * sizeof(ivlsu_sort_record_t));
+		pass.out = (ivlsu_sort_record_t *)pass.records;
+	}
 
+	free(pass.out);
+	free(pass.histogram);
 	return SUCCESS;
 }
 
 /**
- * Queries IMPERIAL at the given points and returns the data that it finds.
+ * Returns the number of worker threads used for large batches: the threads option,
+ * or the number of online processors when it is 0.
  *
- * @param points The points at which the queries will be made.
- * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
- * @param numpoints The total number of points to query.
+ * @return Number of threads, at least 1.
+ */
+int ivlsu_thread_count() {
+	long threads = ivlsu_configuration != NULL ? ivlsu_configuration->threads : 0;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	if (threads > IVLSU_MAX_THREADS)
+		threads = IVLSU_MAX_THREADS;
+	return (int)threads;
+}
+
+/**
+ * Frees the projection handles a worker made for itself.
+ *
+ * @param worker The worker.
+ */
+static void ivlsu_worker_free(ivlsu_worker_t *worker) {
+	if (worker->context == NULL)
+		return;
+	if (worker->latlon != NULL)
+		pj_free(worker->latlon);
+	if (worker->utm != NULL)
+		pj_free(worker->utm);
+	pj_ctx_free(worker->context);
+	worker->context = NULL;
+	worker->latlon = worker->utm = NULL;
+}
+
+/**
+ * Makes a Proj.4 context and the projections of a worker.
+ *
+ * @param worker The worker.
+ * @return SUCCESS or FAIL, leaving what was made for ivlsu_worker_free.
+ */
+static int ivlsu_worker_context(ivlsu_worker_t *worker) {
+	if (worker->context == NULL && (worker->context = pj_ctx_alloc()) == NULL)
+		return FAIL;
+	if (worker->latlon == NULL)
+		worker->latlon = pj_init_plus_ctx(worker->context, IVLSU_LATLON_PROJECTION);
+	if (worker->utm == NULL)
+		worker->utm = pj_init_plus_ctx(worker->context, IVLSU_UTM_PROJECTION);
+
+	return worker->latlon != NULL && worker->utm != NULL ? SUCCESS : FAIL;
+}
+
+/**
+ * Frees the projection handles of a thread when it exits.
+ *
+ * @param arg The thread's handles, an ivlsu_worker_t.
+ */
+static void ivlsu_projection_free(void *arg) {
+	ivlsu_worker_free(arg);
+	free(arg);
+}
+
+/**
+ * Creates the key of the calling threads' projection handles.
+ */
+static void ivlsu_projection_create() {
+	pthread_key_create(&ivlsu_projection_key, ivlsu_projection_free);
+}
+
+/**
+ * Returns the projection handles of a worker. Every thread has a Proj.4 context of
+ * its own, as Proj.4 requires for concurrent use: a calling thread makes one on its
+ * first query and keeps it until it exits, and the other workers make theirs when
+ * they start. Queries of the model and of instances may therefore run on any number
+ * of threads at once.
+ *
+ * @param worker The worker.
  * @return SUCCESS or FAIL.
  */
-int ivlsu_query(ivlsu_point_t *points, ivlsu_properties_t *data, int numpoints) {
-	int i = 0;
-	int load_x_coord = 0, load_y_coord = 0, load_z_coord = 0;
-	double x_percent = 0, y_percent = 0, z_percent = 0;
-	ivlsu_properties_t surrounding_points[8];
-        double lon_e, lat_n;
-
-	int zone = 11;
-	int longlat2utm = 0;
-        double point_utm_e = 0, point_utm_n = 0;
-
-        double delta_lon = (ivlsu_configuration->top_right_corner_e - ivlsu_configuration->bottom_left_corner_e)/(ivlsu_configuration->nx - 1);
-        double delta_lat = (ivlsu_configuration->top_right_corner_n - ivlsu_configuration->bottom_left_corner_n)/(ivlsu_configuration->ny - 1);
-
-	for (i = 0; i < numpoints; i++) {
-		lon_e = points[i].longitude; 
-		lat_n = points[i].latitude; 
-//printf(">>>before e/n %lf %lf\n", lon_e, lat_n);
-
-                point_utm_n = lat_n * DEG_TO_RAD;
-                point_utm_e = lon_e * DEG_TO_RAD;
-
-                // src to destination 
-                pj_transform(ivlsu_latlon, ivlsu_utm, 1, 1, &point_utm_e, &point_utm_n, NULL);
-                //utm_geo_(&lon_e, &lat_n, &point_utm_e, &point_utm_n, &zone, &longlat2utm);
-//printf("utm e/n %lf %lf \n",point_utm_e, point_utm_n);
-
-/*
-                // refine to km for testing 
-                double  tmp_utm_e = round(point_utm_e / 1000) * 1000;
-                double  tmp_utm_n = round(point_utm_n / 1000) * 1000;
-                point_utm_e = tmp_utm_e;
-                point_utm_n = tmp_utm_n;
-*/
-
-		// Which point base point does that correspond to?
-		load_y_coord = (int)(round((point_utm_n - ivlsu_configuration->bottom_left_corner_n) / delta_lat));
-		load_x_coord = (int)(round((point_utm_e - ivlsu_configuration->bottom_left_corner_e) / delta_lon));
-		load_z_coord = (int)((points[i].depth)/1000);
-
-//printf("coord, %d, %d, %d\n", load_x_coord, load_y_coord, load_z_coord);
-
-		// Are we outside the model's X and Y and Z boundaries?
-		if (points[i].depth > ivlsu_configuration->depth || load_x_coord > ivlsu_configuration->nx -1  || load_y_coord > ivlsu_configuration->ny -1 || load_x_coord < 0 || load_y_coord < 0 || load_z_coord < 0) {
-			data[i].vp = -1;
-			data[i].vs = -1;
-			data[i].rho = -1;
-			continue;
+int ivlsu_worker_projection(ivlsu_worker_t *worker) {
+	ivlsu_worker_t *cached = NULL;
+
+	if (worker->latlon != NULL && worker->utm != NULL)
+		return SUCCESS;
+	if (worker->index != 0)
+		return ivlsu_worker_context(worker);
+
+	pthread_once(&ivlsu_projection_once, ivlsu_projection_create);
+	if ((cached = pthread_getspecific(ivlsu_projection_key)) == NULL) {
+		if ((cached = calloc(1, sizeof(ivlsu_worker_t))) == NULL)
+			return FAIL;
+		if (ivlsu_worker_context(cached) != SUCCESS || pthread_setspecific(ivlsu_projection_key, cached) != 0) {
+			ivlsu_projection_free(cached);
+			return FAIL;
 		}
+	}
 
-		// Get the X, Y, and Z percentages for the bilinear or trilinear interpolation below.
-		x_percent =fmod((point_utm_e - ivlsu_configuration->bottom_left_corner_e), delta_lon) /delta_lon;
-		y_percent = fmod((point_utm_n - ivlsu_configuration->bottom_left_corner_n), delta_lat)/
-delta_lat;
-		z_percent = fmod(points[i].depth, ivlsu_configuration->depth_interval) / ivlsu_configuration->depth_interval;
+	worker->latlon = cached->latlon;
+	worker->utm = cached->utm;
+	return SUCCESS;
+}
 
-		if (load_z_coord == 0 && z_percent == 0) {
-			// We're below the model boundaries. Bilinearly interpolate the bottom plane and use that value.
-			load_z_coord = 0;
-                   if(ivlsu_configuration->interpolation) {
+/**
+ * Thread body of a worker: takes ranges of the task until none are left.
+ *
+ * @param arg The worker.
+ * @return NULL
+ */
+static void *ivlsu_worker_main(void *arg) {
+	ivlsu_worker_t *worker = arg;
+	ivlsu_task_t *task = worker->task;
+	long begin = 0;
 
-			// Get the four properties.
-			ivlsu_read_properties(load_x_coord,     load_y_coord,     load_z_coord,     &(surrounding_points[0]));	// Orgin.
-			ivlsu_read_properties(load_x_coord + 1, load_y_coord,     load_z_coord,     &(surrounding_points[1]));	// Orgin + 1x
-			ivlsu_read_properties(load_x_coord,     load_y_coord + 1, load_z_coord,     &(surrounding_points[2]));	// Orgin + 1y
-			ivlsu_read_properties(load_x_coord + 1, load_y_coord + 1, load_z_coord,     &(surrounding_points[3]));	// Orgin + x + y, forms top plane.
+	while ((begin = __sync_fetch_and_add(&(task->next), task->grain)) < task->count)
+		task->function(task->arg, worker, begin, begin + task->grain < task->count ? begin + task->grain : task->count);
 
-			ivlsu_bilinear_interpolation(x_percent, y_percent, surrounding_points, &(data[i]));
-                  } else {
-			ivlsu_read_properties(load_x_coord,     load_y_coord,     load_z_coord,     &(data[i]));	// Orgin.
-                  }
+	return NULL;
+}
 
-		} else {
-		  if( ivlsu_configuration->interpolation) {
-			// Read all the surrounding point properties.
-			ivlsu_read_properties(load_x_coord,     load_y_coord,     load_z_coord,     &(surrounding_points[0]));	// Orgin.
-			ivlsu_read_properties(load_x_coord + 1, load_y_coord,     load_z_coord,     &(surrounding_points[1]));	// Orgin + 1x
-			ivlsu_read_properties(load_x_coord,     load_y_coord + 1, load_z_coord,     &(surrounding_points[2]));	// Orgin + 1y
-			ivlsu_read_properties(load_x_coord + 1, load_y_coord + 1, load_z_coord,     &(surrounding_points[3]));	// Orgin + x + y, forms top plane.
-			ivlsu_read_properties(load_x_coord,     load_y_coord,     load_z_coord - 1, &(surrounding_points[4]));	// Bottom plane origin
-			ivlsu_read_properties(load_x_coord + 1, load_y_coord,     load_z_coord - 1, &(surrounding_points[5]));	// +1x
-			ivlsu_read_properties(load_x_coord,     load_y_coord + 1, load_z_coord - 1, &(surrounding_points[6]));	// +1y
-			ivlsu_read_properties(load_x_coord + 1, load_y_coord + 1, load_z_coord - 1, &(surrounding_points[7]));	// +x +y, forms bottom plane.
+/**
+ * Thread body of a pool worker: runs the tasks it takes part in until the pool stops.
+ * Its projection handles are kept from one task to the next.
+ *
+ * @param arg The worker.
+ * @return NULL
+ */
+static void *ivlsu_pool_main(void *arg) {
+	ivlsu_worker_t *worker = arg;
+	unsigned long *seen = &(ivlsu_pool.seen[worker->index]);
+
+	pthread_mutex_lock(&(ivlsu_pool.lock));
+	while (1) {
+		while (ivlsu_pool.generation == *seen && !ivlsu_pool.stopping)
+			pthread_cond_wait(&(ivlsu_pool.start), &(ivlsu_pool.lock));
+		if (ivlsu_pool.stopping)
+			break;
+		*seen = ivlsu_pool.generation;
+		if (worker->index >= ivlsu_pool.participants)
+			continue;
 
-			ivlsu_trilinear_interpolation(x_percent, y_percent, z_percent, surrounding_points, &(data[i]));
-                    } else {
-                        // no interpolation, data as it is
-			ivlsu_read_properties(load_x_coord,     load_y_coord,     load_z_coord,     &(data[i]));	// Orgin.
-                    }
-		}
+		worker->task = ivlsu_pool.task;
+		pthread_mutex_unlock(&(ivlsu_pool.lock));
+		ivlsu_worker_main(worker);
+		pthread_mutex_lock(&(ivlsu_pool.lock));
+		if (--ivlsu_pool.running == 0)
+			pthread_cond_signal(&(ivlsu_pool.done));
+	}
+	pthread_mutex_unlock(&(ivlsu_pool.lock));
+
+	ivlsu_worker_free(worker);
+	return NULL;
+}
+
+/**
+ * Forgets the pool in a forked child, where its threads do not exist.
+ */
+static void ivlsu_pool_forked() {
+	pthread_mutex_init(&(ivlsu_pool.busy), NULL);
+	pthread_mutex_init(&(ivlsu_pool.lock), NULL);
+	pthread_cond_init(&(ivlsu_pool.start), NULL);
+	pthread_cond_init(&(ivlsu_pool.done), NULL);
+	ivlsu_pool.started = ivlsu_pool.participants = ivlsu_pool.running = 0;
+	memset(ivlsu_pool.workers, 0, sizeof(ivlsu_pool.workers));
+}
+
+/**
+ * Registers the pool's fork handler.
+ */
+static void ivlsu_pool_register() {
+	pthread_atfork(NULL, NULL, ivlsu_pool_forked);
+}
+
+/**
+ * Runs a task on the pool, starting the workers it is missing. The calling thread
+ * holds the pool and is worker 0. If a thread cannot be started, the others pick up
+ * its share.
+ *
+ * @param task The task.
+ * @param nthreads Number of workers, the calling thread included.
+ * @param caller The calling thread's worker.
+ */
+static void ivlsu_pool_run(ivlsu_task_t *task, int nthreads, ivlsu_worker_t *caller) {
+	ivlsu_worker_t *worker = NULL;
+
+	pthread_once(&ivlsu_pool_once, ivlsu_pool_register);
+	pthread_mutex_lock(&(ivlsu_pool.lock));
+	while (ivlsu_pool.started < nthreads - 1) {
+		worker = &(ivlsu_pool.workers[ivlsu_pool.started + 1]);
+		memset(worker, 0, sizeof(ivlsu_worker_t));
+		worker->index = ivlsu_pool.started + 1;
+		ivlsu_pool.seen[worker->index] = ivlsu_pool.generation;
+		if (pthread_create(&(ivlsu_pool.threads[worker->index]), NULL, ivlsu_pool_main, worker) != 0)
+			break;
+		ivlsu_pool.started++;
+	}
+
+	ivlsu_pool.task = task;
+	ivlsu_pool.participants = nthreads < ivlsu_pool.started + 1 ? nthreads : ivlsu_pool.started + 1;
+	ivlsu_pool.running = ivlsu_pool.participants - 1;
+	ivlsu_pool.generation++;
+	pthread_cond_broadcast(&(ivlsu_pool.start));
+	pthread_mutex_unlock(&(ivlsu_pool.lock));
 
-		data[i].rho = ivlsu_calculate_density(data[i].vp);
-		data[i].vs = ivlsu_calculate_vs(data[i].vp);
+	ivlsu_worker_main(caller);
+
+	pthread_mutex_lock(&(ivlsu_pool.lock));
+	while (ivlsu_pool.running > 0)
+		pthread_cond_wait(&(ivlsu_pool.done), &(ivlsu_pool.lock));
+	pthread_mutex_unlock(&(ivlsu_pool.lock));
+}
+
+/**
+ * Stops the pool's threads, which free their projection handles. The next parallel
+ * loop starts them again.
+ */
+static void ivlsu_pool_stop() {
+	int t = 0;
+
+	pthread_mutex_lock(&(ivlsu_pool.busy));
+	pthread_mutex_lock(&(ivlsu_pool.lock));
+	ivlsu_pool.stopping = 1;
+	pthread_cond_broadcast(&(ivlsu_pool.start));
+	pthread_mutex_unlock(&(ivlsu_pool.lock));
+
+	for (t = 1; t <= ivlsu_pool.started; t++)
+		pthread_join(ivlsu_pool.threads[t], NULL);
+
+	ivlsu_pool.started = 0;
+	ivlsu_pool.stopping = 0;
+	pthread_mutex_unlock(&(ivlsu_pool.busy));
+}
+
+/**
+ * Runs a function over [0, count) in ranges of grain items. Work that fits in one
+ * range runs on the calling thread; otherwise up to ivlsu_thread_count() threads take
+ * ranges until none are left. The threads are kept in a pool with their projection
+ * handles, so a loop costs a wake-up rather than starting threads and making Proj.4
+ * contexts. A loop started while the pool is in use, by another thread or from
+ * within a task, runs on threads of its own instead.
+ *
+ * @param count Number of items.
+ * @param grain Number of items handed out at a time.
+ * @param function The function run on each range.
+ * @param arg Argument passed to the function.
+ * @return SUCCESS
+ */
+int ivlsu_parallel_for(long count, long grain, ivlsu_task_function_t function, void *arg) {
+	ivlsu_task_t task = { function, arg, count, grain, 0 };
+	ivlsu_worker_t workers[IVLSU_MAX_THREADS];
+	pthread_t threads[IVLSU_MAX_THREADS];
+	int started[IVLSU_MAX_THREADS];
+	long nthreads = ivlsu_thread_count();
+	int t = 0;
+
+	if (count <= 0)
+		return SUCCESS;
+	if (nthreads > (count + grain - 1) / grain)
+		nthreads = (count + grain - 1) / grain;
+
+	memset(workers, 0, nthreads * sizeof(ivlsu_worker_t));
+	for (t = 0; t < nthreads; t++) {
+		workers[t].index = t;
+		workers[t].task = &task;
 	}
 
+	if (nthreads <= 1) {
+		function(arg, &(workers[0]), 0, count);
+	} else if (pthread_mutex_trylock(&(ivlsu_pool.busy)) == 0) {
+		ivlsu_pool_run(&task, (int)nthreads, &(workers[0]));
+		pthread_mutex_unlock(&(ivlsu_pool.busy));
+	} else {
+		// The calling thread is worker 0. If a thread cannot be started, the others pick up its share.
+		for (t = 1; t < nthreads; t++)
+			started[t] = pthread_create(&(threads[t]), NULL, ivlsu_worker_main, &(workers[t])) == 0;
+		ivlsu_worker_main(&(workers[0]));
+		for (t = 1; t < nthreads; t++)
+			if (started[t])
+				pthread_join(threads[t], NULL);
+	}
+
+	// Free the handles the workers made for themselves; worker 0 borrows its thread's.
+	for (t = 0; t < nthreads; t++)
+		ivlsu_worker_free(&(workers[t]));
+
 	return SUCCESS;
 }
 
@@ -214,22 +3286,15 @@ void ivlsu_read_properties(int x, int y, int z, ivlsu_properties_t *data) {
 	data->vs = -1;
 	data->rho = -1;
 
-	float *ptr = NULL;
-	FILE *fp = NULL;
-
 	int location = z * (ivlsu_configuration->nx * ivlsu_configuration->ny) + (y * ivlsu_configuration->nx) + x;
 
 //printf(">>> LOCATION ivlsu %d\n",location);
 	// Check our loaded components of the model.
-	if (ivlsu_velocity_model->vp_status == 2) {
-		// Read from memory.
-		ptr = (float *)ivlsu_velocity_model->vp;
-		data->vp = ptr[location];
-	} else if (ivlsu_velocity_model->vp_status == 1) {
-		// Read from file.
-		fseek(fp, location * sizeof(float), SEEK_SET);
-		fread(&(data->vp), sizeof(float), 1, fp);
-	}
+	int ticket = 0;
+	ivlsu_model_t *model = ivlsu_model_acquire(&ticket);
+	if (model->vp_status != 0)
+		data->vp = ivlsu_volume_vp(&(model->volume), location);
+	ivlsu_model_release(ticket);
 }
 
 /**
@@ -302,12 +3367,20 @@ void ivlsu_linear_interpolation(double percent, ivlsu_properties_t *x0, ivlsu_pr
  * @return SUCCESS
  */
 int ivlsu_finalize() {
+	ivlsu_pool_stop();
+
         pj_free(ivlsu_latlon);
         pj_free(ivlsu_utm);
+	ivlsu_latlon = NULL;
+	ivlsu_utm = NULL;
 
-	if (ivlsu_velocity_model->vp) free(ivlsu_velocity_model->vp);
+	ivlsu_free_model(ivlsu_velocity_model);
+	ivlsu_velocity_model = NULL;
 
 	free(ivlsu_configuration);
+	ivlsu_configuration = NULL;
+
+	ivlsu_is_initialized = 0;
 
 	return SUCCESS;
 }
@@ -405,13 +3478,7 @@ int ivlsu_read_configuration(char *file, ivlsu_configuration_t *config) {
 				config->bottom_right_corner_n = atof(value);
 			if (strcmp(key, "depth_interval") == 0)
 				config->depth_interval = atof(value);
-			if (strcmp(key, "interpolation") == 0) {
-                                if (strcmp(value, "on") == 0) {
-                                     config->interpolation = 1;
-                                     } else {
-                                          config->interpolation = 0;
-                                }
-                        };
+			ivlsu_parse_option(config, key, value);
 
 		}
 	}
@@ -431,6 +3498,55 @@ int ivlsu_read_configuration(char *file, ivlsu_configuration_t *config) {
 	return SUCCESS;
 }
 
+/**
+ * Applies one of the options that may also be changed after initialization:
+ * interpolation (on or off), threads, sort_threshold and prefetch_distance.
+ *
+ * @param config The configuration struct to which the option should be written.
+ * @param key The option name.
+ * @param value The option value.
+ * @return SUCCESS, or FAIL if the key is not a runtime option or the value is invalid.
+ */
+int ivlsu_parse_option(ivlsu_configuration_t *config, const char *key, const char *value) {
+	if (strcmp(key, "interpolation") == 0) {
+		if (strcmp(value, "on") == 0) {
+			config->interpolation = 1;
+		} else {
+			config->interpolation = 0;
+		}
+		return SUCCESS;
+	}
+	if (strcmp(key, "threads") == 0 && atoi(value) >= 0) {
+		config->threads = atoi(value);
+		return SUCCESS;
+	}
+	if (strcmp(key, "sort_threshold") == 0 && atoi(value) >= 0) {
+		config->sort_threshold = atoi(value);
+		return SUCCESS;
+	}
+	if (strcmp(key, "prefetch_distance") == 0 && atoi(value) >= 0) {
+		config->prefetch_distance = atoi(value);
+		return SUCCESS;
+	}
+	return FAIL;
+}
+
+/**
+ * Changes a runtime option of the initialized model. Options must not be changed
+ * while another thread is querying.
+ *
+ * @param key The option name, as in the configuration file.
+ * @param value The option value, as in the configuration file.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_set_option(const char *key, const char *value) {
+	if (ivlsu_is_initialized == 0 || ivlsu_parse_option(ivlsu_configuration, key, value) != SUCCESS) {
+		print_error("Unknown option or invalid option value.");
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
 /**
  * Calculates the density based off of Vp. Base on Brocher's formulae
  *
@@ -481,6 +3597,17 @@ double ivlsu_calculate_vs(double vp) {
      return retVal;
 }
 
+/**
+ * Calculates the derivative of Vs with respect to Vp, from the same Brocher (2005)
+ * equation as ivlsu_calculate_vs.
+ *
+ * @param vp
+ * @return dVs / dVp, dimensionless.
+ */
+double ivlsu_calculate_vs_slope(double vp) {
+     vp = vp * 0.001;
+     return -1.2344 + 2 * 0.7949 * vp - 3 * 0.1238 * vp * vp + 4 * 0.0064 * vp * vp * vp;
+}
 
 /**
  * Prints the error string provided.
@@ -495,27 +3622,53 @@ void print_error(char *err) {
 }
 
 /**
- * Tries to read the model into memory.
+ * Tries to read the model into memory, or only its window of z levels if it has one,
+ * keeping the file open for the levels outside of the window.
  *
  * @param model The model parameter struct which will hold the pointers to the data either on disk or in memory.
  * @return 2 if all files are read to memory, SUCCESS if file is found but at least 1
  * is not in memory, FAIL if no file found.
  */
 int ivlsu_try_reading_model(ivlsu_model_t *model) {
-	double base_malloc = ivlsu_configuration->nx * ivlsu_configuration->ny * ivlsu_configuration->nz * sizeof(float);
+	return ivlsu_read_model(ivlsu_configuration, ivlsu_data_directory, model);
+}
+
+/**
+ * Reads the Vp data of a data directory into a model, as ivlsu_try_reading_model.
+ *
+ * @param config The configuration describing the data.
+ * @param directory The directory holding vp.dat.
+ * @param model The model, with its window set.
+ * @return 2 if the data is in memory, SUCCESS if it is read from file, FAIL if no file found.
+ */
+int ivlsu_read_model(const ivlsu_configuration_t *config, const char *directory, ivlsu_model_t *model) {
+	double base_malloc = config->nx * config->ny * config->nz * sizeof(float);
+	long plane = (long)config->nx * config->ny;
 	int file_count = 0;
 	int all_read_to_memory = 1;
-	char current_file[128];
+	char current_file[512];
 	FILE *fp;
 
 	// Let's see what data we actually have.
-	sprintf(current_file, "%s/vp.dat", ivlsu_data_directory);
-	if (access(current_file, R_OK) == 0) {
+	snprintf(current_file, sizeof(current_file), "%s/vp.dat", directory);
+	if (access(current_file, R_OK) == 0 && model->window_levels > 0) {
+		model->vp = malloc(model->window_levels * plane * sizeof(float));
+		model->vp_file = fopen(current_file, "rb");
+		if (model->vp == NULL || model->vp_file == NULL || fseek(model->vp_file, model->window_first * plane * sizeof(float), SEEK_SET) != 0 ||
+		    fread(model->vp, sizeof(float), model->window_levels * plane, model->vp_file) != (size_t)(model->window_levels * plane))
+			return FAIL;
+		model->vp_status = 2;
+		file_count++;
+	} else if (access(current_file, R_OK) == 0) {
 		model->vp = malloc(base_malloc);
 		if (model->vp != NULL) {
-			// Read the model in.
-			fp = fopen(current_file, "rb");
-			fread(model->vp, 1, base_malloc, fp);
+			// Read the model in; a file cut short, say while it is being replaced, is not a model.
+			if ((fp = fopen(current_file, "rb")) == NULL)
+				return FAIL;
+			if (fread(model->vp, 1, base_malloc, fp) != (size_t)base_malloc) {
+				fclose(fp);
+				return FAIL;
+			}
 			fclose(fp);
 			model->vp_status = 2;
 		} else {
@@ -534,6 +3687,32 @@ int ivlsu_try_reading_model(ivlsu_model_t *model) {
 		return 2;
 }
 
+/**
+ * Describes the loaded Vp data as a regular volume for the batch kernel. The node
+ * spacing is derived from the corners exactly as the query has always done.
+ *
+ * @param config The model configuration.
+ * @param model The model whose volume is set up.
+ */
+void ivlsu_setup_volume(const ivlsu_configuration_t *config, ivlsu_model_t *model) {
+	ivlsu_volume_t *volume = &(model->volume);
+
+	volume->vp = model->vp_status == 2 ? (const float *)model->vp : NULL;
+	volume->file = model->vp_status == 1 ? (FILE *)model->vp : model->vp_file;
+	volume->nx = config->nx;
+	volume->ny = config->ny;
+	volume->nz = config->nz;
+	volume->count = (long)config->nx * config->ny * config->nz;
+	volume->origin_e = config->bottom_left_corner_e;
+	volume->origin_n = config->bottom_left_corner_n;
+	volume->dx = (config->top_right_corner_e - config->bottom_left_corner_e) / (config->nx - 1);
+	volume->dy = (config->top_right_corner_n - config->bottom_left_corner_n) / (config->ny - 1);
+	volume->dz = config->depth_interval;
+	volume->depth = config->depth;
+	volume->window_begin = model->window_first * (long)config->nx * config->ny;
+	volume->window_end = model->window_levels > 0 ? volume->window_begin + model->window_levels * (long)config->nx * config->ny : 0;
+}
+
 // The following functions are for dynamic library mode. If we are compiling
 // a static library, these functions must be disabled to avoid conflicts.
 #ifdef DYNAMIC_LIBRARY
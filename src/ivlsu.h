@@ -14,6 +14,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
 
 #include "proj_api.h"
 
@@ -33,6 +38,134 @@
 /* config string */
 #define IVLSU_CONFIG_MAX 1000
 
+/** Property mask bit selecting P-wave velocity in the batch API */
+#define IVLSU_VP 0x01
+/** Property mask bit selecting S-wave velocity in the batch API */
+#define IVLSU_VS 0x02
+/** Property mask bit selecting density in the batch API */
+#define IVLSU_RHO 0x04
+/** Property mask bit selecting Qp in the batch API (not provided by the model, always NA) */
+#define IVLSU_QP 0x08
+/** Property mask bit selecting Qs in the batch API (not provided by the model, always NA) */
+#define IVLSU_QS 0x10
+/** Property mask bit selecting the Vp gradient in the batch API */
+#define IVLSU_VP_GRADIENT 0x20
+/** Property mask bit selecting the Vs gradient in the batch API */
+#define IVLSU_VS_GRADIENT 0x40
+/** Property mask bits selecting any gradient */
+#define IVLSU_GRADIENTS (IVLSU_VP_GRADIENT | IVLSU_VS_GRADIENT)
+
+/** Gradients are along UTM easting, northing and depth */
+#define IVLSU_FRAME_UTM 0
+/** Gradients are along geographic east, north and down */
+#define IVLSU_FRAME_ENU 1
+
+/** Batch output arrays hold single precision floats */
+#define IVLSU_FLOAT32 0
+/** Batch output arrays hold double precision floats */
+#define IVLSU_FLOAT64 1
+
+/** Number of points projected and evaluated together by the batch kernel */
+#define IVLSU_BATCH_CHUNK 1024
+/** Batches of at least this many points are evaluated in Morton order by default */
+#define IVLSU_SORT_THRESHOLD 262144
+/** Volumes smaller than this many bytes stay in cache and are not sorted by default */
+#define IVLSU_SORT_MIN_VOLUME (64L * 1024 * 1024)
+/** Default number of points between prefetching a cell's corners and interpolating it */
+#define IVLSU_PREFETCH_DISTANCE 16
+/** Volumes smaller than this many bytes stay in cache and are not prefetched by default */
+#define IVLSU_PREFETCH_MIN_VOLUME (8L * 1024 * 1024)
+/** Vs threshold of Z1.0, in meters per second */
+#define IVLSU_Z1000_THRESHOLD 1000.0
+/** Vs threshold of Z2.5, in meters per second */
+#define IVLSU_Z2500_THRESHOLD 2500.0
+/** Bisection steps locating a threshold crossing between two z levels */
+#define IVLSU_ZDEPTH_BISECTIONS 40
+/** Number of levels of the multiresolution pyramid, at 2x, 4x and 8x the node spacing */
+#define IVLSU_LOD_LEVELS 3
+/** Number of nodes along each edge of a first level brick of the brick hierarchy */
+#define IVLSU_BRICK_SIZE 8
+/** Upper bound on the number of levels of the brick hierarchy */
+#define IVLSU_BRICK_LEVELS 24
+/** Number of sweep orderings of the eikonal solver, one per octant */
+#define IVLSU_EIKONAL_SWEEPS 8
+/** Largest number of iterations of the eikonal solver */
+#define IVLSU_EIKONAL_ITERATIONS 200
+/** The eikonal solver stops once an iteration lowers no travel time by more than this, in seconds */
+#define IVLSU_EIKONAL_TOLERANCE 1e-6
+/** Ray status: the ray crossed its end depth going up */
+#define IVLSU_RAY_ARRIVED 0
+/** Ray status: the ray left the model */
+#define IVLSU_RAY_LEFT_MODEL 1
+/** Ray status: the ray reached a cell without data */
+#define IVLSU_RAY_NO_DATA 2
+/** Ray status: the path had no room for the next point */
+#define IVLSU_RAY_PATH_FULL 3
+/** Ray status: the ray took IVLSU_RAY_MAX_STEPS steps */
+#define IVLSU_RAY_STALLED 4
+/** Ray status: no ray from the source was found to reach the station */
+#define IVLSU_RAY_MISSED 5
+/** Largest position error of one ray step, in meters */
+#define IVLSU_RAY_ACCURACY 0.0001
+/** Largest ray step, as a fraction of the smallest node spacing */
+#define IVLSU_RAY_MAX_STEP 0.25
+/** Largest number of steps of one ray */
+#define IVLSU_RAY_MAX_STEPS 1000000
+/** A ray reaches its station when it crosses the station's depth this close to it, in meters */
+#define IVLSU_RAY_TOLERANCE 1.0
+/** Largest number of Newton iterations finding the ray to a station */
+#define IVLSU_RAY_ITERATIONS 40
+/** Number of tilts along each side of the fan of rays restarting the search for a station */
+#define IVLSU_RAY_FAN 7
+/** Largest tilt of the fan, as the tangent of its angle from the straight line to the station */
+#define IVLSU_RAY_FAN_TILT 1.5
+/** Magic string opening an octree mesh file */
+#define IVLSU_OCTREE_MAGIC "IVLSUOCT"
+/** Upper bound on the number of levels of an octree mesh */
+#define IVLSU_OCTREE_LEVELS 24
+/** Number of leaves a worker buffers before writing them out */
+#define IVLSU_OCTREE_CHUNK 4096
+/** First line of a work journal */
+#define IVLSU_JOURNAL_MAGIC "IVLSU journal 1"
+/** Longest line of a work journal, including its newline */
+#define IVLSU_JOURNAL_LINE 1024
+/** Magic number opening every message of the query server */
+#define IVLSU_SERVER_MAGIC 0x49564c53
+/** Message carrying ivlsu_point_t records to query */
+#define IVLSU_MESSAGE_QUERY 1
+/** Message carrying the ivlsu_properties_t of the points of a query */
+#define IVLSU_MESSAGE_RESULT 2
+/** Message answering a query that could not be evaluated, without payload */
+#define IVLSU_MESSAGE_ERROR 3
+/** Number of points a client sends per query */
+#define IVLSU_SERVER_CHUNK 65536
+/** Number of queries a client may send before it reads their results */
+#define IVLSU_SERVER_PIPELINE 4
+/** Largest number of points the server accepts in one query */
+#define IVLSU_SERVER_MAX_POINTS (1 << 22)
+/** Microseconds between checks of a reload waiting for the queries holding the old model */
+#define IVLSU_RELOAD_POLL 100
+/** Upper bound on the number of worker threads */
+#define IVLSU_MAX_THREADS 256
+
+/** Point lies outside of the model */
+#define IVLSU_CELL_OUTSIDE 0
+/** Point takes the value of its grid node: interpolation is off or the point is on a node */
+#define IVLSU_CELL_NEAREST 1
+/** Point is bilinearly interpolated within its top plane */
+#define IVLSU_CELL_BILINEAR 2
+/** Point is trilinearly interpolated within its cell */
+#define IVLSU_CELL_TRILINEAR 3
+/** Point lies in a brick whose cells reach no data and is NA without reading the volume */
+#define IVLSU_CELL_EMPTY 4
+
+/** Hints the processor to start loading the cache line holding an address */
+#if defined(__GNUC__)
+	#define IVLSU_PREFETCH(address) __builtin_prefetch(address)
+#else
+	#define IVLSU_PREFETCH(address)
+#endif
+
 // Structures
 /** Defines a point (latitude, longitude, and depth) in WGS84 format */
 typedef struct ivlsu_point_t {
@@ -59,6 +192,44 @@ typedef struct ivlsu_properties_t {
 
 } ivlsu_properties_t;
 
+/**
+ * Structure-of-arrays batch query. Inputs are separate longitude, latitude and depth
+ * arrays; outputs are separate arrays of the type given by "type". Only the properties
+ * selected in "properties" are computed and only their arrays need to be provided.
+ */
+typedef struct ivlsu_batch_t {
+	/** Number of points in the batch */
+	int numpoints;
+	/** Longitude of each point, in degrees */
+	const double *longitude;
+	/** Latitude of each point, in degrees */
+	const double *latitude;
+	/** Depth of each point, in meters */
+	const double *depth;
+	/** Bitmask of IVLSU_VP, IVLSU_VS, IVLSU_RHO, IVLSU_QP, IVLSU_QS, IVLSU_VP_GRADIENT and IVLSU_VS_GRADIENT */
+	int properties;
+	/** Element type of the output arrays, IVLSU_FLOAT32 or IVLSU_FLOAT64 */
+	int type;
+	/** P-wave velocity output in meters per second */
+	void *vp;
+	/** S-wave velocity output in meters per second */
+	void *vs;
+	/** Density output in g/m^3 */
+	void *rho;
+	/** Qp output, always NA */
+	void *qp;
+	/** Qs output, always NA */
+	void *qs;
+	/** Target sample spacing in meters, picking a pyramid level; 0 samples the full resolution */
+	double spacing;
+	/** Vp gradient output, three values per point, per meter */
+	void *vp_gradient;
+	/** Vs gradient output, three values per point, per meter */
+	void *vs_gradient;
+	/** Axes of the gradients, IVLSU_FRAME_UTM or IVLSU_FRAME_ENU */
+	int frame;
+} ivlsu_batch_t;
+
 /** The IMPERIAL configuration structure. */
 typedef struct ivlsu_configuration_t {
 	/** The zone of UTM projection */
@@ -94,47 +265,452 @@ typedef struct ivlsu_configuration_t {
 	double p5;
         /** Bilinear or Trilinear Interpolation on or off (1 or 0) */
         int interpolation;
+	/** Number of worker threads for large batches, 0 uses all processors */
+	int threads;
+	/** Batches of at least this many points are sorted spatially, 0 disables sorting, -1 picks a default */
+	int sort_threshold;
+	/** Points between prefetching a cell's corners and interpolating it, 0 disables prefetching, -1 picks a default */
+	int prefetch_distance;
 
 } ivlsu_configuration_t;
 
+/** Counters of the query kernels. */
+typedef struct ivlsu_stats_t {
+	/** Points evaluated */
+	unsigned long points;
+	/** Points that reused the projection and horizontal weights of the point before them */
+	unsigned long column_points;
+	/** Points that fell on a grid node and were read with one load while interpolation is on */
+	unsigned long node_points;
+	/** Points in bricks without data, answered without reading the volume */
+	unsigned long empty_points;
+} ivlsu_stats_t;
+
+/** A regular grid of query points given in UTM coordinates, optionally rotated about its first node. */
+typedef struct ivlsu_grid_t {
+	/** UTM easting of the first node, in meters */
+	double origin_e;
+	/** UTM northing of the first node, in meters */
+	double origin_n;
+	/** Depth of the first node, in meters */
+	double origin_depth;
+	/** Node spacing along easting, in meters */
+	double spacing_e;
+	/** Node spacing along northing, in meters */
+	double spacing_n;
+	/** Node spacing along depth, in meters */
+	double spacing_depth;
+	/** Number of nodes along easting */
+	int nx;
+	/** Number of nodes along northing */
+	int ny;
+	/** Number of nodes along depth */
+	int nz;
+	/** Target sample spacing in meters, picking a pyramid level; 0 samples the full resolution */
+	double spacing;
+	/** Counter-clockwise rotation of the grid's x axis from UTM east about the first node, in degrees */
+	double rotation;
+} ivlsu_grid_t;
+
+/** An axis-aligned box in UTM coordinates and depth. */
+typedef struct ivlsu_box_t {
+	/** Smallest UTM easting, in meters */
+	double min_e;
+	/** Largest UTM easting, in meters */
+	double max_e;
+	/** Smallest UTM northing, in meters */
+	double min_n;
+	/** Largest UTM northing, in meters */
+	double max_n;
+	/** Shallowest depth, in meters */
+	double min_depth;
+	/** Deepest depth, in meters */
+	double max_depth;
+} ivlsu_box_t;
+
+/** The average of the model over a box. */
+typedef struct ivlsu_box_average_t {
+	/** Arithmetic mean of the P-wave velocity in meters per second */
+	double vp;
+	/** Arithmetic mean of the S-wave velocity in meters per second */
+	double vs;
+	/** Arithmetic mean of the density in g/m^3 */
+	double rho;
+	/** Harmonic mean of the shear modulus, density times Vs squared */
+	double mu;
+	/** Share of the box covered by nodes with data, from 0 to 1 */
+	double valid_fraction;
+} ivlsu_box_average_t;
+
+/** An entry of the summed-volume table: sums over the nodes before a lattice point. */
+typedef struct ivlsu_summed_t {
+	/** Sum of Vp */
+	double vp;
+	/** Sum of Vs */
+	double vs;
+	/** Sum of density */
+	double rho;
+	/** Sum of the inverse shear modulus */
+	double inverse_mu;
+	/** Number of nodes with data */
+	double count;
+} ivlsu_summed_t;
+
+/** Statistics of the model nodes inside a region. */
+typedef struct ivlsu_region_stats_t {
+	/** Smallest Vp in meters per second, NA if no node has data */
+	double min_vp;
+	/** Largest Vp in meters per second, NA if no node has data */
+	double max_vp;
+	/** Smallest Vs in meters per second, NA if no node has data */
+	double min_vs;
+	/** Largest Vs in meters per second, NA if no node has data */
+	double max_vs;
+	/** Number of nodes with data */
+	long valid;
+	/** Number of nodes in the region */
+	long nodes;
+} ivlsu_region_stats_t;
+
+/** A ray traced through the model. */
+typedef struct ivlsu_ray_t {
+	/** Longitude of the source in degrees */
+	double longitude;
+	/** Latitude of the source in degrees */
+	double latitude;
+	/** Depth of the source in meters */
+	double depth;
+	/** Takeoff azimuth clockwise from geographic north in degrees, returned by ivlsu_trace_rays */
+	double azimuth;
+	/** Takeoff angle from the downward vertical in degrees, returned by ivlsu_trace_rays */
+	double takeoff;
+	/** The shot ray stops when it crosses this depth going up, never going down; negative to trace it out of the model. Traced rays stop at their station's depth and leave it alone */
+	double end_depth;
+	/** IVLSU_VP or IVLSU_VS */
+	int wave;
+	/** Returned UTM easting, northing and depth of each point of the path, or NULL */
+	double *path;
+	/** Number of points the path has room for */
+	int max_points;
+	/** Returned number of points in the path */
+	int numpoints;
+	/** Returned UTM easting, northing and depth where the ray stopped */
+	double end[3];
+	/** Returned travel time in seconds */
+	double time;
+	/** Returned path length in meters */
+	double length;
+	/** Returned reason the ray stopped, one of IVLSU_RAY_ARRIVED to IVLSU_RAY_MISSED */
+	int status;
+} ivlsu_ray_t;
+
+/** Range of Vp and Vs and number of nodes with data of a brick. */
+typedef struct ivlsu_brick_t {
+	/** Smallest Vp */
+	float min_vp;
+	/** Largest Vp */
+	float max_vp;
+	/** Smallest Vs */
+	float min_vs;
+	/** Largest Vs */
+	float max_vs;
+	/** Number of nodes with data */
+	long valid;
+} ivlsu_brick_t;
+
+/** A level of the brick hierarchy. */
+typedef struct ivlsu_brick_level_t {
+	/** Number of nodes along each edge of a brick */
+	int size;
+	/** Number of bricks along x */
+	int nx;
+	/** Number of bricks along y */
+	int ny;
+	/** Number of bricks along z */
+	int nz;
+	/** The bricks, x varying fastest */
+	ivlsu_brick_t *bricks;
+} ivlsu_brick_level_t;
+
+/** Parameters of an octree mesh sized to the local shortest wavelength. */
+typedef struct ivlsu_octree_t {
+	/** Highest frequency the mesh must carry, in Hz */
+	double frequency;
+	/** Number of leaf edges per shortest wavelength */
+	double points_per_wavelength;
+	/** Edge of the smallest leaf in meters, 0 for the smallest node spacing of the model */
+	double min_size;
+	/** Edge of the largest leaf in meters, rounded down to the smallest times a power of two, 0 for the model's depth */
+	double max_size;
+} ivlsu_octree_t;
+
+/** Header of an octree mesh file, followed by its leaves. */
+typedef struct ivlsu_octree_header_t {
+	/** IVLSU_OCTREE_MAGIC, without the terminating null */
+	char magic[8];
+	/** UTM easting of the corner of the mesh */
+	double origin_e;
+	/** UTM northing of the corner of the mesh */
+	double origin_n;
+	/** Edge of a level 0 leaf in meters */
+	double size;
+	/** Frequency the mesh was sized for, in Hz */
+	double frequency;
+	/** Number of leaf edges per shortest wavelength */
+	double points_per_wavelength;
+	/** Number of root cubes along easting, northing and depth */
+	int32_t roots[3];
+	/** Number of levels, a root cube being a leaf of level levels - 1 */
+	int32_t levels;
+	/** Number of leaves following the header */
+	int64_t leaves;
+} ivlsu_octree_header_t;
+
+/** A leaf of an octree mesh file, with the properties at its center. */
+typedef struct ivlsu_octree_leaf_t {
+	/** Easting, northing and depth index of the leaf's corner, in level 0 leaf edges */
+	uint32_t index[3];
+	/** Level of the leaf, whose edge is size times 2 to the level */
+	uint32_t level;
+	/** Vp in meters per second, NA without data */
+	float vp;
+	/** Vs in meters per second, NA without data */
+	float vs;
+	/** Density, NA without data */
+	float rho;
+} ivlsu_octree_leaf_t;
+
+/** The journal of the completed work units of a long extraction. */
+typedef struct ivlsu_journal_t {
+	/** The journal file, NULL for a journal kept in memory only */
+	FILE *fp;
+	/** Path of the journal file */
+	char *path;
+	/** Number of work units of the job */
+	long numunits;
+	/** Non-zero for each unit recorded as complete */
+	unsigned char *done;
+	/** Checksum of each unit recorded as complete */
+	uint64_t *checksums;
+	/** Number of units the journal recorded as complete when it was opened */
+	long recorded;
+	/** Serializes the records */
+	pthread_mutex_t lock;
+} ivlsu_journal_t;
+
+/** Header of a message of the query server, followed by its payload. */
+typedef struct ivlsu_message_t {
+	/** IVLSU_SERVER_MAGIC */
+	uint32_t magic;
+	/** IVLSU_MESSAGE_QUERY, IVLSU_MESSAGE_RESULT or IVLSU_MESSAGE_ERROR */
+	uint32_t type;
+	/** Length of the payload in bytes */
+	uint64_t length;
+} ivlsu_message_t;
+
+/** A connection to a query server. */
+typedef struct ivlsu_client_t {
+	/** The connected socket, -1 if not connected */
+	int fd;
+} ivlsu_client_t;
+
+/** A regular grid of Vp samples as seen by the batch kernel. */
+typedef struct ivlsu_volume_t {
+	/** Vp samples with x varying fastest, then y, then z. Null if read from file. */
+	const float *vp;
+	/** Open Vp file when the samples are not in memory */
+	FILE *file;
+	/** Number of x points */
+	int nx;
+	/** Number of y points */
+	int ny;
+	/** Number of z points */
+	int nz;
+	/** Total number of samples */
+	long count;
+	/** UTM easting of the bottom left node */
+	double origin_e;
+	/** UTM northing of the bottom left node */
+	double origin_n;
+	/** Node spacing along x, in meters */
+	double dx;
+	/** Node spacing along y, in meters */
+	double dy;
+	/** Node spacing along z, in meters */
+	double dz;
+	/** Maximum depth in meters */
+	double depth;
+	/** Per first level brick flag set when no cell of the brick reaches data, or NULL */
+	const unsigned char *empty;
+	/** Number of first level bricks along x */
+	int brick_nx;
+	/** Number of first level bricks along y */
+	int brick_ny;
+	/** Index of the first sample held in vp when it only holds a window of the samples */
+	long window_begin;
+	/** Index after the last sample held in vp, 0 if vp holds every sample; the others are read from file */
+	long window_end;
+} ivlsu_volume_t;
+
+/** The horizontal part of a located point, shared by points in the same column. */
+typedef struct ivlsu_column_t {
+	/** Index of the origin node in the top plane, or -1 if outside of the model */
+	long location;
+	/** X percentage */
+	double x_percent;
+	/** Y percentage */
+	double y_percent;
+	/** Index of the first level brick holding the origin node within its z layer of bricks */
+	long brick;
+} ivlsu_column_t;
+
+/** A query point resolved to its grid cell and interpolation weights. */
+typedef struct ivlsu_cell_t {
+	/** Index of the origin node in the volume */
+	long location;
+	/** One of IVLSU_CELL_OUTSIDE, IVLSU_CELL_NEAREST, IVLSU_CELL_BILINEAR, IVLSU_CELL_TRILINEAR or IVLSU_CELL_EMPTY */
+	int mode;
+	/** X percentage */
+	double x_percent;
+	/** Y percentage */
+	double y_percent;
+	/** Z percentage */
+	double z_percent;
+} ivlsu_cell_t;
+
+/** A worker of ivlsu_parallel_for with its own projection handles. */
+typedef struct ivlsu_worker_t {
+	/** Worker index, 0 is the calling thread */
+	int index;
+	/** Proj.4 context owned by this worker, NULL for the calling thread */
+	projCtx context;
+	/** Latitude longitude projection used by this worker */
+	projPJ latlon;
+	/** UTM projection used by this worker */
+	projPJ utm;
+	/** The task this worker runs */
+	struct ivlsu_task_t *task;
+} ivlsu_worker_t;
+
+/** A function run by ivlsu_parallel_for over the range [begin, end). */
+typedef void (*ivlsu_task_function_t)(void *arg, ivlsu_worker_t *worker, long begin, long end);
+
+/** Work shared by the workers of ivlsu_parallel_for. */
+typedef struct ivlsu_task_t {
+	/** Function run on each range */
+	ivlsu_task_function_t function;
+	/** Argument passed to the function */
+	void *arg;
+	/** Number of items */
+	long count;
+	/** Number of items handed out at a time */
+	long grain;
+	/** Next item to hand out */
+	long next;
+} ivlsu_task_t;
+
+/** A located point carried through the spatial sort. */
+typedef struct ivlsu_sort_record_t {
+	/** Morton key of the point's grid indices */
+	uint64_t key;
+	/** Index of the point in the caller's order */
+	long index;
+	/** The located cell */
+	ivlsu_cell_t cell;
+} ivlsu_sort_record_t;
+
 /** The model structure which points to available portions of the model. */
 typedef struct ivlsu_model_t {
 	/** A pointer to the Vp data either in memory or disk. Null if does not exist. */
 	void *vp;
 	/** Vp status: 0 = not found, 1 = found and not in memory, 2 = found and in memory */
 	int vp_status;
+	/** First z level held in memory when only a depth window of the model is loaded */
+	int window_first;
+	/** Number of z levels held in memory, 0 if the whole model is loaded */
+	int window_levels;
+	/** Open Vp file backing the z levels outside of the window, or NULL */
+	FILE *vp_file;
+	/** Grid description of the Vp data used by the batch kernel */
+	ivlsu_volume_t volume;
+	/** Depth at which Vs first reaches IVLSU_Z1000_THRESHOLD below each node of the top plane, NA if it never does */
+	float *z1000;
+	/** Depth at which Vs first reaches IVLSU_Z2500_THRESHOLD below each node of the top plane, NA if it never does */
+	float *z2500;
+	/** One-way vertical P travel time from the surface to each node in seconds, laid out as the volume */
+	float *vp_time;
+	/** One-way vertical S travel time from the surface to each node in seconds, laid out as the volume */
+	float *vs_time;
+	/** Summed-volume table of Vp, Vs, density, 1 / mu and the nodes with data, (nx + 1) * (ny + 1) * (nz + 1) entries */
+	ivlsu_summed_t *summed;
+	/** Downsampled levels of the volume, each half the resolution of the one before */
+	ivlsu_volume_t lod[IVLSU_LOD_LEVELS];
+	/** Number of pyramid levels built */
+	int lod_count;
+	/** Brick hierarchy of the volume, from IVLSU_BRICK_SIZE cubed bricks up to one brick */
+	ivlsu_brick_level_t bricks[IVLSU_BRICK_LEVELS];
+	/** Number of brick levels built */
+	int brick_levels;
 } ivlsu_model_t;
 
+/** A loaded model shared by every instance opened on the same data. */
+typedef struct ivlsu_shared_model_t {
+	/** Device of the Vp file */
+	dev_t device;
+	/** Inode of the Vp file */
+	ino_t inode;
+	/** Size of the Vp file in bytes */
+	off_t size;
+	/** Modification time of the Vp file */
+	struct timespec mtime;
+	/** The configuration the data was loaded with */
+	ivlsu_configuration_t config;
+	/** The loaded data, never modified while it is shared */
+	ivlsu_model_t *model;
+	/** Number of instances holding the data */
+	int references;
+	/** Next entry of the registry */
+	struct ivlsu_shared_model_t *next;
+} ivlsu_shared_model_t;
+
+/** An open model: data shared through the registry, with query options of its own. */
+typedef struct ivlsu_instance_t {
+	/** The shared data, NULL if the instance is not open */
+	ivlsu_shared_model_t *shared;
+	/** The instance's configuration, holding its query options */
+	ivlsu_configuration_t config;
+} ivlsu_instance_t;
+
 // Constants
 /** The version of the model. */
-const char *ivlsu_version_string = "IMPERIAL";
+extern const char *ivlsu_version_string;
 
 // Variables
 /** Set to 1 when the model is ready for query. */
-int ivlsu_is_initialized = 0;
+extern int ivlsu_is_initialized;
 
 /** Location of the binary data files. */
-char ivlsu_data_directory[128];
+extern char ivlsu_data_directory[512];
 
 /** Configuration parameters. */
-ivlsu_configuration_t *ivlsu_configuration;
+extern ivlsu_configuration_t *ivlsu_configuration;
 /** Holds pointers to the velocity model data OR indicates it can be read from file. */
-ivlsu_model_t *ivlsu_velocity_model;
+extern ivlsu_model_t *ivlsu_velocity_model;
 
 /** Proj.4 latitude longitude, WGS84 projection holder. */
-projPJ ivlsu_latlon;
+extern projPJ ivlsu_latlon;
 /** Proj.4 UTM projection holder. */
-projPJ ivlsu_utm;
+extern projPJ ivlsu_utm;
 
 /** The cosine of the rotation angle used to rotate the box and point around the bottom-left corner. */
-double ivlsu_cos_rotation_angle = 0;
+extern double ivlsu_cos_rotation_angle;
 /** The sine of the rotation angle used to rotate the box and point around the bottom-left corner. */
-double ivlsu_sin_rotation_angle = 0;
+extern double ivlsu_sin_rotation_angle;
 
 /** The height of this model's region, in meters. */
-double ivlsu_total_height_m = 0;
+extern double ivlsu_total_height_m;
 /** The width of this model's region, in meters. */
-double ivlsu_total_width_m = 0;
+extern double ivlsu_total_width_m;
 
 // UCVM API Required Functions
 
@@ -155,16 +731,45 @@ int model_query(ivlsu_point_t *points, ivlsu_properties_t *data, int numpts);
 
 /** Initializes the model */
 extern int ivlsu_init(const char *dir, const char *label);
+/** Initializes the model holding only the z levels of a depth range in memory */
+extern int ivlsu_init_window(const char *dir, const char *label, double min_depth, double max_depth);
 /** Cleans up the model (frees memory, etc.) */
 extern int ivlsu_finalize();
 /** Returns version information */
 extern int ivlsu_version(char *ver, int len);
 /** Queries the model */
 extern int ivlsu_query(ivlsu_point_t *points, ivlsu_properties_t *data, int numpts);
+/** Queries the model with structure-of-arrays inputs and outputs */
+extern int ivlsu_query_batch(ivlsu_batch_t *batch);
+/** Queries the model on a regular UTM grid */
+extern int ivlsu_query_grid(const ivlsu_grid_t *grid, ivlsu_batch_t *batch);
+/** Returns the depth at which Vs first reaches a threshold (Z1.0, Z2.5) below each site */
+extern int ivlsu_query_zdepth(const double *longitude, const double *latitude, int numpoints, double threshold, double *zdepth);
+/** Returns the time-averaged Vs from the surface to a depth (Vs30, VsZ) below each site, Vs linear between z levels */
+extern int ivlsu_query_vsz(const double *longitude, const double *latitude, int numpoints, double depth, double *vsz);
+/** Maps the time-averaged Vs over a regular UTM grid of sites */
+extern int ivlsu_query_vsz_grid(const ivlsu_grid_t *grid, double depth, double *vsz);
+/** Returns the one-way vertical P and S travel times from the surface to each point, velocity linear between z levels */
+extern int ivlsu_query_travel_time(const double *longitude, const double *latitude, const double *depth, int numpoints, double *tp,
+				   double *ts);
+/** Averages the model over axis-aligned boxes */
+extern int ivlsu_query_box_average(const ivlsu_box_t *boxes, int numboxes, ivlsu_box_average_t *averages);
+/** Returns the Vp and Vs range and the nodes with data inside a box */
+extern int ivlsu_region_stats(const ivlsu_box_t *box, ivlsu_region_stats_t *stats);
+/** Changes a runtime option (interpolation, threads, sort_threshold, prefetch_distance) */
+extern int ivlsu_set_option(const char *key, const char *value);
+/** Returns the counters of the query kernels */
+extern int ivlsu_get_stats(ivlsu_stats_t *stats);
+/** Resets the counters of the query kernels */
+extern void ivlsu_reset_stats();
+/** Reloads the model's data while other threads keep querying it */
+extern int ivlsu_reload(const char *dir, const char *label);
 
 // Non-UCVM Helper Functions
 /** Reads the configuration file. */
 extern int ivlsu_read_configuration(char *file, ivlsu_configuration_t *config);
+/** Applies a runtime option to the configuration. */
+extern int ivlsu_parse_option(ivlsu_configuration_t *config, const char *key, const char *value);
 extern void print_error(char *err);
 /** Retrieves the value at a specified grid point in the model. */
 extern void ivlsu_read_properties(int x, int y, int z, ivlsu_properties_t *data);
@@ -174,6 +779,174 @@ extern int ivlsu_try_reading_model(ivlsu_model_t *model);
 extern double ivlsu_calculate_density(double vp);
 /** Calculates Vs from Vp. */
 extern double ivlsu_calculate_vs(double vp);
+/** Calculates the derivative of Vs with respect to Vp. */
+extern double ivlsu_calculate_vs_slope(double vp);
+/** Returns the meridian convergence of the UTM projection at a point. */
+extern double ivlsu_meridian_convergence(double longitude, double latitude);
+/** Describes the loaded Vp data as a volume for the batch kernel. */
+extern void ivlsu_setup_volume(const ivlsu_configuration_t *config, ivlsu_model_t *model);
+/** Reads the Vp data of a data directory into a model. */
+extern int ivlsu_read_model(const ivlsu_configuration_t *config, const char *directory, ivlsu_model_t *model);
+/** Loads a model from a data directory without touching the loaded model. */
+extern ivlsu_model_t *ivlsu_load_model(const ivlsu_configuration_t *config, const char *directory, int window_first, int window_levels);
+/** Frees a model and everything it holds. */
+extern void ivlsu_free_model(ivlsu_model_t *model);
+/** Checks whether two configurations describe the same grid. */
+extern int ivlsu_same_grid(const ivlsu_configuration_t *a, const ivlsu_configuration_t *b);
+/** Picks the options the configuration leaves at -1 from the size of the volume. */
+extern void ivlsu_default_options(ivlsu_configuration_t *config, const ivlsu_volume_t *volume);
+/** Queries a model at the given points with the options of a configuration. */
+extern int ivlsu_model_query(const ivlsu_model_t *model, const ivlsu_configuration_t *config, const ivlsu_point_t *points,
+			     ivlsu_properties_t *data, int numpoints);
+/** Queries a model with structure-of-arrays inputs and outputs and the options of a configuration. */
+extern int ivlsu_model_query_batch(const ivlsu_model_t *model, const ivlsu_configuration_t *config, ivlsu_batch_t *batch);
+/** Queries a model on a regular UTM grid with the options of a configuration. */
+extern int ivlsu_model_query_grid(const ivlsu_model_t *model, const ivlsu_configuration_t *config, const ivlsu_grid_t *grid,
+				  ivlsu_batch_t *batch);
+
+// Batch Kernel Functions
+/** Returns the Vp sample at a volume index, NA if the index is outside the volume. */
+extern double ivlsu_volume_vp(const ivlsu_volume_t *volume, long location);
+/** Projects longitude and latitude arrays to UTM. */
+extern void ivlsu_project_points(ivlsu_worker_t *worker, const double *longitude, const double *latitude, int stride, int count,
+				 double *utm_e, double *utm_n);
+/** Resolves a UTM point and depth to its cell and interpolation weights. */
+extern void ivlsu_locate_point(const ivlsu_volume_t *volume, int interpolation, double utm_e, double utm_n, double depth, ivlsu_cell_t *cell);
+/** Resolves a coordinate along one horizontal axis to its node and weight. */
+extern int ivlsu_locate_axis(double coordinate, double origin, double spacing, int n, long *index, double *percent);
+/** Resolves a depth to its z level and weight. */
+extern int ivlsu_locate_level(const ivlsu_volume_t *volume, double depth, long *index, double *percent);
+/** Chooses how a located cell is evaluated from its weights. */
+extern int ivlsu_cell_mode(int interpolation, double x_percent, double y_percent, double z_percent);
+/** Resolves a UTM point to its column and horizontal weights. */
+extern void ivlsu_locate_column(const ivlsu_volume_t *volume, double utm_e, double utm_n, ivlsu_column_t *column);
+/** Resolves a depth within a located column to its cell. */
+extern void ivlsu_locate_depth(const ivlsu_volume_t *volume, int interpolation, const ivlsu_column_t *column, double depth,
+			       ivlsu_cell_t *cell);
+/** Starts loading the corner lines of a located cell. */
+extern void ivlsu_prefetch_cell(const ivlsu_volume_t *volume, const ivlsu_cell_t *cell);
+/** Interpolates Vp within a located cell. */
+extern double ivlsu_evaluate_cell(const ivlsu_volume_t *volume, const ivlsu_cell_t *cell);
+/** Differentiates the interpolated Vp within a located cell. */
+extern int ivlsu_cell_gradient(const ivlsu_volume_t *volume, int interpolation, const ivlsu_cell_t *cell, double gradient[3]);
+/** Returns the Morton key of a located cell's grid indices. */
+extern uint64_t ivlsu_cell_key(const ivlsu_volume_t *volume, const ivlsu_cell_t *cell);
+/** Sorts located points by key with a parallel LSD radix sort. */
+extern int ivlsu_radix_sort(ivlsu_sort_record_t *records, long count, int bits);
+
+// Derived Product Functions
+/** Computes the Z1.0 and Z2.5 rasters of the model. */
+extern int ivlsu_build_zdepth_rasters(ivlsu_model_t *model);
+/** Lists the nodes around a located column and their horizontal weights. */
+extern void ivlsu_column_nodes(const ivlsu_volume_t *volume, int interpolation, const ivlsu_column_t *column, long nodes[4],
+			       double weights[4]);
+/** Blends values at the nodes of a column, leaving out NA values. */
+extern double ivlsu_blend_nodes(const double values[4], const long nodes[4], const double weights[4]);
+/** Reads the Vp profile of a column at every z level. */
+extern void ivlsu_column_profile(const ivlsu_volume_t *volume, const long nodes[4], const double weights[4], double *vp);
+/** Finds the depth at which Vs first reaches a threshold down a Vp profile. */
+extern double ivlsu_column_zdepth(const double *vp, int nz, double dz, double threshold);
+/** Returns the velocity of a wave from Vp. */
+extern double ivlsu_wave_velocity(int wave, double vp);
+/** Integrates the vertical travel time of a wave down every column, velocity linear between z levels. */
+extern float *ivlsu_build_travel_time(const ivlsu_volume_t *volume, int wave);
+/** Returns the travel time across a segment of linearly varying velocity. */
+extern double ivlsu_segment_time(double start, double end, double length);
+/** Returns the vertical travel time from the surface to a depth below a located column. */
+extern double ivlsu_column_time(const ivlsu_volume_t *volume, const float *time, int wave, const long nodes[4], const double weights[4],
+				double depth);
+/** Builds the summed-volume table of a volume. */
+extern ivlsu_summed_t *ivlsu_build_summed_table(const ivlsu_volume_t *volume);
+/** Evaluates the summed-volume table at a point given in voxel units. */
+extern void ivlsu_summed_at(const ivlsu_volume_t *volume, const ivlsu_summed_t *table, double x, double y, double z, ivlsu_summed_t *sum);
+/** Builds the levels of the multiresolution pyramid. */
+extern int ivlsu_build_pyramid(ivlsu_model_t *model);
+/** Chooses the volume of a model sampled for a target spacing. */
+extern const ivlsu_volume_t *ivlsu_model_volume(const ivlsu_model_t *model, double spacing);
+/** Chooses the volume of the current model sampled for a target spacing. */
+extern const ivlsu_volume_t *ivlsu_select_volume(double spacing);
+/** Builds the brick hierarchy of the model's volume. */
+extern int ivlsu_build_bricks(ivlsu_model_t *model);
+/** Returns the Vp and Vs range and the nodes with data of a model inside a box */
+extern int ivlsu_model_region_stats(const ivlsu_model_t *model, const ivlsu_box_t *box, ivlsu_region_stats_t *stats);
+
+// Eikonal Functions
+/** Solves the first arrival travel time of a wave from a source to every node. */
+extern int ivlsu_eikonal_solve(const ivlsu_point_t *source, int wave, double spacing, float *time);
+/** Solves the first arrival travel time of a wave from a source through a given volume. */
+extern int ivlsu_eikonal_solve_volume(const ivlsu_volume_t *volume, const ivlsu_point_t *source, int wave, float *time);
+/** Writes the travel time table of a wave from each source to a directory. */
+extern int ivlsu_eikonal_tables(const ivlsu_point_t *sources, int numsources, int wave, double spacing, const char *directory);
+/** Solves the upwind eikonal update of a node from its neighbors' times. */
+extern double ivlsu_eikonal_update(double neighbors[3], double spacing[3], double slowness);
+/** Sweeps every node once in one of the eight orderings. */
+extern void ivlsu_eikonal_sweep(const ivlsu_volume_t *volume, const float *slowness, int ordering, float *time);
+
+// Ray Functions
+/** Shoots rays from their sources at their takeoff angles. */
+extern int ivlsu_shoot_rays(ivlsu_ray_t *rays, int numrays);
+/** Traces rays from their sources up to stations no deeper, returning their takeoff angles. */
+extern int ivlsu_trace_rays(ivlsu_ray_t *rays, const ivlsu_point_t *stations, int numrays);
+/** Integrates a ray from a UTM source position in a direction. */
+extern void ivlsu_ray_integrate(const ivlsu_volume_t *volume, ivlsu_ray_t *ray, const double source[3], const double direction[3]);
+
+// Octree Functions
+/** Extracts an octree mesh sized to the local shortest wavelength to a file */
+extern int ivlsu_extract_octree(const ivlsu_octree_t *octree, const char *file);
+
+// Journal Functions
+/** Computes the 64 bit FNV-1a checksum of a buffer. */
+extern uint64_t ivlsu_checksum(const void *data, size_t length);
+/** Opens the journal of a job, reading back the units it records as complete. */
+extern int ivlsu_journal_open(ivlsu_journal_t *journal, const char *path, const char *job, long numunits);
+/** Checks whether a unit is recorded as complete with the checksum of its bytes. */
+extern int ivlsu_journal_verify(const ivlsu_journal_t *journal, long unit, const void *data, size_t length);
+/** Records a unit as complete. */
+extern int ivlsu_journal_record(ivlsu_journal_t *journal, long unit, uint64_t checksum);
+/** Closes a journal, removing its file once the job is complete. */
+extern int ivlsu_journal_close(ivlsu_journal_t *journal, int complete);
+
+// Reload Functions
+/** Holds the current model until the matching ivlsu_model_release. */
+extern ivlsu_model_t *ivlsu_model_acquire(int *ticket);
+/** Lets go of the model held by ivlsu_model_acquire. */
+extern void ivlsu_model_release(int ticket);
+
+// Instance Functions
+/** Opens an instance of a model, sharing the data of instances already open on it */
+extern int ivlsu_instance_open(ivlsu_instance_t *instance, const char *dir, const char *label);
+/** Closes an instance, freeing the data once no instance holds it */
+extern int ivlsu_instance_close(ivlsu_instance_t *instance);
+/** Changes a query option of one instance */
+extern int ivlsu_instance_set_option(ivlsu_instance_t *instance, const char *key, const char *value);
+/** Queries an instance as ivlsu_query queries the model */
+extern int ivlsu_instance_query(const ivlsu_instance_t *instance, const ivlsu_point_t *points, ivlsu_properties_t *data, int numpoints);
+/** Queries an instance as ivlsu_query_batch queries the model */
+extern int ivlsu_instance_query_batch(const ivlsu_instance_t *instance, ivlsu_batch_t *batch);
+/** Queries an instance on a regular UTM grid as ivlsu_query_grid queries the model */
+extern int ivlsu_instance_query_grid(const ivlsu_instance_t *instance, const ivlsu_grid_t *grid, ivlsu_batch_t *batch);
+
+// Server Functions
+/** Serves the queries of a connected client until it closes the connection. */
+extern int ivlsu_serve_connection(int fd);
+/** Connects a client to the server listening on a UNIX socket. */
+extern int ivlsu_client_open(ivlsu_client_t *client, const char *path);
+/** Queries the server as ivlsu_query queries the model in process. */
+extern int ivlsu_client_query(ivlsu_client_t *client, ivlsu_point_t *points, ivlsu_properties_t *data, int numpoints);
+/** Closes a client's connection. */
+extern int ivlsu_client_close(ivlsu_client_t *client);
+/** Writes a buffer to a socket, retrying short writes. */
+extern int ivlsu_socket_write(int fd, const void *buffer, size_t length);
+/** Reads a buffer from a socket, retrying short reads. */
+extern int ivlsu_socket_read(int fd, void *buffer, size_t length);
+
+// Threading Functions
+/** Number of worker threads used for large batches. */
+extern int ivlsu_thread_count();
+/** Runs a function over [0, count) in ranges of grain items on the worker threads. */
+extern int ivlsu_parallel_for(long count, long grain, ivlsu_task_function_t function, void *arg);
+/** Returns the worker's projection handles, creating them on first use. */
+extern int ivlsu_worker_projection(ivlsu_worker_t *worker);
 
 // Interpolation Functions
 /** Linearly interpolates two ivlsu_properties_t structures */
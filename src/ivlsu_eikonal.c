@@ -0,0 +1,384 @@
+/**
+ * @file ivlsu_eikonal.c
+ * @brief Eikonal travel time solver of the IMPERIAL-LSU library.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Computes first arrival P and S travel times from a source to every node of the
+ * loaded model, or of one of its pyramid levels, with the fast sweeping method, and
+ * writes them out as travel time tables for earthquake location.
+ *
+ */
+
+#include "ivlsu.h"
+
+/** Arguments of the tasks sweeping the travel times. */
+typedef struct ivlsu_eikonal_t {
+	/** The volume the times are computed through */
+	const ivlsu_volume_t *volume;
+	/** Slowness at each node in seconds per meter, infinite where there is no data */
+	float *slowness;
+	/** Travel time at each node, the smallest of the sweeps after each iteration */
+	float *time;
+	/** Travel times of each sweep ordering during an iteration */
+	float *sweeps[IVLSU_EIKONAL_SWEEPS];
+} ivlsu_eikonal_t;
+
+/**
+ * Returns the smaller travel time of a node's two neighbors along one axis.
+ *
+ * @param time The travel times.
+ * @param location Index of the node.
+ * @param step Index distance between neighbors along the axis.
+ * @param index Position of the node along the axis.
+ * @param n Number of nodes along the axis.
+ * @return The smaller time, infinite if neither neighbor has been reached.
+ */
+static inline double ivlsu_eikonal_neighbor(const float *time, long location, long step, int index, int n) {
+	double before = index > 0 ? time[location - step] : INFINITY;
+	double after = index < n - 1 ? time[location + step] : INFINITY;
+
+	return before < after ? before : after;
+}
+
+/**
+ * Solves the first order upwind discretization of the eikonal equation at a node
+ * from the smaller neighbor time along each axis. Axes are added from the earliest
+ * neighbor on for as long as the solution arrives after the next neighbor's time.
+ *
+ * @param neighbors The smaller neighbor time along x, y and z, sorted in place.
+ * @param spacing The node spacing along x, y and z, sorted with the times.
+ * @param slowness Slowness at the node in seconds per meter.
+ * @return The travel time at the node, infinite if no neighbor has been reached.
+ */
+double ivlsu_eikonal_update(double neighbors[3], double spacing[3], double slowness) {
+	double a = 0, b = 0, c = 0, weight = 0, discriminant = 0, time = INFINITY, swap = 0;
+	int i = 0, j = 0;
+
+	for (i = 1; i < 3; i++) {
+		for (j = i; j > 0 && neighbors[j] < neighbors[j - 1]; j--) {
+			swap = neighbors[j], neighbors[j] = neighbors[j - 1], neighbors[j - 1] = swap;
+			swap = spacing[j], spacing[j] = spacing[j - 1], spacing[j - 1] = swap;
+		}
+	}
+
+	// Solve sum((t - neighbor) / spacing)^2 = slowness^2 over the axes used.
+	for (i = 0; i < 3 && isfinite(neighbors[i]); i++) {
+		weight = 1 / (spacing[i] * spacing[i]);
+		a += weight;
+		b += weight * neighbors[i];
+		c += weight * neighbors[i] * neighbors[i];
+		discriminant = b * b - a * (c - slowness * slowness);
+		if (discriminant < 0)
+			break;
+		time = (b + sqrt(discriminant)) / a;
+		if (i == 2 || time <= neighbors[i + 1])
+			break;
+	}
+
+	return time;
+}
+
+/**
+ * Sweeps every node of the volume once in one of the eight orderings, lowering the
+ * travel times that the upwind update improves. Bit 0, 1 and 2 of the ordering
+ * reverse the x, y and z directions.
+ *
+ * @param volume The volume the times are computed through.
+ * @param slowness Slowness at each node, infinite where there is no data.
+ * @param ordering The sweep ordering, 0 to IVLSU_EIKONAL_SWEEPS - 1.
+ * @param time The travel times, updated in place.
+ */
+void ivlsu_eikonal_sweep(const ivlsu_volume_t *volume, const float *slowness, int ordering, float *time) {
+	long plane = (long)volume->nx * volume->ny, location = 0;
+	double neighbors[3], spacing[3], update = 0;
+	int i = 0, j = 0, k = 0, x = 0, y = 0, z = 0;
+
+	for (k = 0; k < volume->nz; k++) {
+		z = ordering & 4 ? volume->nz - 1 - k : k;
+		for (j = 0; j < volume->ny; j++) {
+			y = ordering & 2 ? volume->ny - 1 - j : j;
+			for (i = 0; i < volume->nx; i++) {
+				x = ordering & 1 ? volume->nx - 1 - i : i;
+				location = z * plane + (long)y * volume->nx + x;
+				if (!isfinite(slowness[location]))
+					continue;
+
+				neighbors[0] = ivlsu_eikonal_neighbor(time, location, 1, x, volume->nx);
+				neighbors[1] = ivlsu_eikonal_neighbor(time, location, volume->nx, y, volume->ny);
+				neighbors[2] = ivlsu_eikonal_neighbor(time, location, plane, z, volume->nz);
+				spacing[0] = volume->dx;
+				spacing[1] = volume->dy;
+				spacing[2] = volume->dz;
+				update = ivlsu_eikonal_update(neighbors, spacing, slowness[location]);
+				if (update < time[location])
+					time[location] = update;
+			}
+		}
+	}
+}
+
+/**
+ * Task sweeping the orderings [begin, end), each from the current travel times.
+ */
+static void ivlsu_eikonal_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	ivlsu_eikonal_t *eikonal = arg;
+	long ordering = 0;
+
+	for (ordering = begin; ordering < end; ordering++) {
+		memcpy(eikonal->sweeps[ordering], eikonal->time, eikonal->volume->count * sizeof(float));
+		ivlsu_eikonal_sweep(eikonal->volume, eikonal->slowness, ordering, eikonal->sweeps[ordering]);
+	}
+}
+
+/**
+ * Starts the travel times at the nodes of the cell holding the source, from their
+ * straight line distance to it.
+ *
+ * @param volume The volume the times are computed through.
+ * @param slowness Slowness at each node, infinite where there is no data.
+ * @param utm_e UTM easting of the source.
+ * @param utm_n UTM northing of the source.
+ * @param depth Depth of the source in meters.
+ * @param time The travel times, infinite everywhere else.
+ * @return SUCCESS, or FAIL if the source is outside of the model or no node around it has data.
+ */
+static int ivlsu_eikonal_seed(const ivlsu_volume_t *volume, const float *slowness, double utm_e, double utm_n, double depth,
+			      float *time) {
+	double position[3] = { (utm_e - volume->origin_e) / volume->dx, (utm_n - volume->origin_n) / volume->dy, depth / volume->dz };
+	double spacing[3] = { volume->dx, volume->dy, volume->dz }, distance = 0;
+	int size[3] = { volume->nx, volume->ny, volume->nz }, base[3], node[3];
+	int axis = 0, corner = 0, seeded = 0;
+	long location = 0;
+
+	for (axis = 0; axis < 3; axis++) {
+		if (!(position[axis] >= 0 && position[axis] <= size[axis] - 1))
+			return FAIL;
+		base[axis] = (int)position[axis];
+		if (base[axis] == size[axis] - 1 && base[axis] > 0)
+			base[axis]--;
+	}
+
+	for (corner = 0; corner < 8; corner++) {
+		distance = 0;
+		for (axis = 0; axis < 3; axis++) {
+			node[axis] = base[axis] + ((corner >> axis) & 1);
+			distance += (node[axis] - position[axis]) * (node[axis] - position[axis]) * spacing[axis] * spacing[axis];
+		}
+		if (node[0] >= size[0] || node[1] >= size[1] || node[2] >= size[2])
+			continue;
+
+		location = ((long)node[2] * volume->ny + node[1]) * volume->nx + node[0];
+		if (!isfinite(slowness[location]))
+			continue;
+		time[location] = sqrt(distance) * slowness[location];
+		seeded++;
+	}
+
+	return seeded > 0 ? SUCCESS : FAIL;
+}
+
+/**
+ * Computes the first arrival travel time of a wave from a source to every node of a
+ * volume. The eight sweep orderings of the fast sweeping method run in parallel from
+ * the same times, and each node keeps the smallest of their results, until an
+ * iteration lowers no time by more than IVLSU_EIKONAL_TOLERANCE.
+ *
+ * @param volume The volume the times are computed through, which must stay valid.
+ * @param source The source location.
+ * @param wave IVLSU_VP or IVLSU_VS.
+ * @param time The returned time at each node in seconds, NA where the wave cannot
+ * reach through nodes with data. Holds as many values as the volume.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_eikonal_solve_volume(const ivlsu_volume_t *volume, const ivlsu_point_t *source, int wave, float *time) {
+	ivlsu_eikonal_t eikonal = { volume, NULL, time, { NULL } };
+	ivlsu_worker_t worker = { 0 };
+	double velocity = 0, utm_e = 0, utm_n = 0, change = 0, best = 0;
+	long location = 0;
+	int ordering = 0, iteration = 0, status = SUCCESS;
+
+	if (wave != IVLSU_VP && wave != IVLSU_VS) {
+		print_error("The wave must be P or S.");
+		return FAIL;
+	}
+
+	eikonal.slowness = malloc(volume->count * sizeof(float));
+	for (ordering = 0; ordering < IVLSU_EIKONAL_SWEEPS; ordering++)
+		eikonal.sweeps[ordering] = malloc(volume->count * sizeof(float));
+	for (ordering = 0; ordering < IVLSU_EIKONAL_SWEEPS && eikonal.slowness != NULL; ordering++)
+		if (eikonal.sweeps[ordering] == NULL)
+			break;
+
+	if (ordering < IVLSU_EIKONAL_SWEEPS) {
+		print_error("Could not allocate the eikonal solver.");
+		status = FAIL;
+	}
+
+	for (location = 0; status == SUCCESS && location < volume->count; location++) {
+		velocity = ivlsu_wave_velocity(wave, ivlsu_volume_vp(volume, location));
+		eikonal.slowness[location] = velocity > 0 ? 1 / velocity : INFINITY;
+		time[location] = INFINITY;
+	}
+
+	if (status == SUCCESS) {
+		ivlsu_project_points(&worker, &(source->longitude), &(source->latitude), 1, 1, &utm_e, &utm_n);
+		if (ivlsu_eikonal_seed(volume, eikonal.slowness, utm_e, utm_n, source->depth, time) != SUCCESS) {
+			print_error("The source is outside of the model or has no data around it.");
+			status = FAIL;
+		}
+	}
+
+	for (iteration = 0; status == SUCCESS && iteration < IVLSU_EIKONAL_ITERATIONS; iteration++) {
+		ivlsu_parallel_for(IVLSU_EIKONAL_SWEEPS, 1, ivlsu_eikonal_task, &eikonal);
+
+		change = 0;
+		for (location = 0; location < volume->count; location++) {
+			best = time[location];
+			for (ordering = 0; ordering < IVLSU_EIKONAL_SWEEPS; ordering++)
+				if (eikonal.sweeps[ordering][location] < best)
+					best = eikonal.sweeps[ordering][location];
+			if (best < time[location]) {
+				change = fmax(change, time[location] - best);
+				time[location] = best;
+			}
+		}
+
+		if (change <= IVLSU_EIKONAL_TOLERANCE)
+			break;
+	}
+
+	// Nodes the wave cannot reach are NA.
+	for (location = 0; status == SUCCESS && location < volume->count; location++)
+		if (!isfinite(time[location]))
+			time[location] = NA;
+
+	free(eikonal.slowness);
+	for (ordering = 0; ordering < IVLSU_EIKONAL_SWEEPS; ordering++)
+		free(eikonal.sweeps[ordering]);
+
+	return status;
+}
+
+/**
+ * Computes the first arrival travel time of a wave from a source to every node of
+ * the volume ivlsu_select_volume returns for the spacing, see
+ * ivlsu_eikonal_solve_volume.
+ *
+ * @param source The source location.
+ * @param wave IVLSU_VP or IVLSU_VS.
+ * @param spacing Target node spacing in meters, 0 for the full resolution.
+ * @param time The returned time at each node in seconds, NA where the wave cannot
+ * reach through nodes with data. Holds as many values as the selected volume.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_eikonal_solve(const ivlsu_point_t *source, int wave, double spacing, float *time) {
+	ivlsu_model_t *model = NULL;
+	int ticket = 0, status = FAIL;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	model = ivlsu_model_acquire(&ticket);
+	status = ivlsu_eikonal_solve_volume(ivlsu_model_volume(model, spacing), source, wave, time);
+	ivlsu_model_release(ticket);
+	return status;
+}
+
+/**
+ * Writes the description of a set of travel time tables, in the keys of the model's
+ * configuration file, followed by the wave and the sources.
+ *
+ * @param directory The directory of the tables.
+ * @param volume The volume the tables sample.
+ * @param sources The source locations.
+ * @param numsources Number of sources.
+ * @param wave IVLSU_VP or IVLSU_VS.
+ * @return SUCCESS or FAIL.
+ */
+static int ivlsu_eikonal_write_config(const char *directory, const ivlsu_volume_t *volume, const ivlsu_point_t *sources,
+				      int numsources, int wave) {
+	double max_e = volume->origin_e + (volume->nx - 1) * volume->dx;
+	double max_n = volume->origin_n + (volume->ny - 1) * volume->dy;
+	char path[512];
+	FILE *fp = NULL;
+	int i = 0;
+
+	snprintf(path, sizeof(path), "%s/config", directory);
+	if ((fp = fopen(path, "w")) == NULL)
+		return FAIL;
+
+	fprintf(fp, "# Travel time tables, one %s_NNNN.dat file per source, float32 laid out as vp.dat\n", wave == IVLSU_VS ? "s" : "p");
+	fprintf(fp, "utm_zone = 11\nmodel_dir = .\nnx = %d\nny = %d\nnz = %d\n", volume->nx, volume->ny, volume->nz);
+	fprintf(fp, "depth = %f\ndepth_interval = %f\n", volume->depth, volume->dz);
+	fprintf(fp, "bottom_left_corner_e = %f\nbottom_left_corner_n = %f\n", volume->origin_e, volume->origin_n);
+	fprintf(fp, "bottom_right_corner_e = %f\nbottom_right_corner_n = %f\n", max_e, volume->origin_n);
+	fprintf(fp, "top_left_corner_e = %f\ntop_left_corner_n = %f\n", volume->origin_e, max_n);
+	fprintf(fp, "top_right_corner_e = %f\ntop_right_corner_n = %f\n", max_e, max_n);
+	fprintf(fp, "wave = %s\nsources = %d\n", wave == IVLSU_VS ? "s" : "p", numsources);
+	for (i = 0; i < numsources; i++)
+		fprintf(fp, "source_%04d = %f,%f,%f\n", i, sources[i].longitude, sources[i].latitude, sources[i].depth);
+
+	return fclose(fp) == 0 ? SUCCESS : FAIL;
+}
+
+/**
+ * Solves the travel times of a wave from each source and writes them to a directory,
+ * one float32 table per source laid out as the model's vp.dat, named p_NNNN.dat or
+ * s_NNNN.dat after the source's index, with a config file describing the grid and
+ * the sources.
+ *
+ * @param sources The source locations.
+ * @param numsources Number of sources.
+ * @param wave IVLSU_VP or IVLSU_VS.
+ * @param spacing Target node spacing in meters, 0 for the full resolution.
+ * @param directory An existing directory the tables are written to.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_eikonal_tables(const ivlsu_point_t *sources, int numsources, int wave, double spacing, const char *directory) {
+	const ivlsu_volume_t *volume = NULL;
+	float *time = NULL;
+	char path[512];
+	FILE *fp = NULL;
+	int i = 0, status = SUCCESS, ticket = 0;
+	ivlsu_model_t *model = NULL;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	// Every table samples the same model, even if it is reloaded meanwhile.
+	model = ivlsu_model_acquire(&ticket);
+	volume = ivlsu_model_volume(model, spacing);
+	if ((time = malloc(volume->count * sizeof(float))) == NULL) {
+		print_error("Could not allocate the travel time table.");
+		status = FAIL;
+	}
+
+	if (status == SUCCESS && ivlsu_eikonal_write_config(directory, volume, sources, numsources, wave) != SUCCESS) {
+		print_error("Could not write the travel time table description.");
+		status = FAIL;
+	}
+
+	for (i = 0; status == SUCCESS && i < numsources; i++) {
+		if ((status = ivlsu_eikonal_solve_volume(volume, &(sources[i]), wave, time)) != SUCCESS)
+			break;
+
+		snprintf(path, sizeof(path), "%s/%s_%04d.dat", directory, wave == IVLSU_VS ? "s" : "p", i);
+		if ((fp = fopen(path, "wb")) == NULL || fwrite(time, sizeof(float), volume->count, fp) != (size_t)volume->count) {
+			print_error("Could not write the travel time table.");
+			status = FAIL;
+		}
+		if (fp != NULL && fclose(fp) != 0)
+			status = FAIL;
+	}
+
+	ivlsu_model_release(ticket);
+	free(time);
+	return status;
+}
@@ -0,0 +1,164 @@
+/**
+ * @file ivlsu_journal.c
+ * @brief Work journals of the IMPERIAL-LSU library.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Keeps a small text journal next to the output of a long extraction, recording
+ * each fixed work unit of the output as it completes with a checksum of its bytes.
+ * An extraction restarted after a failure reads the journal back and skips the
+ * units whose bytes in the output still match their checksums, so it only redoes
+ * the work that was lost. Neither the output nor the journal is synced: a unit whose
+ * bytes did not reach the disk fails its checksum and is redone, and a unit whose
+ * record did not is simply redone.
+ *
+ */
+
+#include "ivlsu.h"
+
+/**
+ * Computes the 64 bit FNV-1a checksum of a buffer.
+ *
+ * @param data The bytes.
+ * @param length Number of bytes.
+ * @return The checksum.
+ */
+uint64_t ivlsu_checksum(const void *data, size_t length) {
+	const unsigned char *byte = data;
+	uint64_t checksum = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		checksum ^= byte[i];
+		checksum *= 1099511628211ULL;
+	}
+	return checksum;
+}
+
+/**
+ * Opens the journal of a job, reading back the units it records as complete if it
+ * was written by the same job. A journal of another job, or a missing one, is
+ * started over. A record cut short by a failure is dropped.
+ *
+ * @param journal The journal to open.
+ * @param path The journal file, NULL for a journal kept in memory only.
+ * @param job One line describing the job, which must match for units to be skipped.
+ * @param numunits Number of work units of the job.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_journal_open(ivlsu_journal_t *journal, const char *path, const char *job, long numunits) {
+	char line[IVLSU_JOURNAL_LINE], header[IVLSU_JOURNAL_LINE];
+	unsigned long long checksum;
+	long unit, end = 0;
+	int matches = 0;
+	FILE *fp;
+
+	memset(journal, 0, sizeof(ivlsu_journal_t));
+	pthread_mutex_init(&(journal->lock), NULL);
+	journal->numunits = numunits;
+	journal->done = calloc(numunits > 0 ? numunits : 1, sizeof(unsigned char));
+	journal->checksums = calloc(numunits > 0 ? numunits : 1, sizeof(uint64_t));
+	if (journal->done == NULL || journal->checksums == NULL || strlen(job) + 2 > IVLSU_JOURNAL_LINE) {
+		print_error("The journal could not be allocated.");
+		ivlsu_journal_close(journal, 0);
+		return FAIL;
+	}
+	if (path == NULL)
+		return SUCCESS;
+
+	snprintf(header, sizeof(header), "%s\n", job);
+	if ((fp = fopen(path, "r")) != NULL) {
+		matches = fgets(line, sizeof(line), fp) != NULL && strcmp(line, IVLSU_JOURNAL_MAGIC "\n") == 0 &&
+			  fgets(line, sizeof(line), fp) != NULL && strcmp(line, header) == 0;
+		end = ftell(fp);
+		while (matches && fgets(line, sizeof(line), fp) != NULL) {
+			if (line[strlen(line) - 1] != '\n' || sscanf(line, "%ld %llx", &unit, &checksum) != 2 || unit < 0 || unit >= numunits)
+				break;
+			journal->recorded += !journal->done[unit];
+			journal->done[unit] = 1;
+			journal->checksums[unit] = checksum;
+			end = ftell(fp);
+		}
+		fclose(fp);
+	}
+
+	// Append after the last whole record, or start over.
+	if (matches && truncate(path, end) == 0) {
+		journal->fp = fopen(path, "a");
+	} else {
+		memset(journal->done, 0, numunits * sizeof(unsigned char));
+		journal->recorded = 0;
+		if ((journal->fp = fopen(path, "w")) != NULL && (fprintf(journal->fp, IVLSU_JOURNAL_MAGIC "\n%s", header) < 0 || fflush(journal->fp) != 0)) {
+			fclose(journal->fp);
+			journal->fp = NULL;
+		}
+	}
+	if (journal->fp == NULL) {
+		print_error("The journal could not be written.");
+		ivlsu_journal_close(journal, 0);
+		return FAIL;
+	}
+	journal->path = strdup(path);
+	return SUCCESS;
+}
+
+/**
+ * Checks whether the journal records a unit as complete with the checksum of its
+ * bytes as they are now in the output.
+ *
+ * @param journal The journal.
+ * @param unit The unit.
+ * @param data The unit's bytes read back from the output.
+ * @param length Number of bytes.
+ * @return 1 if the unit can be skipped, 0 if it must be redone.
+ */
+int ivlsu_journal_verify(const ivlsu_journal_t *journal, long unit, const void *data, size_t length) {
+	return unit >= 0 && unit < journal->numunits && journal->done[unit] && journal->checksums[unit] == ivlsu_checksum(data, length);
+}
+
+/**
+ * Records a unit as complete. Safe to call from several threads.
+ *
+ * @param journal The journal.
+ * @param unit The unit.
+ * @param checksum Checksum of the unit's bytes as written to the output.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_journal_record(ivlsu_journal_t *journal, long unit, uint64_t checksum) {
+	int status = SUCCESS;
+
+	if (unit < 0 || unit >= journal->numunits)
+		return FAIL;
+
+	pthread_mutex_lock(&(journal->lock));
+	journal->done[unit] = 1;
+	journal->checksums[unit] = checksum;
+	if (journal->fp != NULL && (fprintf(journal->fp, "%ld %016llx\n", unit, (unsigned long long)checksum) < 0 || fflush(journal->fp) != 0))
+		status = FAIL;
+	pthread_mutex_unlock(&(journal->lock));
+	return status;
+}
+
+/**
+ * Closes a journal, removing its file once the job is complete.
+ *
+ * @param journal The journal.
+ * @param complete Non-zero if every unit was written, so the journal is no longer needed.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_journal_close(ivlsu_journal_t *journal, int complete) {
+	int status = SUCCESS;
+
+	if (journal->fp != NULL && fclose(journal->fp) != 0)
+		status = FAIL;
+	if (journal->path != NULL && complete && status == SUCCESS && remove(journal->path) != 0)
+		status = FAIL;
+	pthread_mutex_destroy(&(journal->lock));
+	free(journal->path);
+	free(journal->done);
+	free(journal->checksums);
+	memset(journal, 0, sizeof(ivlsu_journal_t));
+	return status;
+}
@@ -0,0 +1,341 @@
+/**
+ * @file ivlsu_octree.c
+ * @brief Octree mesh extraction of the IMPERIAL-LSU library.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Extracts an octree mesh of the loaded model whose leaf edges follow the local
+ * shortest wavelength, Vs / (frequency * points per wavelength), for wave
+ * propagation runs. Cubes are refined from the Vs range of the brick hierarchy, the
+ * model is only queried at the centers of the leaves, and the leaves are streamed to
+ * a binary file.
+ *
+ */
+
+#include "ivlsu.h"
+
+/** Arguments of the tasks walking the root cubes of an octree. */
+typedef struct ivlsu_octree_build_t {
+	/** The mesh parameters */
+	const ivlsu_octree_t *octree;
+	/** The model refined on */
+	const ivlsu_model_t *model;
+	/** The volume the leaves are queried in */
+	const ivlsu_volume_t *volume;
+	/** The file the leaves are written to, NULL while counting them */
+	const char *file;
+	/** Edge of a level 0 leaf in meters */
+	double size;
+	/** Extent of the model along easting, northing and depth from its corner, in meters */
+	double extent[3];
+	/** Number of levels */
+	int levels;
+	/** Number of root cubes along easting, northing and depth */
+	int roots[3];
+	/** Non-zero if interpolation is on */
+	int interpolation;
+	/** Number of leaves of each root cube, then the index of its first leaf in the file */
+	long *leaves;
+	/** Set to FAIL by a task that could not write its leaves */
+	int status;
+} ivlsu_octree_build_t;
+
+/** The leaves of a root cube on their way to the file. */
+typedef struct ivlsu_octree_writer_t {
+	/** The open file, NULL while counting */
+	FILE *fp;
+	/** Leaves not yet written */
+	ivlsu_octree_leaf_t leaves[IVLSU_OCTREE_CHUNK];
+	/** Number of leaves not yet written */
+	int numleaves;
+	/** Number of leaves of the root cube so far */
+	long count;
+	/** SUCCESS, or FAIL once a write failed */
+	int status;
+} ivlsu_octree_writer_t;
+
+/**
+ * Writes the buffered leaves out.
+ *
+ * @param writer The writer.
+ */
+static void ivlsu_octree_flush(ivlsu_octree_writer_t *writer) {
+	if (writer->numleaves > 0 && fwrite(writer->leaves, sizeof(ivlsu_octree_leaf_t), writer->numleaves, writer->fp) != (size_t)writer->numleaves)
+		writer->status = FAIL;
+	writer->numleaves = 0;
+}
+
+/**
+ * Adds a leaf, querying the model at its center unless the leaves are only counted.
+ *
+ * @param build The octree being built.
+ * @param writer The writer of the leaf's root cube.
+ * @param index Easting, northing and depth index of the leaf's corner, in level 0 leaf edges.
+ * @param level Level of the leaf.
+ * @param center UTM easting, northing and depth of the leaf's center.
+ */
+static void ivlsu_octree_leaf(const ivlsu_octree_build_t *build, ivlsu_octree_writer_t *writer, const long index[3], int level,
+			      const double center[3]) {
+	ivlsu_octree_leaf_t *leaf = NULL;
+	ivlsu_cell_t cell;
+	double vp = 0;
+
+	writer->count++;
+	if (writer->fp == NULL)
+		return;
+
+	ivlsu_locate_point(build->volume, build->interpolation, center[0], center[1], center[2], &cell);
+	vp = ivlsu_evaluate_cell(build->volume, &cell);
+
+	leaf = &(writer->leaves[writer->numleaves++]);
+	leaf->index[0] = (uint32_t)index[0];
+	leaf->index[1] = (uint32_t)index[1];
+	leaf->index[2] = (uint32_t)index[2];
+	leaf->level = (uint32_t)level;
+	leaf->vp = vp < 0 ? NA : vp;
+	leaf->vs = vp < 0 ? NA : ivlsu_calculate_vs(vp);
+	leaf->rho = vp < 0 ? NA : ivlsu_calculate_density(vp);
+
+	if (writer->numleaves == IVLSU_OCTREE_CHUNK)
+		ivlsu_octree_flush(writer);
+}
+
+/**
+ * Walks a cube of the octree depth first, refining it while its edge is longer than
+ * the shortest wavelength over the nodes within one node spacing of it divided by
+ * the points per wavelength. Cubes crossing the side of the model are refined down
+ * to level 0, whose leaves are kept when their center is inside the model. Cubes
+ * without data are not refined.
+ *
+ * @param build The octree being built.
+ * @param writer The writer of the cube's root cube.
+ * @param index Easting, northing and depth index of the cube's corner, in level 0 leaf edges.
+ * @param level Level of the cube.
+ */
+static void ivlsu_octree_walk(const ivlsu_octree_build_t *build, ivlsu_octree_writer_t *writer, const long index[3], int level) {
+	const ivlsu_volume_t *volume = build->volume;
+	double edge = build->size * (double)(1L << level), corner[3], center[3];
+	double spacing[3] = { volume->dx, volume->dy, volume->dz };
+	double offset[3] = { volume->origin_e, volume->origin_n, 0 };
+	long child[3];
+	int axis = 0, crossing = 0, refine = 0, i = 0;
+	ivlsu_region_stats_t stats;
+	ivlsu_box_t box;
+
+	for (axis = 0; axis < 3; axis++) {
+		corner[axis] = index[axis] * build->size;
+		if (corner[axis] >= build->extent[axis] && corner[axis] > 0)
+			return;
+		if (corner[axis] + edge > build->extent[axis])
+			crossing = 1;
+		center[axis] = offset[axis] + corner[axis] + edge / 2;
+	}
+
+	if (level > 0 && crossing) {
+		refine = 1;
+	} else if (level > 0) {
+		box.min_e = offset[0] + corner[0] - spacing[0];
+		box.max_e = offset[0] + corner[0] + edge + spacing[0];
+		box.min_n = offset[1] + corner[1] - spacing[1];
+		box.max_n = offset[1] + corner[1] + edge + spacing[1];
+		box.min_depth = corner[2] - spacing[2];
+		box.max_depth = corner[2] + edge + spacing[2];
+		refine = ivlsu_model_region_stats(build->model, &box, &stats) == SUCCESS && stats.valid > 0 &&
+			 edge * build->octree->frequency * build->octree->points_per_wavelength > stats.min_vs;
+	}
+
+	if (refine) {
+		for (i = 0; i < 8; i++) {
+			child[0] = index[0] + (i & 1) * (1L << (level - 1));
+			child[1] = index[1] + ((i >> 1) & 1) * (1L << (level - 1));
+			child[2] = index[2] + (i >> 2) * (1L << (level - 1));
+			ivlsu_octree_walk(build, writer, child, level - 1);
+		}
+		return;
+	}
+
+	for (axis = 0; axis < 3; axis++)
+		if (center[axis] - offset[axis] > build->extent[axis])
+			return;
+	ivlsu_octree_leaf(build, writer, index, level, center);
+}
+
+/**
+ * Task walking the root cubes [begin, end). While counting, it stores the number of
+ * leaves of each root cube; otherwise it writes each root cube's leaves from the
+ * position of its first leaf in the file, through a buffer of IVLSU_OCTREE_CHUNK
+ * leaves.
+ */
+static void ivlsu_octree_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	ivlsu_octree_build_t *build = arg;
+	ivlsu_octree_writer_t *writer = NULL;
+	long root = 0, index[3];
+
+	(void)worker;
+	if ((writer = malloc(sizeof(ivlsu_octree_writer_t))) == NULL) {
+		build->status = FAIL;
+		return;
+	}
+	writer->fp = NULL;
+	writer->numleaves = 0;
+	writer->status = SUCCESS;
+	if (build->file != NULL && (writer->fp = fopen(build->file, "r+b")) == NULL)
+		writer->status = FAIL;
+
+	for (root = begin; root < end && writer->status == SUCCESS; root++) {
+		index[0] = (root % build->roots[0]) << (build->levels - 1);
+		index[1] = (root / build->roots[0] % build->roots[1]) << (build->levels - 1);
+		index[2] = (root / build->roots[0] / build->roots[1]) << (build->levels - 1);
+
+		if (writer->fp != NULL && fseek(writer->fp, sizeof(ivlsu_octree_header_t) + build->leaves[root] * sizeof(ivlsu_octree_leaf_t),
+						SEEK_SET) != 0) {
+			writer->status = FAIL;
+			break;
+		}
+
+		writer->count = 0;
+		ivlsu_octree_walk(build, writer, index, build->levels - 1);
+		if (writer->fp == NULL)
+			build->leaves[root] = writer->count;
+		else
+			ivlsu_octree_flush(writer);
+	}
+
+	if (writer->fp != NULL && fclose(writer->fp) != 0)
+		writer->status = FAIL;
+	if (writer->status != SUCCESS)
+		build->status = FAIL;
+	free(writer);
+}
+
+/**
+ * Extracts an octree mesh of a model to a file, as ivlsu_extract_octree.
+ *
+ * @param model The model.
+ * @param octree The mesh parameters.
+ * @param file The file the mesh is written to.
+ * @return SUCCESS or FAIL.
+ */
+static int ivlsu_octree_extract(const ivlsu_model_t *model, const ivlsu_octree_t *octree, const char *file) {
+	const ivlsu_volume_t *volume = NULL;
+	ivlsu_octree_build_t build;
+	ivlsu_octree_header_t header;
+	double max_size = 0;
+	long numroots = 0, root = 0, total = 0, count = 0;
+	int axis = 0;
+	FILE *fp = NULL;
+
+	if (model->brick_levels == 0) {
+		print_error("The brick hierarchy could not be allocated at init.");
+		return FAIL;
+	}
+	if (!(octree->frequency > 0) || !(octree->points_per_wavelength > 0) || octree->min_size < 0 || octree->max_size < 0) {
+		print_error("The octree needs a positive frequency and points per wavelength.");
+		return FAIL;
+	}
+
+	volume = &(model->volume);
+	memset(&build, 0, sizeof(build));
+	build.octree = octree;
+	build.model = model;
+	build.volume = volume;
+	build.interpolation = ivlsu_configuration->interpolation;
+	build.extent[0] = (volume->nx - 1) * volume->dx;
+	build.extent[1] = (volume->ny - 1) * volume->dy;
+	build.extent[2] = (volume->nz - 1) * volume->dz;
+	build.status = SUCCESS;
+
+	build.size = octree->min_size;
+	if (build.size == 0)
+		build.size = fmin(volume->dx, fmin(volume->dy, volume->dz));
+	max_size = octree->max_size > 0 ? octree->max_size : build.extent[2];
+	for (build.levels = 1; build.levels < IVLSU_OCTREE_LEVELS && build.size * (double)(1L << build.levels) <= max_size; build.levels++)
+		;
+
+	numroots = 1;
+	for (axis = 0; axis < 3; axis++) {
+		build.roots[axis] = (int)ceil(build.extent[axis] / (build.size * (double)(1L << (build.levels - 1))));
+		build.roots[axis] = build.roots[axis] < 1 ? 1 : build.roots[axis];
+		if (((long)build.roots[axis] << (build.levels - 1)) > UINT32_MAX) {
+			print_error("The octree has too many leaves along an axis.");
+			return FAIL;
+		}
+		numroots *= build.roots[axis];
+	}
+
+	if ((build.leaves = malloc(numroots * sizeof(long))) == NULL) {
+		print_error("Could not allocate the octree's root cubes.");
+		return FAIL;
+	}
+
+	// Count the leaves of each root cube and turn the counts into file positions.
+	ivlsu_parallel_for(numroots, 1, ivlsu_octree_task, &build);
+	for (root = 0; build.status == SUCCESS && root < numroots; root++) {
+		count = build.leaves[root];
+		build.leaves[root] = total;
+		total += count;
+	}
+
+	memcpy(header.magic, IVLSU_OCTREE_MAGIC, sizeof(header.magic));
+	header.origin_e = volume->origin_e;
+	header.origin_n = volume->origin_n;
+	header.size = build.size;
+	header.frequency = octree->frequency;
+	header.points_per_wavelength = octree->points_per_wavelength;
+	for (axis = 0; axis < 3; axis++)
+		header.roots[axis] = build.roots[axis];
+	header.levels = build.levels;
+	header.leaves = total;
+
+	if (build.status == SUCCESS &&
+	    ((fp = fopen(file, "wb")) == NULL || fwrite(&header, sizeof(header), 1, fp) != 1)) {
+		print_error("Could not write the octree header.");
+		build.status = FAIL;
+	}
+	if (fp != NULL && fclose(fp) != 0)
+		build.status = FAIL;
+
+	if (build.status == SUCCESS) {
+		build.file = file;
+		ivlsu_parallel_for(numroots, 1, ivlsu_octree_task, &build);
+		if (build.status != SUCCESS)
+			print_error("Could not write the octree leaves.");
+	}
+
+	free(build.leaves);
+	return build.status;
+}
+
+/**
+ * Extracts an octree mesh of the model to a file. The mesh covers the model with a
+ * grid of root cubes of edge max_size, each refined into eight while its edge is
+ * longer than the shortest wavelength, Vs / frequency, divided by the points per
+ * wavelength, down to leaves of edge min_size. Refinement reads the Vs range of the
+ * brick hierarchy and the model is queried only at the centers of the leaves.
+ *
+ * The leaves are counted first, so that the second pass can write each root cube's
+ * leaves to their place in the file, and the root cubes are walked in parallel with
+ * a buffer of IVLSU_OCTREE_CHUNK leaves per worker. The file holds an
+ * ivlsu_octree_header_t followed by the ivlsu_octree_leaf_t of each root cube in
+ * turn, easting varying fastest, in depth first order within a root cube.
+ *
+ * @param octree The mesh parameters.
+ * @param file The file the mesh is written to.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_extract_octree(const ivlsu_octree_t *octree, const char *file) {
+	ivlsu_model_t *model = NULL;
+	int ticket = 0, status;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	model = ivlsu_model_acquire(&ticket);
+	status = ivlsu_octree_extract(model, octree, file);
+	ivlsu_model_release(ticket);
+	return status;
+}
@@ -0,0 +1,616 @@
+/**
+ * @file ivlsu_ray.c
+ * @brief Ray tracing through the IMPERIAL-LSU model.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Integrates the kinematic ray equations through the model with adaptive Cash-Karp
+ * Runge-Kutta steps, for rays shot at given takeoff angles and for two point rays
+ * from a source to a station.
+ *
+ */
+
+#include "ivlsu.h"
+
+/** Number of values in the state of a ray: position, slowness vector and time. */
+#define IVLSU_RAY_STATE 7
+
+/** Cash-Karp nodes, coupling coefficients, fifth order weights and error weights. */
+static const double ivlsu_ray_b[6][5] = { { 0, 0, 0, 0, 0 },
+					  { 1.0 / 5, 0, 0, 0, 0 },
+					  { 3.0 / 40, 9.0 / 40, 0, 0, 0 },
+					  { 3.0 / 10, -9.0 / 10, 6.0 / 5, 0, 0 },
+					  { -11.0 / 54, 5.0 / 2, -70.0 / 27, 35.0 / 27, 0 },
+					  { 1631.0 / 55296, 175.0 / 512, 575.0 / 13824, 44275.0 / 110592, 253.0 / 4096 } };
+static const double ivlsu_ray_c[6] = { 37.0 / 378, 0, 250.0 / 621, 125.0 / 594, 0, 512.0 / 1771 };
+static const double ivlsu_ray_e[6] = { 37.0 / 378 - 2825.0 / 27648, 0, 250.0 / 621 - 18575.0 / 48384,
+				       125.0 / 594 - 13525.0 / 55296, -277.0 / 14336, 512.0 / 1771 - 1.0 / 4 };
+
+/** The cell a ray is in, with the Vp at its eight nodes. */
+typedef struct ivlsu_ray_cell_t {
+	/** Indices of the cell's first node along x, y and z, -1 before the ray is located */
+	int index[3];
+	/** Vp at the nodes, x varying fastest, then y, then z */
+	double vp[8];
+	/** Non-zero if a node of the cell has data */
+	int valid;
+} ivlsu_ray_cell_t;
+
+/** A ray being integrated. */
+typedef struct ivlsu_ray_walk_t {
+	/** The volume the ray travels through */
+	const ivlsu_volume_t *volume;
+	/** IVLSU_VP or IVLSU_VS */
+	int wave;
+	/** The cell of the last evaluation */
+	ivlsu_ray_cell_t cell;
+} ivlsu_ray_walk_t;
+
+/** Arguments of the tasks tracing rays. */
+typedef struct ivlsu_ray_batch_t {
+	/** The rays */
+	ivlsu_ray_t *rays;
+	/** Station of each ray, or NULL when the rays are shot at their takeoff angles */
+	const ivlsu_point_t *stations;
+	/** The volume the rays travel through */
+	const ivlsu_volume_t *volume;
+} ivlsu_ray_batch_t;
+
+/**
+ * Returns the velocity of the wave and its gradient at a UTM position. Within the
+ * volume the Vp of the enclosing cell's nodes is blended trilinearly, leaving out
+ * nodes without data as ivlsu_blend_nodes does; outside of it the position is moved
+ * onto the nearest face. The nodes are only read again when the position is in a
+ * different cell than the last one.
+ *
+ * @param walk The ray, holding the last cell.
+ * @param position UTM easting, northing and depth.
+ * @param velocity The returned velocity.
+ * @param gradient The returned gradient of the velocity along easting, northing and depth.
+ * @return SUCCESS, or FAIL if no node of the cell has data.
+ */
+static int ivlsu_ray_velocity(ivlsu_ray_walk_t *walk, const double position[3], double *velocity, double gradient[3]) {
+	const ivlsu_volume_t *volume = walk->volume;
+	ivlsu_ray_cell_t *cell = &(walk->cell);
+	double origin[3] = { volume->origin_e, volume->origin_n, 0 }, spacing[3] = { volume->dx, volume->dy, volume->dz };
+	double weight[3], corner_gradient[3], sum_gradient[3], weight_gradient[3];
+	double coordinate = 0, vp = 0, sum = 0, total = 0, slope = 1, wx = 0, wy = 0, wz = 0;
+	int size[3] = { volume->nx, volume->ny, volume->nz }, index[3], axis = 0, corner = 0, moved = 0;
+
+	for (axis = 0; axis < 3; axis++) {
+		coordinate = (position[axis] - origin[axis]) / spacing[axis];
+		coordinate = coordinate < 0 ? 0 : coordinate > size[axis] - 1 ? size[axis] - 1 : coordinate;
+		index[axis] = (int)coordinate;
+		if (index[axis] > size[axis] - 2)
+			index[axis] = size[axis] > 1 ? size[axis] - 2 : 0;
+		weight[axis] = coordinate - index[axis];
+		moved |= index[axis] != cell->index[axis];
+	}
+
+	if (moved) {
+		cell->valid = 0;
+		for (corner = 0; corner < 8; corner++) {
+			cell->vp[corner] = ivlsu_volume_vp(volume, ((long)(index[2] + ((corner >> 2) & 1)) * volume->ny +
+								    index[1] + ((corner >> 1) & 1)) * volume->nx + index[0] + (corner & 1));
+			cell->valid |= cell->vp[corner] >= 0;
+		}
+		memcpy(cell->index, index, sizeof(index));
+	}
+	if (!cell->valid)
+		return FAIL;
+
+	// Blend the nodes with data and divide by their weight, differentiating both sums.
+	for (axis = 0; axis < 3; axis++)
+		sum_gradient[axis] = weight_gradient[axis] = 0;
+	for (corner = 0; corner < 8; corner++) {
+		if (cell->vp[corner] < 0)
+			continue;
+		wx = corner & 1 ? weight[0] : 1 - weight[0];
+		wy = corner & 2 ? weight[1] : 1 - weight[1];
+		wz = corner & 4 ? weight[2] : 1 - weight[2];
+		sum += wx * wy * wz * cell->vp[corner];
+		total += wx * wy * wz;
+		corner_gradient[0] = (corner & 1 ? 1 : -1) * wy * wz;
+		corner_gradient[1] = (corner & 2 ? 1 : -1) * wx * wz;
+		corner_gradient[2] = (corner & 4 ? 1 : -1) * wx * wy;
+		for (axis = 0; axis < 3; axis++) {
+			sum_gradient[axis] += corner_gradient[axis] * cell->vp[corner];
+			weight_gradient[axis] += corner_gradient[axis];
+		}
+	}
+	if (total <= 0)
+		return FAIL;
+	vp = sum / total;
+	for (axis = 0; axis < 3; axis++)
+		gradient[axis] = (sum_gradient[axis] - vp * weight_gradient[axis]) / total;
+
+	if ((*velocity = ivlsu_wave_velocity(walk->wave, vp)) <= 0)
+		return FAIL;
+	if (walk->wave == IVLSU_VS)
+		slope = ivlsu_calculate_vs_slope(vp);
+	for (axis = 0; axis < 3; axis++)
+		gradient[axis] *= slope / spacing[axis];
+
+	return SUCCESS;
+}
+
+/**
+ * Evaluates the kinematic ray equations with the path length as the variable: the
+ * position moves along velocity times slowness, the slowness vector changes with the
+ * gradient of the slowness and the time grows with the slowness.
+ *
+ * @param walk The ray.
+ * @param state Position, slowness vector and time.
+ * @param rate The returned derivatives of the state.
+ * @return SUCCESS, or FAIL if the position has no data.
+ */
+static int ivlsu_ray_rate(ivlsu_ray_walk_t *walk, const double state[IVLSU_RAY_STATE], double rate[IVLSU_RAY_STATE]) {
+	double velocity = 0, gradient[3];
+	int axis = 0;
+
+	if (ivlsu_ray_velocity(walk, state, &velocity, gradient) != SUCCESS)
+		return FAIL;
+
+	for (axis = 0; axis < 3; axis++) {
+		rate[axis] = velocity * state[3 + axis];
+		rate[3 + axis] = -gradient[axis] / (velocity * velocity);
+	}
+	rate[6] = 1 / velocity;
+	return SUCCESS;
+}
+
+/**
+ * Takes one Cash-Karp step along the ray.
+ *
+ * @param walk The ray.
+ * @param state The state at the start of the step.
+ * @param step The path length of the step in meters.
+ * @param next The returned state at the end of the step, with its slowness vector
+ * rescaled to the slowness there.
+ * @param error The returned position error of the step, in units of IVLSU_RAY_ACCURACY.
+ * @return SUCCESS, or FAIL if the step reaches a cell without data.
+ */
+static int ivlsu_ray_step(ivlsu_ray_walk_t *walk, const double state[IVLSU_RAY_STATE], double step, double next[IVLSU_RAY_STATE],
+			  double *error) {
+	double rates[6][IVLSU_RAY_STATE], stage[IVLSU_RAY_STATE], velocity = 0, gradient[3], norm = 0, difference = 0;
+	int i = 0, j = 0, k = 0;
+
+	for (i = 0; i < 6; i++) {
+		for (k = 0; k < IVLSU_RAY_STATE; k++) {
+			stage[k] = state[k];
+			for (j = 0; j < i; j++)
+				stage[k] += step * ivlsu_ray_b[i][j] * rates[j][k];
+		}
+		if (ivlsu_ray_rate(walk, stage, rates[i]) != SUCCESS)
+			return FAIL;
+	}
+
+	*error = 0;
+	for (k = 0; k < IVLSU_RAY_STATE; k++) {
+		difference = 0;
+		next[k] = state[k];
+		for (i = 0; i < 6; i++) {
+			next[k] += step * ivlsu_ray_c[i] * rates[i][k];
+			difference += step * ivlsu_ray_e[i] * rates[i][k];
+		}
+		if (k < 3)
+			*error = fmax(*error, fabs(difference) / IVLSU_RAY_ACCURACY);
+	}
+
+	// Keep the slowness vector as long as the slowness, which the steps drift from.
+	if (ivlsu_ray_velocity(walk, next, &velocity, gradient) != SUCCESS)
+		return FAIL;
+	norm = sqrt(next[3] * next[3] + next[4] * next[4] + next[5] * next[5]) * velocity;
+	for (k = 3; k < 6; k++)
+		next[k] /= norm;
+
+	return SUCCESS;
+}
+
+/**
+ * Appends a point to the path of a ray.
+ *
+ * @param ray The ray.
+ * @param state The state at the point.
+ * @return SUCCESS, or FAIL if the path is full.
+ */
+static int ivlsu_ray_record(ivlsu_ray_t *ray, const double state[IVLSU_RAY_STATE]) {
+	if (ray->path == NULL)
+		return SUCCESS;
+	if (ray->numpoints >= ray->max_points)
+		return FAIL;
+
+	memcpy(ray->path + 3 * ray->numpoints, state, 3 * sizeof(double));
+	ray->numpoints++;
+	return SUCCESS;
+}
+
+/**
+ * Integrates a ray from a UTM source position in a direction until it crosses an
+ * end depth going up, leaves the model, reaches a cell without data or fills its
+ * path. A step crossing the end depth is shortened by the secant method to end on it.
+ *
+ * @param volume The volume the ray travels through.
+ * @param ray The ray. Its wave and path are read; its path, time, length and status
+ * are returned.
+ * @param source UTM easting, northing and depth of the source.
+ * @param direction Unit vector along easting, northing and depth of the takeoff.
+ * @param end_depth The depth the ray stops at going up; negative to trace it out of the model.
+ */
+static void ivlsu_ray_integrate_to(const ivlsu_volume_t *volume, ivlsu_ray_t *ray, const double source[3], const double direction[3],
+				   double end_depth) {
+	ivlsu_ray_walk_t walk = { volume, ray->wave, { { -1, -1, -1 }, { 0 }, 0 } };
+	double state[IVLSU_RAY_STATE], next[IVLSU_RAY_STATE], low[IVLSU_RAY_STATE], high[IVLSU_RAY_STATE];
+	double extent[3] = { volume->origin_e + (volume->nx - 1) * volume->dx, volume->origin_n + (volume->ny - 1) * volume->dy,
+			     (volume->nz - 1) * volume->dz };
+	double velocity = 0, gradient[3], error = 0, smallest = fmin(volume->dx, fmin(volume->dy, volume->dz));
+	double largest = IVLSU_RAY_MAX_STEP * smallest, step = 0.1 * largest, shorter = 0, low_step = 0, high_step = 0;
+	long steps = 0;
+	int k = 0, i = 0;
+
+	ray->numpoints = 0;
+	ray->time = 0;
+	ray->length = 0;
+	ray->status = IVLSU_RAY_NO_DATA;
+	memcpy(ray->end, source, sizeof(ray->end));
+	if (ivlsu_ray_velocity(&walk, source, &velocity, gradient) != SUCCESS)
+		return;
+
+	for (k = 0; k < 3; k++) {
+		state[k] = source[k];
+		state[3 + k] = direction[k] / velocity;
+	}
+	state[6] = 0;
+	ivlsu_ray_record(ray, state);
+
+	for (steps = 0; steps < IVLSU_RAY_MAX_STEPS; steps++) {
+		if (ivlsu_ray_step(&walk, state, step, next, &error) != SUCCESS || error > 1) {
+			// Retry shorter; a ray that cannot step on has reached a cell without data.
+			step *= error > 1 ? fmax(0.1, 0.9 * pow(error, -0.25)) : 0.25;
+			if (step < 1e-9 * smallest) {
+				ray->status = IVLSU_RAY_NO_DATA;
+				return;
+			}
+			continue;
+		}
+
+		if (end_depth >= 0 && state[2] > end_depth && next[2] <= end_depth) {
+			// Shorten the step to end on the end depth, by false position.
+			memcpy(low, state, sizeof(low));
+			memcpy(high, next, sizeof(high));
+			low_step = 0;
+			high_step = shorter = step;
+			for (i = 0; i < 32 && fabs(next[2] - end_depth) > 1e-6; i++) {
+				shorter = low_step + (high_step - low_step) * (low[2] - end_depth) / (low[2] - high[2]);
+				if (ivlsu_ray_step(&walk, state, shorter, next, &error) != SUCCESS)
+					break;
+				if (next[2] > end_depth) {
+					memcpy(low, next, sizeof(low));
+					low_step = shorter;
+				} else {
+					memcpy(high, next, sizeof(high));
+					high_step = shorter;
+				}
+			}
+			// The crossing is within a micrometre; end on the depth itself.
+			next[2] = end_depth;
+			ray->length += shorter;
+			ray->time = next[6];
+			memcpy(ray->end, next, sizeof(ray->end));
+			ray->status = ivlsu_ray_record(ray, next) == SUCCESS ? IVLSU_RAY_ARRIVED : IVLSU_RAY_PATH_FULL;
+			return;
+		}
+
+		memcpy(state, next, sizeof(state));
+		ray->length += step;
+		ray->time = state[6];
+		memcpy(ray->end, state, sizeof(ray->end));
+		if (ivlsu_ray_record(ray, state) != SUCCESS) {
+			ray->status = IVLSU_RAY_PATH_FULL;
+			return;
+		}
+		if (state[0] < volume->origin_e || state[0] > extent[0] || state[1] < volume->origin_n || state[1] > extent[1] ||
+		    state[2] < 0 || state[2] > extent[2]) {
+			ray->status = IVLSU_RAY_LEFT_MODEL;
+			return;
+		}
+
+		step = fmin(largest, step * (error > 0 ? fmin(5, 0.9 * pow(error, -0.2)) : 5));
+	}
+
+	ray->status = IVLSU_RAY_STALLED;
+}
+
+/**
+ * Integrates a ray from a UTM source position in a direction until it crosses its
+ * end depth going up, or stops on its own, see ivlsu_ray_integrate_to.
+ *
+ * @param volume The volume the ray travels through.
+ * @param ray The ray. Its wave, end depth and path are read; its path, time, length
+ * and status are returned.
+ * @param source UTM easting, northing and depth of the source.
+ * @param direction Unit vector along easting, northing and depth of the takeoff.
+ */
+void ivlsu_ray_integrate(const ivlsu_volume_t *volume, ivlsu_ray_t *ray, const double source[3], const double direction[3]) {
+	ivlsu_ray_integrate_to(volume, ray, source, direction, ray->end_depth);
+}
+
+/**
+ * Returns the UTM direction of a takeoff given by its geographic azimuth and its
+ * angle from the downward vertical.
+ *
+ * @param longitude Longitude of the source, for the meridian convergence.
+ * @param latitude Latitude of the source.
+ * @param azimuth Azimuth clockwise from geographic north, in degrees.
+ * @param takeoff Angle from the downward vertical, in degrees.
+ * @param direction The returned unit vector along easting, northing and depth.
+ */
+static void ivlsu_ray_direction(double longitude, double latitude, double azimuth, double takeoff, double direction[3]) {
+	double grid_azimuth = azimuth * DEG_TO_RAD - ivlsu_meridian_convergence(longitude, latitude);
+
+	direction[0] = sin(takeoff * DEG_TO_RAD) * sin(grid_azimuth);
+	direction[1] = sin(takeoff * DEG_TO_RAD) * cos(grid_azimuth);
+	direction[2] = cos(takeoff * DEG_TO_RAD);
+}
+
+/** The straight line from a source to a station and the plane across it. */
+typedef struct ivlsu_ray_aim_t {
+	/** UTM easting, northing and depth of the source */
+	double source[3];
+	/** UTM easting, northing and depth of the station */
+	double station[3];
+	/** Unit vector from the source to the station */
+	double line[3];
+	/** Two unit vectors across the line */
+	double across[2][3];
+} ivlsu_ray_aim_t;
+
+/**
+ * Shoots a ray tilted away from the straight line to its station and returns where it
+ * crosses the station's depth relative to the station.
+ *
+ * @param volume The volume the ray travels through.
+ * @param ray The ray.
+ * @param aim The line and plane the tilt is measured in.
+ * @param tilt The tilt along each vector across the line.
+ * @param direction The returned unit vector of the takeoff.
+ * @param miss The returned easting and northing offsets of the crossing from the station.
+ * @return Non-zero if the ray crossed the station's depth.
+ */
+static int ivlsu_ray_shoot(const ivlsu_volume_t *volume, ivlsu_ray_t *ray, const ivlsu_ray_aim_t *aim, const double tilt[2],
+			   double direction[3], double miss[2]) {
+	double length = 0;
+	int k = 0;
+
+	for (k = 0; k < 3; k++)
+		direction[k] = aim->line[k] + tilt[0] * aim->across[0][k] + tilt[1] * aim->across[1][k];
+	length = sqrt(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+	for (k = 0; k < 3; k++)
+		direction[k] /= length;
+
+	ivlsu_ray_integrate_to(volume, ray, aim->source, direction, aim->station[2]);
+	miss[0] = ray->end[0] - aim->station[0];
+	miss[1] = ray->end[1] - aim->station[1];
+	return ray->status == IVLSU_RAY_ARRIVED;
+}
+
+/**
+ * Moves the tilt of a ray by damped Newton iterations on where it crosses its
+ * station's depth, with the Jacobian from finite differences.
+ *
+ * @param volume The volume the ray travels through.
+ * @param ray The ray.
+ * @param aim The line and plane the tilt is measured in.
+ * @param tilt The starting tilt, returned as the closest one found.
+ * @return The distance from the station at which the ray with the returned tilt
+ * crosses its depth, infinite if it does not cross it.
+ */
+static double ivlsu_ray_newton(const ivlsu_volume_t *volume, ivlsu_ray_t *ray, const ivlsu_ray_aim_t *aim, double tilt[2]) {
+	double direction[3], trial[2], miss[2], trial_miss[2], jacobian[2][2], change[2];
+	double distance = 0, trial_distance = 0, determinant = 0, damping = 0, delta = 1e-3;
+	int iteration = 0, reached = 0, j = 0;
+
+	if (!ivlsu_ray_shoot(volume, ray, aim, tilt, direction, miss))
+		return INFINITY;
+	distance = hypot(miss[0], miss[1]);
+
+	for (iteration = 0; distance > IVLSU_RAY_TOLERANCE && iteration < IVLSU_RAY_ITERATIONS; iteration++) {
+		for (j = 0, reached = 1; j < 2 && reached; j++) {
+			trial[0] = tilt[0] + (j == 0 ? delta : 0);
+			trial[1] = tilt[1] + (j == 1 ? delta : 0);
+			reached = ivlsu_ray_shoot(volume, ray, aim, trial, direction, trial_miss);
+			jacobian[0][j] = (trial_miss[0] - miss[0]) / delta;
+			jacobian[1][j] = (trial_miss[1] - miss[1]) / delta;
+		}
+		determinant = jacobian[0][0] * jacobian[1][1] - jacobian[0][1] * jacobian[1][0];
+		if (!reached || determinant == 0)
+			break;
+		change[0] = -(jacobian[1][1] * miss[0] - jacobian[0][1] * miss[1]) / determinant;
+		change[1] = -(jacobian[0][0] * miss[1] - jacobian[1][0] * miss[0]) / determinant;
+
+		// Halve the change until the ray lands closer.
+		for (damping = 1; damping > 1.0 / 1024; damping *= 0.5) {
+			trial[0] = tilt[0] + damping * change[0];
+			trial[1] = tilt[1] + damping * change[1];
+			reached = ivlsu_ray_shoot(volume, ray, aim, trial, direction, trial_miss);
+			trial_distance = hypot(trial_miss[0], trial_miss[1]);
+			if (reached && trial_distance < distance)
+				break;
+		}
+		if (!reached || trial_distance >= distance)
+			break;
+		memcpy(tilt, trial, 2 * sizeof(double));
+		memcpy(miss, trial_miss, sizeof(miss));
+		distance = trial_distance;
+	}
+
+	return distance;
+}
+
+/**
+ * Finds the takeoff of the ray from a source to a station. The direction is tilted
+ * away from the straight line to the station by Newton iterations starting on the
+ * line; if they stall short of the station, they start again from the ray of a fan
+ * of IVLSU_RAY_FAN by IVLSU_RAY_FAN tilts that lands closest to it. Only the last
+ * shot records the path.
+ *
+ * @param volume The volume the ray travels through.
+ * @param ray The ray.
+ * @param source UTM easting, northing and depth of the source.
+ * @param station UTM easting, northing and depth of the station.
+ * @param direction The returned unit vector of the takeoff.
+ * @return SUCCESS, or FAIL if no ray reaching the station was found.
+ */
+static int ivlsu_ray_bend(const ivlsu_volume_t *volume, ivlsu_ray_t *ray, const double source[3], const double station[3],
+			  double direction[3]) {
+	ivlsu_ray_aim_t aim;
+	double tilt[2] = { 0, 0 }, start[2] = { 0, 0 }, trial[2], miss[2], length = 0, distance = 0, closest = INFINITY;
+	double *path = ray->path;
+	int k = 0, j = 0;
+
+	for (k = 0; k < 3; k++) {
+		aim.source[k] = source[k];
+		aim.station[k] = station[k];
+		aim.line[k] = station[k] - source[k];
+	}
+	length = sqrt(aim.line[0] * aim.line[0] + aim.line[1] * aim.line[1] + aim.line[2] * aim.line[2]);
+	if (length == 0)
+		return FAIL;
+	for (k = 0; k < 3; k++)
+		aim.line[k] /= length;
+
+	// The first vector across the line is horizontal unless the line is close to vertical.
+	aim.across[0][0] = fabs(aim.line[2]) < 0.9 ? -aim.line[1] : 1;
+	aim.across[0][1] = fabs(aim.line[2]) < 0.9 ? aim.line[0] : 0;
+	aim.across[0][2] = 0;
+	length = hypot(aim.across[0][0], aim.across[0][1]);
+	aim.across[0][0] /= length;
+	aim.across[0][1] /= length;
+	aim.across[1][0] = aim.line[1] * aim.across[0][2] - aim.line[2] * aim.across[0][1];
+	aim.across[1][1] = aim.line[2] * aim.across[0][0] - aim.line[0] * aim.across[0][2];
+	aim.across[1][2] = aim.line[0] * aim.across[0][1] - aim.line[1] * aim.across[0][0];
+	length = sqrt(aim.across[1][0] * aim.across[1][0] + aim.across[1][1] * aim.across[1][1] + aim.across[1][2] * aim.across[1][2]);
+	for (k = 0; k < 3; k++)
+		aim.across[1][k] /= length;
+
+	ray->path = NULL;
+	distance = ivlsu_ray_newton(volume, ray, &aim, tilt);
+
+	if (distance > IVLSU_RAY_TOLERANCE) {
+		for (j = 0; j < IVLSU_RAY_FAN * IVLSU_RAY_FAN; j++) {
+			trial[0] = IVLSU_RAY_FAN_TILT * (2.0 * (j % IVLSU_RAY_FAN) / (IVLSU_RAY_FAN - 1) - 1);
+			trial[1] = IVLSU_RAY_FAN_TILT * (2.0 * (j / IVLSU_RAY_FAN) / (IVLSU_RAY_FAN - 1) - 1);
+			if (ivlsu_ray_shoot(volume, ray, &aim, trial, direction, miss) && hypot(miss[0], miss[1]) < closest) {
+				closest = hypot(miss[0], miss[1]);
+				memcpy(start, trial, sizeof(start));
+			}
+		}
+		if (closest < distance && ivlsu_ray_newton(volume, ray, &aim, start) < distance)
+			memcpy(tilt, start, sizeof(tilt));
+	}
+
+	ray->path = path;
+	if (!ivlsu_ray_shoot(volume, ray, &aim, tilt, direction, miss))
+		return FAIL;
+	return hypot(miss[0], miss[1]) <= IVLSU_RAY_TOLERANCE ? SUCCESS : FAIL;
+}
+
+/**
+ * Task tracing the rays [begin, end).
+ */
+static void ivlsu_ray_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	ivlsu_ray_batch_t *batch = arg;
+	ivlsu_ray_t *ray = NULL;
+	double source[3], station[3], direction[3], convergence = 0;
+	long i = 0;
+
+	for (i = begin; i < end; i++) {
+		ray = &(batch->rays[i]);
+		ivlsu_project_points(worker, &(ray->longitude), &(ray->latitude), 1, 1, &(source[0]), &(source[1]));
+		source[2] = ray->depth;
+
+		if (batch->stations == NULL) {
+			ivlsu_ray_direction(ray->longitude, ray->latitude, ray->azimuth, ray->takeoff, direction);
+			ivlsu_ray_integrate(batch->volume, ray, source, direction);
+			continue;
+		}
+
+		ivlsu_project_points(worker, &(batch->stations[i].longitude), &(batch->stations[i].latitude), 1, 1, &(station[0]),
+				     &(station[1]));
+		station[2] = batch->stations[i].depth;
+		if (ivlsu_ray_bend(batch->volume, ray, source, station, direction) != SUCCESS && ray->status == IVLSU_RAY_ARRIVED)
+			ray->status = IVLSU_RAY_MISSED;
+
+		convergence = ivlsu_meridian_convergence(ray->longitude, ray->latitude);
+		ray->azimuth = fmod((atan2(direction[0], direction[1]) + convergence) / DEG_TO_RAD + 360, 360);
+		ray->takeoff = acos(fmax(-1, fmin(1, direction[2]))) / DEG_TO_RAD;
+	}
+}
+
+/**
+ * Checks a batch of rays and traces them on the worker threads. Rays end on their
+ * station's depth going up, so no station may be deeper than its source.
+ *
+ * @param rays The rays.
+ * @param stations Station of each ray, or NULL.
+ * @param numrays Number of rays.
+ * @return SUCCESS or FAIL.
+ */
+static int ivlsu_ray_run(ivlsu_ray_t *rays, const ivlsu_point_t *stations, int numrays) {
+	ivlsu_ray_batch_t batch = { rays, stations, NULL };
+	ivlsu_model_t *model = NULL;
+	int i = 0, ticket = 0, status;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is queried.");
+		return FAIL;
+	}
+
+	for (i = 0; i < numrays; i++) {
+		if ((rays[i].wave != IVLSU_VP && rays[i].wave != IVLSU_VS) || (rays[i].path != NULL && rays[i].max_points < 1)) {
+			print_error("A ray has an unknown wave or no room for its path.");
+			return FAIL;
+		}
+		if (stations != NULL && stations[i].depth > rays[i].depth) {
+			print_error("A ray's station is deeper than its source; rays only arrive going up.");
+			return FAIL;
+		}
+	}
+
+	model = ivlsu_model_acquire(&ticket);
+	batch.volume = &(model->volume);
+	status = ivlsu_parallel_for(numrays, 1, ivlsu_ray_task, &batch);
+	ivlsu_model_release(ticket);
+	return status;
+}
+
+/**
+ * Shoots rays from their sources at their takeoff azimuths and angles, each until
+ * it crosses its end depth going up or stops on its own.
+ *
+ * @param rays The rays.
+ * @param numrays Number of rays.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_shoot_rays(ivlsu_ray_t *rays, int numrays) {
+	return ivlsu_ray_run(rays, NULL, numrays);
+}
+
+/**
+ * Traces the rays from their sources to stations, returning the takeoff azimuth and
+ * angle of each along with its path and time. A ray not found to reach its station
+ * within IVLSU_RAY_TOLERANCE has the status IVLSU_RAY_MISSED, or the status of its
+ * last shot if that stopped short of the station's depth. A ray only arrives when it
+ * crosses its station's depth going up, so the batch fails if a station is deeper
+ * than its source.
+ *
+ * @param rays The rays.
+ * @param stations The station of each ray.
+ * @param numrays Number of rays.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_trace_rays(ivlsu_ray_t *rays, const ivlsu_point_t *stations, int numrays) {
+	return ivlsu_ray_run(rays, stations, numrays);
+}
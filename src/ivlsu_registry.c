@@ -0,0 +1,197 @@
+/**
+ * @file ivlsu_registry.c
+ * @brief Model instances of the IMPERIAL-LSU library.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Opens any number of instances of the model next to the one ivlsu_init loads, for
+ * workflows comparing variants such as interpolation on and off, or two versions
+ * of the data. Instances opened on the same data share one read-only copy of it
+ * through a registry keyed by the identity of the Vp file, its device, inode, size
+ * and modification time, so a second instance costs a stat call. Each instance
+ * keeps its own query options. The shared data is freed with its last instance.
+ *
+ */
+
+#include <sys/stat.h>
+#include "ivlsu.h"
+
+/** The loaded models, each shared by its open instances. */
+static ivlsu_shared_model_t *ivlsu_registry = NULL;
+/** Protects the registry. */
+static pthread_mutex_t ivlsu_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Opens an instance of a model. If an instance is already open on the same Vp file,
+ * unchanged since, with the same grid, the new instance shares its data; otherwise
+ * the data is loaded. The instance starts with the options of the configuration
+ * file. The threads option is shared by every query of the process and is only set
+ * through ivlsu_set_option.
+ *
+ * @param instance The instance to open.
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_instance_open(ivlsu_instance_t *instance, const char *dir, const char *label) {
+	ivlsu_shared_model_t *shared = NULL;
+	char directory[512], path[sizeof(directory) + 8];
+	struct stat status;
+
+	memset(instance, 0, sizeof(ivlsu_instance_t));
+	instance->config.sort_threshold = -1;
+	instance->config.prefetch_distance = -1;
+
+	if (snprintf(path, sizeof(path), "%s/model/%s/data/config", dir, label) >= (int)sizeof(path)) {
+		print_error("The path of the model is too long.");
+		return FAIL;
+	}
+	if (ivlsu_read_configuration(path, &(instance->config)) != SUCCESS) {
+		print_error("No configuration file was found to read from.");
+		return FAIL;
+	}
+	if (snprintf(directory, sizeof(directory), "%s/model/%s/data/%s", dir, label, instance->config.model_dir) >=
+	    (int)sizeof(directory)) {
+		print_error("The path of the model is too long.");
+		return FAIL;
+	}
+	snprintf(path, sizeof(path), "%s/vp.dat", directory);
+	if (stat(path, &status) != 0) {
+		print_error("No model file was found to read from.");
+		return FAIL;
+	}
+
+	pthread_mutex_lock(&ivlsu_registry_lock);
+	for (shared = ivlsu_registry; shared != NULL; shared = shared->next)
+		if (shared->device == status.st_dev && shared->inode == status.st_ino && shared->size == status.st_size &&
+		    shared->mtime.tv_sec == status.st_mtim.tv_sec && shared->mtime.tv_nsec == status.st_mtim.tv_nsec &&
+		    ivlsu_same_grid(&(shared->config), &(instance->config)))
+			break;
+
+	if (shared == NULL && (shared = calloc(1, sizeof(ivlsu_shared_model_t))) != NULL) {
+		shared->device = status.st_dev;
+		shared->inode = status.st_ino;
+		shared->size = status.st_size;
+		shared->mtime = status.st_mtim;
+		shared->config = instance->config;
+		if ((shared->model = ivlsu_load_model(&(shared->config), directory, 0, 0)) == NULL) {
+			free(shared);
+			shared = NULL;
+		} else {
+			shared->next = ivlsu_registry;
+			ivlsu_registry = shared;
+		}
+	}
+	if (shared != NULL)
+		shared->references++;
+	pthread_mutex_unlock(&ivlsu_registry_lock);
+
+	if (shared == NULL) {
+		print_error("Could not load the model of the instance.");
+		return FAIL;
+	}
+
+	instance->shared = shared;
+	ivlsu_default_options(&(instance->config), &(shared->model->volume));
+	return SUCCESS;
+}
+
+/**
+ * Closes an instance. The shared data is freed once no instance holds it. The
+ * instance must not be queried meanwhile.
+ *
+ * @param instance The instance.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_instance_close(ivlsu_instance_t *instance) {
+	ivlsu_shared_model_t *shared = instance->shared, **link = NULL;
+
+	if (shared == NULL)
+		return FAIL;
+
+	pthread_mutex_lock(&ivlsu_registry_lock);
+	if (--shared->references == 0) {
+		for (link = &ivlsu_registry; *link != shared; link = &((*link)->next))
+			;
+		*link = shared->next;
+	} else {
+		shared = NULL;
+	}
+	pthread_mutex_unlock(&ivlsu_registry_lock);
+
+	if (shared != NULL) {
+		ivlsu_free_model(shared->model);
+		free(shared);
+	}
+	memset(instance, 0, sizeof(ivlsu_instance_t));
+	return SUCCESS;
+}
+
+/**
+ * Changes a query option of one instance (interpolation, sort_threshold,
+ * prefetch_distance), leaving the other instances on the same data as they are.
+ * Options must not be changed while another thread is querying the instance.
+ *
+ * @param instance The instance.
+ * @param key The option name, as in the configuration file.
+ * @param value The option value, as in the configuration file.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_instance_set_option(ivlsu_instance_t *instance, const char *key, const char *value) {
+	if (instance->shared == NULL || strcmp(key, "threads") == 0 || ivlsu_parse_option(&(instance->config), key, value) != SUCCESS) {
+		print_error("Unknown option or invalid option value.");
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Queries an instance at the given points, as ivlsu_query queries the model.
+ *
+ * @param instance The instance.
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned.
+ * @param numpoints The total number of points to query.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_instance_query(const ivlsu_instance_t *instance, const ivlsu_point_t *points, ivlsu_properties_t *data, int numpoints) {
+	if (instance->shared == NULL) {
+		print_error("The instance must be open before it is queried.");
+		return FAIL;
+	}
+	return ivlsu_model_query(instance->shared->model, &(instance->config), points, data, numpoints);
+}
+
+/**
+ * Queries an instance with structure-of-arrays inputs and outputs, as
+ * ivlsu_query_batch queries the model.
+ *
+ * @param instance The instance.
+ * @param batch The input arrays, property mask and output arrays.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_instance_query_batch(const ivlsu_instance_t *instance, ivlsu_batch_t *batch) {
+	if (instance->shared == NULL) {
+		print_error("The instance must be open before it is queried.");
+		return FAIL;
+	}
+	return ivlsu_model_query_batch(instance->shared->model, &(instance->config), batch);
+}
+
+/**
+ * Queries an instance on a regular UTM grid, as ivlsu_query_grid queries the model.
+ *
+ * @param instance The instance.
+ * @param grid The grid to query.
+ * @param batch The property mask and output arrays, holding nx * ny * nz values.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_instance_query_grid(const ivlsu_instance_t *instance, const ivlsu_grid_t *grid, ivlsu_batch_t *batch) {
+	if (instance->shared == NULL) {
+		print_error("The instance must be open before it is queried.");
+		return FAIL;
+	}
+	return ivlsu_model_query_grid(instance->shared->model, &(instance->config), grid, batch);
+}
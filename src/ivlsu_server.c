@@ -0,0 +1,334 @@
+/**
+ * @file ivlsu_server.c
+ * @brief Query server protocol of the IMPERIAL-LSU library.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Serves queries of the loaded model over a stream socket, and queries such a server
+ * from other processes, so that short lived tools do not each load the model. Every
+ * message is an ivlsu_message_t header giving the length of the payload that follows:
+ * a query carries ivlsu_point_t records and its result the ivlsu_properties_t of each
+ * point, in the native layout since both ends run on the same host. A client may send
+ * up to IVLSU_SERVER_PIPELINE queries before it reads their results, which come back
+ * in order. Each connection has a reader taking queries off the socket while its
+ * worker answers the earlier ones, so a pipelining client never stalls the server.
+ * The workers of different connections evaluate their queries at the same time, each
+ * projecting with its own thread's Proj.4 context.
+ *
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include "ivlsu.h"
+
+/** A query waiting for its connection's worker. */
+typedef struct ivlsu_server_query_t {
+	/** Number of points */
+	long numpoints;
+	/** The points */
+	ivlsu_point_t *points;
+} ivlsu_server_query_t;
+
+/** The queries of a connection between its reader and its worker. */
+typedef struct ivlsu_server_queue_t {
+	/** The socket */
+	int fd;
+	/** The queries read but not yet answered, as a ring */
+	ivlsu_server_query_t queries[IVLSU_SERVER_PIPELINE];
+	/** Index of the oldest query */
+	int head;
+	/** Number of queries */
+	int count;
+	/** Set when the reader or the worker has stopped */
+	int closed;
+	/** Guards the queue */
+	pthread_mutex_t lock;
+	/** Signaled when a query is added or taken, or the reader stops */
+	pthread_cond_t changed;
+} ivlsu_server_queue_t;
+
+/**
+ * Writes a buffer to a socket, retrying short writes.
+ *
+ * @param fd The socket.
+ * @param buffer The bytes.
+ * @param length Number of bytes.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_socket_write(int fd, const void *buffer, size_t length) {
+	const char *bytes = buffer;
+	ssize_t written;
+
+	while (length > 0) {
+		written = send(fd, bytes, length, MSG_NOSIGNAL);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return FAIL;
+		bytes += written;
+		length -= written;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Reads a buffer from a socket, retrying short reads.
+ *
+ * @param fd The socket.
+ * @param buffer The bytes.
+ * @param length Number of bytes.
+ * @return SUCCESS, or FAIL if the socket failed or closed first.
+ */
+int ivlsu_socket_read(int fd, void *buffer, size_t length) {
+	char *bytes = buffer;
+	ssize_t got;
+
+	while (length > 0) {
+		got = recv(fd, bytes, length, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return FAIL;
+		bytes += got;
+		length -= got;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Sends a message header.
+ *
+ * @param fd The socket.
+ * @param type IVLSU_MESSAGE_QUERY, IVLSU_MESSAGE_RESULT or IVLSU_MESSAGE_ERROR.
+ * @param length Length of the payload that will follow.
+ * @return SUCCESS or FAIL.
+ */
+static int ivlsu_send_header(int fd, uint32_t type, uint64_t length) {
+	ivlsu_message_t header = { IVLSU_SERVER_MAGIC, type, length };
+
+	return ivlsu_socket_write(fd, &header, sizeof(header));
+}
+
+/**
+ * Reader of a connection: reads queries into the queue until the client closes the
+ * connection or breaks the protocol, or the worker closes the queue.
+ *
+ * @param arg The queue.
+ * @return NULL
+ */
+static void *ivlsu_server_reader(void *arg) {
+	ivlsu_server_queue_t *queue = arg;
+	ivlsu_server_query_t query;
+	ivlsu_message_t header;
+
+	while (ivlsu_socket_read(queue->fd, &header, sizeof(header)) == SUCCESS) {
+		if (header.magic != IVLSU_SERVER_MAGIC || header.type != IVLSU_MESSAGE_QUERY || header.length % sizeof(ivlsu_point_t) != 0 ||
+		    header.length > IVLSU_SERVER_MAX_POINTS * sizeof(ivlsu_point_t))
+			break;
+		query.numpoints = header.length / sizeof(ivlsu_point_t);
+		if ((query.points = malloc(header.length > 0 ? header.length : 1)) == NULL)
+			break;
+		if (ivlsu_socket_read(queue->fd, query.points, header.length) != SUCCESS) {
+			free(query.points);
+			break;
+		}
+
+		pthread_mutex_lock(&(queue->lock));
+		while (queue->count == IVLSU_SERVER_PIPELINE && !queue->closed)
+			pthread_cond_wait(&(queue->changed), &(queue->lock));
+		if (queue->closed) {
+			pthread_mutex_unlock(&(queue->lock));
+			free(query.points);
+			break;
+		}
+		queue->queries[(queue->head + queue->count) % IVLSU_SERVER_PIPELINE] = query;
+		queue->count++;
+		pthread_cond_broadcast(&(queue->changed));
+		pthread_mutex_unlock(&(queue->lock));
+	}
+
+	pthread_mutex_lock(&(queue->lock));
+	queue->closed = 1;
+	pthread_cond_broadcast(&(queue->changed));
+	pthread_mutex_unlock(&(queue->lock));
+	return NULL;
+}
+
+/**
+ * Serves the queries of a connected client until it closes the connection. Runs on
+ * the caller's thread, which answers the queries in order, with a reader thread
+ * taking the following queries off the socket meanwhile.
+ *
+ * @param fd The connected socket, left open.
+ * @return SUCCESS, or FAIL if the connection ended on an error.
+ */
+int ivlsu_serve_connection(int fd) {
+	ivlsu_server_queue_t queue;
+	ivlsu_server_query_t query;
+	ivlsu_properties_t *data = NULL;
+	long capacity = 0;
+	int status = SUCCESS, failed;
+	pthread_t reader;
+
+	if (ivlsu_is_initialized == 0) {
+		print_error("The model must be initialized before it is served.");
+		return FAIL;
+	}
+
+	memset(&queue, 0, sizeof(queue));
+	queue.fd = fd;
+	pthread_mutex_init(&(queue.lock), NULL);
+	pthread_cond_init(&(queue.changed), NULL);
+	if (pthread_create(&reader, NULL, ivlsu_server_reader, &queue) != 0) {
+		print_error("The connection's reader could not be started.");
+		pthread_mutex_destroy(&(queue.lock));
+		pthread_cond_destroy(&(queue.changed));
+		return FAIL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&(queue.lock));
+		while (queue.count == 0 && !queue.closed)
+			pthread_cond_wait(&(queue.changed), &(queue.lock));
+		if (queue.count == 0) {
+			pthread_mutex_unlock(&(queue.lock));
+			break;
+		}
+		query = queue.queries[queue.head];
+		queue.head = (queue.head + 1) % IVLSU_SERVER_PIPELINE;
+		queue.count--;
+		pthread_cond_broadcast(&(queue.changed));
+		pthread_mutex_unlock(&(queue.lock));
+
+		if (query.numpoints > capacity) {
+			free(data);
+			capacity = query.numpoints;
+			data = malloc(capacity * sizeof(ivlsu_properties_t));
+		}
+		failed = query.numpoints > 0 && data == NULL;
+		if (!failed && query.numpoints > 0) {
+			// ivlsu_query leaves Qp and Qs alone; send zeros rather than an earlier query's bytes.
+			memset(data, 0, query.numpoints * sizeof(ivlsu_properties_t));
+			failed = ivlsu_query(query.points, data, (int)query.numpoints) != SUCCESS;
+		}
+		free(query.points);
+		if (data == NULL)
+			capacity = 0;
+
+		if (failed ? ivlsu_send_header(fd, IVLSU_MESSAGE_ERROR, 0) != SUCCESS :
+			     ivlsu_send_header(fd, IVLSU_MESSAGE_RESULT, query.numpoints * sizeof(ivlsu_properties_t)) != SUCCESS ||
+			     ivlsu_socket_write(fd, data, query.numpoints * sizeof(ivlsu_properties_t)) != SUCCESS) {
+			// Stop the reader, whether it is waiting on the socket or on the queue.
+			status = FAIL;
+			shutdown(fd, SHUT_RDWR);
+			pthread_mutex_lock(&(queue.lock));
+			queue.closed = 1;
+			pthread_cond_broadcast(&(queue.changed));
+			pthread_mutex_unlock(&(queue.lock));
+			break;
+		}
+	}
+
+	pthread_join(reader, NULL);
+	while (queue.count > 0) {
+		free(queue.queries[queue.head].points);
+		queue.head = (queue.head + 1) % IVLSU_SERVER_PIPELINE;
+		queue.count--;
+	}
+	pthread_mutex_destroy(&(queue.lock));
+	pthread_cond_destroy(&(queue.changed));
+	free(data);
+	return status;
+}
+
+/**
+ * Connects a client to the server listening on a UNIX socket.
+ *
+ * @param client The client to connect.
+ * @param path Path of the server's socket.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_client_open(ivlsu_client_t *client, const char *path) {
+	struct sockaddr_un address;
+
+	client->fd = -1;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		print_error("The server's socket path is too long.");
+		return FAIL;
+	}
+	strcpy(address.sun_path, path);
+
+	if ((client->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(client->fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		if (client->fd >= 0)
+			close(client->fd);
+		client->fd = -1;
+		print_error("Could not connect to the server.");
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Queries the server as ivlsu_query queries the model in process, returning the same
+ * properties. The points go in chunks of IVLSU_SERVER_CHUNK, with up to
+ * IVLSU_SERVER_PIPELINE chunks in flight. A client whose connection failed must be
+ * closed and opened again.
+ *
+ * @param client The connected client.
+ * @param points The points.
+ * @param data The properties of each point.
+ * @param numpoints Number of points.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_client_query(ivlsu_client_t *client, ivlsu_point_t *points, ivlsu_properties_t *data, int numpoints) {
+	long numchunks = ((long)numpoints + IVLSU_SERVER_CHUNK - 1) / IVLSU_SERVER_CHUNK, sent = 0, received = 0, first, count;
+	ivlsu_message_t header;
+
+	if (client->fd < 0) {
+		print_error("The client is not connected.");
+		return FAIL;
+	}
+
+	while (received < numchunks) {
+		for (; sent < numchunks && sent - received < IVLSU_SERVER_PIPELINE; sent++) {
+			first = sent * IVLSU_SERVER_CHUNK;
+			count = numpoints - first < IVLSU_SERVER_CHUNK ? numpoints - first : IVLSU_SERVER_CHUNK;
+			if (ivlsu_send_header(client->fd, IVLSU_MESSAGE_QUERY, count * sizeof(ivlsu_point_t)) != SUCCESS ||
+			    ivlsu_socket_write(client->fd, points + first, count * sizeof(ivlsu_point_t)) != SUCCESS)
+				break;
+		}
+
+		first = received * IVLSU_SERVER_CHUNK;
+		count = numpoints - first < IVLSU_SERVER_CHUNK ? numpoints - first : IVLSU_SERVER_CHUNK;
+		if (ivlsu_socket_read(client->fd, &header, sizeof(header)) != SUCCESS || header.magic != IVLSU_SERVER_MAGIC ||
+		    header.type != IVLSU_MESSAGE_RESULT || header.length != count * sizeof(ivlsu_properties_t) ||
+		    ivlsu_socket_read(client->fd, data + first, header.length) != SUCCESS) {
+			print_error("The server did not answer the query.");
+			close(client->fd);
+			client->fd = -1;
+			return FAIL;
+		}
+		received++;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Closes a client's connection.
+ *
+ * @param client The client.
+ * @return SUCCESS or FAIL.
+ */
+int ivlsu_client_close(ivlsu_client_t *client) {
+	int status = SUCCESS;
+
+	if (client->fd >= 0 && close(client->fd) != 0)
+		status = FAIL;
+	client->fd = -1;
+	return status;
+}
@@ -0,0 +1,276 @@
+/**
+ * @file bench.c
+ * @brief Benchmarks the batch query paths of the IMPERIAL/IVLSU library.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * Times the batch kernel on the installed model or on a synthetic model of any
+ * size, so that the behavior of volumes that do not fit in cache can be measured.
+ *
+ * Usage: bench_ivlsu [sort|prefetch] [--synthetic nx ny nz]
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ivlsu.h"
+
+/** Longitude range of the synthetic model and of the random points. */
+#define BENCH_LON_MIN -116.0
+#define BENCH_LON_MAX -115.4
+/** Latitude range of the synthetic model and of the random points. */
+#define BENCH_LAT_MIN 32.7
+#define BENCH_LAT_MAX 33.3
+/** Depth range of the synthetic model and of the random points. */
+#define BENCH_DEPTH 8000.0
+
+/** Largest batch timed. */
+#define BENCH_MAX_POINTS (1 << 22)
+
+/** Directory holding the synthetic model, empty if the installed model is used. */
+char bench_synthetic_dir[256] = "";
+
+/**
+ * Returns the current monotonic time in seconds.
+ *
+ * @return Time in seconds.
+ */
+double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Writes a synthetic model of nx * ny * nz nodes covering the benchmark region in
+ * the layout ivlsu_init expects, under a temporary directory.
+ *
+ * @param nx Number of x points.
+ * @param ny Number of y points.
+ * @param nz Number of z points.
+ * @return 0 on success.
+ */
+int bench_make_synthetic(int nx, int ny, int nz) {
+	double e[4] = { BENCH_LON_MIN * DEG_TO_RAD, BENCH_LON_MAX * DEG_TO_RAD, BENCH_LON_MIN * DEG_TO_RAD, BENCH_LON_MAX * DEG_TO_RAD };
+	double n[4] = { BENCH_LAT_MIN * DEG_TO_RAD, BENCH_LAT_MIN * DEG_TO_RAD, BENCH_LAT_MAX * DEG_TO_RAD, BENCH_LAT_MAX * DEG_TO_RAD };
+	double min_e, min_n, max_e, max_n;
+	char path[512];
+	projPJ latlon, utm;
+	float *plane;
+	FILE *fp;
+	int i, x, y, z;
+
+	latlon = pj_init_plus("+proj=latlong +datum=WGS84");
+	utm = pj_init_plus("+proj=utm +zone=11 +datum=WGS84 +units=m +no_defs");
+	pj_transform(latlon, utm, 4, 1, e, n, NULL);
+	pj_free(latlon);
+	pj_free(utm);
+
+	min_e = max_e = e[0];
+	min_n = max_n = n[0];
+	for (i = 1; i < 4; i++) {
+		min_e = e[i] < min_e ? e[i] : min_e;
+		max_e = e[i] > max_e ? e[i] : max_e;
+		min_n = n[i] < min_n ? n[i] : min_n;
+		max_n = n[i] > max_n ? n[i] : max_n;
+	}
+	min_e = floor(min_e) - 1000;
+	min_n = floor(min_n) - 1000;
+	max_e = ceil(max_e) + 1000;
+	max_n = ceil(max_n) + 1000;
+
+	strcpy(bench_synthetic_dir, "/tmp/ivlsu_bench_XXXXXX");
+	if (mkdtemp(bench_synthetic_dir) == NULL)
+		return 1;
+	sprintf(path, "mkdir -p %s/model/synthetic/data/ivlsu", bench_synthetic_dir);
+	if (system(path) != 0)
+		return 1;
+
+	sprintf(path, "%s/model/synthetic/data/config", bench_synthetic_dir);
+	if ((fp = fopen(path, "w")) == NULL)
+		return 1;
+	fprintf(fp, "utm_zone = 11\nmodel_dir = ivlsu\nnx = %d\nny = %d\nnz = %d\n", nx, ny, nz);
+	fprintf(fp, "depth = %f\ndepth_interval = %f\n", BENCH_DEPTH, BENCH_DEPTH / (nz - 1));
+	fprintf(fp, "bottom_left_corner_e = %f\nbottom_left_corner_n = %f\n", min_e, min_n);
+	fprintf(fp, "bottom_right_corner_e = %f\nbottom_right_corner_n = %f\n", max_e, min_n);
+	fprintf(fp, "top_left_corner_e = %f\ntop_left_corner_n = %f\n", min_e, max_n);
+	fprintf(fp, "top_right_corner_e = %f\ntop_right_corner_n = %f\n", max_e, max_n);
+	fprintf(fp, "interpolation = on\n");
+	fclose(fp);
+
+	sprintf(path, "%s/model/synthetic/data/ivlsu/vp.dat", bench_synthetic_dir);
+	if ((fp = fopen(path, "wb")) == NULL)
+		return 1;
+	plane = malloc((size_t)nx * ny * sizeof(float));
+	for (z = 0; z < nz; z++) {
+		for (y = 0; y < ny; y++)
+			for (x = 0; x < nx; x++)
+				plane[y * nx + x] = 1500.0 + 5000.0 * z / nz + 100.0 * sin(x * 0.05) * cos(y * 0.07);
+		fwrite(plane, sizeof(float), (size_t)nx * ny, fp);
+	}
+	free(plane);
+	fclose(fp);
+
+	printf("Synthetic model %d x %d x %d (%.1f MB) in %s\n", nx, ny, nz, (double)nx * ny * nz * sizeof(float) / 1048576.0,
+	       bench_synthetic_dir);
+	return 0;
+}
+
+/**
+ * Times one batch query of the points, repeated until enough time has passed.
+ *
+ * @param batch The batch to run.
+ * @return Nanoseconds per point.
+ */
+double bench_time_batch(ivlsu_batch_t *batch) {
+	double start, elapsed;
+	long reps = 0;
+
+	ivlsu_query_batch(batch);
+	start = bench_now();
+	do {
+		ivlsu_query_batch(batch);
+		reps++;
+		elapsed = bench_now() - start;
+	} while (elapsed < 0.25);
+
+	return elapsed * 1e9 / ((double)reps * batch->numpoints);
+}
+
+/**
+ * Times scattered batches with and without the Morton sort and reports the batch
+ * size from which sorting pays off.
+ *
+ * @param batch A batch of BENCH_MAX_POINTS scattered points.
+ */
+void bench_sort(ivlsu_batch_t *batch) {
+	int numpoints, crossover = 0;
+	double unsorted, sorted;
+
+	printf("\n%10s %14s %14s %8s\n", "points", "unsorted ns", "sorted ns", "speedup");
+	for (numpoints = 1 << 10; numpoints <= BENCH_MAX_POINTS; numpoints <<= 2) {
+		batch->numpoints = numpoints;
+		ivlsu_set_option("sort_threshold", "0");
+		unsorted = bench_time_batch(batch);
+		ivlsu_set_option("sort_threshold", "1");
+		sorted = bench_time_batch(batch);
+		printf("%10d %14.1f %14.1f %8.2f\n", numpoints, unsorted, sorted, unsorted / sorted);
+		if (sorted < unsorted && crossover == 0)
+			crossover = numpoints;
+		if (sorted >= unsorted)
+			crossover = 0;
+	}
+
+	if (crossover > 0)
+		printf("Sorting pays off from about %d points.\n", crossover);
+	else
+		printf("Sorting does not pay off for this model.\n");
+}
+
+/**
+ * Times the largest scattered batch at several prefetch distances. The gain grows
+ * with the volume: run it with --synthetic grids of increasing size.
+ *
+ * @param batch A batch of BENCH_MAX_POINTS scattered points.
+ */
+void bench_prefetch(ivlsu_batch_t *batch) {
+	const char *distances[] = { "0", "4", "8", "16", "32", "64" };
+	double baseline = 0, elapsed;
+	int i;
+
+	batch->numpoints = BENCH_MAX_POINTS;
+	ivlsu_set_option("sort_threshold", "0");
+
+	printf("\n%10s %14s %8s\n", "distance", "ns per point", "speedup");
+	for (i = 0; i < sizeof(distances) / sizeof(distances[0]); i++) {
+		ivlsu_set_option("prefetch_distance", distances[i]);
+		elapsed = bench_time_batch(batch);
+		if (i == 0)
+			baseline = elapsed;
+		printf("%10s %14.1f %8.2f\n", distances[i], elapsed, baseline / elapsed);
+	}
+}
+
+/**
+ * Runs the benchmarks.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return A zero value indicating success.
+ */
+int main(int argc, const char* argv[]) {
+	const char *mode = "sort";
+	double *lon, *lat, *depth;
+	float *vp;
+	ivlsu_batch_t batch = { 0 };
+	char *envstr;
+	char path[512];
+	int i, status;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--synthetic") == 0 && i + 3 < argc) {
+			if (bench_make_synthetic(atoi(argv[i + 1]), atoi(argv[i + 2]), atoi(argv[i + 3])) != 0) {
+				fprintf(stderr, "Could not write the synthetic model.\n");
+				return 1;
+			}
+			i += 3;
+		} else {
+			mode = argv[i];
+		}
+	}
+
+	if (bench_synthetic_dir[0] != '\0') {
+		status = ivlsu_init(bench_synthetic_dir, "synthetic");
+	} else if ((envstr = getenv("UCVM_INSTALL_PATH")) != NULL) {
+		status = ivlsu_init(envstr, "ivlsu");
+	} else {
+		status = ivlsu_init("..", "ivlsu");
+	}
+	if (status != 0) {
+		fprintf(stderr, "Could not load the model.\n");
+		return 1;
+	}
+
+	lon = malloc(BENCH_MAX_POINTS * sizeof(double));
+	lat = malloc(BENCH_MAX_POINTS * sizeof(double));
+	depth = malloc(BENCH_MAX_POINTS * sizeof(double));
+	vp = malloc(BENCH_MAX_POINTS * sizeof(float));
+
+	srand(1);
+	for (i = 0; i < BENCH_MAX_POINTS; i++) {
+		lon[i] = BENCH_LON_MIN + (BENCH_LON_MAX - BENCH_LON_MIN) * rand() / (double)RAND_MAX;
+		lat[i] = BENCH_LAT_MIN + (BENCH_LAT_MAX - BENCH_LAT_MIN) * rand() / (double)RAND_MAX;
+		depth[i] = BENCH_DEPTH * rand() / (double)RAND_MAX;
+	}
+
+	batch.longitude = lon;
+	batch.latitude = lat;
+	batch.depth = depth;
+	batch.properties = IVLSU_VP;
+	batch.type = IVLSU_FLOAT32;
+	batch.vp = vp;
+
+	printf("Benchmarking with %d threads.\n", ivlsu_thread_count());
+	if (strcmp(mode, "sort") == 0) {
+		bench_sort(&batch);
+	} else if (strcmp(mode, "prefetch") == 0) {
+		bench_prefetch(&batch);
+	} else {
+		fprintf(stderr, "Unknown benchmark %s.\n", mode);
+	}
+
+	ivlsu_finalize();
+
+	if (bench_synthetic_dir[0] != '\0') {
+		sprintf(path, "rm -rf %s", bench_synthetic_dir);
+		system(path);
+	}
+
+	free(lon);
+	free(lat);
+	free(depth);
+	free(vp);
+	return 0;
+}
@@ -0,0 +1,267 @@
+/**
+ * @file mesh.c
+ * @brief Writes AWP-ODC material meshes from the IMPERIAL/IVLSU library.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * Samples the model on a regular grid, optionally rotated about its first node, and
+ * writes an AWP-ODC style mesh: a float32 (vp, vs, rho) triple per node, x varying
+ * fastest, then y, then z from the top down. The grid is cut into slabs of whole
+ * z planes that worker threads take in turn, query through the structured grid path
+ * and write with pwrite at the slab's offset, so no thread waits on another to write.
+ *
+ * Each slab is a work unit recorded with its checksum in a journal next to the output,
+ * output.journal. If the tool is run again with the same arguments after it failed,
+ * the slabs whose bytes still match their checksums are skipped. The journal is
+ * removed once the whole mesh has been written.
+ *
+ * Usage: ivlsu_mesh (--corner lon lat | --utm e n) [--rotation degrees] --dims nx ny nz
+ *                   --spacing meters [--depth meters] [--planes count] output
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "ivlsu.h"
+
+/** The mesh being written. */
+typedef struct mesh_job_t {
+	/** The whole grid */
+	ivlsu_grid_t grid;
+	/** Number of z planes per slab */
+	int planes;
+	/** Number of slabs */
+	long numslabs;
+	/** Next slab to take */
+	long next;
+	/** The output file */
+	int fd;
+	/** The slabs already written */
+	ivlsu_journal_t journal;
+	/** Number of nodes without data */
+	long missing;
+	/** Set to 1 when a slab could not be queried or written */
+	int failed;
+} mesh_job_t;
+
+/**
+ * Writes a buffer at an offset of a file, retrying short writes.
+ *
+ * @param fd The file.
+ * @param buffer The bytes.
+ * @param length Number of bytes.
+ * @param offset Offset in the file.
+ * @return 0 on success.
+ */
+int mesh_pwrite(int fd, const char *buffer, size_t length, off_t offset) {
+	ssize_t written;
+
+	while (length > 0) {
+		written = pwrite(fd, buffer, length, offset);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return 1;
+		buffer += written;
+		length -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+/**
+ * Reads a buffer at an offset of a file, retrying short reads.
+ *
+ * @param fd The file.
+ * @param buffer The bytes.
+ * @param length Number of bytes.
+ * @param offset Offset in the file.
+ * @return 0 on success.
+ */
+int mesh_pread(int fd, char *buffer, size_t length, off_t offset) {
+	ssize_t got;
+
+	while (length > 0) {
+		got = pread(fd, buffer, length, offset);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return 1;
+		buffer += got;
+		length -= got;
+		offset += got;
+	}
+	return 0;
+}
+
+/**
+ * Worker taking slabs until none are left.
+ *
+ * @param arg The mesh job.
+ * @return NULL
+ */
+void *mesh_worker(void *arg) {
+	mesh_job_t *job = arg;
+	long plane = (long)job->grid.nx * job->grid.ny, size = plane * job->planes, slab, i, missing = 0;
+	float *vp = malloc(size * sizeof(float)), *vs = malloc(size * sizeof(float)), *rho = malloc(size * sizeof(float));
+	float *triples = malloc(3 * size * sizeof(float));
+	ivlsu_batch_t batch = { 0 };
+	ivlsu_grid_t grid;
+	size_t length;
+	off_t offset;
+
+	if (vp == NULL || vs == NULL || rho == NULL || triples == NULL)
+		job->failed = 1;
+
+	batch.properties = IVLSU_VP | IVLSU_VS | IVLSU_RHO;
+	batch.type = IVLSU_FLOAT32;
+	batch.vp = vp;
+	batch.vs = vs;
+	batch.rho = rho;
+	while (!job->failed && (slab = __sync_fetch_and_add(&(job->next), 1)) < job->numslabs) {
+		grid = job->grid;
+		grid.origin_depth += slab * job->planes * grid.spacing_depth;
+		grid.nz = job->grid.nz - slab * job->planes < job->planes ? job->grid.nz - slab * job->planes : job->planes;
+		length = 3 * plane * grid.nz * sizeof(float);
+		offset = (off_t)slab * job->planes * plane * 3 * sizeof(float);
+
+		// A slab written before a failure is kept if it still matches its checksum.
+		if (job->journal.done[slab] && mesh_pread(job->fd, (char *)triples, length, offset) == 0 &&
+		    ivlsu_journal_verify(&(job->journal), slab, triples, length)) {
+			for (i = 0; i < plane * grid.nz; i++)
+				missing += triples[3 * i] < 0;
+			continue;
+		}
+
+		if (ivlsu_query_grid(&grid, &batch) != 0) {
+			job->failed = 1;
+			break;
+		}
+
+		for (i = 0; i < plane * grid.nz; i++) {
+			triples[3 * i] = vp[i];
+			triples[3 * i + 1] = vs[i];
+			triples[3 * i + 2] = rho[i];
+			missing += vp[i] < 0;
+		}
+		if (mesh_pwrite(job->fd, (const char *)triples, length, offset) != 0 ||
+		    ivlsu_journal_record(&(job->journal), slab, ivlsu_checksum(triples, length)) != 0)
+			job->failed = 1;
+	}
+
+	__sync_fetch_and_add(&(job->missing), missing);
+	free(vp);
+	free(vs);
+	free(rho);
+	free(triples);
+	return NULL;
+}
+
+/**
+ * Writes the mesh.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return A zero value indicating success.
+ */
+int main(int argc, const char* argv[]) {
+	const char *output = NULL;
+	double corner[2] = { 0, 0 }, spacing = 0;
+	char journal[IVLSU_JOURNAL_LINE], job_line[IVLSU_JOURNAL_LINE];
+	int geographic = -1, nthreads = 0, started = 0, status = 0, t, i;
+	mesh_job_t job;
+	pthread_t threads[IVLSU_MAX_THREADS];
+	ivlsu_worker_t worker = { 0 };
+	char *envstr;
+
+	memset(&job, 0, sizeof(job));
+	job.planes = 1;
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "--corner") == 0 || strcmp(argv[i], "--utm") == 0) && i + 2 < argc) {
+			geographic = strcmp(argv[i], "--corner") == 0;
+			corner[0] = atof(argv[i + 1]);
+			corner[1] = atof(argv[i + 2]);
+			i += 2;
+		} else if (strcmp(argv[i], "--rotation") == 0 && i + 1 < argc) {
+			job.grid.rotation = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--dims") == 0 && i + 3 < argc) {
+			job.grid.nx = atoi(argv[i + 1]);
+			job.grid.ny = atoi(argv[i + 2]);
+			job.grid.nz = atoi(argv[i + 3]);
+			i += 3;
+		} else if (strcmp(argv[i], "--spacing") == 0 && i + 1 < argc) {
+			spacing = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+			job.grid.origin_depth = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--planes") == 0 && i + 1 < argc) {
+			job.planes = atoi(argv[++i]);
+		} else {
+			output = argv[i];
+		}
+	}
+	if (output == NULL || geographic < 0 || job.grid.nx <= 0 || job.grid.ny <= 0 || job.grid.nz <= 0 || spacing <= 0 ||
+	    job.planes <= 0) {
+		fprintf(stderr, "Usage: ivlsu_mesh (--corner lon lat | --utm e n) [--rotation degrees] --dims nx ny nz\n"
+				"                  --spacing meters [--depth meters] [--planes count] output\n");
+		return 1;
+	}
+
+	if ((envstr = getenv("UCVM_INSTALL_PATH")) != NULL)
+		status = ivlsu_init(envstr, "ivlsu");
+	else
+		status = ivlsu_init("..", "ivlsu");
+	if (status != 0) {
+		fprintf(stderr, "Could not load the model.\n");
+		return 1;
+	}
+
+	if (geographic)
+		ivlsu_project_points(&worker, &corner[0], &corner[1], 1, 1, &(job.grid.origin_e), &(job.grid.origin_n));
+	else
+		job.grid.origin_e = corner[0], job.grid.origin_n = corner[1];
+	job.grid.spacing_e = job.grid.spacing_n = job.grid.spacing_depth = spacing;
+	job.numslabs = (job.grid.nz + job.planes - 1) / job.planes;
+
+	// Pick up the slabs of an earlier run of the same mesh, if any.
+	snprintf(journal, sizeof(journal), "%s.journal", output);
+	snprintf(job_line, sizeof(job_line), "ivlsu_mesh %.17g %.17g %.17g %.17g %.17g %d %d %d %d", job.grid.origin_e, job.grid.origin_n,
+		 job.grid.origin_depth, spacing, job.grid.rotation, job.grid.nx, job.grid.ny, job.grid.nz, job.planes);
+	if (ivlsu_journal_open(&(job.journal), journal, job_line, job.numslabs) != 0) {
+		fprintf(stderr, "Could not write %s.\n", journal);
+		return 1;
+	}
+	if (job.journal.recorded > 0)
+		fprintf(stderr, "Resuming from %s, %ld of %ld slabs were written.\n", journal, job.journal.recorded, job.numslabs);
+
+	if ((job.fd = open(output, job.journal.recorded > 0 ? O_RDWR | O_CREAT : O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+	    ftruncate(job.fd, (off_t)job.grid.nx * job.grid.ny * job.grid.nz * 3 * sizeof(float)) != 0) {
+		fprintf(stderr, "Could not create %s.\n", output);
+		return 1;
+	}
+
+	// Each worker queries its own slabs on its own thread.
+	nthreads = ivlsu_thread_count();
+	nthreads = nthreads < job.numslabs ? nthreads : (int)job.numslabs;
+	ivlsu_set_option("threads", "1");
+	for (t = 1; t < nthreads; t++)
+		started += pthread_create(&threads[started], NULL, mesh_worker, &job) == 0;
+	mesh_worker(&job);
+	for (t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+
+	if (job.failed || close(job.fd) != 0) {
+		fprintf(stderr, "Could not write %s, run again to resume.\n", output);
+		ivlsu_journal_close(&(job.journal), 0);
+		status = 1;
+	} else if (ivlsu_journal_close(&(job.journal), 1) != 0) {
+		fprintf(stderr, "Could not remove %s.\n", journal);
+	}
+	if (status == 0 && job.missing > 0)
+		fprintf(stderr, "%ld of %ld nodes have no data and are -1.\n", job.missing, (long)job.grid.nx * job.grid.ny * job.grid.nz);
+
+	ivlsu_finalize();
+	return status;
+}
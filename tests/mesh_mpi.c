@@ -0,0 +1,217 @@
+/**
+ * @file mesh_mpi.c
+ * @brief Writes AWP-ODC material meshes from the IMPERIAL/IVLSU library with MPI.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * Writes the same mesh as ivlsu_mesh from several MPI ranks. The slabs of the mesh
+ * are split into one contiguous range per rank. Each rank loads only the z levels of
+ * the model its range reaches, with ivlsu_init_window, samples its slabs through the
+ * threaded grid kernel and writes them into the one output file with collective
+ * MPI-IO writes.
+ *
+ * The slabs are the same work units as those of ivlsu_mesh and are recorded in the
+ * same journal, output.journal, by the first rank, so a failed run can be resumed
+ * with either tool and any number of ranks.
+ *
+ * Built by "make mpi". Run with, for example:
+ *
+ *   mpirun -np 4 ivlsu_mesh_mpi --utm 590000 3610000 --dims 60 70 9 --spacing 1000 mesh.bin
+ *
+ * Usage: ivlsu_mesh_mpi (--corner lon lat | --utm e n) [--rotation degrees] --dims nx ny nz
+ *                       --spacing meters [--depth meters] [--planes count] output
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <mpi.h>
+#include "ivlsu.h"
+
+/**
+ * Writes the mesh.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return A zero value indicating success.
+ */
+int main(int argc, char* argv[]) {
+	const char *output = NULL;
+	char journal_path[IVLSU_JOURNAL_LINE], job_line[IVLSU_JOURNAL_LINE];
+	double corner[2] = { 0, 0 }, spacing = 0;
+	int geographic = -1, planes = 1, rank = 0, size = 1, failed = 0, any_failed = 0, status = 0, fd = -1, i;
+	long plane = 0, numslabs = 0, first_slab = 0, last_slab = 0, first = 0, last = 0, myslabs = 0, rounds = 0, round = 0;
+	long slab = 0, k = 0, missing = 0, total_missing = 0;
+	uint64_t record[2], *records = NULL;
+	size_t length = 0;
+	float *vp = NULL, *vs = NULL, *rho = NULL, *triples = NULL;
+	ivlsu_journal_t journal;
+	ivlsu_grid_t mesh, grid;
+	ivlsu_batch_t batch = { 0 };
+	ivlsu_worker_t worker = { 0 };
+	MPI_File fh;
+	char *envstr;
+
+	MPI_Init(&argc, &argv);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+	memset(&mesh, 0, sizeof(mesh));
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "--corner") == 0 || strcmp(argv[i], "--utm") == 0) && i + 2 < argc) {
+			geographic = strcmp(argv[i], "--corner") == 0;
+			corner[0] = atof(argv[i + 1]);
+			corner[1] = atof(argv[i + 2]);
+			i += 2;
+		} else if (strcmp(argv[i], "--rotation") == 0 && i + 1 < argc) {
+			mesh.rotation = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--dims") == 0 && i + 3 < argc) {
+			mesh.nx = atoi(argv[i + 1]);
+			mesh.ny = atoi(argv[i + 2]);
+			mesh.nz = atoi(argv[i + 3]);
+			i += 3;
+		} else if (strcmp(argv[i], "--spacing") == 0 && i + 1 < argc) {
+			spacing = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+			mesh.origin_depth = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--planes") == 0 && i + 1 < argc) {
+			planes = atoi(argv[++i]);
+		} else {
+			output = argv[i];
+		}
+	}
+	if (output == NULL || geographic < 0 || mesh.nx <= 0 || mesh.ny <= 0 || mesh.nz <= 0 || spacing <= 0 || planes <= 0) {
+		if (rank == 0)
+			fprintf(stderr, "Usage: ivlsu_mesh_mpi (--corner lon lat | --utm e n) [--rotation degrees] --dims nx ny nz\n"
+					"                      --spacing meters [--depth meters] [--planes count] output\n");
+		MPI_Finalize();
+		return 1;
+	}
+	mesh.spacing_e = mesh.spacing_n = mesh.spacing_depth = spacing;
+	plane = (long)mesh.nx * mesh.ny;
+
+	// This rank's slabs, its planes [first, last) and the z levels of the model they reach.
+	numslabs = (mesh.nz + planes - 1) / planes;
+	first_slab = numslabs * rank / size;
+	last_slab = numslabs * (rank + 1) / size;
+	first = first_slab * planes;
+	last = last_slab * planes < mesh.nz ? last_slab * planes : mesh.nz;
+	if ((envstr = getenv("UCVM_INSTALL_PATH")) != NULL)
+		status = ivlsu_init_window(envstr, "ivlsu", mesh.origin_depth + first * spacing, mesh.origin_depth + (last - 1) * spacing);
+	else
+		status = ivlsu_init_window("..", "ivlsu", mesh.origin_depth + first * spacing, mesh.origin_depth + (last - 1) * spacing);
+	if (status != 0) {
+		fprintf(stderr, "Rank %d could not load the model.\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	if (geographic)
+		ivlsu_project_points(&worker, &corner[0], &corner[1], 1, 1, &(mesh.origin_e), &(mesh.origin_n));
+	else
+		mesh.origin_e = corner[0], mesh.origin_n = corner[1];
+
+	// The first rank keeps the journal and tells the others which slabs it records.
+	snprintf(journal_path, sizeof(journal_path), "%s.journal", output);
+	snprintf(job_line, sizeof(job_line), "ivlsu_mesh %.17g %.17g %.17g %.17g %.17g %d %d %d %d", mesh.origin_e, mesh.origin_n,
+		 mesh.origin_depth, spacing, mesh.rotation, mesh.nx, mesh.ny, mesh.nz, planes);
+	status = ivlsu_journal_open(&journal, rank == 0 ? journal_path : NULL, job_line, numslabs);
+	MPI_Allreduce(&status, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+	if (any_failed) {
+		if (rank == 0)
+			fprintf(stderr, "Could not write %s.\n", journal_path);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	MPI_Bcast(&(journal.recorded), 1, MPI_LONG, 0, MPI_COMM_WORLD);
+	MPI_Bcast(journal.done, (int)numslabs, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+	MPI_Bcast(journal.checksums, (int)numslabs, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+	if (rank == 0 && journal.recorded > 0)
+		fprintf(stderr, "Resuming from %s, %ld of %ld slabs were written.\n", journal_path, journal.recorded, numslabs);
+
+	if (MPI_File_open(MPI_COMM_WORLD, (char *)output, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+		if (rank == 0)
+			fprintf(stderr, "Could not create %s.\n", output);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	MPI_File_set_size(fh, (MPI_Offset)plane * mesh.nz * 3 * sizeof(float));
+	if (journal.recorded > 0 && (fd = open(output, O_RDONLY)) < 0)
+		failed = 1;
+
+	vp = malloc(plane * planes * sizeof(float));
+	vs = malloc(plane * planes * sizeof(float));
+	rho = malloc(plane * planes * sizeof(float));
+	triples = malloc(3 * plane * planes * sizeof(float));
+	records = malloc(2 * size * sizeof(uint64_t));
+	failed |= vp == NULL || vs == NULL || rho == NULL || triples == NULL || records == NULL;
+
+	batch.properties = IVLSU_VP | IVLSU_VS | IVLSU_RHO;
+	batch.type = IVLSU_FLOAT32;
+	batch.vp = vp;
+	batch.vs = vs;
+	batch.rho = rho;
+
+	// Every rank takes part in every collective write, with nothing to write once its slabs run out
+	// or for a slab it kept from an earlier run.
+	myslabs = last_slab - first_slab;
+	MPI_Allreduce(&myslabs, &rounds, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+	for (round = 0; round < rounds; round++) {
+		slab = first_slab + round;
+		grid = mesh;
+		grid.origin_depth += slab * planes * spacing;
+		grid.nz = round < myslabs && !failed ? (int)(last - slab * planes < planes ? last - slab * planes : planes) : 0;
+		length = 3 * plane * grid.nz * sizeof(float);
+		record[0] = UINT64_MAX;
+
+		if (grid.nz > 0 && journal.done[slab] && pread(fd, triples, length, (off_t)slab * planes * plane * 3 * sizeof(float)) == (ssize_t)length &&
+		    ivlsu_journal_verify(&journal, slab, triples, length)) {
+			for (k = 0; k < plane * grid.nz; k++)
+				missing += triples[3 * k] < 0;
+			grid.nz = 0;
+		} else if (grid.nz > 0 && ivlsu_query_grid(&grid, &batch) != 0) {
+			failed = 1;
+			grid.nz = 0;
+		}
+		for (k = 0; k < plane * grid.nz; k++) {
+			triples[3 * k] = vp[k];
+			triples[3 * k + 1] = vs[k];
+			triples[3 * k + 2] = rho[k];
+			missing += vp[k] < 0;
+		}
+
+		if (MPI_File_write_at_all(fh, (MPI_Offset)slab * planes * plane * 3 * sizeof(float), triples,
+					  (int)(3 * plane * grid.nz), MPI_FLOAT, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+			failed = 1;
+		else if (grid.nz > 0)
+			record[0] = slab, record[1] = ivlsu_checksum(triples, 3 * plane * grid.nz * sizeof(float));
+
+		// The first rank records the slabs written in this round.
+		MPI_Gather(record, 2, MPI_UINT64_T, records, 2, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+		for (i = 0; rank == 0 && i < size; i++) {
+			if (records[2 * i] != UINT64_MAX && ivlsu_journal_record(&journal, (long)records[2 * i], records[2 * i + 1]) != 0)
+				failed = 1;
+		}
+	}
+
+	if (MPI_File_close(&fh) != MPI_SUCCESS)
+		failed = 1;
+	if (fd >= 0)
+		close(fd);
+	MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+	MPI_Reduce(&missing, &total_missing, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	if (ivlsu_journal_close(&journal, !any_failed) != 0)
+		fprintf(stderr, "Could not remove %s.\n", journal_path);
+	if (rank == 0 && any_failed)
+		fprintf(stderr, "Could not write %s, run again to resume.\n", output);
+	else if (rank == 0 && total_missing > 0)
+		fprintf(stderr, "%ld of %ld nodes have no data and are -1.\n", total_missing, plane * mesh.nz);
+
+	free(vp);
+	free(vs);
+	free(rho);
+	free(triples);
+	free(records);
+	ivlsu_finalize();
+	MPI_Finalize();
+	return any_failed;
+}
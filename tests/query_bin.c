@@ -0,0 +1,243 @@
+/**
+ * @file query_bin.c
+ * @brief Queries the IMPERIAL/IVLSU library for a binary file of points.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * Reads a file of native endian float64 (longitude, latitude, depth) records and
+ * writes the selected properties of every point to a file holding one plane per
+ * property, in the order vp, vs, rho, each numpoints values long. Both files are
+ * memory mapped. The points go through the parallel batch path a chunk at a time,
+ * and a loader thread unpacks the next chunk of records while the current one is
+ * evaluated, so that reading the input overlaps the queries. The output is written
+ * in place by the batch kernel through the shared mapping.
+ *
+ * Usage: ivlsu_query_bin [--properties vp,vs,rho] [--float64] [--chunk points] input output
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ivlsu.h"
+
+/** Default number of points per chunk. */
+#define QUERY_BIN_CHUNK (1 << 20)
+
+/** A chunk of points unpacked into the arrays of a batch. */
+typedef struct query_bin_chunk_t {
+	/** The mapped (longitude, latitude, depth) records */
+	const double *records;
+	/** Index of the first point of the chunk */
+	long first;
+	/** Number of points of the chunk */
+	long count;
+	/** Unpacked longitudes */
+	double *longitude;
+	/** Unpacked latitudes */
+	double *latitude;
+	/** Unpacked depths */
+	double *depth;
+} query_bin_chunk_t;
+
+/**
+ * Unpacks a chunk of records into its longitude, latitude and depth arrays, and asks
+ * the kernel to read ahead the records of the chunk after it.
+ *
+ * @param arg The chunk.
+ * @return NULL
+ */
+void *query_bin_load(void *arg) {
+	query_bin_chunk_t *chunk = arg;
+	const double *record = chunk->records + 3 * chunk->first;
+	long i;
+
+	madvise((void *)((uintptr_t)(record + 3 * chunk->count) & ~(uintptr_t)(getpagesize() - 1)), 3 * chunk->count * sizeof(double),
+		MADV_WILLNEED);
+	for (i = 0; i < chunk->count; i++, record += 3) {
+		chunk->longitude[i] = record[0];
+		chunk->latitude[i] = record[1];
+		chunk->depth[i] = record[2];
+	}
+	return NULL;
+}
+
+/**
+ * Parses a comma separated list of vp, vs and rho.
+ *
+ * @param list The list.
+ * @return The IVLSU_VP, IVLSU_VS and IVLSU_RHO bitmask, or 0 if the list is not valid.
+ */
+int query_bin_properties(const char *list) {
+	char copy[64], *name, *rest;
+	int properties = 0;
+
+	snprintf(copy, sizeof(copy), "%s", list);
+	for (name = strtok_r(copy, ",", &rest); name != NULL; name = strtok_r(NULL, ",", &rest)) {
+		if (strcmp(name, "vp") == 0)
+			properties |= IVLSU_VP;
+		else if (strcmp(name, "vs") == 0)
+			properties |= IVLSU_VS;
+		else if (strcmp(name, "rho") == 0)
+			properties |= IVLSU_RHO;
+		else
+			return 0;
+	}
+	return properties;
+}
+
+/**
+ * Queries the model for a binary file of points.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return A zero value indicating success.
+ */
+int main(int argc, const char* argv[]) {
+	const char *input = NULL, *output = NULL;
+	int properties = IVLSU_VP | IVLSU_VS | IVLSU_RHO, type = IVLSU_FLOAT32, planes = 0, status = 0, in_fd = -1, out_fd = -1, loading = 0, i;
+	long chunk_size = QUERY_BIN_CHUNK, numpoints = 0, first = 0, count = 0, element = 0, numchunks = 0, k = 0;
+	query_bin_chunk_t chunks[2];
+	ivlsu_batch_t batch = { 0 };
+	void *records = NULL, *values = NULL;
+	size_t in_size = 0, out_size = 0;
+	char *plane = NULL;
+	struct stat st;
+	pthread_t loader;
+	char *envstr;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--properties") == 0 && i + 1 < argc) {
+			properties = query_bin_properties(argv[++i]);
+		} else if (strcmp(argv[i], "--float64") == 0) {
+			type = IVLSU_FLOAT64;
+		} else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc) {
+			chunk_size = atol(argv[++i]);
+		} else if (input == NULL) {
+			input = argv[i];
+		} else {
+			output = argv[i];
+		}
+	}
+	if (input == NULL || output == NULL || properties == 0 || chunk_size <= 0 || chunk_size > 1 << 30) {
+		fprintf(stderr, "Usage: ivlsu_query_bin [--properties vp,vs,rho] [--float64] [--chunk points] input output\n");
+		return 1;
+	}
+	planes = ((properties & IVLSU_VP) != 0) + ((properties & IVLSU_VS) != 0) + ((properties & IVLSU_RHO) != 0);
+	element = type == IVLSU_FLOAT64 ? sizeof(double) : sizeof(float);
+
+	if ((envstr = getenv("UCVM_INSTALL_PATH")) != NULL)
+		status = ivlsu_init(envstr, "ivlsu");
+	else
+		status = ivlsu_init("..", "ivlsu");
+	if (status != 0) {
+		fprintf(stderr, "Could not load the model.\n");
+		return 1;
+	}
+
+	// Map the points and a pre-sized output file.
+	if ((in_fd = open(input, O_RDONLY)) < 0 || fstat(in_fd, &st) != 0 || st.st_size % (3 * sizeof(double)) != 0) {
+		fprintf(stderr, "Could not read %s as (longitude, latitude, depth) float64 records.\n", input);
+		return 1;
+	}
+	in_size = st.st_size;
+	numpoints = in_size / (3 * sizeof(double));
+	out_size = (size_t)numpoints * planes * element;
+
+	if ((out_fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(out_fd, out_size) != 0) {
+		fprintf(stderr, "Could not create %s.\n", output);
+		return 1;
+	}
+	if (numpoints > 0) {
+		records = mmap(NULL, in_size, PROT_READ, MAP_SHARED, in_fd, 0);
+		values = mmap(NULL, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+		if (records == MAP_FAILED || values == MAP_FAILED) {
+			fprintf(stderr, "Could not map the input and output files.\n");
+			return 1;
+		}
+		madvise(records, in_size, MADV_SEQUENTIAL);
+	}
+
+	chunk_size = chunk_size < numpoints ? chunk_size : numpoints;
+	for (k = 0; k < 2; k++) {
+		chunks[k].records = records;
+		chunks[k].longitude = malloc(chunk_size * sizeof(double));
+		chunks[k].latitude = malloc(chunk_size * sizeof(double));
+		chunks[k].depth = malloc(chunk_size * sizeof(double));
+		if (numpoints > 0 && (chunks[k].longitude == NULL || chunks[k].latitude == NULL || chunks[k].depth == NULL)) {
+			fprintf(stderr, "Could not allocate the chunks.\n");
+			return 1;
+		}
+	}
+
+	// Evaluate each chunk while the loader unpacks the one after it.
+	numchunks = numpoints > 0 ? (numpoints + chunk_size - 1) / chunk_size : 0;
+	if (numchunks > 0) {
+		chunks[0].first = 0;
+		chunks[0].count = chunk_size;
+		query_bin_load(&chunks[0]);
+	}
+	batch.properties = properties;
+	batch.type = type;
+	for (k = 0; k < numchunks && status == 0; k++) {
+		query_bin_chunk_t *current = &chunks[k % 2], *next = &chunks[(k + 1) % 2];
+
+		if (k + 1 < numchunks) {
+			next->first = (k + 1) * chunk_size;
+			next->count = numpoints - next->first < chunk_size ? numpoints - next->first : chunk_size;
+			loading = pthread_create(&loader, NULL, query_bin_load, next) == 0;
+			if (!loading)
+				query_bin_load(next);
+		}
+
+		first = current->first;
+		count = current->count;
+		plane = (char *)values;
+		batch.numpoints = (int)count;
+		batch.longitude = current->longitude;
+		batch.latitude = current->latitude;
+		batch.depth = current->depth;
+		if (properties & IVLSU_VP) {
+			batch.vp = plane + first * element;
+			plane += numpoints * element;
+		}
+		if (properties & IVLSU_VS) {
+			batch.vs = plane + first * element;
+			plane += numpoints * element;
+		}
+		if (properties & IVLSU_RHO)
+			batch.rho = plane + first * element;
+		if (ivlsu_query_batch(&batch) != 0) {
+			fprintf(stderr, "Could not query the points %ld to %ld.\n", first, first + count - 1);
+			status = 1;
+		}
+
+		if (loading) {
+			pthread_join(loader, NULL);
+			loading = 0;
+		}
+	}
+
+	if (numpoints > 0) {
+		if (msync(values, out_size, MS_SYNC) != 0)
+			status = 1;
+		munmap(values, out_size);
+		munmap(records, in_size);
+	}
+	if (close(out_fd) != 0)
+		status = 1;
+	close(in_fd);
+	for (k = 0; k < 2; k++) {
+		free(chunks[k].longitude);
+		free(chunks[k].latitude);
+		free(chunks[k].depth);
+	}
+
+	ivlsu_finalize();
+	if (status != 0)
+		fprintf(stderr, "Could not write %s.\n", output);
+	return status;
+}
@@ -0,0 +1,449 @@
+/**
+ * @file query_text.c
+ * @brief Queries the IMPERIAL/IVLSU library for text lines of points.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * Reads "longitude latitude depth" lines, the input of ucvm_query, and writes each
+ * line back followed by the point's vp, vs and rho, -1 where the model has no data.
+ * Blank lines and lines starting with # are copied through, and lines that do not
+ * hold three numbers get -1 for every property. The input is read in large blocks
+ * that are split into line aligned pieces: the pieces are parsed in parallel, the
+ * block goes through the parallel batch path, and the pieces are formatted in
+ * parallel and written out in their order. Numbers are parsed and formatted by hand
+ * rather than with sscanf and printf, and each property is written with the fewest
+ * digits that read back to the same float.
+ *
+ * Usage: ivlsu_query_text [input [output]]
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "ivlsu.h"
+
+/** Bytes of input read at a time. */
+#define QUERY_TEXT_BLOCK (16 << 20)
+/** Pieces of a block per worker thread. */
+#define QUERY_TEXT_PIECES 4
+/** Bytes a formatted property takes at most, with its separator. */
+#define QUERY_TEXT_NUMBER 24
+
+/** Powers of ten exactly representable as doubles. */
+static const double query_text_powers[23] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+					       1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+/** A line aligned piece of a block. */
+typedef struct query_text_piece_t {
+	/** First byte of the piece */
+	const char *text;
+	/** Number of bytes of the piece, ending with a newline */
+	long length;
+	/** Index of the first line of the piece within the block */
+	long first;
+	/** Number of lines of the piece */
+	long lines;
+	/** The formatted lines */
+	char *output;
+	/** Number of formatted bytes */
+	long output_length;
+} query_text_piece_t;
+
+/** A block of lines on its way through the model. */
+typedef struct query_text_block_t {
+	/** The pieces */
+	query_text_piece_t *pieces;
+	/** Longitude of each line, NaN if the line holds no point */
+	double *longitude;
+	/** Latitude of each line */
+	double *latitude;
+	/** Depth of each line */
+	double *depth;
+	/** Vp of each line */
+	float *vp;
+	/** Vs of each line */
+	float *vs;
+	/** Density of each line */
+	float *rho;
+} query_text_block_t;
+
+/**
+ * Returns whether a line holds no point: it is blank or starts with #.
+ *
+ * @param line First byte of the line.
+ * @return Non-zero if the line is copied through.
+ */
+static int query_text_skipped(const char *line) {
+	while (*line == ' ' || *line == '\t')
+		line++;
+	return *line == '\n' || *line == '\r' || *line == '#';
+}
+
+/**
+ * Parses a decimal number. Numbers of at most 19 significant digits whose mantissa
+ * and power of ten are both exact doubles are converted with one correctly rounded
+ * multiplication or division; the others are handed to strtod.
+ *
+ * @param cursor The text, moved past the number.
+ * @param value The returned number.
+ * @return Non-zero if a number was parsed.
+ */
+static int query_text_number(const char **cursor, double *value) {
+	const char *p = *cursor, *start = NULL;
+	uint64_t mantissa = 0;
+	int negative = 0, exponent = 0, digits = 0, truncated = 0, power = 0, power_negative = 0;
+
+	while (*p == ' ' || *p == '\t' || *p == ',')
+		p++;
+	start = p;
+	if (*p == '-' || *p == '+')
+		negative = *p++ == '-';
+
+	for (; *p >= '0' && *p <= '9'; p++, digits++) {
+		if (mantissa < 1000000000000000000ULL)
+			mantissa = 10 * mantissa + (*p - '0');
+		else
+			exponent++, truncated |= *p != '0';
+	}
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++, digits++) {
+			if (mantissa < 1000000000000000000ULL)
+				mantissa = 10 * mantissa + (*p - '0'), exponent--;
+			else
+				truncated |= *p != '0';
+		}
+	}
+	if (digits == 0)
+		return 0;
+	if (*p == 'e' || *p == 'E') {
+		p++;
+		if (*p == '-' || *p == '+')
+			power_negative = *p++ == '-';
+		if (*p < '0' || *p > '9')
+			return 0;
+		for (; *p >= '0' && *p <= '9'; p++)
+			power = power < 10000 ? 10 * power + (*p - '0') : power;
+		exponent += power_negative ? -power : power;
+	}
+	if (*p != ' ' && *p != '\t' && *p != ',' && *p != '\n' && *p != '\r')
+		return 0;
+
+	if (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+		*value = exponent < 0 ? (double)mantissa / query_text_powers[-exponent] : (double)mantissa * query_text_powers[exponent];
+		*value = negative ? -*value : *value;
+	} else {
+		*value = strtod(start, NULL);
+	}
+	*cursor = p;
+	return 1;
+}
+
+/**
+ * Formats a float with the fewest significant digits that read back to it, in plain
+ * notation, or in exponent notation for very small and very large magnitudes.
+ *
+ * @param value The value.
+ * @param out The returned text, at least QUERY_TEXT_NUMBER bytes.
+ * @return Number of bytes written.
+ */
+static int query_text_format(float value, char *out) {
+	char digits[24];
+	double magnitude = fabs((double)value), candidate = 0;
+	uint64_t scaled = 0;
+	int length = 0, count = 0, exponent = 0, scale = 0, i = 0, point = 0;
+
+	if (value == 0 || !isfinite(value))
+		return snprintf(out, QUERY_TEXT_NUMBER, "%g", value);
+	if (value < 0)
+		out[length++] = '-';
+
+	// Find the fewest digits that round trip, scaling by an exact power of ten.
+	exponent = (int)floor(log10(magnitude));
+	for (count = 1; count <= 9; count++) {
+		scale = count - 1 - exponent;
+		candidate = scale >= 0 ? magnitude * (scale <= 22 ? query_text_powers[scale] : pow(10, scale))
+				       : magnitude / (-scale <= 22 ? query_text_powers[-scale] : pow(10, -scale));
+		scaled = (uint64_t)nearbyint(candidate);
+		candidate = scale >= 0 ? scaled / (scale <= 22 ? query_text_powers[scale] : pow(10, scale))
+				       : scaled * (-scale <= 22 ? query_text_powers[-scale] : pow(10, -scale));
+		if ((float)candidate == fabsf(value))
+			break;
+	}
+	if (count > 9)
+		return snprintf(out, QUERY_TEXT_NUMBER, "%.9g", value);
+	for (; scaled % 10 == 0 && scaled > 0; scale--)
+		scaled /= 10;
+
+	for (count = 0; scaled > 0; scaled /= 10)
+		digits[count++] = '0' + scaled % 10;
+	point = count - scale;
+
+	if (point < -5 || point > 17) {
+		// d.ddde[-]x
+		out[length++] = digits[count - 1];
+		if (count > 1)
+			out[length++] = '.';
+		for (i = count - 2; i >= 0; i--)
+			out[length++] = digits[i];
+		return length + sprintf(out + length, "e%d", point - 1);
+	}
+	if (point <= 0) {
+		out[length++] = '0';
+		out[length++] = '.';
+		for (i = point; i < 0; i++)
+			out[length++] = '0';
+	}
+	for (i = count - 1; i >= 0; i--) {
+		if (count - 1 - i == point && point > 0)
+			out[length++] = '.';
+		out[length++] = digits[i];
+	}
+	for (i = count; i < point; i++)
+		out[length++] = '0';
+	return length;
+}
+
+/**
+ * Task counting the lines of the pieces [begin, end).
+ */
+static void query_text_count_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	query_text_block_t *block = arg;
+	query_text_piece_t *piece = NULL;
+	const char *p = NULL, *last = NULL;
+
+	for (piece = &(block->pieces[begin]); piece < &(block->pieces[end]); piece++) {
+		last = piece->text + piece->length;
+		for (piece->lines = 0, p = piece->text; p < last && (p = memchr(p, '\n', last - p)) != NULL; p++)
+			piece->lines++;
+	}
+}
+
+/**
+ * Task parsing the points of the pieces [begin, end).
+ */
+static void query_text_parse_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	query_text_block_t *block = arg;
+	query_text_piece_t *piece = NULL;
+	const char *p = NULL;
+	long line = 0;
+
+	for (piece = &(block->pieces[begin]); piece < &(block->pieces[end]); piece++) {
+		p = piece->text;
+		for (line = piece->first; line < piece->first + piece->lines; line++) {
+			if (query_text_skipped(p) || !query_text_number(&p, &(block->longitude[line])) ||
+			    !query_text_number(&p, &(block->latitude[line])) || !query_text_number(&p, &(block->depth[line])))
+				block->longitude[line] = block->latitude[line] = block->depth[line] = NAN;
+			p = (const char *)memchr(p, '\n', piece->text + piece->length - p) + 1;
+		}
+	}
+}
+
+/**
+ * Task formatting the lines of the pieces [begin, end).
+ */
+static void query_text_format_task(void *arg, ivlsu_worker_t *worker, long begin, long end) {
+	query_text_block_t *block = arg;
+	query_text_piece_t *piece = NULL;
+	const char *p = NULL, *next = NULL;
+	char *out = NULL;
+	long line = 0, length = 0;
+
+	for (piece = &(block->pieces[begin]); piece < &(block->pieces[end]); piece++) {
+		p = piece->text;
+		out = piece->output;
+		for (line = piece->first; line < piece->first + piece->lines; line++, p = next) {
+			next = (const char *)memchr(p, '\n', piece->text + piece->length - p) + 1;
+			if (query_text_skipped(p)) {
+				memcpy(out, p, next - p);
+				out += next - p;
+				continue;
+			}
+			for (length = next - 1 - p; length > 0 && (p[length - 1] == ' ' || p[length - 1] == '\t' || p[length - 1] == '\r'); length--)
+				;
+			memcpy(out, p, length);
+			out += length;
+			*out++ = ' ';
+			out += query_text_format(block->vp[line], out);
+			*out++ = ' ';
+			out += query_text_format(block->vs[line], out);
+			*out++ = ' ';
+			out += query_text_format(block->rho[line], out);
+			*out++ = '\n';
+		}
+		piece->output_length = out - piece->output;
+	}
+}
+
+/**
+ * Queries the model for the lines of a block and writes them out.
+ *
+ * @param text The lines, each ending with a newline.
+ * @param length Number of bytes of the lines.
+ * @param numpieces Number of pieces to split the lines into.
+ * @param pieces Room for the pieces.
+ * @param output The stream the lines are written to.
+ * @return 0 on success.
+ */
+static int query_text_block(const char *text, long length, int numpieces, query_text_piece_t *pieces, FILE *output) {
+	query_text_block_t block = { pieces };
+	ivlsu_batch_t batch = { 0 };
+	const char *start = text, *cut = NULL;
+	long lines = 0;
+	int i, status = 0;
+
+	// Split the block into pieces ending on a newline.
+	for (i = 0; i < numpieces; i++) {
+		cut = i == numpieces - 1 ? text + length : text + length * (i + 1) / numpieces;
+		if (cut < start)
+			cut = start;
+		if (cut < text + length)
+			cut = (const char *)memchr(cut, '\n', text + length - cut) + 1;
+		pieces[i].text = start;
+		pieces[i].length = cut - start;
+		start = cut;
+	}
+
+	ivlsu_parallel_for(numpieces, 1, query_text_count_task, &block);
+	for (i = 0; i < numpieces; i++) {
+		pieces[i].first = lines;
+		lines += pieces[i].lines;
+		pieces[i].output = malloc(pieces[i].length + pieces[i].lines * 3 * QUERY_TEXT_NUMBER);
+		status |= pieces[i].output == NULL;
+	}
+	block.longitude = malloc(lines * sizeof(double));
+	block.latitude = malloc(lines * sizeof(double));
+	block.depth = malloc(lines * sizeof(double));
+	block.vp = malloc(lines * sizeof(float));
+	block.vs = malloc(lines * sizeof(float));
+	block.rho = malloc(lines * sizeof(float));
+	if (status != 0 || block.longitude == NULL || block.latitude == NULL || block.depth == NULL || block.vp == NULL ||
+	    block.vs == NULL || block.rho == NULL) {
+		fprintf(stderr, "Could not allocate a block of %ld lines.\n", lines);
+		status = 1;
+	}
+
+	if (status == 0) {
+		ivlsu_parallel_for(numpieces, 1, query_text_parse_task, &block);
+
+		batch.numpoints = (int)lines;
+		batch.longitude = block.longitude;
+		batch.latitude = block.latitude;
+		batch.depth = block.depth;
+		batch.properties = IVLSU_VP | IVLSU_VS | IVLSU_RHO;
+		batch.type = IVLSU_FLOAT32;
+		batch.vp = block.vp;
+		batch.vs = block.vs;
+		batch.rho = block.rho;
+		if (ivlsu_query_batch(&batch) != 0) {
+			fprintf(stderr, "Could not query a block of %ld lines.\n", lines);
+			status = 1;
+		}
+	}
+
+	if (status == 0) {
+		ivlsu_parallel_for(numpieces, 1, query_text_format_task, &block);
+		for (i = 0; i < numpieces && status == 0; i++)
+			if (fwrite(pieces[i].output, 1, pieces[i].output_length, output) != (size_t)pieces[i].output_length)
+				status = 1;
+	}
+
+	for (i = 0; i < numpieces; i++)
+		free(pieces[i].output);
+	free(block.longitude);
+	free(block.latitude);
+	free(block.depth);
+	free(block.vp);
+	free(block.vs);
+	free(block.rho);
+	return status;
+}
+
+/**
+ * Queries the model for text lines of points.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return A zero value indicating success.
+ */
+int main(int argc, const char* argv[]) {
+	FILE *input = stdin, *output = stdout;
+	query_text_piece_t *pieces = NULL;
+	char *buffer = NULL, *grown = NULL, *end = NULL;
+	long capacity = QUERY_TEXT_BLOCK, filled = 0, used = 0, got = 0;
+	int numpieces = 0, status = 0, done = 0;
+	char *envstr;
+
+	if (argc > 3 || (argc > 1 && strcmp(argv[1], "--help") == 0)) {
+		fprintf(stderr, "Usage: ivlsu_query_text [input [output]]\n");
+		return 1;
+	}
+	if (argc > 1 && strcmp(argv[1], "-") != 0 && (input = fopen(argv[1], "r")) == NULL) {
+		fprintf(stderr, "Could not open %s.\n", argv[1]);
+		return 1;
+	}
+	if (argc > 2 && (output = fopen(argv[2], "w")) == NULL) {
+		fprintf(stderr, "Could not create %s.\n", argv[2]);
+		return 1;
+	}
+
+	if ((envstr = getenv("UCVM_INSTALL_PATH")) != NULL)
+		status = ivlsu_init(envstr, "ivlsu");
+	else
+		status = ivlsu_init("..", "ivlsu");
+	if (status != 0) {
+		fprintf(stderr, "Could not load the model.\n");
+		return 1;
+	}
+
+	numpieces = QUERY_TEXT_PIECES * ivlsu_thread_count();
+	pieces = malloc(numpieces * sizeof(query_text_piece_t));
+	buffer = malloc(capacity + 1);
+	if (pieces == NULL || buffer == NULL) {
+		fprintf(stderr, "Could not allocate the input buffer.\n");
+		return 1;
+	}
+
+	// Query each block up to its last newline, carrying the partial line over.
+	while (!done && status == 0) {
+		got = fread(buffer + filled, 1, capacity - filled, input);
+		filled += got;
+		done = got == 0;
+		if (done && filled > 0 && buffer[filled - 1] != '\n')
+			buffer[filled++] = '\n';
+
+		for (end = buffer + filled - 1; end >= buffer && *end != '\n'; end--)
+			;
+		if (end < buffer) {
+			if (filled == capacity) {
+				// A line longer than the buffer.
+				if ((grown = realloc(buffer, 2 * capacity + 1)) == NULL) {
+					fprintf(stderr, "Could not allocate the input buffer.\n");
+					status = 1;
+				}
+				buffer = grown != NULL ? grown : buffer;
+				capacity *= 2;
+			}
+			continue;
+		}
+
+		used = end + 1 - buffer;
+		status = query_text_block(buffer, used, numpieces, pieces, output);
+		memmove(buffer, buffer + used, filled - used);
+		filled -= used;
+	}
+	if (ferror(input) || fflush(output) != 0)
+		status = 1;
+
+	if (input != stdin)
+		fclose(input);
+	if (output != stdout && fclose(output) != 0)
+		status = 1;
+	free(buffer);
+	free(pieces);
+
+	ivlsu_finalize();
+	if (status != 0)
+		fprintf(stderr, "Could not query the lines.\n");
+	return status;
+}
@@ -0,0 +1,164 @@
+/**
+ * @file server.c
+ * @brief Serves the IMPERIAL/IVLSU library over a UNIX domain socket.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * Loads the model once and answers the queries of other processes, made through
+ * ivlsu_client_query, until it is interrupted. Each connection is served on its own
+ * thread; see ivlsu_server.c for the protocol. The connections' queries are evaluated
+ * at the same time, the library's worker threads helping one of them at a time.
+ * SIGHUP reloads the model's data in the background while the queries go on, see
+ * ivlsu_reload.
+ *
+ * Usage: ivlsu_server socket
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ivlsu.h"
+
+/** Set by SIGINT and SIGTERM. */
+volatile sig_atomic_t server_stopping = 0;
+/** Set by SIGHUP. */
+volatile sig_atomic_t server_reload_requested = 0;
+/** Number of connections being served. */
+long server_connections = 0;
+/** Non-zero while a reload runs. */
+long server_reloading = 0;
+/** The directory the model was loaded from. */
+const char *server_directory = "..";
+
+/**
+ * Stops accepting connections.
+ *
+ * @param signal The signal.
+ */
+void server_stop(int signal) {
+	server_stopping = 1;
+}
+
+/**
+ * Asks for the model to be reloaded.
+ *
+ * @param signal The signal.
+ */
+void server_request_reload(int signal) {
+	server_reload_requested = 1;
+}
+
+/**
+ * Reloads the model from the directory it was loaded from.
+ *
+ * @param arg Unused.
+ * @return NULL
+ */
+void *server_reload(void *arg) {
+	if (ivlsu_reload(server_directory, "ivlsu") == 0)
+		fprintf(stderr, "Reloaded the model.\n");
+	else
+		fprintf(stderr, "Could not reload the model; still serving the old one.\n");
+	__sync_fetch_and_sub(&server_reloading, 1);
+	return NULL;
+}
+
+/**
+ * Serves a connection and closes it.
+ *
+ * @param arg The socket, as a long.
+ * @return NULL
+ */
+void *server_connection(void *arg) {
+	int fd = (int)(long)arg;
+
+	ivlsu_serve_connection(fd);
+	close(fd);
+	__sync_fetch_and_sub(&server_connections, 1);
+	return NULL;
+}
+
+/**
+ * Runs the server.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return A zero value indicating success.
+ */
+int main(int argc, const char* argv[]) {
+	struct sockaddr_un address;
+	struct sigaction action;
+	pthread_attr_t attributes;
+	pthread_t thread;
+	int listener, fd, status = 0;
+	char *envstr;
+
+	if (argc != 2 || strlen(argv[1]) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Usage: ivlsu_server socket\n");
+		return 1;
+	}
+
+	if ((envstr = getenv("UCVM_INSTALL_PATH")) != NULL)
+		server_directory = envstr;
+	status = ivlsu_init(server_directory, "ivlsu");
+	if (status != 0) {
+		fprintf(stderr, "Could not load the model.\n");
+		return 1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, argv[1]);
+	unlink(argv[1]);
+	if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+	    listen(listener, SOMAXCONN) != 0) {
+		fprintf(stderr, "Could not listen on %s.\n", argv[1]);
+		return 1;
+	}
+
+	// Interrupt accept on SIGINT and SIGTERM rather than restarting it.
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = server_stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	action.sa_handler = server_request_reload;
+	sigaction(SIGHUP, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	fprintf(stderr, "Serving the model on %s.\n", argv[1]);
+	while (!server_stopping) {
+		// Reload on a thread of its own, so that connections are still accepted meanwhile.
+		if (server_reload_requested) {
+			server_reload_requested = 0;
+			if (__sync_fetch_and_add(&server_reloading, 1) != 0 ||
+			    pthread_create(&thread, &attributes, server_reload, NULL) != 0)
+				__sync_fetch_and_sub(&server_reloading, 1);
+		}
+		if ((fd = accept(listener, NULL, NULL)) < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				fprintf(stderr, "Could not accept a connection: %s.\n", strerror(errno));
+			continue;
+		}
+		__sync_fetch_and_add(&server_connections, 1);
+		if (pthread_create(&thread, &attributes, server_connection, (void *)(long)fd) != 0) {
+			close(fd);
+			__sync_fetch_and_sub(&server_connections, 1);
+		}
+	}
+	pthread_attr_destroy(&attributes);
+
+	close(listener);
+	unlink(argv[1]);
+
+	// Connections still being served, or a reload, keep the model until the process exits.
+	if (__sync_fetch_and_add(&server_connections, 0) == 0 && __sync_fetch_and_add(&server_reloading, 0) == 0)
+		ivlsu_finalize();
+	return 0;
+}
@@ -12,8 +12,130 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <sys/socket.h>
 #include "ivlsu.h"
 
+/**
+ * Serves the queries of one end of a socket pair.
+ *
+ * @param arg The socket.
+ * @return NULL if the connection ended without error.
+ */
+void *test_serve(void *arg) {
+	return ivlsu_serve_connection(*(int *)arg) == 0 ? NULL : arg;
+}
+
+/** A client querying the server alongside other clients. */
+typedef struct test_client_t {
+	/** The client's end of the connection */
+	int fd;
+	/** The points */
+	ivlsu_point_t *points;
+	/** Properties of each point queried in process */
+	const ivlsu_properties_t *expected;
+	/** Number of points */
+	int numpoints;
+	/** Number of queries that did not return the expected values */
+	long mismatches;
+} test_client_t;
+
+/**
+ * Queries the server a few times, then closes the connection.
+ *
+ * @param arg The test_client_t.
+ * @return NULL
+ */
+void *test_client_loop(void *arg) {
+	test_client_t *test = arg;
+	ivlsu_properties_t *data = calloc(test->numpoints, sizeof(ivlsu_properties_t));
+	ivlsu_client_t client = { test->fd };
+	int round;
+
+	for (round = 0; round < 8; round++)
+		if (ivlsu_client_query(&client, test->points, data, test->numpoints) != 0 ||
+		    memcmp(data, test->expected, test->numpoints * sizeof(ivlsu_properties_t)) != 0)
+			test->mismatches++;
+	ivlsu_client_close(&client);
+	free(data);
+	return NULL;
+}
+
+/** A thread querying a grid while the model is reloaded. */
+typedef struct test_reload_t {
+	/** The grid queried */
+	const ivlsu_grid_t *grid;
+	/** Vp of each node of the grid before the reload */
+	const double *expected;
+	/** Set to stop querying */
+	volatile int stop;
+	/** Number of queries made */
+	long queries;
+	/** Number of queries that did not return the expected values */
+	long mismatches;
+} test_reload_t;
+
+/**
+ * Queries a grid until stopped, counting the results that differ from the expected.
+ *
+ * @param arg The test_reload_t.
+ * @return NULL
+ */
+void *test_query_loop(void *arg) {
+	test_reload_t *reload = arg;
+	long numpoints = (long)reload->grid->nx * reload->grid->ny * reload->grid->nz;
+	double *vp = malloc(numpoints * sizeof(double));
+	ivlsu_batch_t batch = { 0 };
+
+	batch.properties = IVLSU_VP;
+	batch.type = IVLSU_FLOAT64;
+	batch.vp = vp;
+	while (!reload->stop) {
+		if (ivlsu_query_grid(reload->grid, &batch) != 0 || memcmp(vp, reload->expected, numpoints * sizeof(double)) != 0)
+			reload->mismatches++;
+		reload->queries++;
+	}
+	free(vp);
+	return NULL;
+}
+
+/** A thread querying an instance, or the model, alongside other threads. */
+typedef struct test_instance_t {
+	/** The instance queried, NULL for the model */
+	const ivlsu_instance_t *instance;
+	/** The points */
+	ivlsu_point_t *points;
+	/** Properties of each point queried alone */
+	const ivlsu_properties_t *expected;
+	/** Number of points */
+	int numpoints;
+	/** Number of queries that did not return the expected values */
+	long mismatches;
+} test_instance_t;
+
+/**
+ * Queries the points a few times, counting the results that differ from the expected.
+ *
+ * @param arg The test_instance_t.
+ * @return NULL
+ */
+void *test_instance_loop(void *arg) {
+	test_instance_t *test = arg;
+	ivlsu_properties_t *data = calloc(test->numpoints, sizeof(ivlsu_properties_t));
+	int round, i, status;
+
+	for (round = 0; round < 8; round++) {
+		if (test->instance != NULL)
+			status = ivlsu_instance_query(test->instance, test->points, data, test->numpoints);
+		else
+			status = ivlsu_query(test->points, data, test->numpoints);
+		for (i = 0; i < test->numpoints; i++)
+			if (status != 0 || data[i].vp != test->expected[i].vp || data[i].rho != test->expected[i].rho)
+				test->mismatches++;
+	}
+	free(data);
+	return NULL;
+}
+
 /**
  * Initializes and runs the test program. Tests link against the
  * static version of the library to prevent any dynamic loading
@@ -57,11 +179,851 @@ int main(int argc, const char* argv[]) {
 
 	printf("Query was successful.\n");
 
+	// Query a few points through the structure-of-arrays batch API and compare
+	// them with the regular query.
+	double lons[4] = { -116.0516, -115.80, -115.50, -117.00 };
+	double lats[4] = { 32.6862, 32.90, 33.20, 32.70 };
+	double depths[4] = { 2000, 3500, 0, 1000 };
+	double vp64[4], rho64[4];
+	float vs32[4], qp32[4];
+	ivlsu_batch_t batch = { 0 };
+	int i;
+
+	batch.numpoints = 4;
+	batch.longitude = lons;
+	batch.latitude = lats;
+	batch.depth = depths;
+	batch.properties = IVLSU_VP | IVLSU_RHO;
+	batch.type = IVLSU_FLOAT64;
+	batch.vp = vp64;
+	batch.rho = rho64;
+	assert(ivlsu_query_batch(&batch) == 0);
+
+	batch.properties = IVLSU_VS | IVLSU_QP;
+	batch.type = IVLSU_FLOAT32;
+	batch.vp = NULL;
+	batch.rho = NULL;
+	batch.vs = vs32;
+	batch.qp = qp32;
+	assert(ivlsu_query_batch(&batch) == 0);
+
+	for (i = 0; i < 4; i++) {
+		pt.longitude = lons[i];
+		pt.latitude = lats[i];
+		pt.depth = depths[i];
+		ivlsu_query(&pt, &ret, 1);
+		assert(vp64[i] == ret.vp);
+		assert(rho64[i] == ret.rho);
+		assert(vs32[i] == (float)ret.vs);
+		assert(qp32[i] == NA);
+	}
+
+	printf("Batch query was successful.\n");
+
+	// A profile shares its longitude and latitude, so all points but the first
+	// should reuse the column and match single point queries.
+	ivlsu_point_t profile[9];
+	ivlsu_properties_t profile_data[9];
+	ivlsu_stats_t stats;
+
+	for (i = 0; i < 9; i++) {
+		profile[i].longitude = -115.80;
+		profile[i].latitude = 32.90;
+		profile[i].depth = i * 1000;
+	}
+	ivlsu_reset_stats();
+	assert(ivlsu_query(profile, profile_data, 9) == 0);
+	assert(ivlsu_get_stats(&stats) == 0);
+	assert(stats.points == 9);
+	assert(stats.column_points == 8);
+
+	for (i = 0; i < 9; i++) {
+		ivlsu_query(&(profile[i]), &ret, 1);
+		assert(profile_data[i].vp == ret.vp);
+	}
+
+	printf("Profile query was successful.\n");
+
+	// A grid on the model's nodes reads the same values with and without
+	// interpolation, one direct load per point.
+	ivlsu_grid_t grid = { 600000, 3620000, 1000, 1000, 2000, 1000, 5, 4, 3 };
+	double grid_off[60], grid_on[60];
+	ivlsu_cell_t cell;
+
+	batch.properties = IVLSU_VP;
+	batch.type = IVLSU_FLOAT64;
+	batch.vp = grid_off;
+	assert(ivlsu_query_grid(&grid, &batch) == 0);
+
+	assert(ivlsu_set_option("interpolation", "on") == 0);
+	batch.vp = grid_on;
+	ivlsu_reset_stats();
+	assert(ivlsu_query_grid(&grid, &batch) == 0);
+	assert(ivlsu_get_stats(&stats) == 0);
+	assert(stats.node_points == 60);
+	for (i = 0; i < 60; i++)
+		assert(grid_on[i] == grid_off[i]);
+
+	// An aligned grid reaching past the east edge only counts the node reads inside.
+	ivlsu_grid_t past_edge = { 650000, 3620000, 0, 1000, 1000, 1000, 8, 2, 2 };
+	unsigned long inside_nodes = 0;
+
+	for (i = 0; i < 32; i++) {
+		ivlsu_locate_point(&(ivlsu_velocity_model->volume), 1, past_edge.origin_e + (i % 8) * past_edge.spacing_e,
+				   past_edge.origin_n + (i / 8 % 2) * past_edge.spacing_n, past_edge.origin_depth + (i / 16) * past_edge.spacing_depth,
+				   &cell);
+		inside_nodes += cell.mode == IVLSU_CELL_NEAREST;
+	}
+	ivlsu_reset_stats();
+	assert(ivlsu_query_grid(&past_edge, &batch) == 0);
+	assert(ivlsu_get_stats(&stats) == 0);
+	assert(inside_nodes > 0 && inside_nodes < 32 && stats.points == 32 && stats.node_points == inside_nodes);
+
+	// Off the nodes, the grid matches locating every point on its own.
+	grid.origin_e += 250;
+	grid.origin_n += 400;
+	grid.origin_depth += 300;
+	assert(ivlsu_query_grid(&grid, &batch) == 0);
+	for (i = 0; i < 60; i++) {
+		ivlsu_locate_point(&(ivlsu_velocity_model->volume), 1, grid.origin_e + (i % 5) * grid.spacing_e,
+				   grid.origin_n + (i / 5 % 4) * grid.spacing_n, grid.origin_depth + (i / 20) * grid.spacing_depth, &cell);
+		assert(grid_on[i] == ivlsu_evaluate_cell(&(ivlsu_velocity_model->volume), &cell));
+	}
+
+	// A grid turned a quarter turn runs its x axis north and its y axis west.
+	ivlsu_grid_t rotated = grid;
+	double grid_rotated[60];
+
+	rotated.nx = 4;
+	rotated.ny = 5;
+	rotated.spacing_e = grid.spacing_n;
+	rotated.spacing_n = grid.spacing_e;
+	rotated.origin_e += 4 * grid.spacing_e;
+	rotated.rotation = 90;
+	batch.vp = grid_rotated;
+	assert(ivlsu_query_grid(&rotated, &batch) == 0);
+	for (i = 0; i < 60; i++)
+		assert(fabs(grid_rotated[i] - grid_on[(i / 20) * 20 + (i % 4) * 5 + 4 - i / 4 % 5]) < 1e-6);
+
+	// Turned back onto the nodes, every point is counted as a node read.
+	rotated.origin_e -= 250;
+	rotated.origin_n -= 400;
+	rotated.origin_depth -= 300;
+	ivlsu_reset_stats();
+	assert(ivlsu_query_grid(&rotated, &batch) == 0);
+	assert(ivlsu_get_stats(&stats) == 0);
+	assert(stats.points == 60 && stats.node_points == 60 && stats.column_points == 0);
+	assert(ivlsu_set_option("interpolation", "off") == 0);
+
+	printf("Grid query was successful.\n");
+
+	// The precomputed Z1.0 and Z2.5 rasters agree with searching the columns, and
+	// Vs reaches 2.5 km/s no shallower than 1.0 km/s.
+	double z1000[4], z2500[4], zsearch[4];
+
+	assert(ivlsu_query_zdepth(lons, lats, 4, IVLSU_Z1000_THRESHOLD, z1000) == 0);
+	assert(ivlsu_query_zdepth(lons, lats, 4, IVLSU_Z1000_THRESHOLD + 1e-9, zsearch) == 0);
+	assert(ivlsu_query_zdepth(lons, lats, 4, IVLSU_Z2500_THRESHOLD, z2500) == 0);
+	assert(z1000[3] == NA);
+	for (i = 0; i < 3; i++) {
+		assert(z1000[i] >= 0);
+		assert(fabs(z1000[i] - zsearch[i]) < 0.01);
+		assert(z2500[i] == NA || z2500[i] >= z1000[i]);
+	}
+
+	// With interpolation on, the named thresholds blend the columns as any other
+	// threshold does, between the nodes as well.
+	double zsites_lon[8], zsites_lat[8], zblend[8], zblend_search[8];
+
+	for (i = 0; i < 8; i++) {
+		zsites_lon[i] = lons[i % 3] + 0.0043 * (i / 3 + 1);
+		zsites_lat[i] = lats[i % 3] - 0.0037 * (i / 3 + 1);
+	}
+	assert(ivlsu_set_option("interpolation", "on") == 0);
+	assert(ivlsu_query_zdepth(zsites_lon, zsites_lat, 8, IVLSU_Z1000_THRESHOLD, zblend) == 0);
+	assert(ivlsu_query_zdepth(zsites_lon, zsites_lat, 8, IVLSU_Z1000_THRESHOLD + 1e-9, zblend_search) == 0);
+	for (i = 0; i < 8; i++)
+		assert(zblend[i] == zblend_search[i] || fabs(zblend[i] - zblend_search[i]) < 0.01);
+	assert(ivlsu_query_zdepth(zsites_lon, zsites_lat, 8, IVLSU_Z2500_THRESHOLD, zblend) == 0);
+	assert(ivlsu_query_zdepth(zsites_lon, zsites_lat, 8, IVLSU_Z2500_THRESHOLD + 1e-9, zblend_search) == 0);
+	for (i = 0; i < 8; i++)
+		assert(zblend[i] == zblend_search[i] || fabs(zblend[i] - zblend_search[i]) < 0.01);
+	assert(ivlsu_set_option("interpolation", "off") == 0);
+
+	printf("Basin depth query was successful.\n");
+
+	// On a node, the time-averaged Vs down to the next level is the harmonic mean of
+	// Vs varying linearly between the two nodes.
+	ivlsu_grid_t site = { 600000, 3620000, 0, 1000, 1000, 1000, 1, 1, 2 };
+	double node_vs[2], vsz[4];
+
+	batch.properties = IVLSU_VS;
+	batch.vs = node_vs;
+	assert(ivlsu_query_grid(&site, &batch) == 0);
+	assert(ivlsu_query_vsz_grid(&site, 1000, vsz) == 0);
+	assert(fabs(vsz[0] - (node_vs[1] - node_vs[0]) / log(node_vs[1] / node_vs[0])) < 1e-3);
+
+	assert(ivlsu_query_vsz(lons, lats, 4, 30, vsz) == 0);
+	assert(vsz[0] == NA && vsz[3] == NA);
+	assert(vsz[1] > 0 && vsz[2] > 0);
+
+	printf("Time-averaged Vs query was successful.\n");
+
+	// The vertical S travel time is the depth over the time-averaged Vs, and P is
+	// faster than S.
+	double tdepth[4] = { 30, 30, 30, 30 }, tp[4], ts[4];
+
+	assert(ivlsu_query_travel_time(lons, lats, tdepth, 4, tp, ts) == 0);
+	assert(ts[0] == NA && tp[3] == NA);
+	for (i = 1; i < 3; i++) {
+		assert(fabs(ts[i] - 30 / vsz[i]) < 1e-9);
+		assert(tp[i] > 0 && tp[i] < ts[i]);
+	}
+
+	printf("Travel time query was successful.\n");
+
+	// A box covering one node's voxel averages to the node, and a box spanning two
+	// nodes along x averages them, half of it in each voxel.
+	ivlsu_box_t boxes[3] = { { 599500, 600500, 3619500, 3620500, 1500, 2500 },
+				 { 599500, 600500, 3619500, 3620500, 1700, 2200 },
+				 { 599900, 600900, 3619500, 3620500, 1500, 2500 } };
+	ivlsu_box_average_t averages[3];
+	ivlsu_grid_t pair = { 600000, 3620000, 2000, 1000, 1000, 1000, 2, 1, 1 };
+	double pair_vp[2], pair_vs[2], pair_rho[2];
+
+	batch.properties = IVLSU_VP | IVLSU_VS | IVLSU_RHO;
+	batch.vp = pair_vp;
+	batch.vs = pair_vs;
+	batch.rho = pair_rho;
+	assert(ivlsu_query_grid(&pair, &batch) == 0);
+	assert(ivlsu_query_box_average(boxes, 3, averages) == 0);
+
+	for (i = 0; i < 2; i++) {
+		assert(fabs(averages[i].vp - pair_vp[0]) < 1e-6);
+		assert(fabs(averages[i].vs - pair_vs[0]) < 1e-6);
+		assert(fabs(averages[i].mu - pair_rho[0] * pair_vs[0] * pair_vs[0]) < 1e-6 * averages[i].mu);
+		assert(fabs(averages[i].valid_fraction - 1) < 1e-9);
+	}
+	assert(fabs(averages[2].vp - 0.6 * pair_vp[0] - 0.4 * pair_vp[1]) < 1e-6);
+
+	printf("Box average query was successful.\n");
+
+	// A grid with a 2 km target spacing samples the 2x level, whose nodes are the tent
+	// filtered fine nodes around them; a finer target samples the full resolution.
+	ivlsu_grid_t coarse = { 601000, 3621000, 2000, 2000, 2000, 2000, 1, 1, 1, 2000 };
+	const ivlsu_volume_t *volume = &(ivlsu_velocity_model->volume);
+	double coarse_vp, tent_vp = 0, tent_weight = 0, weight;
+	int x, y, z;
+
+	for (z = 1; z <= 3; z++) {
+		for (y = 13; y <= 15; y++) {
+			for (x = 11; x <= 13; x++) {
+				weight = (x == 12 ? 2 : 1) * (y == 14 ? 2 : 1) * (z == 2 ? 2 : 1);
+				tent_vp += weight * ivlsu_volume_vp(volume, (z * volume->ny + y) * volume->nx + x);
+				tent_weight += weight;
+			}
+		}
+	}
+
+	batch.properties = IVLSU_VP;
+	batch.vp = &coarse_vp;
+	assert(ivlsu_query_grid(&coarse, &batch) == 0);
+	assert(fabs(coarse_vp - tent_vp / tent_weight) < 1e-3);
+
+	coarse.spacing = 1500;
+	assert(ivlsu_query_grid(&coarse, &batch) == 0);
+	assert(coarse_vp == ivlsu_volume_vp(volume, (2 * volume->ny + 14) * volume->nx + 12));
+
+	// The coarse levels end on the model's last nodes, so points just past the east
+	// and north edges, where the model has an even number of nodes, have no data.
+	ivlsu_grid_t past_east = { volume->origin_e + (volume->nx - 1) * volume->dx + 0.7 * volume->dx, 3650000, 2000,
+				   1, 1, 1, 1, 1, 1, 2000 };
+	ivlsu_grid_t past_north = { 620000, volume->origin_n + (volume->ny - 1) * volume->dy + 0.7 * volume->dy, 2000,
+				    1, 1, 1, 1, 1, 1, 2000 };
+
+	const ivlsu_volume_t *level = ivlsu_select_volume(2000);
+
+	assert(volume->nx % 2 == 0 && volume->ny % 2 == 0 && level != volume);
+	assert(ivlsu_query_grid(&past_east, &batch) == 0 && coarse_vp == NA);
+	assert(ivlsu_query_grid(&past_north, &batch) == 0 && coarse_vp == NA);
+	ivlsu_locate_point(level, 0, past_east.origin_e, past_east.origin_n, 2000, &cell);
+	assert(cell.mode == IVLSU_CELL_OUTSIDE);
+	ivlsu_locate_point(level, 0, past_north.origin_e, past_north.origin_n, 2000, &cell);
+	assert(cell.mode == IVLSU_CELL_OUTSIDE);
+	ivlsu_locate_point(level, 0, past_east.origin_e - 1.7 * volume->dx, past_north.origin_n - 1.7 * volume->dy, 2000, &cell);
+	assert(cell.mode != IVLSU_CELL_OUTSIDE);
+
+	printf("Multiresolution query was successful.\n");
+
+	// Region statistics from the brick hierarchy match scanning the nodes.
+	ivlsu_box_t regions[2] = { { 591500, 640000, 3610200, 3650000, 500, 6500 },
+				   { 500000, 700000, 3500000, 3700000, -100, 9000 } };
+	ivlsu_region_stats_t region;
+	double min_vs, max_vs, node_vp;
+	long valid, nodes;
+
+	for (i = 0; i < 2; i++) {
+		assert(ivlsu_region_stats(&(regions[i]), &region) == 0);
+		min_vs = 1e9;
+		max_vs = -1e9;
+		valid = nodes = 0;
+		for (z = 0; z < volume->nz; z++) {
+			for (y = 0; y < volume->ny; y++) {
+				for (x = 0; x < volume->nx; x++) {
+					if (volume->origin_e + x * volume->dx < regions[i].min_e || volume->origin_e + x * volume->dx > regions[i].max_e ||
+					    volume->origin_n + y * volume->dy < regions[i].min_n || volume->origin_n + y * volume->dy > regions[i].max_n ||
+					    z * volume->dz < regions[i].min_depth || z * volume->dz > regions[i].max_depth)
+						continue;
+					nodes++;
+					if ((node_vp = ivlsu_volume_vp(volume, (z * volume->ny + y) * volume->nx + x)) < 0)
+						continue;
+					valid++;
+					min_vs = fmin(min_vs, ivlsu_calculate_vs(node_vp));
+					max_vs = fmax(max_vs, ivlsu_calculate_vs(node_vp));
+				}
+			}
+		}
+		assert(region.nodes == nodes && region.valid == valid);
+		assert(fabs(region.min_vs - min_vs) < 1e-3 && fabs(region.max_vs - max_vs) < 1e-3);
+	}
+	assert(region.nodes == volume->count);
+
+	// Cells reaching no data are answered without reading the volume.
+	ivlsu_grid_t east = { 645000, 3608000, 0, 1000, 1000, 1000, 8, 8, 9 };
+	double east_vp[576];
+
+	batch.vp = east_vp;
+	ivlsu_reset_stats();
+	assert(ivlsu_query_grid(&east, &batch) == 0);
+	assert(ivlsu_get_stats(&stats) == 0);
+	for (i = 0; i < 576; i++)
+		assert(east_vp[i] == NA);
+
+	// Every point in a brick without data is counted once, by the grid and the point paths.
+	double mix_lon[400], mix_lat[400], mix_depth[400], mix_e[400], mix_n[400], mix_vp[400];
+	ivlsu_worker_t mix_worker = { 0 };
+	long empty = 0, outside = 0;
+
+	for (i = 0; i < 576; i++) {
+		ivlsu_locate_point(volume, ivlsu_configuration->interpolation, east.origin_e + (i % 8) * east.spacing_e,
+				   east.origin_n + (i / 8 % 8) * east.spacing_n, east.origin_depth + (i / 64) * east.spacing_depth, &cell);
+		empty += cell.mode == IVLSU_CELL_EMPTY;
+	}
+	assert(empty > 0 && stats.empty_points == (unsigned long)empty);
+
+	// The rotated grid counts them as well; a half turn about the far corner covers
+	// the same nodes.
+	ivlsu_grid_t east_turned = east;
+
+	east_turned.origin_e += 7 * east.spacing_e;
+	east_turned.origin_n += 7 * east.spacing_n;
+	east_turned.rotation = 180;
+	ivlsu_reset_stats();
+	assert(ivlsu_query_grid(&east_turned, &batch) == 0);
+	assert(ivlsu_get_stats(&stats) == 0);
+	assert(stats.points == 576 && stats.empty_points == (unsigned long)empty);
+
+	for (i = 0; i < 400; i++) {
+		mix_lon[i] = -116.2 + 0.1 * (i % 10);
+		mix_lat[i] = 32.5 + 0.1 * (i / 10 % 10);
+		mix_depth[i] = 2500.0 * (i / 100);
+	}
+	ivlsu_project_points(&mix_worker, mix_lon, mix_lat, 1, 400, mix_e, mix_n);
+	for (i = 0, empty = 0; i < 400; i++) {
+		ivlsu_locate_point(volume, ivlsu_configuration->interpolation, mix_e[i], mix_n[i], mix_depth[i], &cell);
+		empty += cell.mode == IVLSU_CELL_EMPTY;
+		outside += cell.mode == IVLSU_CELL_OUTSIDE;
+	}
+	batch.numpoints = 400;
+	batch.longitude = mix_lon;
+	batch.latitude = mix_lat;
+	batch.depth = mix_depth;
+	batch.vp = mix_vp;
+	ivlsu_reset_stats();
+	assert(ivlsu_query_batch(&batch) == 0);
+	assert(ivlsu_get_stats(&stats) == 0);
+	assert(empty > 0 && outside > 0 && empty + outside < 400);
+	assert(stats.points == 400 && stats.empty_points == (unsigned long)empty);
+
+	// Vs and density are NA wherever Vp is, on nodes without data as outside of the model.
+	double mix_vs[400], mix_rho[400], east_vs[576], east_rho[576];
+
+	batch.properties = IVLSU_VP | IVLSU_VS | IVLSU_RHO;
+	batch.vs = mix_vs;
+	batch.rho = mix_rho;
+	assert(ivlsu_query_batch(&batch) == 0);
+	for (i = 0; i < 400; i++)
+		assert((mix_vp[i] == NA) == (mix_vs[i] == NA) && (mix_vp[i] == NA) == (mix_rho[i] == NA));
+	batch.properties = IVLSU_VS | IVLSU_RHO;
+	batch.vs = east_vs;
+	batch.rho = east_rho;
+	assert(ivlsu_query_grid(&east, &batch) == 0);
+	for (i = 0; i < 576; i++)
+		assert(east_vs[i] == NA && east_rho[i] == NA);
+	batch.properties = IVLSU_VP;
+	batch.vs = NULL;
+	batch.rho = NULL;
+	batch.longitude = lons;
+	batch.latitude = lats;
+	batch.depth = depths;
+
+	printf("Region statistics were successful.\n");
+
+	// The gradients match central differences of the interpolated field, and the ENU
+	// frame rotates them by the meridian convergence.
+	ivlsu_grid_t around = { 600299, 3620399, 2299, 1, 1, 1, 3, 3, 3 };
+	ivlsu_grid_t center = { 600300, 3620400, 2300, 1, 1, 1, 1, 1, 1 };
+	double around_vp[27], around_vs[27], center_vp, vp_gradient[12], vs_gradient[12], enu_gradient[12], convergence;
+
+	assert(ivlsu_set_option("interpolation", "on") == 0);
+	batch.properties = IVLSU_VP | IVLSU_VS;
+	batch.vp = around_vp;
+	batch.vs = around_vs;
+	assert(ivlsu_query_grid(&around, &batch) == 0);
+	batch.properties = IVLSU_VP | IVLSU_VP_GRADIENT | IVLSU_VS_GRADIENT;
+	batch.vp = &center_vp;
+	batch.vp_gradient = vp_gradient;
+	batch.vs_gradient = vs_gradient;
+	assert(ivlsu_query_grid(&center, &batch) == 0);
+
+	assert(center_vp == around_vp[13]);
+	assert(fabs(vp_gradient[0] - (around_vp[14] - around_vp[12]) / 2) < 1e-6);
+	assert(fabs(vp_gradient[1] - (around_vp[16] - around_vp[10]) / 2) < 1e-6);
+	assert(fabs(vp_gradient[2] - (around_vp[22] - around_vp[4]) / 2) < 1e-6);
+	assert(fabs(vs_gradient[2] - (around_vs[22] - around_vs[4]) / 2) < 1e-6);
+
+	batch.numpoints = 4;
+	batch.properties = IVLSU_VP_GRADIENT;
+	batch.type = IVLSU_FLOAT64;
+	assert(ivlsu_query_batch(&batch) == 0);
+	batch.frame = IVLSU_FRAME_ENU;
+	batch.vp_gradient = enu_gradient;
+	assert(ivlsu_query_batch(&batch) == 0);
+	batch.frame = IVLSU_FRAME_UTM;
+
+	// The surface point's cell reaches the level above the model, so it has no gradient.
+	assert(vp_gradient[6] == NA && vp_gradient[9] == NA && enu_gradient[9] == NA);
+	convergence = ivlsu_meridian_convergence(lons[1], lats[1]);
+	assert(convergence > 0);
+	assert(fabs(enu_gradient[3] - vp_gradient[3] * cos(convergence) - vp_gradient[4] * sin(convergence)) < 1e-9);
+	assert(fabs(enu_gradient[4] - vp_gradient[4] * cos(convergence) + vp_gradient[3] * sin(convergence)) < 1e-9);
+	assert(enu_gradient[5] == vp_gradient[5]);
+	assert(ivlsu_set_option("interpolation", "off") == 0);
+
+	printf("Gradient query was successful.\n");
+
+	// The upwind update is exact for a plane wave along an axis and along a diagonal.
+	double neighbors[3] = { 2, INFINITY, INFINITY }, spacings[3] = { 10, 20, 30 };
+
+	assert(fabs(ivlsu_eikonal_update(neighbors, spacings, 0.5) - 7) < 1e-12);
+	neighbors[0] = neighbors[1] = neighbors[2] = 0;
+	spacings[0] = spacings[1] = spacings[2] = 1;
+	assert(fabs(ivlsu_eikonal_update(neighbors, spacings, 1) - 1 / sqrt(3)) < 1e-12);
+
+	// First arrivals are no earlier than the straight line at the fastest velocity,
+	// P arrives before S, and the written table holds the solved times.
+	ivlsu_point_t source = { -115.80, 32.90, 3500 };
+	ivlsu_worker_t worker = { 0 };
+	char table_dir[] = "/tmp/ivlsu_tables_XXXXXX", table_path[64];
+	float *tp_table = malloc(volume->count * sizeof(float)), *ts_table = malloc(volume->count * sizeof(float));
+	float *read_table = malloc(volume->count * sizeof(float));
+	double source_e, source_n, distance, max_vp = 0;
+	long reached = 0;
+	FILE *fp;
+
+	ivlsu_project_points(&worker, &(source.longitude), &(source.latitude), 1, 1, &source_e, &source_n);
+	assert(ivlsu_eikonal_solve(&source, IVLSU_VP, 0, tp_table) == 0);
+	assert(ivlsu_eikonal_solve(&source, IVLSU_VS, 0, ts_table) == 0);
+	for (i = 0; i < volume->count; i++)
+		max_vp = fmax(max_vp, ivlsu_volume_vp(volume, i));
+
+	for (z = 0; z < volume->nz; z++) {
+		for (y = 0; y < volume->ny; y++) {
+			for (x = 0; x < volume->nx; x++) {
+				i = (z * volume->ny + y) * volume->nx + x;
+				assert((tp_table[i] == NA) == (ts_table[i] == NA));
+				if (tp_table[i] == NA)
+					continue;
+				distance = sqrt(pow(volume->origin_e + x * volume->dx - source_e, 2) +
+						pow(volume->origin_n + y * volume->dy - source_n, 2) + pow(z * volume->dz - source.depth, 2));
+				assert(tp_table[i] >= distance / max_vp * (1 - 1e-6));
+				assert(tp_table[i] < ts_table[i] || distance == 0);
+				reached++;
+			}
+		}
+	}
+	assert(reached > volume->count / 4);
+
+	assert(mkdtemp(table_dir) != NULL);
+	assert(ivlsu_eikonal_tables(&source, 1, IVLSU_VP, 0, table_dir) == 0);
+	sprintf(table_path, "%s/p_0000.dat", table_dir);
+	assert((fp = fopen(table_path, "rb")) != NULL);
+	assert(fread(read_table, sizeof(float), volume->count, fp) == volume->count);
+	fclose(fp);
+	assert(memcmp(read_table, tp_table, volume->count * sizeof(float)) == 0);
+	remove(table_path);
+	sprintf(table_path, "%s/config", table_dir);
+	remove(table_path);
+	rmdir(table_dir);
+
+	source.depth = -100;
+	assert(ivlsu_eikonal_solve(&source, IVLSU_VP, 0, tp_table) != 0);
+
+	// Through a homogeneous volume the times follow the straight rays from the source,
+	// exactly down the source's column and off the axes within the first order scheme's
+	// error, under a tenth of the one second the wave takes to the far corners.
+	ivlsu_volume_t column = { 0 };
+	float *column_vp = malloc(21 * 21 * 11 * sizeof(float)), *column_time = malloc(21 * 21 * 11 * sizeof(float));
+	double column_error = 0;
+
+	column.nx = column.ny = 21;
+	column.nz = 11;
+	column.count = 21 * 21 * 11;
+	column.dx = column.dy = column.dz = 200;
+	column.depth = 2000;
+	column.origin_e = source_e - 10 * column.dx;
+	column.origin_n = source_n - 10 * column.dy;
+	for (i = 0; i < column.count; i++)
+		column_vp[i] = 3000;
+	column.vp = column_vp;
+	source.depth = 1000;
+	assert(ivlsu_eikonal_solve_volume(&column, &source, IVLSU_VP, column_time) == 0);
+	for (z = 0; z < column.nz; z++) {
+		for (y = 0; y < column.ny; y++) {
+			for (x = 0; x < column.nx; x++) {
+				i = (z * column.ny + y) * column.nx + x;
+				distance = sqrt(pow((x - 10) * column.dx, 2) + pow((y - 10) * column.dy, 2) + pow(z * column.dz - source.depth, 2));
+				assert(column_time[i] >= distance / 3000 * (1 - 1e-6));
+				column_error = fmax(column_error, column_time[i] - distance / 3000);
+				if (x == 10 && y == 10)
+					assert(fabs(column_time[i] - distance / 3000) < 1e-6);
+			}
+		}
+	}
+	assert(column_error < 0.1);
+	assert(ivlsu_eikonal_solve_volume(&column, &source, IVLSU_VS, column_time) == 0);
+	assert(fabs(column_time[10 * 21 * 21 + 10 * 21 + 10] - 1000 / ivlsu_wave_velocity(IVLSU_VS, 3000)) < 1e-5);
+	free(column_vp);
+	free(column_time);
+	free(tp_table);
+	free(ts_table);
+	free(read_table);
+
+	printf("Eikonal travel time tables were successful.\n");
+
+	// A traced ray ends at its station, shooting it again at the returned takeoff
+	// lands in the same place, S takes longer than P and the first order eikonal
+	// time from the station is not earlier than the ray. Tracing leaves the rays' end
+	// depths as they were.
+	ivlsu_point_t stations[2] = { { -115.75, 32.91, 0 }, { -115.75, 32.91, 0 } };
+	ivlsu_ray_t rays[2];
+	double ray_path[2][3 * 1000], station_e, station_n, eikonal_time = 0, p_time;
+
+	memset(rays, 0, sizeof(rays));
+	for (i = 0; i < 2; i++) {
+		rays[i].longitude = -115.80;
+		rays[i].latitude = 32.90;
+		rays[i].depth = 3500;
+		rays[i].wave = IVLSU_VP;
+		rays[i].path = ray_path[i];
+		rays[i].max_points = 1000;
+		rays[i].end_depth = -1;
+	}
+	assert(ivlsu_trace_rays(rays, stations, 2) == 0);
+	assert(rays[0].end_depth == -1 && rays[1].end_depth == -1);
+	ivlsu_project_points(&worker, &(stations[0].longitude), &(stations[0].latitude), 1, 1, &station_e, &station_n);
+	assert(rays[0].status == IVLSU_RAY_ARRIVED);
+	assert(hypot(rays[0].end[0] - station_e, rays[0].end[1] - station_n) <= IVLSU_RAY_TOLERANCE && rays[0].end[2] == 0);
+	assert(ray_path[0][0] == source_e && ray_path[0][1] == source_n && ray_path[0][2] == 3500);
+	assert(memcmp(&(ray_path[0][3 * (rays[0].numpoints - 1)]), rays[0].end, sizeof(rays[0].end)) == 0);
+	assert(rays[0].length >= sqrt(pow(station_e - source_e, 2) + pow(station_n - source_n, 2) + 3500 * 3500));
+	assert(rays[1].time == rays[0].time && rays[1].numpoints == rays[0].numpoints);
+
+	rays[1].end_depth = 0;
+	assert(ivlsu_shoot_rays(&(rays[1]), 1) == 0);
+	assert(rays[1].status == IVLSU_RAY_ARRIVED);
+	assert(hypot(rays[1].end[0] - rays[0].end[0], rays[1].end[1] - rays[0].end[1]) < 1e-3);
+	assert(fabs(rays[1].time - rays[0].time) < 1e-9);
+
+	tp_table = malloc(volume->count * sizeof(float));
+	assert(ivlsu_eikonal_solve(&(stations[0]), IVLSU_VP, 0, tp_table) == 0);
+	x = (int)((source_e - volume->origin_e) / volume->dx);
+	y = (int)((source_n - volume->origin_n) / volume->dy);
+	for (i = 0; i < 8; i++)
+		eikonal_time = fmax(eikonal_time, tp_table[((3 + (i >> 2)) * volume->ny + y + ((i >> 1) & 1)) * volume->nx + x + (i & 1)]);
+	free(tp_table);
+	assert(rays[0].time < eikonal_time && rays[0].time > 0.8 * eikonal_time);
+
+	p_time = rays[0].time;
+	rays[0].wave = IVLSU_VS;
+	assert(ivlsu_trace_rays(rays, stations, 1) == 0);
+	assert(rays[0].status == IVLSU_RAY_ARRIVED && rays[0].time > p_time);
+
+	// Rays only arrive going up, so a station deeper than its source is refused.
+	stations[0].depth = 4000;
+	assert(ivlsu_trace_rays(rays, stations, 1) != 0);
+	stations[0].depth = 0;
+
+	printf("Ray tracing was successful.\n");
+
+	// The leaves of an octree tile the model, are no longer than the shortest
+	// wavelength over the points per wavelength where they have data and hold the
+	// model at their centers, whatever the number of threads.
+	ivlsu_octree_t octree = { 0.2, 5, 500, 8000 };
+	ivlsu_octree_header_t octree_header;
+	ivlsu_octree_leaf_t *octree_leaves[2];
+	char octree_path[] = "/tmp/ivlsu_octree_XXXXXX";
+	double covered = 0, edge;
+	long coarse_leaves = 0;
+	int octree_fd, pass;
+
+	assert((octree_fd = mkstemp(octree_path)) >= 0);
+	close(octree_fd);
+	for (pass = 0; pass < 2; pass++) {
+		assert(ivlsu_set_option("threads", pass == 0 ? "0" : "1") == 0);
+		assert(ivlsu_extract_octree(&octree, octree_path) == 0);
+		assert((fp = fopen(octree_path, "rb")) != NULL);
+		assert(fread(&octree_header, sizeof(octree_header), 1, fp) == 1);
+		assert(memcmp(octree_header.magic, IVLSU_OCTREE_MAGIC, 8) == 0 && octree_header.size == 500 && octree_header.levels == 5);
+		octree_leaves[pass] = malloc(octree_header.leaves * sizeof(ivlsu_octree_leaf_t));
+		assert(fread(octree_leaves[pass], sizeof(ivlsu_octree_leaf_t), octree_header.leaves, fp) == octree_header.leaves);
+		assert(fgetc(fp) == EOF);
+		fclose(fp);
+	}
+	assert(ivlsu_set_option("threads", "0") == 0);
+	assert(memcmp(octree_leaves[0], octree_leaves[1], octree_header.leaves * sizeof(ivlsu_octree_leaf_t)) == 0);
+	remove(octree_path);
+
+	for (i = 0; i < octree_header.leaves; i++) {
+		edge = octree_header.size * (1 << octree_leaves[0][i].level);
+		covered += edge * edge * edge;
+		coarse_leaves += octree_leaves[0][i].level > 0;
+		if (octree_leaves[0][i].level > 0 && octree_leaves[0][i].vs != NA)
+			assert(edge * octree.frequency * octree.points_per_wavelength <= octree_leaves[0][i].vs);
+		ivlsu_locate_point(volume, 0, octree_header.origin_e + (octree_leaves[0][i].index[0] + 0.5 * edge / 500) * 500,
+				   octree_header.origin_n + (octree_leaves[0][i].index[1] + 0.5 * edge / 500) * 500,
+				   (octree_leaves[0][i].index[2] + 0.5 * edge / 500) * 500, &cell);
+		assert(octree_leaves[0][i].vp == (float)ivlsu_evaluate_cell(volume, &cell));
+	}
+	assert(covered == (volume->nx - 1) * volume->dx * (volume->ny - 1) * volume->dy * (volume->nz - 1) * volume->dz);
+	assert(coarse_leaves > 0 && coarse_leaves < octree_header.leaves);
+	free(octree_leaves[0]);
+	free(octree_leaves[1]);
+
+	printf("Octree extraction was successful.\n");
+
+	// A journal reads back the units it recorded, drops a record cut short, only
+	// keeps units whose bytes match and starts over for another job.
+	ivlsu_journal_t journal;
+	char journal_path[] = "/tmp/ivlsu_journal_XXXXXX";
+	float unit_data[2][16];
+	int journal_fd;
+
+	for (i = 0; i < 16; i++)
+		unit_data[0][i] = i, unit_data[1][i] = -i;
+	assert((journal_fd = mkstemp(journal_path)) >= 0);
+	close(journal_fd);
+	assert(ivlsu_journal_open(&journal, journal_path, "job 1", 4) == 0 && journal.recorded == 0);
+	assert(ivlsu_journal_record(&journal, 0, ivlsu_checksum(unit_data[0], sizeof(unit_data[0]))) == 0);
+	assert(ivlsu_journal_record(&journal, 2, ivlsu_checksum(unit_data[1], sizeof(unit_data[1]))) == 0);
+	assert(ivlsu_journal_record(&journal, 4, 0) != 0);
+	assert(ivlsu_journal_close(&journal, 0) == 0);
+	assert((fp = fopen(journal_path, "a")) != NULL && fputs("3 12", fp) >= 0 && fclose(fp) == 0);
+
+	assert(ivlsu_journal_open(&journal, journal_path, "job 1", 4) == 0 && journal.recorded == 2);
+	assert(ivlsu_journal_verify(&journal, 0, unit_data[0], sizeof(unit_data[0])));
+	assert(!ivlsu_journal_verify(&journal, 2, unit_data[0], sizeof(unit_data[0])));
+	assert(ivlsu_journal_verify(&journal, 2, unit_data[1], sizeof(unit_data[1])));
+	assert(!ivlsu_journal_verify(&journal, 3, unit_data[1], sizeof(unit_data[1])));
+	assert(ivlsu_journal_record(&journal, 3, 12) == 0);
+	assert(ivlsu_journal_close(&journal, 0) == 0);
+	assert(ivlsu_journal_open(&journal, journal_path, "job 1", 4) == 0 && journal.recorded == 3 && journal.checksums[3] == 12);
+	assert(ivlsu_journal_close(&journal, 0) == 0);
+
+	assert(ivlsu_journal_open(&journal, journal_path, "job 2", 4) == 0 && journal.recorded == 0);
+	assert(!ivlsu_journal_verify(&journal, 0, unit_data[0], sizeof(unit_data[0])));
+	assert(ivlsu_journal_close(&journal, 1) == 0);
+	assert(access(journal_path, F_OK) != 0);
+
+	printf("Work journal was successful.\n");
+
+	// Queries through the server, pipelined in several chunks, match the in process
+	// queries, and the server's connection ends cleanly when the client closes it.
+	int server_points = 5 * IVLSU_SERVER_CHUNK / 2, server_fds[2];
+	ivlsu_point_t *server_query = malloc(server_points * sizeof(ivlsu_point_t));
+	ivlsu_properties_t *served = malloc(server_points * sizeof(ivlsu_properties_t));
+	ivlsu_properties_t *local = malloc(server_points * sizeof(ivlsu_properties_t));
+	ivlsu_client_t client;
+	pthread_t server;
+	void *served_status;
+
+	for (i = 0; i < server_points; i++) {
+		server_query[i].longitude = -116.3 + 0.6 * (i % 251) / 250.0;
+		server_query[i].latitude = 32.6 + 0.7 * (i / 251 % 199) / 198.0;
+		server_query[i].depth = 37.0 * (i % 241);
+	}
+	memset(local, 0, server_points * sizeof(ivlsu_properties_t));
+	assert(ivlsu_query(server_query, local, server_points) == 0);
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, server_fds) == 0);
+	assert(pthread_create(&server, NULL, test_serve, &server_fds[0]) == 0);
+	client.fd = server_fds[1];
+	memset(served, 0, server_points * sizeof(ivlsu_properties_t));
+	assert(ivlsu_client_query(&client, server_query, served, server_points) == 0);
+	assert(memcmp(served, local, server_points * sizeof(ivlsu_properties_t)) == 0);
+	assert(ivlsu_client_query(&client, server_query, served, 0) == 0);
+	assert(ivlsu_client_query(&client, server_query + 7, served, 3) == 0);
+	assert(memcmp(served, local + 7, 3 * sizeof(ivlsu_properties_t)) == 0);
+	assert(ivlsu_client_close(&client) == 0);
+	assert(pthread_join(server, &served_status) == 0 && served_status == NULL);
+	close(server_fds[0]);
+	assert(ivlsu_client_query(&client, server_query, served, 1) != 0);
+
+	// Several connections are answered at the same time.
+	int connection_fds[2][2];
+	pthread_t connection_servers[2], connection_clients[2];
+	test_client_t connections[2];
+
+	for (i = 0; i < 2; i++) {
+		assert(socketpair(AF_UNIX, SOCK_STREAM, 0, connection_fds[i]) == 0);
+		assert(pthread_create(&connection_servers[i], NULL, test_serve, &connection_fds[i][0]) == 0);
+		memset(&connections[i], 0, sizeof(test_client_t));
+		connections[i].fd = connection_fds[i][1];
+		connections[i].points = server_query;
+		connections[i].expected = local;
+		connections[i].numpoints = server_points;
+		assert(pthread_create(&connection_clients[i], NULL, test_client_loop, &connections[i]) == 0);
+	}
+	for (i = 0; i < 2; i++) {
+		assert(pthread_join(connection_clients[i], NULL) == 0 && connections[i].mismatches == 0);
+		assert(pthread_join(connection_servers[i], &served_status) == 0 && served_status == NULL);
+		close(connection_fds[i][0]);
+	}
+	free(server_query);
+	free(served);
+	free(local);
+
+	printf("Query server was successful.\n");
+
+	// Reloading the model while other threads query it swaps in the new data without
+	// any query failing or seeing a partly loaded model. The data is the same here,
+	// so every query must return what it did before the reload.
+	ivlsu_grid_t reload_grid = { 590000, 3610000, 0, 1500, 1700, 900, 40, 30, 10 };
+	double *reload_expected = malloc(40 * 30 * 10 * sizeof(double));
+	test_reload_t reloads[2];
+	pthread_t reloaders[2];
+	ivlsu_model_t *before = ivlsu_velocity_model;
+
+	batch.properties = IVLSU_VP;
+	batch.type = IVLSU_FLOAT64;
+	batch.vp = reload_expected;
+	assert(ivlsu_query_grid(&reload_grid, &batch) == 0);
+	for (i = 0; i < 2; i++) {
+		memset(&reloads[i], 0, sizeof(test_reload_t));
+		reloads[i].grid = &reload_grid;
+		reloads[i].expected = reload_expected;
+		assert(pthread_create(&reloaders[i], NULL, test_query_loop, &reloads[i]) == 0);
+	}
+	assert(ivlsu_reload(envstr != NULL ? envstr : "..", "ivlsu") == 0);
+	assert(ivlsu_velocity_model != before);
+	assert(ivlsu_reload(envstr != NULL ? envstr : "..", "ivlsu") == 0);
+	for (i = 0; i < 2; i++) {
+		reloads[i].stop = 1;
+		assert(pthread_join(reloaders[i], NULL) == 0);
+		assert(reloads[i].queries > 0 && reloads[i].mismatches == 0);
+	}
+	assert(ivlsu_reload("/nonexistent", "ivlsu") != 0);
+	char long_dir[600];
+	memset(long_dir, '/', sizeof(long_dir) - 1);
+	long_dir[sizeof(long_dir) - 1] = '\0';
+	assert(ivlsu_reload(long_dir, "ivlsu") != 0);
+	assert(ivlsu_query_grid(&reload_grid, &batch) == 0);
+	free(reload_expected);
+
+	printf("Model reload was successful.\n");
+
+	// Instances on the same data share it, each with its own options, and answer
+	// as the model does with the same options.
+	const char *instance_dir = envstr != NULL ? envstr : "..";
+	ivlsu_instance_t smooth, nearest;
+	ivlsu_properties_t *instance_data = malloc(server_points * sizeof(ivlsu_properties_t));
+	ivlsu_properties_t *model_data = malloc(server_points * sizeof(ivlsu_properties_t));
+	ivlsu_properties_t *smooth_data = malloc(server_points * sizeof(ivlsu_properties_t));
+	server_query = malloc(server_points * sizeof(ivlsu_point_t));
+
+	for (i = 0; i < server_points; i++) {
+		server_query[i].longitude = -116.3 + 0.6 * (i % 251) / 250.0;
+		server_query[i].latitude = 32.6 + 0.7 * (i / 251 % 199) / 198.0;
+		server_query[i].depth = 37.0 * (i % 241);
+	}
+	assert(ivlsu_instance_open(&smooth, instance_dir, "ivlsu") == 0);
+	assert(ivlsu_instance_open(&nearest, instance_dir, "ivlsu") == 0);
+	assert(smooth.shared == nearest.shared && smooth.shared->references == 2);
+	assert(ivlsu_instance_set_option(&smooth, "interpolation", "on") == 0);
+	assert(ivlsu_instance_set_option(&nearest, "interpolation", "off") == 0);
+	assert(ivlsu_instance_set_option(&nearest, "threads", "1") != 0);
+	assert(ivlsu_set_option("interpolation", "on") == 0);
+	assert(ivlsu_query(server_query, model_data, server_points) == 0);
+	memset(smooth_data, 0, server_points * sizeof(ivlsu_properties_t));
+	assert(ivlsu_instance_query(&smooth, server_query, smooth_data, server_points) == 0);
+	for (i = 0; i < server_points; i++)
+		assert(smooth_data[i].vp == model_data[i].vp && smooth_data[i].vs == model_data[i].vs);
+	assert(ivlsu_set_option("interpolation", "off") == 0);
+	assert(ivlsu_query(server_query, model_data, server_points) == 0);
+	assert(ivlsu_instance_query(&nearest, server_query, instance_data, server_points) == 0);
+	for (i = 0; i < server_points; i++)
+		assert(instance_data[i].vp == model_data[i].vp && instance_data[i].rho == model_data[i].rho);
+
+	// Instance and model queries on several threads at once each project on their own.
+	test_instance_t concurrent[4];
+	pthread_t concurrent_threads[4];
+
+	for (i = 0; i < 4; i++) {
+		memset(&concurrent[i], 0, sizeof(test_instance_t));
+		concurrent[i].instance = i % 2 == 0 ? &nearest : NULL;
+		concurrent[i].points = server_query;
+		concurrent[i].expected = model_data;
+		concurrent[i].numpoints = server_points;
+		assert(pthread_create(&concurrent_threads[i], NULL, test_instance_loop, &concurrent[i]) == 0);
+	}
+	for (i = 0; i < 4; i++) {
+		assert(pthread_join(concurrent_threads[i], NULL) == 0);
+		assert(concurrent[i].mismatches == 0);
+	}
+	assert(ivlsu_instance_close(&nearest) == 0 && smooth.shared->references == 1);
+
+	printf("Model instances were successful.\n");
+
 	// Close the model.
 	assert(ivlsu_finalize() == 0);
 
 	printf("Model closed successfully.\n");
 
+	// The queries of the loaded model fail rather than read a model that is gone.
+	assert(ivlsu_query_zdepth(lons, lats, 4, IVLSU_Z1000_THRESHOLD, z1000) != 0);
+	assert(ivlsu_query_vsz(lons, lats, 4, 30, vsz) != 0 && ivlsu_query_vsz_grid(&site, 30, vsz) != 0);
+	assert(ivlsu_query_travel_time(lons, lats, tdepth, 4, tp, ts) != 0);
+	assert(ivlsu_query_box_average(boxes, 3, averages) != 0);
+	assert(ivlsu_region_stats(&(regions[0]), &region) != 0);
+
+	// An instance outlives the model and keeps working without it.
+	memset(instance_data, 0, server_points * sizeof(ivlsu_properties_t));
+	assert(ivlsu_instance_query(&smooth, server_query, instance_data, server_points) == 0);
+	assert(memcmp(instance_data, smooth_data, server_points * sizeof(ivlsu_properties_t)) == 0);
+	assert(ivlsu_instance_open(&nearest, instance_dir, "ivlsu") == 0 && nearest.shared == smooth.shared);
+	assert(ivlsu_instance_close(&smooth) == 0);
+	assert(ivlsu_instance_query(&smooth, server_query, instance_data, 1) != 0);
+	assert(ivlsu_instance_set_option(&nearest, "interpolation", "on") == 0);
+	memset(instance_data, 0, server_points * sizeof(ivlsu_properties_t));
+	assert(ivlsu_instance_query(&nearest, server_query, instance_data, server_points) == 0);
+	assert(memcmp(instance_data, smooth_data, server_points * sizeof(ivlsu_properties_t)) == 0);
+	assert(ivlsu_instance_close(&nearest) == 0);
+	free(server_query);
+	free(instance_data);
+	free(model_data);
+	free(smooth_data);
+
+	printf("Instance without the model was successful.\n");
+
 	printf("\nALL IMPERIAL TESTS PASSED\n");
 
 	return 0;
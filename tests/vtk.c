@@ -0,0 +1,357 @@
+/**
+ * @file vtk.c
+ * @brief Exports volumes and slices of the IMPERIAL/IVLSU library to VTK files.
+ * @author - SCEC
+ * @version 1.0
+ *
+ * Samples the model on a regular grid, optionally rotated about its first node, and
+ * writes the selected properties to a VTK XML ImageData (.vti) or StructuredGrid
+ * (.vts) file for ParaView. A slice is a grid one node thick: --dims nx ny 1 for a
+ * depth slice, or --dims nx 1 nz with a rotation for a cross-section along any
+ * azimuth. The VTK z axis is up, at minus the depth, and nodes without data are NaN.
+ *
+ * The arrays are appended raw binary, each a run of float32 values with x varying
+ * fastest, then y, then z from the top down, so every z plane of every array has a
+ * fixed place in the file. The grid is cut into slabs of whole z planes that worker
+ * threads take in turn, query through the structured grid path and write with
+ * pwrite at their places, so memory stays bounded by the slabs in flight.
+ *
+ * Usage: ivlsu_vtk (--corner lon lat | --utm e n) [--rotation degrees] --dims nx ny nz
+ *                  --spacing meters [--depth meters] [--properties vp,vs,rho]
+ *                  [--structured] [--planes count] output
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "ivlsu.h"
+
+/** Default number of z planes per slab. */
+#define VTK_PLANES 4
+
+/** The export being written. */
+typedef struct vtk_job_t {
+	/** The whole grid */
+	ivlsu_grid_t grid;
+	/** IVLSU_VP, IVLSU_VS and IVLSU_RHO bitmask of the arrays */
+	int properties;
+	/** Non-zero to write a StructuredGrid with the coordinates of every node */
+	int structured;
+	/** Number of z planes per slab */
+	int planes;
+	/** Number of slabs */
+	long numslabs;
+	/** Next slab to take */
+	long next;
+	/** Offset in the file of the values of vp, vs, rho and the points, -1 for arrays not written */
+	off_t offsets[4];
+	/** The output file */
+	int fd;
+	/** Number of nodes without data */
+	long missing;
+	/** Set to 1 when a slab could not be queried or written */
+	int failed;
+} vtk_job_t;
+
+/**
+ * Writes a buffer at an offset of a file, retrying short writes.
+ *
+ * @param fd The file.
+ * @param buffer The bytes.
+ * @param length Number of bytes.
+ * @param offset Offset in the file.
+ * @return 0 on success.
+ */
+int vtk_pwrite(int fd, const char *buffer, size_t length, off_t offset) {
+	ssize_t written;
+
+	while (length > 0) {
+		written = pwrite(fd, buffer, length, offset);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return 1;
+		buffer += written;
+		length -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+/**
+ * Worker taking slabs until none are left.
+ *
+ * @param arg The export job.
+ * @return NULL
+ */
+void *vtk_worker(void *arg) {
+	vtk_job_t *job = arg;
+	long plane = (long)job->grid.nx * job->grid.ny, size = plane * job->planes, slab, first, i, missing = 0;
+	double c = cos(job->grid.rotation * DEG_TO_RAD), s = sin(job->grid.rotation * DEG_TO_RAD), along, across;
+	float *values[3] = { NULL, NULL, NULL }, *points = NULL;
+	ivlsu_batch_t batch = { 0 };
+	ivlsu_grid_t grid;
+	int x, y, z, k, counting;
+
+	for (k = 0; k < 3; k++) {
+		if (job->offsets[k] >= 0 && (values[k] = malloc(size * sizeof(float))) == NULL)
+			job->failed = 1;
+	}
+	if (job->structured && (points = malloc(3 * size * sizeof(float))) == NULL)
+		job->failed = 1;
+
+	batch.properties = job->properties;
+	batch.type = IVLSU_FLOAT32;
+	batch.vp = values[0];
+	batch.vs = values[1];
+	batch.rho = values[2];
+	while (!job->failed && (slab = __sync_fetch_and_add(&(job->next), 1)) < job->numslabs) {
+		grid = job->grid;
+		first = slab * job->planes;
+		grid.origin_depth += first * grid.spacing_depth;
+		grid.nz = job->grid.nz - first < job->planes ? job->grid.nz - first : job->planes;
+		if (ivlsu_query_grid(&grid, &batch) != 0) {
+			job->failed = 1;
+			break;
+		}
+
+		// Nodes without data are counted on the first array written.
+		for (k = 0, counting = 1; k < 3; k++) {
+			if (values[k] == NULL)
+				continue;
+			for (i = 0; i < plane * grid.nz; i++) {
+				if (values[k][i] < 0) {
+					values[k][i] = NAN;
+					missing += counting;
+				}
+			}
+			counting = 0;
+			if (vtk_pwrite(job->fd, (const char *)values[k], plane * grid.nz * sizeof(float),
+				       job->offsets[k] + first * plane * sizeof(float)) != 0)
+				job->failed = 1;
+		}
+
+		if (points != NULL) {
+			for (i = 0, z = 0; z < grid.nz; z++) {
+				for (y = 0; y < grid.ny; y++) {
+					for (x = 0; x < grid.nx; x++, i += 3) {
+						along = x * grid.spacing_e;
+						across = y * grid.spacing_n;
+						points[i] = (float)(grid.origin_e + along * c - across * s);
+						points[i + 1] = (float)(grid.origin_n + along * s + across * c);
+						points[i + 2] = (float)-(grid.origin_depth + z * grid.spacing_depth);
+					}
+				}
+			}
+			if (vtk_pwrite(job->fd, (const char *)points, 3 * plane * grid.nz * sizeof(float),
+				       job->offsets[3] + 3 * first * plane * sizeof(float)) != 0)
+				job->failed = 1;
+		}
+	}
+
+	__sync_fetch_and_add(&(job->missing), missing);
+	for (k = 0; k < 3; k++)
+		free(values[k]);
+	free(points);
+	return NULL;
+}
+
+/**
+ * Parses a comma separated list of vp, vs and rho.
+ *
+ * @param list The list.
+ * @return The IVLSU_VP, IVLSU_VS and IVLSU_RHO bitmask, or 0 if the list is not valid.
+ */
+int vtk_properties(const char *list) {
+	char copy[64], *name, *rest;
+	int properties = 0;
+
+	snprintf(copy, sizeof(copy), "%s", list);
+	for (name = strtok_r(copy, ",", &rest); name != NULL; name = strtok_r(NULL, ",", &rest)) {
+		if (strcmp(name, "vp") == 0)
+			properties |= IVLSU_VP;
+		else if (strcmp(name, "vs") == 0)
+			properties |= IVLSU_VS;
+		else if (strcmp(name, "rho") == 0)
+			properties |= IVLSU_RHO;
+		else
+			return 0;
+	}
+	return properties;
+}
+
+/**
+ * Writes the XML header of the file, placing the appended arrays after it.
+ *
+ * @param job The export job, whose offsets are set.
+ * @param fp The file.
+ * @return The size of the whole file, or -1 if the header could not be written.
+ */
+off_t vtk_header(vtk_job_t *job, FILE *fp) {
+	static const char *names[3] = { "vp", "vs", "rho" };
+	static const int flags[3] = { IVLSU_VP, IVLSU_VS, IVLSU_RHO };
+	const ivlsu_grid_t *grid = &(job->grid);
+	const char *type = job->structured ? "StructuredGrid" : "ImageData";
+	uint64_t numpoints = (uint64_t)grid->nx * grid->ny * grid->nz, one = 1;
+	double c = cos(grid->rotation * DEG_TO_RAD), s = sin(grid->rotation * DEG_TO_RAD);
+	off_t offset = 0, base;
+	char extent[128];
+	int k;
+
+	snprintf(extent, sizeof(extent), "0 %d 0 %d 0 %d", grid->nx - 1, grid->ny - 1, grid->nz - 1);
+	fprintf(fp, "<?xml version=\"1.0\"?>\n");
+	fprintf(fp, "<VTKFile type=\"%s\" version=\"1.0\" byte_order=\"%s\" header_type=\"UInt64\">\n", type,
+		*(const char *)&one ? "LittleEndian" : "BigEndian");
+	if (job->structured) {
+		fprintf(fp, "  <StructuredGrid WholeExtent=\"%s\">\n", extent);
+	} else {
+		fprintf(fp, "  <ImageData WholeExtent=\"%s\" Origin=\"%.17g %.17g %.17g\" Spacing=\"%.17g %.17g %.17g\"", extent,
+			grid->origin_e, grid->origin_n, 0 - grid->origin_depth, grid->spacing_e, grid->spacing_n, grid->spacing_depth);
+		fprintf(fp, " Direction=\"%.17g %.17g 0 %.17g %.17g 0 0 0 -1\">\n", c, 0 - s, s, c);
+	}
+	fprintf(fp, "    <Piece Extent=\"%s\">\n", extent);
+
+	// Each array is a UInt64 byte count followed by its values.
+	fprintf(fp, "      <PointData>\n");
+	for (k = 0; k < 3; k++) {
+		job->offsets[k] = -1;
+		if ((job->properties & flags[k]) == 0)
+			continue;
+		fprintf(fp, "        <DataArray type=\"Float32\" Name=\"%s\" format=\"appended\" offset=\"%lld\"/>\n", names[k],
+			(long long)offset);
+		job->offsets[k] = offset;
+		offset += sizeof(uint64_t) + numpoints * sizeof(float);
+	}
+	fprintf(fp, "      </PointData>\n");
+	job->offsets[3] = -1;
+	if (job->structured) {
+		fprintf(fp, "      <Points>\n");
+		fprintf(fp, "        <DataArray type=\"Float32\" NumberOfComponents=\"3\" format=\"appended\" offset=\"%lld\"/>\n",
+			(long long)offset);
+		fprintf(fp, "      </Points>\n");
+		job->offsets[3] = offset;
+		offset += sizeof(uint64_t) + 3 * numpoints * sizeof(float);
+	}
+	fprintf(fp, "    </Piece>\n");
+	fprintf(fp, "  </%s>\n", type);
+	fprintf(fp, "  <AppendedData encoding=\"raw\">\n   _");
+	if (fflush(fp) != 0 || (base = ftello(fp)) < 0)
+		return -1;
+
+	// Write the byte counts, and turn the offsets into offsets of the values in the file.
+	for (k = 0; k < 4; k++) {
+		uint64_t count = (k == 3 ? 3 : 1) * numpoints * sizeof(float);
+
+		if (job->offsets[k] < 0)
+			continue;
+		job->offsets[k] += base;
+		if (vtk_pwrite(fileno(fp), (const char *)&count, sizeof(count), job->offsets[k]) != 0)
+			return -1;
+		job->offsets[k] += sizeof(uint64_t);
+	}
+	offset += base;
+	if (fseeko(fp, offset, SEEK_SET) != 0 || fprintf(fp, "\n  </AppendedData>\n</VTKFile>\n") < 0 || fflush(fp) != 0)
+		return -1;
+	return ftello(fp);
+}
+
+/**
+ * Writes the VTK file.
+ *
+ * @param argc The number of arguments.
+ * @param argv The argument strings.
+ * @return A zero value indicating success.
+ */
+int main(int argc, const char* argv[]) {
+	const char *output = NULL;
+	double corner[2] = { 0, 0 }, spacing = 0;
+	int geographic = -1, nthreads = 0, started = 0, status = 0, t, i;
+	vtk_job_t job;
+	pthread_t threads[IVLSU_MAX_THREADS];
+	ivlsu_worker_t worker = { 0 };
+	FILE *fp;
+	char *envstr;
+
+	memset(&job, 0, sizeof(job));
+	job.planes = VTK_PLANES;
+	job.properties = IVLSU_VP | IVLSU_VS | IVLSU_RHO;
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "--corner") == 0 || strcmp(argv[i], "--utm") == 0) && i + 2 < argc) {
+			geographic = strcmp(argv[i], "--corner") == 0;
+			corner[0] = atof(argv[i + 1]);
+			corner[1] = atof(argv[i + 2]);
+			i += 2;
+		} else if (strcmp(argv[i], "--rotation") == 0 && i + 1 < argc) {
+			job.grid.rotation = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--dims") == 0 && i + 3 < argc) {
+			job.grid.nx = atoi(argv[i + 1]);
+			job.grid.ny = atoi(argv[i + 2]);
+			job.grid.nz = atoi(argv[i + 3]);
+			i += 3;
+		} else if (strcmp(argv[i], "--spacing") == 0 && i + 1 < argc) {
+			spacing = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+			job.grid.origin_depth = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--properties") == 0 && i + 1 < argc) {
+			job.properties = vtk_properties(argv[++i]);
+		} else if (strcmp(argv[i], "--structured") == 0) {
+			job.structured = 1;
+		} else if (strcmp(argv[i], "--planes") == 0 && i + 1 < argc) {
+			job.planes = atoi(argv[++i]);
+		} else {
+			output = argv[i];
+		}
+	}
+	if (output == NULL || geographic < 0 || job.grid.nx <= 0 || job.grid.ny <= 0 || job.grid.nz <= 0 || spacing <= 0 ||
+	    job.planes <= 0 || job.properties == 0) {
+		fprintf(stderr, "Usage: ivlsu_vtk (--corner lon lat | --utm e n) [--rotation degrees] --dims nx ny nz\n"
+				"                 --spacing meters [--depth meters] [--properties vp,vs,rho]\n"
+				"                 [--structured] [--planes count] output\n");
+		return 1;
+	}
+
+	if ((envstr = getenv("UCVM_INSTALL_PATH")) != NULL)
+		status = ivlsu_init(envstr, "ivlsu");
+	else
+		status = ivlsu_init("..", "ivlsu");
+	if (status != 0) {
+		fprintf(stderr, "Could not load the model.\n");
+		return 1;
+	}
+
+	if (geographic)
+		ivlsu_project_points(&worker, &corner[0], &corner[1], 1, 1, &(job.grid.origin_e), &(job.grid.origin_n));
+	else
+		job.grid.origin_e = corner[0], job.grid.origin_n = corner[1];
+	job.grid.spacing_e = job.grid.spacing_n = job.grid.spacing_depth = spacing;
+	job.numslabs = (job.grid.nz + job.planes - 1) / job.planes;
+
+	if ((fp = fopen(output, "w+b")) == NULL || vtk_header(&job, fp) < 0) {
+		fprintf(stderr, "Could not create %s.\n", output);
+		return 1;
+	}
+	job.fd = fileno(fp);
+
+	// Each worker queries its own slabs on its own thread.
+	nthreads = ivlsu_thread_count();
+	nthreads = nthreads < job.numslabs ? nthreads : (int)job.numslabs;
+	ivlsu_set_option("threads", "1");
+	for (t = 1; t < nthreads; t++)
+		started += pthread_create(&threads[started], NULL, vtk_worker, &job) == 0;
+	vtk_worker(&job);
+	for (t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+
+	if (job.failed || fclose(fp) != 0) {
+		fprintf(stderr, "Could not write %s.\n", output);
+		status = 1;
+	} else if (job.missing > 0) {
+		fprintf(stderr, "%ld of %ld nodes have no data and are NaN.\n", job.missing, (long)job.grid.nx * job.grid.ny * job.grid.nz);
+	}
+
+	ivlsu_finalize();
+	return status;
+}